@@ -20,7 +20,9 @@ Environment:
 
 --*/
 
+#ifdef _WIN32
 #include <winternl.h>
+#endif
 
 NTSYSAPI
 NTSTATUS
@@ -101,6 +103,26 @@ typedef struct _SYSTEM_BIGPOOL_ENTRY
 } SYSTEM_BIGPOOL_ENTRY, *PSYSTEM_BIGPOOL_ENTRY;
 #pragma warning(pop)
 
+typedef struct _RTL_PROCESS_MODULE_INFORMATION
+{
+    HANDLE Section;
+    PVOID MappedBase;
+    PVOID ImageBase;
+    ULONG ImageSize;
+    ULONG Flags;
+    USHORT LoadOrderIndex;
+    USHORT InitOrderIndex;
+    USHORT LoadCount;
+    USHORT OffsetToFileName;
+    UCHAR FullPathName[256];
+} RTL_PROCESS_MODULE_INFORMATION, *PRTL_PROCESS_MODULE_INFORMATION;
+
+typedef struct _RTL_PROCESS_MODULES
+{
+    ULONG NumberOfModules;
+    RTL_PROCESS_MODULE_INFORMATION Modules[ANYSIZE_ARRAY];
+} RTL_PROCESS_MODULES, *PRTL_PROCESS_MODULES;
+
 typedef struct _SYSTEM_BIGPOOL_INFORMATION
 {
     ULONG Count;
@@ -108,9 +130,17 @@ typedef struct _SYSTEM_BIGPOOL_INFORMATION
 } SYSTEM_BIGPOOL_INFORMATION, *PSYSTEM_BIGPOOL_INFORMATION;
 
 #define SE_DEBUG_PRIVILEGE 20
+#define SystemModuleInformation (SYSTEM_INFORMATION_CLASS)11
 #define SystemBigPoolInformation (SYSTEM_INFORMATION_CLASS)66
 #define SystemHardwareSecurityTestInterfaceResultsInformation (SYSTEM_INFORMATION_CLASS)166
 #define PERF_WORKER_THREAD 0x48000000
 #define EVENT_TRACE_GROUP_THREAD 0x0500
 #define PERFINFO_LOG_TYPE_WORKER_THREAD_ITEM_END (EVENT_TRACE_GROUP_THREAD | 0x41)
 
+typedef struct _PERFINFO_WORKER_THREAD_ITEM
+{
+    PVOID WorkerRoutine;
+    PVOID Parameter;
+    PVOID WorkItem;
+} PERFINFO_WORKER_THREAD_ITEM, *PPERFINFO_WORKER_THREAD_ITEM;
+
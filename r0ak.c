@@ -22,32 +22,106 @@ Environment:
 
 #include "r0ak.h"
 
+//
+// Internal definitions
+//
+#define CMD_MAX_READ_RANGES         64
+#define CMD_MAX_RANGE_SIZE          (1024 * 1024)
+
 _Success_(return != 0)
 BOOL
-CmdParseInputParameters (
-    _In_ PCHAR Arguments[],
-    _Out_ PVOID* Function,
-    _Out_ PULONG_PTR FunctionArgument
+CmdParseFieldExpression (
+    _In_ PCHAR FieldExpression,
+    _Out_ PULONG FieldOffset,
+    _Out_ PULONG FieldSize
+    )
+{
+    PCHAR moduleName, typeName, fieldPath, pBang, pDot;
+
+    //
+    // Separate out the module name from the type name
+    //
+    pBang = strchr(FieldExpression, '!');
+    if (pBang == NULL)
+    {
+        printf("[-] Malformed field string: %s\n", FieldExpression);
+        return FALSE;
+    }
+    *pBang = ANSI_NULL;
+    moduleName = FieldExpression;
+    typeName = pBang + 1;
+
+    //
+    // And the type name from the field, which can be a nested field path
+    //
+    pDot = strchr(typeName, '.');
+    if ((pDot == NULL) || (pDot[1] == ANSI_NULL))
+    {
+        printf("[-] Malformed field string: %s\n", typeName);
+        return FALSE;
+    }
+    *pDot = ANSI_NULL;
+    fieldPath = pDot + 1;
+
+    //
+    // Get the field requested
+    //
+    if (SymLookupField(moduleName,
+                       typeName,
+                       fieldPath,
+                       FieldOffset,
+                       FieldSize) == FALSE)
+    {
+        printf("[-] Could not find field!\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+CmdParseAddress (
+    _In_ PCHAR Expression,
+    _Out_ PVOID* Address,
+    _Out_ PULONG FieldSize
     )
 {
     PVOID functionPointer;
-    PCHAR moduleName, functionName, pBang, functionNameAndModule;
+    PCHAR moduleName, functionName, pBang, pPlus, functionNameAndModule;
+    ULONG fieldOffset;
+
+    //
+    // Check if the user added a +module!_TYPE.Field offset to the address
+    //
+    *FieldSize = 0;
+    fieldOffset = 0;
+    pPlus = strchr(Expression, '+');
+    if (pPlus != NULL)
+    {
+        *pPlus = ANSI_NULL;
+        if (CmdParseFieldExpression(pPlus + 1,
+                                    &fieldOffset,
+                                    FieldSize) == FALSE)
+        {
+            return FALSE;
+        }
+    }
 
     //
     // Check if the user passed in a module!function instead
     //
-    functionPointer = (PVOID)strtoull(Arguments[2], NULL, 0);
+    functionPointer = (PVOID)strtoull(Expression, NULL, 0);
     if (functionPointer == NULL)
     {
         //
         // Separate out the module name from the symbol name
         //
-        functionNameAndModule = Arguments[2];
+        functionNameAndModule = Expression;
         pBang = strchr(functionNameAndModule, '!');
         if (pBang == NULL)
         {
             printf("[-] Malformed symbol string: %s\n",
-                   Arguments[2]);
+                   Expression);
             return FALSE;
         }
 
@@ -70,67 +144,347 @@ CmdParseInputParameters (
     }
 
     //
-    // Return the data back
+    // Return the address back
+    //
+    *Address = (PVOID)((ULONG_PTR)functionPointer + fieldOffset);
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+CmdParseInputParameters (
+    _In_ PCHAR Arguments[],
+    _Out_ PVOID* Function,
+    _Out_ PULONG_PTR FunctionArgument,
+    _Out_ PULONG FieldSize
+    )
+{
+    //
+    // Get the address, and then the argument
     //
-    *Function = functionPointer;
+    if (CmdParseAddress(Arguments[2], Function, FieldSize) == FALSE)
+    {
+        return FALSE;
+    }
     *FunctionArgument = strtoull(Arguments[3], NULL, 0);
     return TRUE;
 }
 
-INT
-main (
-    _In_ INT ArgumentCount,
-    _In_ PCHAR Arguments[]
+_Success_(return != 0)
+BOOL
+CmdParseReadRanges (
+    _In_ PCHAR RangeList,
+    _Out_writes_(CMD_MAX_READ_RANGES) PCMD_READ_RANGE Ranges,
+    _Out_ PULONG RangeCount
     )
 {
-    PKERNEL_EXECUTE kernelExecute;
+    PCHAR range, nextRange, pColon;
+    ULONG fieldSize;
+    ULONGLONG size;
+
+    //
+    // Ranges are separated by commas
+    //
+    *RangeCount = 0;
+    for (range = RangeList; range != NULL; range = nextRange)
+    {
+        nextRange = strchr(range, ',');
+        if (nextRange != NULL)
+        {
+            *nextRange++ = ANSI_NULL;
+        }
+        if (*RangeCount == CMD_MAX_READ_RANGES)
+        {
+            printf("[-] Too many ranges, at most %d can be read at once\n",
+                   CMD_MAX_READ_RANGES);
+            return FALSE;
+        }
+
+        //
+        // Each one is an address, a colon, and a size
+        //
+        pColon = strrchr(range, ':');
+        if (pColon == NULL)
+        {
+            printf("[-] Malformed range string: %s\n", range);
+            return FALSE;
+        }
+        *pColon = ANSI_NULL;
+        size = strtoull(pColon + 1, NULL, 0);
+        if (CmdParseAddress(range,
+                            &Ranges[*RangeCount].KernelAddress,
+                            &fieldSize) == FALSE)
+        {
+            return FALSE;
+        }
+
+        //
+        // A size of zero means the size of the field that was given
+        //
+        if (size == 0)
+        {
+            size = fieldSize;
+        }
+        if ((size == 0) || (size > CMD_MAX_RANGE_SIZE))
+        {
+            printf("[-] Invalid range size, must be between 1 and 0x%lX bytes\n",
+                   CMD_MAX_RANGE_SIZE);
+            return FALSE;
+        }
+        Ranges[*RangeCount].Size = (ULONG)size;
+        (*RangeCount)++;
+    }
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+CmdReadRanges (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PCHAR RangeList,
+    _In_ ULONG GapThreshold
+    )
+{
+    CMD_READ_RANGE ranges[CMD_MAX_READ_RANGES];
+    ULONG i, rangeCount;
     BOOL b;
-    ULONG_PTR kernelValue;
-    PVOID kernelPointer;
-    INT errValue;
 
     //
-    // Print header
+    // Get the ranges, and a buffer for each of them
     //
-    printf("r0ak v1.0.0 -- Ring 0 Army Knife\n");
-    printf("http://www.github.com/ionescu007/r0ak\n");
-    printf("Copyright (c) 2018 Alex Ionescu [@aionescu]\n");
-    printf("http://www.windows-internals.com\n\n");
-    kernelExecute = NULL;
-    errValue = -1;
+    b = CmdParseReadRanges(RangeList, ranges, &rangeCount);
+    if (b == FALSE)
+    {
+        return b;
+    }
+    for (i = 0; i < rangeCount; i++)
+    {
+        ranges[i].Buffer = HeapAlloc(GetProcessHeap(), 0, ranges[i].Size);
+        if (ranges[i].Buffer == NULL)
+        {
+            printf("[-] Failed to allocate user mode buffer\n");
+            b = FALSE;
+            break;
+        }
+    }
 
     //
-    // We need four arguments
+    // Read them all at once, and dump each one
     //
-    if (ArgumentCount != 4)
+    if (b != FALSE)
     {
-        printf("USAGE: r0ak.exe\n"
-               "       [--execute <Address | module!function> <Argument>]\n"
-               "       [--write   <Address | module!function> <Value>]\n"
-               "       [--read    <Address | module!function> <Size>]\n");
-        goto Cleanup;
+        b = CmdReadKernelRanges(KernelExecute, ranges, rangeCount, GapThreshold);
+        for (i = 0; (b != FALSE) && (i < rangeCount); i++)
+        {
+            printf("[+] Range %lu at                                        0x%.16p\n",
+                   i,
+                   ranges[i].KernelAddress);
+            DumpHex(ranges[i].Buffer,
+                    ranges[i].Size,
+                    (ULONG_PTR)ranges[i].KernelAddress);
+        }
     }
 
     //
-    // Initialize symbol engine
+    // Free the buffers
     //
-    b = SymSetup();
-    if (b == FALSE)
+    for (i = 0; (i < rangeCount) && (ranges[i].Buffer != NULL); i++)
     {
-        printf("[-] Failed to initialize Symbol Engine\n");
-        goto Cleanup;
+        HeapFree(GetProcessHeap(), 0, ranges[i].Buffer);
+    }
+    return b;
+}
+
+_Success_(return != 0)
+BOOL
+CmdWriteFile (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID KernelAddress,
+    _In_ PCCH FileName
+    )
+{
+    HANDLE hFile;
+    LARGE_INTEGER fileSize;
+    PVOID buffer;
+    ULONG bytesRead;
+    BOOL b;
+
+    //
+    // Open the file with the bytes to write
+    //
+    hFile = CreateFileA(FileName,
+                        GENERIC_READ,
+                        FILE_SHARE_READ,
+                        NULL,
+                        OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        printf("[-] Failed to open %s: %lx\n", FileName, GetLastError());
+        return FALSE;
+    }
+    b = GetFileSizeEx(hFile, &fileSize);
+    if ((b == FALSE) ||
+        (fileSize.QuadPart == 0) ||
+        (fileSize.QuadPart > CMD_MAX_WRITE_SIZE))
+    {
+        printf("[-] Invalid size for %s, must be between 1 and %d bytes\n",
+               FileName,
+               CMD_MAX_WRITE_SIZE);
+        CloseHandle(hFile);
+        return FALSE;
     }
 
     //
-    // Initialize our execution engine
+    // Read it all in
     //
-    b = KernelExecuteSetup(&kernelExecute, g_TrampolineFunction);
-    if (b == FALSE)
+    buffer = HeapAlloc(GetProcessHeap(), 0, fileSize.LowPart);
+    if (buffer == NULL)
     {
-        printf("[-] Failed to setup Ring 0 execution engine\n");
-        goto Cleanup;
+        printf("[-] Out of memory reading %s\n", FileName);
+        CloseHandle(hFile);
+        return FALSE;
+    }
+    b = ReadFile(hFile, buffer, fileSize.LowPart, &bytesRead, NULL);
+    CloseHandle(hFile);
+    if ((b == FALSE) || (bytesRead != fileSize.LowPart))
+    {
+        printf("[-] Failed to read %s: %lx\n", FileName, GetLastError());
+        HeapFree(GetProcessHeap(), 0, buffer);
+        return FALSE;
+    }
+
+    //
+    // And write it as one batch
+    //
+    b = CmdWriteKernelBuffer(KernelExecute, KernelAddress, buffer, bytesRead);
+    HeapFree(GetProcessHeap(), 0, buffer);
+    return b;
+}
+
+_Success_(return != 0)
+BOOL
+CmdWriteValue (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID KernelAddress,
+    _In_ PCHAR Value,
+    _In_ ULONG FieldSize
+    )
+{
+    ULONGLONG value;
+    ULONG size;
+
+    //
+    // A value of @file means the contents of that file
+    //
+    if (Value[0] == '@')
+    {
+        return CmdWriteFile(KernelExecute, KernelAddress, Value + 1);
+    }
+
+    //
+    // Write exactly the size of the field that was given, if any. Otherwise
+    // write 64 bits if the value needs them, or was spelled out with more
+    // than 8 hex digits, and 32 bits if not.
+    //
+    value = strtoull(Value, NULL, 0);
+    if ((FieldSize == sizeof(UCHAR)) ||
+        (FieldSize == sizeof(USHORT)) ||
+        (FieldSize == sizeof(ULONG)) ||
+        (FieldSize == sizeof(ULONGLONG)))
+    {
+        size = FieldSize;
+    }
+    else if ((value > ULONG_MAX) ||
+             ((_strnicmp(Value, "0x", 2) == 0) && (strlen(Value) > 10)))
+    {
+        size = sizeof(ULONGLONG);
+    }
+    else
+    {
+        size = sizeof(ULONG);
+    }
+    if ((size < sizeof(ULONGLONG)) && (value >= (1ULL << (size * 8))))
+    {
+        printf("[-] Value 0x%llX doesn't fit in %lu bytes\n", value, size);
+        return FALSE;
+    }
+
+    //
+    // 32-bit values are a single move, everything else gets split up
+    //
+    if (size == sizeof(ULONG))
+    {
+        return CmdWriteKernel(KernelExecute, KernelAddress, (ULONG)value);
+    }
+    return CmdWriteKernelBuffer(KernelExecute, KernelAddress, &value, size);
+}
+
+_Success_(return != 0)
+BOOL
+CmdParseOptions (
+    _In_ INT ArgumentCount,
+    _In_ PCHAR Arguments[],
+    _In_ INT FirstOption,
+    _Out_ PCHAR* OutputFile
+    )
+{
+    ULONG timeout;
+    INT i;
+
+    //
+    // Options come in pairs after the command and its parameters
+    //
+    timeout = 0;
+    *OutputFile = NULL;
+    for (i = FirstOption; i < ArgumentCount; i += 2)
+    {
+        if ((i + 1) == ArgumentCount)
+        {
+            printf("[-] Missing value for option: %s\n", Arguments[i]);
+            return FALSE;
+        }
+
+        if (strcmp(Arguments[i], "--timeout") == 0)
+        {
+            timeout = strtoul(Arguments[i + 1], NULL, 0);
+        }
+        else if (strcmp(Arguments[i], "--out") == 0)
+        {
+            *OutputFile = Arguments[i + 1];
+        }
+        else if (strcmp(Arguments[i], "--cache-ttl") == 0)
+        {
+            CmdSetReadCacheTtl(strtoul(Arguments[i + 1], NULL, 0));
+        }
+        else
+        {
+            printf("[-] Unknown option: %s\n", Arguments[i]);
+            return FALSE;
+        }
     }
 
+    //
+    // Apply them
+    //
+    EtwSetTimeout(timeout);
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+CmdRunCommand (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PCHAR Arguments[],
+    _In_opt_ PCCH OutputFile
+    )
+{
+    BOOL b;
+    ULONG_PTR kernelValue;
+    PVOID kernelPointer;
+    ULONG fieldSize;
+
     //
     // Caller wants to execute their own routine
     //
@@ -139,73 +493,104 @@ main (
         //
         // Get the initial inputs
         //
-        b = CmdParseInputParameters(Arguments, &kernelPointer, &kernelValue);
+        b = CmdParseInputParameters(Arguments,
+                                    &kernelPointer,
+                                    &kernelValue,
+                                    &fieldSize);
         if (b == FALSE)
         {
-            goto Cleanup;
+            return FALSE;
         }
 
         //
         // Execute it
         //
-        b = CmdExecuteKernel(kernelExecute, kernelPointer, kernelValue);
+        b = CmdExecuteKernel(KernelExecute, kernelPointer, kernelValue);
         if (b == FALSE)
         {
             printf("[-] Failed to execute function\n");
-            goto Cleanup;
+            return FALSE;
         }
 
+        //
+        // The function may have changed any memory, so nothing that was read
+        // before can be trusted anymore
+        //
+        CmdInvalidateReadCache(NULL, 0);
+
         //
         // It's now safe to exit/cleanup state
         //
         printf("[+] Function executed successfuly!\n");
-        errValue = 0;
     }
     else if (strstr(Arguments[1], "--write"))
     {
         //
         // Get the initial inputs
         //
-        b = CmdParseInputParameters(Arguments, &kernelPointer, &kernelValue);
+        b = CmdParseInputParameters(Arguments,
+                                    &kernelPointer,
+                                    &kernelValue,
+                                    &fieldSize);
         if (b == FALSE)
         {
-            goto Cleanup;
+            return FALSE;
         }
 
         //
-        // Only 32-bit values can be written
+        // Write it!
         //
-        if (kernelValue > ULONG_MAX)
+        b = CmdWriteValue(KernelExecute, kernelPointer, Arguments[3], fieldSize);
+        if (b == FALSE)
         {
-            printf("[-] Invalid 64-bit value, r0ak only supports 32-bit\n");
-            goto Cleanup;
+            printf("[-] Failed to write variable\n");
+            return FALSE;
         }
 
         //
-        // Write it!
+        // It's now safe to exit/cleanup state
+        //
+        printf("[+] Write executed successfuly!\n");
+    }
+    else if (strstr(Arguments[1], "--readv"))
+    {
+        //
+        // Read all of the ranges, merging those which are close enough
         //
-        b = CmdWriteKernel(kernelExecute, kernelPointer, (ULONG)kernelValue);
+        b = CmdReadRanges(KernelExecute,
+                          Arguments[2],
+                          strtoul(Arguments[3], NULL, 0));
         if (b == FALSE)
         {
-            printf("[-] Failed to write variable\n");
-            goto Cleanup;
+            printf("[-] Failed to read ranges\n");
+            return FALSE;
         }
 
         //
         // It's now safe to exit/cleanup state
         //
-        printf("[+] Write executed successfuly!\n");
-        errValue = 0;
+        printf("[+] Read executed successfuly!\n");
     }
     else if (strstr(Arguments[1], "--read"))
     {
         //
         // Get the initial inputs
         //
-        b = CmdParseInputParameters(Arguments, &kernelPointer, &kernelValue);
+        b = CmdParseInputParameters(Arguments,
+                                    &kernelPointer,
+                                    &kernelValue,
+                                    &fieldSize);
         if (b == FALSE)
         {
-            goto Cleanup;
+            return FALSE;
+        }
+
+        //
+        // A size of zero means the size of the field that was given
+        //
+        if (kernelValue == 0)
+        {
+            kernelValue = fieldSize;
         }
 
         //
@@ -214,24 +599,256 @@ main (
         if (kernelValue > ULONG_MAX)
         {
             printf("[-] Invalid size, r0ak can only read up to 4GB of data\n");
-            goto Cleanup;
+            return FALSE;
         }
 
-
         //
-        // Write it!
+        // Read it, either to the screen or streamed into a file
         //
-        b = CmdReadKernel(kernelExecute, kernelPointer, (ULONG)kernelValue);
+        if (OutputFile != NULL)
+        {
+            b = CmdReadKernelToFile(KernelExecute,
+                                    kernelPointer,
+                                    (ULONG)kernelValue,
+                                    OutputFile);
+        }
+        else
+        {
+            b = CmdReadKernel(KernelExecute, kernelPointer, (ULONG)kernelValue);
+        }
         if (b == FALSE)
         {
             printf("[-] Failed to read variable\n");
-            goto Cleanup;
+            return FALSE;
         }
 
         //
         // It's now safe to exit/cleanup state
         //
         printf("[+] Read executed successfuly!\n");
+    }
+    else if (strstr(Arguments[1], "--invalidate"))
+    {
+        //
+        // Drop cached pages, either all of them or just those of a range
+        //
+        if ((Arguments[2] == NULL) || (strncmp(Arguments[2], "--", 2) == 0))
+        {
+            CmdInvalidateReadCache(NULL, 0);
+        }
+        else
+        {
+            b = CmdParseInputParameters(Arguments,
+                                        &kernelPointer,
+                                        &kernelValue,
+                                        &fieldSize);
+            if (b == FALSE)
+            {
+                return FALSE;
+            }
+            if (kernelValue == 0)
+            {
+                kernelValue = fieldSize;
+            }
+            CmdInvalidateReadCache(kernelPointer, (ULONG)kernelValue);
+        }
+        printf("[+] Read cache invalidated\n");
+    }
+    else
+    {
+        printf("[-] Unknown command: %s\n", Arguments[1]);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+CmdRunScript (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PCCH ScriptFile
+    )
+{
+    CHAR line[1024];
+    PCHAR arguments[4];
+    PCHAR token, context;
+    ULONG lineNumber, count;
+    FILE* script;
+    BOOL b;
+
+    //
+    // Open the script, which has one command per line
+    //
+    if (fopen_s(&script, ScriptFile, "r") != 0)
+    {
+        printf("[-] Failed to open %s\n", ScriptFile);
+        return FALSE;
+    }
+
+    //
+    // Run each command in turn, all in the same session, so that the read
+    // cache and the HSTI buffer state carry over from one to the next
+    //
+    b = TRUE;
+    lineNumber = 0;
+    while ((b != FALSE) && (fgets(line, sizeof(line), script) != NULL))
+    {
+        //
+        // Split the line up like a command line, skipping blank lines and
+        // comments
+        //
+        lineNumber++;
+        RtlZeroMemory(arguments, sizeof(arguments));
+        arguments[0] = (PCHAR)ScriptFile;
+        count = 1;
+        context = NULL;
+        for (token = strtok_s(line, " \t\r\n", &context);
+             token != NULL;
+             token = strtok_s(NULL, " \t\r\n", &context))
+        {
+            if (count == _ARRAYSIZE(arguments))
+            {
+                count++;
+                break;
+            }
+            arguments[count++] = token;
+        }
+        if ((count == 1) || (arguments[1][0] == '#'))
+        {
+            continue;
+        }
+
+        //
+        // Every command takes two parameters, except for dropping the whole
+        // read cache
+        //
+        if ((count != _ARRAYSIZE(arguments)) &&
+            ((count != 2) || (strstr(arguments[1], "--invalidate") == NULL)))
+        {
+            printf("[-] Malformed command on line %lu of %s\n",
+                   lineNumber,
+                   ScriptFile);
+            b = FALSE;
+            break;
+        }
+        printf("[+] Line %lu: %s\n", lineNumber, arguments[1]);
+        b = CmdRunCommand(KernelExecute, arguments, NULL);
+    }
+    fclose(script);
+    return b;
+}
+
+INT
+main (
+    _In_ INT ArgumentCount,
+    _In_ PCHAR Arguments[]
+    )
+{
+    PKERNEL_EXECUTE kernelExecute;
+    BOOL b;
+    ULONG gadgets;
+    PCHAR outputFile;
+    INT errValue, firstOption;
+
+    //
+    // Print header
+    //
+    printf("r0ak v1.0.0 -- Ring 0 Army Knife\n");
+    printf("http://www.github.com/ionescu007/r0ak\n");
+    printf("Copyright (c) 2018 Alex Ionescu [@aionescu]\n");
+    printf("http://www.windows-internals.com\n\n");
+    kernelExecute = NULL;
+    errValue = -1;
+
+    //
+    // We need at least four arguments, three for a script, or just the
+    // command to drop the whole read cache, followed by any options
+    //
+    firstOption = 4;
+    if ((ArgumentCount > 1) && (strstr(Arguments[1], "--script")))
+    {
+        firstOption = 3;
+    }
+    else if ((ArgumentCount > 1) &&
+             (strstr(Arguments[1], "--invalidate")) &&
+             ((ArgumentCount == 2) || (strncmp(Arguments[2], "--", 2) == 0)))
+    {
+        firstOption = 2;
+    }
+    if ((ArgumentCount < firstOption) ||
+        (CmdParseOptions(ArgumentCount,
+                         Arguments,
+                         firstOption,
+                         &outputFile) == FALSE))
+    {
+        printf("USAGE: r0ak.exe\n"
+               "       [--execute <Address | module!function> <Argument>]\n"
+               "       [--write   <Address | module!function>[+module!_TYPE.Field] <Value | @File>]\n"
+               "       [--read    <Address | module!function>[+module!_TYPE.Field] <Size>]\n"
+               "       [--readv   <Address | module!function>[+module!_TYPE.Field]:<Size>[,...] <Gap>]\n"
+               "       [--invalidate [<Address | module!function>[+module!_TYPE.Field] <Size>]]\n"
+               "       [--script  <File>]\n"
+               "       [--timeout <Milliseconds>] [--out <File>]\n"
+               "       [--cache-ttl <Milliseconds>]\n");
+        goto Cleanup;
+    }
+
+    //
+    // Every command that runs in the kernel needs the trampoline, writes need
+    // the emulator's move routine, and reads need the HSTI buffer variables
+    // on top of that. Dropping cached pages only needs symbols for the range.
+    //
+    gadgets = SYM_GADGET_TRAMPOLINE;
+    if (strstr(Arguments[1], "--invalidate"))
+    {
+        gadgets = 0;
+    }
+    else if (strstr(Arguments[1], "--write"))
+    {
+        gadgets |= SYM_GADGET_XM;
+    }
+    else if ((strstr(Arguments[1], "--read")) ||
+             (strstr(Arguments[1], "--script")))
+    {
+        gadgets |= SYM_GADGET_XM | SYM_GADGET_HSTI;
+    }
+
+    //
+    // Initialize symbol engine, along with the gadgets we need
+    //
+    b = SymSetup(gadgets);
+    if (b == FALSE)
+    {
+        printf("[-] Failed to initialize Symbol Engine\n");
+        goto Cleanup;
+    }
+
+    //
+    // Initialize our execution engine, if the command runs anything
+    //
+    if (gadgets != 0)
+    {
+        b = KernelExecuteSetup(&kernelExecute, g_TrampolineFunction);
+        if (b == FALSE)
+        {
+            printf("[-] Failed to setup Ring 0 execution engine\n");
+            goto Cleanup;
+        }
+    }
+
+    //
+    // Run the command, or every command in the script
+    //
+    if (strstr(Arguments[1], "--script"))
+    {
+        b = CmdRunScript(kernelExecute, Arguments[2]);
+    }
+    else
+    {
+        b = CmdRunCommand(kernelExecute, Arguments, outputFile);
+    }
+    if (b != FALSE)
+    {
         errValue = 0;
     }
 
@@ -243,5 +860,25 @@ Cleanup:
     {
         KernelExecuteTeardown(kernelExecute);
     }
+
+    //
+    // Release the read cache
+    //
+    CmdReadCacheTeardown();
+
+    //
+    // Stop the ETW session, if any operation started it
+    //
+    EtwTeardown();
+
+    //
+    // Release the big pool snapshot buffer
+    //
+    KernelMemoryTeardown();
+
+    //
+    // Release any symbol state
+    //
+    SymTeardown();
     return errValue;
 }
@@ -20,6 +20,7 @@ Environment:
 
 --*/
 
+#ifdef _WIN32
 #define UNICODE
 #include <initguid.h>
 #include <windows.h>
@@ -31,6 +32,12 @@ Environment:
 #include <winternl.h>
 #include <evntcons.h>
 #include <Evntrace.h>
+#include <intrin.h>
+#include <immintrin.h>
+#define DECLSPEC_AVX2
+#else
+#include "r0akposix.h"
+#endif
 #include "nt.h"
 
 //
@@ -41,12 +48,110 @@ extern PVOID g_HstiBufferSize;
 extern PVOID g_HstiBufferPointer;
 extern PVOID g_TrampolineFunction;
 
+//
+// Gadgets which can be requested from the symbol engine
+//
+#define SYM_GADGET_TRAMPOLINE       0x1
+#define SYM_GADGET_XM               0x2
+#define SYM_GADGET_HSTI             0x4
+
+//
+// Largest buffer that can be written as one batch of emulator moves
+//
+#define CMD_MAX_WRITE_SIZE          4096
+
+//
+// Largest kernel allocation, which keeps the pipe buffer behind it at a size
+// that can still be told apart in the big pool
+//
+#define KERNEL_MAX_ALLOC_SIZE       (64 * 4096)
+
+//
+// Largest single read, and the largest a merged read may grow to
+//
+#define CMD_READ_CHUNK_SIZE         (1024 * 1024)
+
 //
 // Opaque to callers
 //
 typedef struct _KERNEL_ALLOC *PKERNEL_ALLOC;
 typedef struct _KERNEL_EXECUTE *PKERNEL_EXECUTE;
 typedef struct _ETW_DATA *PETW_DATA;
+typedef struct _PDB_FILE *PPDB_FILE;
+typedef struct _PE_IMAGE *PPE_IMAGE;
+
+//
+// CodeView identity of an image, matching the one of its PDB
+//
+typedef struct _SYM_DEBUG_ID
+{
+    GUID Guid;
+    ULONG Age;
+} SYM_DEBUG_ID, *PSYM_DEBUG_ID;
+
+//
+// A module!symbol to be resolved as part of a batch
+//
+typedef struct _SYM_REQUEST
+{
+    PCHAR ModuleName;
+    PCHAR SymbolName;
+    PVOID Address;
+} SYM_REQUEST, *PSYM_REQUEST;
+
+//
+// A resolved symbol, as stored in a precomputed symbol database
+//
+typedef struct _SYM_DB_RECORD
+{
+    SYM_DEBUG_ID DebugId;
+    PCCH SymbolName;
+    ULONG Rva;
+} SYM_DB_RECORD, *PSYM_DB_RECORD;
+
+//
+// One of several kernel ranges to be read together
+//
+typedef struct _CMD_READ_RANGE
+{
+    PVOID KernelAddress;
+    ULONG Size;
+    PVOID Buffer;
+} CMD_READ_RANGE, *PCMD_READ_RANGE;
+
+//
+// A work item submitted to the execution engine. It must stay around until
+// it is completed.
+//
+typedef struct _KERNEL_REQUEST
+{
+    PETW_DATA EtwData;
+    PVOID WorkItem;
+    BOOL Pending;
+    BOOL Succeeded;
+} KERNEL_REQUEST, *PKERNEL_REQUEST;
+
+//
+// A single HSTI read covering one or more of the requested ranges, which
+// are the RangeCount entries of the sorted order starting at FirstRange
+//
+typedef struct _CMD_READ_PLAN
+{
+    ULONG_PTR Start;
+    ULONG Size;
+    ULONG FirstRange;
+    ULONG RangeCount;
+} CMD_READ_PLAN, *PCMD_READ_PLAN;
+
+//
+// Called for each symbol when enumerating an image or its PDB
+//
+typedef VOID
+(*PSYM_ENUM_ROUTINE)(
+    _In_ PVOID Context,
+    _In_ PCCH SymbolName,
+    _In_ ULONG Rva
+    );
 
 //
 // Symbol Routines
@@ -58,19 +163,250 @@ SymLookup (
     _In_ PCHAR SymbolName
     );
 
+_Success_(return != 0)
+BOOL
+SymLookupBatch (
+    _Inout_updates_(Count) PSYM_REQUEST Requests,
+    _In_ ULONG Count
+    );
+
+_Success_(return != 0)
+BOOL
+SymLookupField (
+    _In_ PCHAR ModuleName,
+    _In_ PCHAR TypeName,
+    _In_ PCHAR FieldPath,
+    _Out_ PULONG Offset,
+    _Out_ PULONG Size
+    );
+
+_Success_(return != 0)
+BOOL
+SymLookupAddress (
+    _In_ ULONG_PTR Address,
+    _Out_writes_(NameSize) PCHAR Name,
+    _In_ ULONG NameSize
+    );
+
+_Success_(return != 0)
+BOOL
+SymResolveGadgets (
+    _In_ ULONG Gadgets
+    );
+
 _Success_(return != 0)
 BOOL
 SymSetup (
+    _In_ ULONG Gadgets
+    );
+
+VOID
+SymTeardown (
+    VOID
+    );
+
+//
+// Symbol Cache Routines
+//
+_Success_(return != 0)
+BOOL
+SymCacheOpen (
+    VOID
+    );
+
+_Success_(return != 0)
+BOOL
+SymCacheLookup (
+    _In_ PSYM_DEBUG_ID DebugId,
+    _In_ PCCH SymbolName,
+    _Out_ PULONG Rva,
+    _Out_opt_ PULONG Size
+    );
+
+VOID
+SymCacheInsert (
+    _In_ PSYM_DEBUG_ID DebugId,
+    _In_ PCCH SymbolName,
+    _In_ ULONG Rva,
+    _In_ ULONG Size
+    );
+
+VOID
+SymCacheClose (
     VOID
     );
 
+//
+// Symbol Database Routines
+//
+_Success_(return != 0)
+BOOL
+SymDbOpen (
+    VOID
+    );
+
+_Success_(return != 0)
+BOOL
+SymDbLookup (
+    _In_ PSYM_DEBUG_ID DebugId,
+    _In_ PCCH SymbolName,
+    _Out_ PULONG Rva
+    );
+
+VOID
+SymDbClose (
+    VOID
+    );
+
+_Success_(return != 0)
+BOOL
+SymDbWrite (
+    _In_ PCCH DbPath,
+    _Inout_updates_(RecordCount) PSYM_DB_RECORD Records,
+    _In_ ULONG RecordCount
+    );
+
+//
+// PE Image Routines
+//
+_Success_(return != 0)
+BOOL
+PeLocateImage (
+    _In_ PCCH ModuleName,
+    _Out_writes_(PathSize) PCHAR ImagePath,
+    _In_ ULONG PathSize
+    );
+
+_Success_(return != 0)
+BOOL
+PeOpen (
+    _Outptr_ PPE_IMAGE* Image,
+    _In_ PCCH ImagePath
+    );
+
+_Success_(return != 0)
+BOOL
+PeRvaToFileOffset (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG Rva,
+    _Out_ PULONG FileOffset
+    );
+
+_Success_(return != NULL)
+PVOID
+PeMapRva (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG Rva,
+    _In_ ULONG Size
+    );
+
+_Success_(return != NULL)
+PIMAGE_DATA_DIRECTORY
+PeGetDirectory (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG Index
+    );
+
+ULONG
+PeGetImageSize (
+    _In_ PPE_IMAGE Image
+    );
+
+_Success_(return != 0)
+BOOL
+PeGetDebugId (
+    _In_ PPE_IMAGE Image,
+    _Out_ PSYM_DEBUG_ID DebugId,
+    _Out_writes_(PdbNameSize) PCHAR PdbName,
+    _In_ ULONG PdbNameSize
+    );
+
+_Success_(return != 0)
+BOOL
+PeLookupExport (
+    _In_ PPE_IMAGE Image,
+    _In_ PCCH Name,
+    _Out_ PULONG Rva
+    );
+
+_Success_(return != 0)
+BOOL
+PeLookupExportOrdinal (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG Ordinal,
+    _Out_ PULONG Rva
+    );
+
+VOID
+PeEnumExports (
+    _In_ PPE_IMAGE Image,
+    _In_ PSYM_ENUM_ROUTINE EnumRoutine,
+    _In_ PVOID Context
+    );
+
+VOID
+PeClose (
+    _In_ PPE_IMAGE Image
+    );
+
+//
+// Native PDB Routines
+//
+_Success_(return != 0)
+BOOL
+PdbLocate (
+    _In_ PCCH PdbName,
+    _In_ PSYM_DEBUG_ID DebugId,
+    _Out_writes_(PathSize) PCHAR PdbPath,
+    _In_ ULONG PathSize
+    );
+
+_Success_(return != 0)
+BOOL
+PdbOpen (
+    _Outptr_ PPDB_FILE* Pdb,
+    _In_ PCCH PdbPath,
+    _In_ PSYM_DEBUG_ID DebugId
+    );
+
+_Success_(return != 0)
+BOOL
+PdbLookupPublic (
+    _In_ PPDB_FILE Pdb,
+    _In_ PCCH SymbolName,
+    _Out_ PULONG Rva
+    );
+
+_Success_(return != 0)
+BOOL
+PdbLookupField (
+    _In_ PPDB_FILE Pdb,
+    _In_ PCCH TypeName,
+    _In_ PCCH FieldPath,
+    _Out_ PULONG Offset,
+    _Out_ PULONG Size
+    );
+
+VOID
+PdbEnumPublics (
+    _In_ PPDB_FILE Pdb,
+    _In_ PSYM_ENUM_ROUTINE EnumRoutine,
+    _In_ PVOID Context
+    );
+
+VOID
+PdbClose (
+    _In_ PPDB_FILE Pdb
+    );
+
 //
 // Utility Routines
 //
 VOID
 DumpHex (
     _In_ LPCVOID Data,
-    _In_ SIZE_T Size
+    _In_ SIZE_T Size,
+    _In_ ULONG_PTR BaseAddress
     );
 
 _Success_(return != 0)
@@ -79,6 +415,14 @@ GetDriverBaseAddr (
     _In_ PCCH BaseName
     );
 
+_Success_(return != NULL)
+PCCH
+GetDriverByAddress (
+    _In_ ULONG_PTR Address,
+    _Out_ PULONG_PTR ImageBase,
+    _Out_ PULONG ImageSize
+    );
+
 _Success_(return != 0)
 BOOL
 ElevateToSystem (
@@ -101,11 +445,63 @@ KernelWrite (
     _In_ PKERNEL_ALLOC KernelAlloc
     );
 
+_Success_(return != 0)
+PVOID
+KernelRefresh (
+    _In_ PKERNEL_ALLOC KernelAlloc
+    );
+
 VOID
 KernelFree (
     _In_ PKERNEL_ALLOC KernelAlloc
     );
 
+VOID
+KernelAbandon (
+    _In_ PKERNEL_ALLOC KernelAlloc
+    );
+
+VOID
+KernelMemoryTeardown (
+    VOID
+    );
+
+//
+// Pool Scan Routines
+//
+ULONG
+PoolFindAllocations (
+    _In_ PSYSTEM_BIGPOOL_INFORMATION BigPoolInfo,
+    _In_ ULONG Tag,
+    _In_reads_(SizeCount) PULONGLONG Sizes,
+    _In_ ULONG SizeCount,
+    _Out_writes_(SizeCount) PVOID* Addresses
+    );
+
+ULONG
+PoolFindNewAllocations (
+    _In_ PSYSTEM_BIGPOOL_INFORMATION BigPoolInfo,
+    _In_ ULONG Tag,
+    _In_reads_opt_(SizeCount) PULONGLONG Sizes,
+    _In_ ULONG SizeCount,
+    _Out_writes_opt_(SizeCount) PVOID* Addresses
+    );
+
+BOOL
+PoolIsTracking (
+    VOID
+    );
+
+VOID
+PoolForgetAllocation (
+    _In_ PVOID Address
+    );
+
+VOID
+PoolTeardown (
+    VOID
+    );
+
 //
 // Kernel Execution Routines
 //
@@ -130,6 +526,22 @@ KernelExecuteSetCallback (
     _In_ PVOID WorkParameter
     );
 
+_Success_(return != 0)
+BOOL
+KernelExecuteSubmit (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _Out_ PKERNEL_REQUEST Request,
+    _In_ PVOID WorkFunction,
+    _In_ PVOID WorkParameter
+    );
+
+_Success_(return != 0)
+BOOL
+KernelExecuteComplete (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _Inout_ PKERNEL_REQUEST Request
+    );
+
 VOID
 KernelExecuteTeardown (
     _In_ PKERNEL_EXECUTE KernelExecute
@@ -138,6 +550,49 @@ KernelExecuteTeardown (
 //
 // Kernel Read Routine
 //
+ULONG
+CmdPlanReads (
+    _In_reads_(Count) PCMD_READ_RANGE Ranges,
+    _In_ ULONG Count,
+    _In_ ULONG GapThreshold,
+    _Out_writes_(Count) PULONG Order,
+    _Out_writes_(Count) PCMD_READ_PLAN Plans
+    );
+
+_Success_(return != 0)
+BOOL
+CmdReadKernelRanges (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _Inout_updates_(Count) PCMD_READ_RANGE Ranges,
+    _In_ ULONG Count,
+    _In_ ULONG GapThreshold
+    );
+
+VOID
+CmdInvalidateReadCache (
+    _In_opt_ PVOID KernelAddress,
+    _In_ ULONG Size
+    );
+
+VOID
+CmdSetReadCacheTtl (
+    _In_ ULONG Ttl
+    );
+
+VOID
+CmdReadCacheTeardown (
+    VOID
+    );
+
+_Success_(return != 0)
+BOOL
+CmdReadKernelToFile (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID KernelAddress,
+    _In_ ULONG ValueSize,
+    _In_ PCCH OutputFile
+    );
+
 _Success_(return != 0)
 BOOL
 CmdReadKernel (
@@ -149,6 +604,24 @@ CmdReadKernel (
 //
 // Kernel Write Routine
 //
+_Success_(return != 0)
+BOOL
+CmdWriteKernelBuffer (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID KernelAddress,
+    _In_reads_bytes_(Size) PVOID Buffer,
+    _In_ ULONG Size
+    );
+
+_Success_(return != 0)
+BOOL
+CmdWriteKernelBatch (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_reads_(Count) PVOID* KernelAddresses,
+    _In_reads_(Count) PULONG KernelValues,
+    _In_ ULONG Count
+    );
+
 _Success_(return != 0)
 BOOL
 CmdWriteKernel (
@@ -175,7 +648,9 @@ _Success_(return != 0)
 BOOL
 EtwStartSession (
     _Outptr_ PETW_DATA* EtwData,
-    _In_ PVOID WorkerRoutine
+    _In_ PVOID WorkItem,
+    _In_ PVOID WorkerRoutine,
+    _In_ PVOID WorkerParameter
     );
 
 _Success_(return != 0)
@@ -184,3 +659,18 @@ EtwParseSession (
     _In_ PETW_DATA EtwData
     );
 
+VOID
+EtwSetTimeout (
+    _In_ ULONG Timeout
+    );
+
+VOID
+EtwAbortSession (
+    _In_ PETW_DATA EtwData
+    );
+
+VOID
+EtwTeardown (
+    VOID
+    );
+
@@ -0,0 +1,418 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    r0akcache.c
+
+Abstract:
+
+    This module implements the persistent symbol offset cache for r0ak
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0ak.h"
+
+//
+// Internal definitions
+//
+#define SYM_CACHE_SIGNATURE         'CSkr'
+#define SYM_CACHE_VERSION           3
+#define SYM_CACHE_ENTRIES           2048
+#define SYM_CACHE_NAME_LENGTH       100
+#define SYM_CACHE_PATH              L"%LOCALAPPDATA%\\r0ak.symcache"
+
+//
+// A resolved symbol RVA, or a type field offset, keyed by the CodeView
+// identity of its image. Size is only used by fields, and LastRun is the
+// run which last used the entry.
+//
+typedef struct _SYM_CACHE_ENTRY
+{
+    GUID Guid;
+    ULONG Age;
+    ULONG Rva;
+    ULONG Size;
+    ULONG LastRun;
+    CHAR Name[SYM_CACHE_NAME_LENGTH];
+} SYM_CACHE_ENTRY, *PSYM_CACHE_ENTRY;
+
+//
+// Layout of the memory-mapped cache file: an open-addressed hash table, and
+// a counter bumped by every run of r0ak that opens it
+//
+typedef struct _SYM_CACHE_FILE
+{
+    ULONG Signature;
+    ULONG Version;
+    ULONG EntryCount;
+    ULONG RunCount;
+    SYM_CACHE_ENTRY Entries[SYM_CACHE_ENTRIES];
+} SYM_CACHE_FILE, *PSYM_CACHE_FILE;
+
+PSYM_CACHE_FILE g_SymCache;
+HANDLE g_SymCacheFile;
+ULONG g_SymCacheRun;
+
+VOID
+SympCacheAcquire (
+    VOID
+    )
+{
+    OVERLAPPED overlapped = { 0 };
+
+    //
+    // Other instances of r0ak may be using the file at the same time, so
+    // every access to the table is done under an exclusive file lock
+    //
+    LockFileEx(g_SymCacheFile,
+               LOCKFILE_EXCLUSIVE_LOCK,
+               0,
+               sizeof(*g_SymCache),
+               0,
+               &overlapped);
+}
+
+VOID
+SympCacheRelease (
+    VOID
+    )
+{
+    OVERLAPPED overlapped = { 0 };
+
+    //
+    // Let the other instances in
+    //
+    UnlockFileEx(g_SymCacheFile, 0, sizeof(*g_SymCache), 0, &overlapped);
+}
+
+ULONG
+SympCacheHash (
+    _In_ PSYM_DEBUG_ID DebugId,
+    _In_ PCCH SymbolName
+    )
+{
+    ULONG hash;
+    PUCHAR data;
+    ULONG i;
+
+    //
+    // FNV-1a over the image identity followed by the symbol name
+    //
+    hash = 2166136261;
+    data = (PUCHAR)DebugId;
+    for (i = 0; i < sizeof(*DebugId); i++)
+    {
+        hash = (hash ^ data[i]) * 16777619;
+    }
+    for (data = (PUCHAR)SymbolName; *data != ANSI_NULL; data++)
+    {
+        hash = (hash ^ *data) * 16777619;
+    }
+    return hash;
+}
+
+_Success_(return != NULL)
+PSYM_CACHE_ENTRY
+SympCacheFindSlot (
+    _In_ PSYM_DEBUG_ID DebugId,
+    _In_ PCCH SymbolName
+    )
+{
+    PSYM_CACHE_ENTRY entry;
+    ULONG slot;
+    ULONG i;
+
+    //
+    // Linearly probe from the home slot until we find our key or a free slot
+    //
+    slot = SympCacheHash(DebugId, SymbolName) & (SYM_CACHE_ENTRIES - 1);
+    for (i = 0; i < SYM_CACHE_ENTRIES; i++)
+    {
+        entry = &g_SymCache->Entries[(slot + i) & (SYM_CACHE_ENTRIES - 1)];
+        if (entry->Name[0] == ANSI_NULL)
+        {
+            return entry;
+        }
+
+        if ((IsEqualGUID(&entry->Guid, &DebugId->Guid)) &&
+            (entry->Age == DebugId->Age) &&
+            (strcmp(entry->Name, SymbolName) == 0))
+        {
+            return entry;
+        }
+    }
+
+    //
+    // The table is completely full
+    //
+    return NULL;
+}
+
+VOID
+SympCacheRebuild (
+    VOID
+    )
+{
+    PSYM_CACHE_ENTRY entries;
+    PSYM_CACHE_ENTRY entry;
+    ULONG i, count;
+    SYM_DEBUG_ID debugId;
+
+    //
+    // Set aside the entries used by this run, which are for the kernel build
+    // we're on -- everything else is most likely from older builds
+    //
+    entries = HeapAlloc(GetProcessHeap(),
+                        0,
+                        g_SymCache->EntryCount * sizeof(*entries));
+    count = 0;
+    if (entries != NULL)
+    {
+        for (i = 0; i < SYM_CACHE_ENTRIES; i++)
+        {
+            if ((g_SymCache->Entries[i].Name[0] != ANSI_NULL) &&
+                (g_SymCache->Entries[i].LastRun == g_SymCacheRun))
+            {
+                entries[count++] = g_SymCache->Entries[i];
+            }
+        }
+    }
+
+    //
+    // Empty the table, and put them back, since dropping entries from the
+    // middle of a probe chain would break lookups of the ones after them
+    //
+    RtlZeroMemory(g_SymCache->Entries, sizeof(g_SymCache->Entries));
+    g_SymCache->EntryCount = 0;
+    for (i = 0; i < count; i++)
+    {
+        debugId.Guid = entries[i].Guid;
+        debugId.Age = entries[i].Age;
+        entry = SympCacheFindSlot(&debugId, entries[i].Name);
+        *entry = entries[i];
+        g_SymCache->EntryCount++;
+    }
+    if (entries != NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, entries);
+    }
+}
+
+_Success_(return != 0)
+BOOL
+SymCacheLookup (
+    _In_ PSYM_DEBUG_ID DebugId,
+    _In_ PCCH SymbolName,
+    _Out_ PULONG Rva,
+    _Out_opt_ PULONG Size
+    )
+{
+    PSYM_CACHE_ENTRY entry;
+
+    //
+    // Nothing to do if the cache couldn't be opened
+    //
+    if (g_SymCache == NULL)
+    {
+        return FALSE;
+    }
+
+    //
+    // Find the slot for this key, and check if it was populated
+    //
+    SympCacheAcquire();
+    entry = SympCacheFindSlot(DebugId, SymbolName);
+    if ((entry == NULL) || (entry->Name[0] == ANSI_NULL))
+    {
+        SympCacheRelease();
+        return FALSE;
+    }
+
+    //
+    // Return the cached RVA and size, and remember that this run used it
+    //
+    *Rva = entry->Rva;
+    if (Size != NULL)
+    {
+        *Size = entry->Size;
+    }
+    entry->LastRun = g_SymCacheRun;
+    SympCacheRelease();
+    return TRUE;
+}
+
+VOID
+SymCacheInsert (
+    _In_ PSYM_DEBUG_ID DebugId,
+    _In_ PCCH SymbolName,
+    _In_ ULONG Rva,
+    _In_ ULONG Size
+    )
+{
+    PSYM_CACHE_ENTRY entry;
+
+    //
+    // Nothing to do if the cache couldn't be opened, or the name won't fit
+    //
+    if ((g_SymCache == NULL) ||
+        (strlen(SymbolName) >= SYM_CACHE_NAME_LENGTH))
+    {
+        return;
+    }
+
+    //
+    // Keep a quarter of the table free so that probe chains stay short, by
+    // rebuilding it once it fills up
+    //
+    SympCacheAcquire();
+    if (g_SymCache->EntryCount >= (SYM_CACHE_ENTRIES / 4 * 3))
+    {
+        SympCacheRebuild();
+    }
+
+    //
+    // Find the slot for this key, and fill it out if it's a new one
+    //
+    entry = SympCacheFindSlot(DebugId, SymbolName);
+    if (entry != NULL)
+    {
+        if (entry->Name[0] == ANSI_NULL)
+        {
+            entry->Guid = DebugId->Guid;
+            entry->Age = DebugId->Age;
+            strcpy_s(entry->Name, sizeof(entry->Name), SymbolName);
+            g_SymCache->EntryCount++;
+        }
+        entry->Rva = Rva;
+        entry->Size = Size;
+        entry->LastRun = g_SymCacheRun;
+    }
+    SympCacheRelease();
+}
+
+_Success_(return != 0)
+BOOL
+SymCacheOpen (
+    VOID
+    )
+{
+    HANDLE hFile, hSection;
+    WCHAR cachePath[MAX_PATH];
+    DWORD pathSize;
+
+    //
+    // Build the path to the cache file
+    //
+    pathSize = ExpandEnvironmentStringsW(SYM_CACHE_PATH,
+                                         cachePath,
+                                         _ARRAYSIZE(cachePath));
+    if ((pathSize == 0) || (pathSize > _ARRAYSIZE(cachePath)))
+    {
+        printf("[-] Failed to build symbol cache path: %lx\n",
+               GetLastError());
+        return FALSE;
+    }
+
+    //
+    // Open it, or create it if this is the first run
+    //
+    hFile = CreateFileW(cachePath,
+                        GENERIC_READ | GENERIC_WRITE,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE,
+                        NULL,
+                        OPEN_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        printf("[-] Failed to open symbol cache: %lx\n", GetLastError());
+        return FALSE;
+    }
+
+    //
+    // Create a section large enough for the whole table -- this extends the
+    // file with zeroes if it was just created
+    //
+    hSection = CreateFileMappingW(hFile,
+                                  NULL,
+                                  PAGE_READWRITE,
+                                  0,
+                                  sizeof(*g_SymCache),
+                                  NULL);
+    if (hSection == NULL)
+    {
+        printf("[-] Failed to create symbol cache section: %lx\n",
+               GetLastError());
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    //
+    // Map it in our address space
+    //
+    g_SymCache = MapViewOfFile(hSection,
+                               FILE_MAP_READ | FILE_MAP_WRITE,
+                               0,
+                               0,
+                               sizeof(*g_SymCache));
+    CloseHandle(hSection);
+    if (g_SymCache == NULL)
+    {
+        printf("[-] Failed to map symbol cache: %lx\n", GetLastError());
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    //
+    // Keep the file handle around, since it's what the lock is taken on
+    //
+    g_SymCacheFile = hFile;
+
+    //
+    // Initialize the table if it's new, or reset it if it's from an older
+    // version of r0ak. Then number this run, so that the entries it uses
+    // can be told apart from stale ones.
+    //
+    SympCacheAcquire();
+    if ((g_SymCache->Signature != SYM_CACHE_SIGNATURE) ||
+        (g_SymCache->Version != SYM_CACHE_VERSION))
+    {
+        RtlZeroMemory(g_SymCache, sizeof(*g_SymCache));
+        g_SymCache->Signature = SYM_CACHE_SIGNATURE;
+        g_SymCache->Version = SYM_CACHE_VERSION;
+    }
+    g_SymCacheRun = ++g_SymCache->RunCount;
+    SympCacheRelease();
+    return TRUE;
+}
+
+VOID
+SymCacheClose (
+    VOID
+    )
+{
+    //
+    // Unmap the table, and only then drop the handle the lock is taken on
+    //
+    if (g_SymCache != NULL)
+    {
+        UnmapViewOfFile(g_SymCache);
+        g_SymCache = NULL;
+    }
+    if (g_SymCacheFile != NULL)
+    {
+        CloseHandle(g_SymCacheFile);
+        g_SymCacheFile = NULL;
+    }
+    g_SymCacheRun = 0;
+}
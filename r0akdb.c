@@ -0,0 +1,368 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    r0akdb.c
+
+Abstract:
+
+    This module implements the offline symbol database builder for r0ak
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0ak.h"
+
+//
+// Internal definitions
+//
+#define DB_INITIAL_RECORDS          1024
+#define DB_GUID_AGE_MIN_LENGTH      33
+
+//
+// A PDB to be parsed by the thread pool
+//
+typedef struct _DB_WORK_ITEM
+{
+    CHAR PdbPath[MAX_PATH];
+    SYM_DEBUG_ID DebugId;
+} DB_WORK_ITEM, *PDB_WORK_ITEM;
+
+//
+// PDB names used by the kernel and the HAL across builds
+//
+PCCH g_DbPdbNames[] =
+{
+    "ntkrnlmp.pdb",
+    "ntoskrnl.pdb",
+    "ntkrnlpa.pdb",
+    "ntkrpamp.pdb",
+    "hal.pdb",
+    "halmacpi.pdb",
+    "halacpi.pdb",
+};
+
+//
+// Symbols that r0ak itself needs, unless others are given
+//
+PCCH g_DbDefaultSymbols[] =
+{
+    "XmMovOp",
+    "SepHSTIResultsSize",
+    "SepHSTIResultsBuffer",
+    "PopFanIrpComplete",
+};
+
+PCCH* g_DbSymbols;
+ULONG g_DbSymbolCount;
+SRWLOCK g_DbLock;
+PSYM_DB_RECORD g_DbRecords;
+ULONG g_DbRecordCount;
+ULONG g_DbRecordCapacity;
+BOOL g_DbFailed;
+volatile LONG g_DbPdbCount;
+
+_Success_(return != 0)
+BOOL
+DbpParseDebugId (
+    _In_ PCCH DirectoryName,
+    _Out_ PSYM_DEBUG_ID DebugId
+    )
+{
+    CHAR hex[9];
+    ULONG i;
+
+    //
+    // Symbol stores name each directory after the GUID and age, in hex
+    //
+    if (strlen(DirectoryName) < DB_GUID_AGE_MIN_LENGTH)
+    {
+        return FALSE;
+    }
+    for (i = 0; DirectoryName[i] != ANSI_NULL; i++)
+    {
+        if (!isxdigit((UCHAR)DirectoryName[i]))
+        {
+            return FALSE;
+        }
+    }
+
+    //
+    // Split the GUID into its fields
+    //
+    hex[8] = ANSI_NULL;
+    RtlCopyMemory(hex, DirectoryName, 8);
+    DebugId->Guid.Data1 = strtoul(hex, NULL, 16);
+    hex[4] = ANSI_NULL;
+    RtlCopyMemory(hex, DirectoryName + 8, 4);
+    DebugId->Guid.Data2 = (USHORT)strtoul(hex, NULL, 16);
+    RtlCopyMemory(hex, DirectoryName + 12, 4);
+    DebugId->Guid.Data3 = (USHORT)strtoul(hex, NULL, 16);
+    hex[2] = ANSI_NULL;
+    for (i = 0; i < sizeof(DebugId->Guid.Data4); i++)
+    {
+        RtlCopyMemory(hex, DirectoryName + 16 + (i * 2), 2);
+        DebugId->Guid.Data4[i] = (UCHAR)strtoul(hex, NULL, 16);
+    }
+
+    //
+    // And the age is whatever comes after it
+    //
+    DebugId->Age = strtoul(DirectoryName + 32, NULL, 16);
+    return TRUE;
+}
+
+VOID
+DbpAddRecord (
+    _In_ PSYM_DEBUG_ID DebugId,
+    _In_ PCCH SymbolName,
+    _In_ ULONG Rva
+    )
+{
+    PVOID newRecords;
+    ULONG newCapacity;
+
+    //
+    // Workers share the record array
+    //
+    AcquireSRWLockExclusive(&g_DbLock);
+    if (g_DbRecordCount == g_DbRecordCapacity)
+    {
+        newCapacity = max(g_DbRecordCapacity * 2, DB_INITIAL_RECORDS);
+        newRecords = (g_DbRecords == NULL) ?
+                     HeapAlloc(GetProcessHeap(),
+                               0,
+                               newCapacity * sizeof(*g_DbRecords)) :
+                     HeapReAlloc(GetProcessHeap(),
+                                 0,
+                                 g_DbRecords,
+                                 newCapacity * sizeof(*g_DbRecords));
+        if (newRecords == NULL)
+        {
+            g_DbFailed = TRUE;
+            ReleaseSRWLockExclusive(&g_DbLock);
+            return;
+        }
+        g_DbRecords = newRecords;
+        g_DbRecordCapacity = newCapacity;
+    }
+    g_DbRecords[g_DbRecordCount].DebugId = *DebugId;
+    g_DbRecords[g_DbRecordCount].SymbolName = SymbolName;
+    g_DbRecords[g_DbRecordCount].Rva = Rva;
+    g_DbRecordCount++;
+    ReleaseSRWLockExclusive(&g_DbLock);
+}
+
+VOID
+CALLBACK
+DbpProcessPdb (
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _In_ PVOID Context
+    )
+{
+    PDB_WORK_ITEM workItem;
+    PPDB_FILE pdb;
+    ULONG i, rva;
+
+    UNREFERENCED_PARAMETER(Instance);
+
+    //
+    // Open the PDB, which also checks that it matches its directory
+    //
+    workItem = (PDB_WORK_ITEM)Context;
+    if (PdbOpen(&pdb, workItem->PdbPath, &workItem->DebugId) != FALSE)
+    {
+        //
+        // Record every symbol that this PDB has
+        //
+        for (i = 0; i < g_DbSymbolCount; i++)
+        {
+            if (PdbLookupPublic(pdb, g_DbSymbols[i], &rva) != FALSE)
+            {
+                DbpAddRecord(&workItem->DebugId, g_DbSymbols[i], rva);
+            }
+        }
+        PdbClose(pdb);
+        InterlockedIncrement(&g_DbPdbCount);
+    }
+    HeapFree(GetProcessHeap(), 0, workItem);
+}
+
+ULONG
+DbpScanStore (
+    _In_ PCCH StorePath,
+    _In_ PTP_CALLBACK_ENVIRON CallbackEnviron
+    )
+{
+    WIN32_FIND_DATAA findData;
+    CHAR searchPath[MAX_PATH];
+    PDB_WORK_ITEM workItem;
+    HANDLE hFind;
+    ULONG i, count;
+    INT length;
+
+    //
+    // Look for each kernel and HAL PDB name in the store
+    //
+    count = 0;
+    for (i = 0; i < _ARRAYSIZE(g_DbPdbNames); i++)
+    {
+        length = _snprintf_s(searchPath,
+                             sizeof(searchPath),
+                             _TRUNCATE,
+                             "%s\\%s\\*",
+                             StorePath,
+                             g_DbPdbNames[i]);
+        if (length < 0)
+        {
+            continue;
+        }
+        hFind = FindFirstFileA(searchPath, &findData);
+        if (hFind == INVALID_HANDLE_VALUE)
+        {
+            continue;
+        }
+
+        //
+        // Each build has its own GUID and age directory under it
+        //
+        do
+        {
+            if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+            {
+                continue;
+            }
+
+            workItem = HeapAlloc(GetProcessHeap(), 0, sizeof(*workItem));
+            if (workItem == NULL)
+            {
+                printf("[-] Out of memory queueing %s\n", findData.cFileName);
+                continue;
+            }
+            length = _snprintf_s(workItem->PdbPath,
+                                 sizeof(workItem->PdbPath),
+                                 _TRUNCATE,
+                                 "%s\\%s\\%s\\%s",
+                                 StorePath,
+                                 g_DbPdbNames[i],
+                                 findData.cFileName,
+                                 g_DbPdbNames[i]);
+            if ((length < 0) ||
+                (DbpParseDebugId(findData.cFileName,
+                                 &workItem->DebugId) == FALSE) ||
+                (GetFileAttributesA(workItem->PdbPath) ==
+                 INVALID_FILE_ATTRIBUTES))
+            {
+                HeapFree(GetProcessHeap(), 0, workItem);
+                continue;
+            }
+
+            //
+            // Hand it off to the thread pool
+            //
+            if (TrySubmitThreadpoolCallback(DbpProcessPdb,
+                                            workItem,
+                                            CallbackEnviron) == FALSE)
+            {
+                printf("[-] Failed to queue %s: %lx\n",
+                       workItem->PdbPath,
+                       GetLastError());
+                HeapFree(GetProcessHeap(), 0, workItem);
+                continue;
+            }
+            count++;
+        } while (FindNextFileA(hFind, &findData) != FALSE);
+        FindClose(hFind);
+    }
+    return count;
+}
+
+INT
+main (
+    _In_ INT ArgumentCount,
+    _In_ PCHAR Arguments[]
+    )
+{
+    TP_CALLBACK_ENVIRON callbackEnviron;
+    PTP_CLEANUP_GROUP cleanupGroup;
+    ULONG queued;
+    BOOL b;
+
+    //
+    // Print header
+    //
+    printf("r0akdb v1.0.0 -- Ring 0 Army Knife Symbol Database Builder\n");
+    printf("http://www.github.com/ionescu007/r0ak\n");
+    printf("Copyright (c) 2018 Alex Ionescu [@aionescu]\n");
+    printf("http://www.windows-internals.com\n\n");
+
+    //
+    // We need a store and an output file, and optionally a list of symbols
+    //
+    if (ArgumentCount < 3)
+    {
+        printf("USAGE: r0akdb.exe <Symbol Store> <Output File> [Symbol ...]\n");
+        return -1;
+    }
+    if (ArgumentCount > 3)
+    {
+        g_DbSymbols = (PCCH*)&Arguments[3];
+        g_DbSymbolCount = ArgumentCount - 3;
+    }
+    else
+    {
+        g_DbSymbols = g_DbDefaultSymbols;
+        g_DbSymbolCount = _ARRAYSIZE(g_DbDefaultSymbols);
+    }
+    InitializeSRWLock(&g_DbLock);
+
+    //
+    // Use the process thread pool, with a cleanup group so that we can wait
+    // for all of the work to finish
+    //
+    cleanupGroup = CreateThreadpoolCleanupGroup();
+    if (cleanupGroup == NULL)
+    {
+        printf("[-] Failed to create cleanup group: %lx\n", GetLastError());
+        return -1;
+    }
+    InitializeThreadpoolEnvironment(&callbackEnviron);
+    SetThreadpoolCallbackCleanupGroup(&callbackEnviron, cleanupGroup, NULL);
+
+    //
+    // Queue every PDB in the store, and wait for them to be parsed
+    //
+    queued = DbpScanStore(Arguments[1], &callbackEnviron);
+    CloseThreadpoolCleanupGroupMembers(cleanupGroup, FALSE, NULL);
+    CloseThreadpoolCleanupGroup(cleanupGroup);
+    DestroyThreadpoolEnvironment(&callbackEnviron);
+    printf("[+] Parsed %ld of %lu PDBs, found %lu symbols\n",
+           g_DbPdbCount,
+           queued,
+           g_DbRecordCount);
+    if (g_DbFailed != FALSE)
+    {
+        printf("[-] Out of memory collecting symbols\n");
+        return -1;
+    }
+
+    //
+    // Sort everything and write out the database
+    //
+    b = SymDbWrite(Arguments[2], g_DbRecords, g_DbRecordCount);
+    if (b == FALSE)
+    {
+        return -1;
+    }
+    printf("[+] Wrote %s\n", Arguments[2]);
+    return 0;
+}
@@ -22,15 +22,40 @@ Environment:
 #include "r0ak.h"
 
 //
-// Tracks tracing data between calls
+// Internal definitions
+//
+#define ETW_LATENCY_BUCKETS         32
+#define ETW_DEFAULT_TIMEOUT         10000
+
+//
+// An operation waiting for its work item to finish executing
 //
 typedef struct _ETW_DATA
+{
+    struct _ETW_DATA* Next;
+    PVOID WorkItem;
+    PVOID WorkItemRoutine;
+    PVOID WorkItemParameter;
+    HANDLE CompletionEvent;
+    BOOL Completed;
+    LARGE_INTEGER TriggerTime;
+    LARGE_INTEGER CompletionTime;
+} ETW_DATA, *PETW_DATA;
+
+//
+// Real-time session shared by all operations, whose events are consumed by
+// a dedicated thread for as long as r0ak runs
+//
+typedef struct _ETW_SESSION
 {
     TRACEHANDLE SessionHandle;
     TRACEHANDLE ParserHandle;
     PEVENT_TRACE_PROPERTIES Properties;
-    PVOID WorkItemRoutine;
-} ETW_DATA, *PETW_DATA;
+    HANDLE ConsumerThread;
+    SRWLOCK Lock;
+    PETW_DATA Waiters;
+    BOOL Stopped;
+} ETW_SESSION, *PETW_SESSION;
 
 DEFINE_GUID(g_EtwTraceGuid,
             0x53636210,
@@ -38,74 +63,117 @@ DEFINE_GUID(g_EtwTraceGuid,
             0x1264,
             0xc6, 0xa5, 0xf0, 0x9c, 0x59, 0x88, 0x1e, 0xbd);
 WCHAR g_EtwTraceName[] = L"r0ak-etw";
+ETW_SESSION g_EtwSession = { 0, 0, NULL, NULL, SRWLOCK_INIT, NULL, FALSE };
+
+//
+// How long to wait for a work item before giving up on it as overdue
+//
+ULONG g_EtwTimeout = ETW_DEFAULT_TIMEOUT;
+
+//
+// Latency from triggering a work item to it finishing, in power of two
+// microsecond buckets
+//
+ULONG g_EtwLatencyBuckets[ETW_LATENCY_BUCKETS];
+ULONG g_EtwLatencyCount;
+ULONGLONG g_EtwLatencyTotal;
+ULONGLONG g_EtwLatencyMin;
+ULONGLONG g_EtwLatencyMax;
+ULONG g_EtwOverdueCount;
 
 VOID
 EtpEtwEventCallback(
     _In_ PEVENT_RECORD EventRecord
     )
 {
+    PPERFINFO_WORKER_THREAD_ITEM workItem;
     PETW_DATA etwData;
 
     //
     // Look for an "end of work item execution event"
     //
-    if (EventRecord->EventHeader.EventDescriptor.Opcode ==
+    if (EventRecord->EventHeader.EventDescriptor.Opcode !=
         (PERFINFO_LOG_TYPE_WORKER_THREAD_ITEM_END & 0xFF))
     {
-        //
-        // Grab our context and check if the work routine matches ours
-        //
-        etwData = (PETW_DATA)EventRecord->UserContext;
-        if (*(PVOID*)EventRecord->UserData == etwData->WorkItemRoutine)
+        return;
+    }
+
+    //
+    // Make sure the whole payload is there before decoding it
+    //
+    if (EventRecord->UserDataLength < sizeof(*workItem))
+    {
+        return;
+    }
+    workItem = (PPERFINFO_WORKER_THREAD_ITEM)EventRecord->UserData;
+
+    //
+    // Find the oldest operation still waiting on this exact work item, with
+    // the same routine and parameter, so that other work items don't count.
+    // Waiters are kept in the order they were started.
+    //
+    AcquireSRWLockExclusive(&g_EtwSession.Lock);
+    for (etwData = g_EtwSession.Waiters;
+         etwData != NULL;
+         etwData = etwData->Next)
+    {
+        if ((etwData->Completed == FALSE) &&
+            (workItem->WorkItem == etwData->WorkItem) &&
+            (workItem->WorkerRoutine == etwData->WorkItemRoutine) &&
+            (workItem->Parameter == etwData->WorkItemParameter))
         {
             //
-            // Stop the trace -- this callback will run a few more times
+            // Wake it up
             //
             printf("[+] Kernel finished executing work item at               0x%.16p\n",
-                   etwData->WorkItemRoutine);
-            ControlTrace(etwData->SessionHandle,
-                         NULL,
-                         etwData->Properties,
-                         EVENT_TRACE_CONTROL_STOP);
+                   workItem->WorkItem);
+            etwData->Completed = TRUE;
+            etwData->CompletionTime = EventRecord->EventHeader.TimeStamp;
+            SetEvent(etwData->CompletionEvent);
+            break;
         }
     }
+    ReleaseSRWLockExclusive(&g_EtwSession.Lock);
 }
 
-_Success_(return != 0)
-BOOL
-EtwParseSession (
-    _In_ PETW_DATA EtwData
+DWORD
+WINAPI
+EtpConsumerThread (
+    _In_ PVOID Parameter
     )
 {
+    PETW_DATA etwData;
     ULONG errorCode;
 
+    UNREFERENCED_PARAMETER(Parameter);
+
     //
-    // Process the trace until the right work item is found
+    // Process the trace until the session is stopped
     //
-    errorCode = ProcessTrace(&EtwData->ParserHandle, 1, NULL, NULL);
-    if (errorCode != ERROR_SUCCESS)
+    errorCode = ProcessTrace(&g_EtwSession.ParserHandle, 1, NULL, NULL);
+    if ((errorCode != ERROR_SUCCESS) && (errorCode != ERROR_CANCELLED))
     {
         printf("[-] Failed to process trace: %lX\n", errorCode);
-        ControlTrace(EtwData->SessionHandle,
-                     NULL,
-                     EtwData->Properties,
-                     EVENT_TRACE_CONTROL_STOP);
     }
 
     //
-    // All done -- cleanup
+    // No more events will come, so wake up anyone left waiting. They will
+    // see that their work item never completed.
     //
-    CloseTrace(EtwData->ParserHandle);
-    HeapFree(GetProcessHeap(), 0, EtwData->Properties);
-    HeapFree(GetProcessHeap(), 0, EtwData);
-    return errorCode == ERROR_SUCCESS;
+    AcquireSRWLockExclusive(&g_EtwSession.Lock);
+    g_EtwSession.Stopped = TRUE;
+    for (etwData = g_EtwSession.Waiters; etwData != NULL; etwData = etwData->Next)
+    {
+        SetEvent(etwData->CompletionEvent);
+    }
+    ReleaseSRWLockExclusive(&g_EtwSession.Lock);
+    return errorCode;
 }
 
 _Success_(return != 0)
 BOOL
-EtwStartSession (
-    _Outptr_ PETW_DATA* EtwData,
-    _In_ PVOID WorkItemRoutine
+EtpStartSession (
+    VOID
     )
 {
     ULONG errorCode;
@@ -113,52 +181,55 @@ EtwStartSession (
     EVENT_TRACE_LOGFILEW logFile = { 0 };
     ULONG bufferSize;
 
-    //
-    // Initialize context
-    //
-    *EtwData = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(**EtwData));
-    if (*EtwData == NULL)
-    {
-        printf("[-] Out of memory allocating ETW state\n");
-        return FALSE;
-    }
-
     //
     // Allocate memory for our session descriptor
     //
     bufferSize = sizeof(EVENT_TRACE_PROPERTIES) + sizeof(g_EtwTraceName);
-    (*EtwData)->Properties = HeapAlloc(GetProcessHeap(),
-                                       HEAP_ZERO_MEMORY,
-                                       bufferSize);
-    if ((*EtwData)->Properties == NULL)
+    g_EtwSession.Properties = HeapAlloc(GetProcessHeap(),
+                                        HEAP_ZERO_MEMORY,
+                                        bufferSize);
+    if (g_EtwSession.Properties == NULL)
     {
         printf("[-] Failed to allocate memory for the ETW trace\n");
-        HeapFree(GetProcessHeap(), 0, *EtwData);
         return FALSE;
     }
 
     //
     // Create a real-time session using the system logger, tracing nothing
     //
-    (*EtwData)->Properties->Wnode.BufferSize = bufferSize;
-    (*EtwData)->Properties->Wnode.Guid = g_EtwTraceGuid;
-    (*EtwData)->Properties->Wnode.ClientContext = 1;
-    (*EtwData)->Properties->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
-    (*EtwData)->Properties->MinimumBuffers = 1;
-    (*EtwData)->Properties->LogFileMode = EVENT_TRACE_REAL_TIME_MODE |
-                                          EVENT_TRACE_SYSTEM_LOGGER_MODE;
-    (*EtwData)->Properties->FlushTimer = 1;
-    (*EtwData)->Properties->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
-    errorCode = StartTrace(&(*EtwData)->SessionHandle,
+    g_EtwSession.Properties->Wnode.BufferSize = bufferSize;
+    g_EtwSession.Properties->Wnode.Guid = g_EtwTraceGuid;
+    g_EtwSession.Properties->Wnode.ClientContext = 1;
+    g_EtwSession.Properties->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
+    g_EtwSession.Properties->MinimumBuffers = 1;
+    g_EtwSession.Properties->LogFileMode = EVENT_TRACE_REAL_TIME_MODE |
+                                           EVENT_TRACE_SYSTEM_LOGGER_MODE;
+    g_EtwSession.Properties->FlushTimer = 1;
+    g_EtwSession.Properties->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+    errorCode = StartTrace(&g_EtwSession.SessionHandle,
                            g_EtwTraceName,
-                           (*EtwData)->Properties);
+                           g_EtwSession.Properties);
+    if (errorCode == ERROR_ALREADY_EXISTS)
+    {
+        //
+        // A previous instance died without stopping its session, so stop it
+        // and try again
+        //
+        ControlTrace(0,
+                     g_EtwTraceName,
+                     g_EtwSession.Properties,
+                     EVENT_TRACE_CONTROL_STOP);
+        g_EtwSession.Properties->Wnode.BufferSize = bufferSize;
+        g_EtwSession.Properties->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+        errorCode = StartTrace(&g_EtwSession.SessionHandle,
+                               g_EtwTraceName,
+                               g_EtwSession.Properties);
+    }
     if (errorCode != ERROR_SUCCESS)
     {
-        printf("[-] Failed to create the event trace session: %lX\n", 
+        printf("[-] Failed to create the event trace session: %lX\n",
                errorCode);
-        HeapFree(GetProcessHeap(), 0, (*EtwData)->Properties);
-        HeapFree(GetProcessHeap(), 0, *EtwData);
-        return FALSE;
+        goto Failure;
     }
 
     //
@@ -166,28 +237,22 @@ EtwStartSession (
     //
     logFile.LoggerName = g_EtwTraceName;
     logFile.ProcessTraceMode = PROCESS_TRACE_MODE_REAL_TIME |
-                               PROCESS_TRACE_MODE_EVENT_RECORD;
+                               PROCESS_TRACE_MODE_EVENT_RECORD |
+                               PROCESS_TRACE_MODE_RAW_TIMESTAMP;
     logFile.EventRecordCallback = EtpEtwEventCallback;
-    logFile.Context = *EtwData;
-    (*EtwData)->ParserHandle = OpenTrace(&logFile);
-    if ((*EtwData)->ParserHandle == INVALID_PROCESSTRACE_HANDLE)
+    g_EtwSession.ParserHandle = OpenTrace(&logFile);
+    if (g_EtwSession.ParserHandle == INVALID_PROCESSTRACE_HANDLE)
     {
         printf("[-] Failed open a consumer handle for the trace session: %lX\n",
                GetLastError());
-        ControlTrace((*EtwData)->SessionHandle,
-                     NULL,
-                     (*EtwData)->Properties,
-                     EVENT_TRACE_CONTROL_STOP);
-        HeapFree(GetProcessHeap(), 0, (*EtwData)->Properties);
-        HeapFree(GetProcessHeap(), 0, *EtwData);
-        return FALSE;
+        goto FailureStop;
     }
 
     //
     // Trace worker thread events
     //
     traceFlags[2] = PERF_WORKER_THREAD;
-    errorCode = TraceSetInformation((*EtwData)->SessionHandle,
+    errorCode = TraceSetInformation(g_EtwSession.SessionHandle,
                                     TraceSystemTraceEnableFlagsInfo,
                                     traceFlags,
                                     sizeof(traceFlags));
@@ -195,19 +260,326 @@ EtwStartSession (
     {
         printf("[-] Failed to set flags for event trace session: %lX\n",
                errorCode);
-        ControlTrace((*EtwData)->SessionHandle,
-                     NULL,
-                     (*EtwData)->Properties,
-                     EVENT_TRACE_CONTROL_STOP);
-        CloseTrace((*EtwData)->ParserHandle);
-        HeapFree(GetProcessHeap(), 0, (*EtwData)->Properties);
+        goto FailureClose;
+    }
+
+    //
+    // Start consuming events in the background
+    //
+    g_EtwSession.ConsumerThread = CreateThread(NULL,
+                                               0,
+                                               EtpConsumerThread,
+                                               NULL,
+                                               0,
+                                               NULL);
+    if (g_EtwSession.ConsumerThread == NULL)
+    {
+        printf("[-] Failed to create the trace consumer thread: %lX\n",
+               GetLastError());
+        goto FailureClose;
+    }
+    return TRUE;
+
+FailureClose:
+    CloseTrace(g_EtwSession.ParserHandle);
+FailureStop:
+    ControlTrace(g_EtwSession.SessionHandle,
+                 NULL,
+                 g_EtwSession.Properties,
+                 EVENT_TRACE_CONTROL_STOP);
+Failure:
+    HeapFree(GetProcessHeap(), 0, g_EtwSession.Properties);
+    g_EtwSession.Properties = NULL;
+    return FALSE;
+}
+
+VOID
+EtpRemoveWaiter (
+    _In_ PETW_DATA EtwData
+    )
+{
+    PETW_DATA* link;
+
+    //
+    // Unlink the waiter so that no more events are matched against it
+    //
+    AcquireSRWLockExclusive(&g_EtwSession.Lock);
+    for (link = &g_EtwSession.Waiters; *link != NULL; link = &(*link)->Next)
+    {
+        if (*link == EtwData)
+        {
+            *link = EtwData->Next;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_EtwSession.Lock);
+
+    //
+    // And free it
+    //
+    CloseHandle(EtwData->CompletionEvent);
+    HeapFree(GetProcessHeap(), 0, EtwData);
+}
+
+VOID
+EtpRecordLatency (
+    _In_ PETW_DATA EtwData
+    )
+{
+    LARGE_INTEGER frequency;
+    ULONGLONG latency, ticks;
+    ULONG bucket;
+
+    //
+    // The session clock is QPC (ClientContext 1), and the consumer asks for
+    // raw timestamps, so the event time is directly comparable with the QPC
+    // value taken when the work item was triggered
+    //
+    if (EtwData->CompletionTime.QuadPart < EtwData->TriggerTime.QuadPart)
+    {
+        return;
+    }
+    QueryPerformanceFrequency(&frequency);
+    ticks = EtwData->CompletionTime.QuadPart - EtwData->TriggerTime.QuadPart;
+    latency = ((ticks / frequency.QuadPart) * 1000000) +
+              (((ticks % frequency.QuadPart) * 1000000) / frequency.QuadPart);
+
+    //
+    // Bucket N holds latencies below 2^N microseconds
+    //
+    for (bucket = 0;
+         (bucket < (ETW_LATENCY_BUCKETS - 1)) && ((1ULL << bucket) <= latency);
+         bucket++);
+    g_EtwLatencyBuckets[bucket]++;
+    if ((g_EtwLatencyCount == 0) || (latency < g_EtwLatencyMin))
+    {
+        g_EtwLatencyMin = latency;
+    }
+    if (latency > g_EtwLatencyMax)
+    {
+        g_EtwLatencyMax = latency;
+    }
+    g_EtwLatencyTotal += latency;
+    g_EtwLatencyCount++;
+}
+
+VOID
+EtwSetTimeout (
+    _In_ ULONG Timeout
+    )
+{
+    //
+    // A timeout of zero keeps the default
+    //
+    g_EtwTimeout = (Timeout != 0) ? Timeout : ETW_DEFAULT_TIMEOUT;
+}
+
+_Success_(return != 0)
+BOOL
+EtwParseSession (
+    _In_ PETW_DATA EtwData
+    )
+{
+    ULONG waitResult;
+
+    //
+    // Wait for the consumer thread to see the work item finish, or stop, but
+    // no longer than the timeout -- the work item is already queued, so it is
+    // never triggered a second time
+    //
+    waitResult = WaitForSingleObject(EtwData->CompletionEvent, g_EtwTimeout);
+    if ((waitResult != WAIT_OBJECT_0) || (EtwData->Completed == FALSE))
+    {
+        if (waitResult == WAIT_TIMEOUT)
+        {
+            printf("[-] Work item did not finish within %lu ms\n",
+                   g_EtwTimeout);
+        }
+        else
+        {
+            printf("[-] Trace session stopped before the work item finished\n");
+        }
+
+        //
+        // We have no idea if, or when, the work item will be done with its
+        // kernel memory, so the caller must leave it allocated. Its event may
+        // still come in, so the waiter stays around until teardown.
+        //
+        g_EtwOverdueCount++;
+        return FALSE;
+    }
+    EtpRecordLatency(EtwData);
+
+    //
+    // All done -- cleanup
+    //
+    EtpRemoveWaiter(EtwData);
+    return TRUE;
+}
+
+VOID
+EtwAbortSession (
+    _In_ PETW_DATA EtwData
+    )
+{
+    //
+    // The work item was never queued, so stop waiting for it
+    //
+    EtpRemoveWaiter(EtwData);
+}
+
+_Success_(return != 0)
+BOOL
+EtwStartSession (
+    _Outptr_ PETW_DATA* EtwData,
+    _In_ PVOID WorkItem,
+    _In_ PVOID WorkItemRoutine,
+    _In_ PVOID WorkItemParameter
+    )
+{
+    PETW_DATA* link;
+
+    //
+    // Start the shared session the first time around
+    //
+    *EtwData = NULL;
+    if (g_EtwSession.ConsumerThread == NULL)
+    {
+        if (EtpStartSession() == FALSE)
+        {
+            return FALSE;
+        }
+    }
+
+    //
+    // Initialize context
+    //
+    *EtwData = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(**EtwData));
+    if (*EtwData == NULL)
+    {
+        printf("[-] Out of memory allocating ETW state\n");
+        return FALSE;
+    }
+    (*EtwData)->CompletionEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if ((*EtwData)->CompletionEvent == NULL)
+    {
+        printf("[-] Failed to create the completion event: %lX\n",
+               GetLastError());
         HeapFree(GetProcessHeap(), 0, *EtwData);
+        *EtwData = NULL;
         return FALSE;
     }
 
     //
-    // Remember which work routine we'll be looking for
+    // Remember which work item, routine and parameter we'll be looking for,
+    // and start waiting for them before the work item can possibly run
     //
+    (*EtwData)->WorkItem = WorkItem;
     (*EtwData)->WorkItemRoutine = WorkItemRoutine;
+    (*EtwData)->WorkItemParameter = WorkItemParameter;
+    AcquireSRWLockExclusive(&g_EtwSession.Lock);
+    if (g_EtwSession.Stopped != FALSE)
+    {
+        ReleaseSRWLockExclusive(&g_EtwSession.Lock);
+        printf("[-] The event trace session is no longer running\n");
+        CloseHandle((*EtwData)->CompletionEvent);
+        HeapFree(GetProcessHeap(), 0, *EtwData);
+        *EtwData = NULL;
+        return FALSE;
+    }
+    for (link = &g_EtwSession.Waiters; *link != NULL; link = &(*link)->Next);
+    *link = *EtwData;
+    ReleaseSRWLockExclusive(&g_EtwSession.Lock);
+
+    //
+    // The caller triggers the work item right after this
+    //
+    QueryPerformanceCounter(&(*EtwData)->TriggerTime);
     return TRUE;
 }
+
+VOID
+EtpPrintLatency (
+    VOID
+    )
+{
+    ULONG i;
+
+    //
+    // Summarize, then show every bucket that has samples in it
+    //
+    if (g_EtwLatencyCount != 0)
+    {
+        printf("[+] Work item latency: %lu samples, min %llu us, avg %llu us, max %llu us\n",
+               g_EtwLatencyCount,
+               g_EtwLatencyMin,
+               g_EtwLatencyTotal / g_EtwLatencyCount,
+               g_EtwLatencyMax);
+    }
+    for (i = 0; i < ETW_LATENCY_BUCKETS; i++)
+    {
+        if (g_EtwLatencyBuckets[i] != 0)
+        {
+            printf("[+]     < %10llu us: %lu\n",
+                   1ULL << i,
+                   g_EtwLatencyBuckets[i]);
+        }
+    }
+    if (g_EtwOverdueCount != 0)
+    {
+        printf("[-] %lu work items did not finish within %lu ms\n",
+               g_EtwOverdueCount,
+               g_EtwTimeout);
+    }
+}
+
+VOID
+EtwTeardown (
+    VOID
+    )
+{
+    PETW_DATA etwData;
+
+    //
+    // Nothing to do if no operation ever needed the session
+    //
+    if (g_EtwSession.ConsumerThread == NULL)
+    {
+        return;
+    }
+
+    //
+    // Stopping the session makes the consumer thread return
+    //
+    ControlTrace(g_EtwSession.SessionHandle,
+                 NULL,
+                 g_EtwSession.Properties,
+                 EVENT_TRACE_CONTROL_STOP);
+    WaitForSingleObject(g_EtwSession.ConsumerThread, INFINITE);
+    CloseHandle(g_EtwSession.ConsumerThread);
+    CloseTrace(g_EtwSession.ParserHandle);
+    HeapFree(GetProcessHeap(), 0, g_EtwSession.Properties);
+    g_EtwSession.ConsumerThread = NULL;
+    g_EtwSession.Properties = NULL;
+
+    //
+    // No more events can come in, so free the waiters left behind by overdue
+    // work items
+    //
+    while (g_EtwSession.Waiters != NULL)
+    {
+        etwData = g_EtwSession.Waiters;
+        g_EtwSession.Waiters = etwData->Next;
+        CloseHandle(etwData->CompletionEvent);
+        HeapFree(GetProcessHeap(), 0, etwData);
+    }
+    g_EtwSession.Stopped = FALSE;
+
+    //
+    // Show how long the kernel took to run our work items
+    //
+    if ((g_EtwLatencyCount != 0) || (g_EtwOverdueCount != 0))
+    {
+        EtpPrintLatency();
+    }
+}
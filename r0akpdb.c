@@ -0,0 +1,1764 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    r0akpdb.c
+
+Abstract:
+
+    This module implements a native PDB (MSF 7.00) reader for r0ak
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0ak.h"
+
+//
+// Internal definitions
+//
+#define PDB_MSF_MAGIC               "Microsoft C/C++ MSF 7.00\r\n\x1a" "DS\0\0"
+#define PDB_STREAM_INFO             1
+#define PDB_STREAM_TPI              2
+#define PDB_STREAM_DBI              3
+#define PDB_DBI_SECTION_HEADERS     5
+#define PDB_GSI_HASH_SIGNATURE      0xFFFFFFFF
+#define PDB_GSI_HASH_VERSION        (0xEFFE0000 + 19990810)
+#define PDB_GSI_HASH_BUCKETS        4096
+#define PDB_GSI_HASH_RECORD_SIZE    12
+#define PDB_NIL_STREAM              0xFFFFFFFF
+#define PDB_NIL_STREAM_INDEX        0xFFFF
+#define PDB_TYPE_INDEX_BEGIN        0x1000
+#define PDB_TYPE_MAX_DEPTH          16
+#define PDB_FIELD_PATH_LENGTH       256
+#define S_PUB32                     0x110E
+
+//
+// CodeView type leaves that we understand
+//
+#define LF_MODIFIER                 0x1001
+#define LF_POINTER                  0x1002
+#define LF_FIELDLIST                0x1203
+#define LF_BITFIELD                 0x1205
+#define LF_BCLASS                   0x1400
+#define LF_VBCLASS                  0x1401
+#define LF_IVBCLASS                 0x1402
+#define LF_INDEX                    0x1404
+#define LF_VFUNCTAB                 0x1409
+#define LF_ENUMERATE                0x1502
+#define LF_ARRAY                    0x1503
+#define LF_CLASS                    0x1504
+#define LF_STRUCTURE                0x1505
+#define LF_UNION                    0x1506
+#define LF_ENUM                     0x1507
+#define LF_MEMBER                   0x150D
+#define LF_STMEMBER                 0x150E
+#define LF_METHOD                   0x150F
+#define LF_NESTTYPE                 0x1510
+#define LF_ONEMETHOD                0x1511
+#define LF_NUMERIC                  0x8000
+#define LF_CHAR                     0x8000
+#define LF_SHORT                    0x8001
+#define LF_USHORT                   0x8002
+#define LF_LONG                     0x8003
+#define LF_ULONG                    0x8004
+#define LF_QUADWORD                 0x8009
+#define LF_UQUADWORD                0x800A
+#define LF_PAD0                     0xF0
+#define CV_PROP_FWDREF              0x0080
+#define CV_MTINTRO                  4
+#define CV_MTPUREINTRO              6
+
+//
+// On-disk structures
+//
+typedef struct _MSF_SUPER_BLOCK
+{
+    CHAR Magic[32];
+    ULONG BlockSize;
+    ULONG FreeBlockMapBlock;
+    ULONG NumBlocks;
+    ULONG NumDirectoryBytes;
+    ULONG Unknown;
+    ULONG BlockMapAddr;
+} MSF_SUPER_BLOCK, *PMSF_SUPER_BLOCK;
+
+typedef struct _PDB_INFO_HEADER
+{
+    ULONG Version;
+    ULONG Signature;
+    ULONG Age;
+    GUID Guid;
+} PDB_INFO_HEADER, *PPDB_INFO_HEADER;
+
+typedef struct _PDB_DBI_HEADER
+{
+    LONG VersionSignature;
+    ULONG VersionHeader;
+    ULONG Age;
+    USHORT GlobalStreamIndex;
+    USHORT BuildNumber;
+    USHORT PublicStreamIndex;
+    USHORT PdbDllVersion;
+    USHORT SymRecordStream;
+    USHORT PdbDllRbld;
+    LONG ModInfoSize;
+    LONG SectionContributionSize;
+    LONG SectionMapSize;
+    LONG SourceInfoSize;
+    LONG TypeServerMapSize;
+    ULONG MfcTypeServerIndex;
+    LONG OptionalDbgHeaderSize;
+    LONG EcSubstreamSize;
+    USHORT Flags;
+    USHORT Machine;
+    ULONG Padding;
+} PDB_DBI_HEADER, *PPDB_DBI_HEADER;
+
+typedef struct _PDB_TPI_HEADER
+{
+    ULONG Version;
+    ULONG HeaderSize;
+    ULONG TypeIndexBegin;
+    ULONG TypeIndexEnd;
+    ULONG TypeRecordBytes;
+    USHORT HashStreamIndex;
+    USHORT HashAuxStreamIndex;
+    ULONG HashKeySize;
+    ULONG NumHashBuckets;
+    LONG HashValueBufferOffset;
+    ULONG HashValueBufferLength;
+    LONG IndexOffsetBufferOffset;
+    ULONG IndexOffsetBufferLength;
+    LONG HashAdjBufferOffset;
+    ULONG HashAdjBufferLength;
+} PDB_TPI_HEADER, *PPDB_TPI_HEADER;
+
+typedef struct _PDB_PUBLICS_HEADER
+{
+    ULONG SymHash;
+    ULONG AddrMap;
+    ULONG NumThunks;
+    ULONG SizeOfThunk;
+    USHORT ThunkSection;
+    USHORT Padding;
+    ULONG ThunkTableOffset;
+    ULONG NumSections;
+} PDB_PUBLICS_HEADER, *PPDB_PUBLICS_HEADER;
+
+typedef struct _PDB_GSI_HASH_HEADER
+{
+    ULONG VerSignature;
+    ULONG VerHeader;
+    ULONG HashRecordSize;
+    ULONG BucketsSize;
+} PDB_GSI_HASH_HEADER, *PPDB_GSI_HASH_HEADER;
+
+typedef struct _PDB_GSI_HASH_RECORD
+{
+    ULONG Offset;
+    ULONG References;
+} PDB_GSI_HASH_RECORD, *PPDB_GSI_HASH_RECORD;
+
+#pragma pack(push, 1)
+typedef struct _PDB_PUBLIC_SYMBOL
+{
+    USHORT Length;
+    USHORT Kind;
+    ULONG Flags;
+    ULONG Offset;
+    USHORT Segment;
+    CHAR Name[ANYSIZE_ARRAY];
+} PDB_PUBLIC_SYMBOL, *PPDB_PUBLIC_SYMBOL;
+#pragma pack(pop)
+
+//
+// A stream, either pointing straight into the mapped file, or gathered from
+// its non-contiguous blocks into a heap buffer
+//
+typedef struct _PDB_STREAM
+{
+    PUCHAR Data;
+    ULONG Size;
+    BOOLEAN Allocated;
+} PDB_STREAM, *PPDB_STREAM;
+
+//
+// Tracks an opened PDB between calls
+//
+typedef struct _PDB_FILE
+{
+    PUCHAR Base;
+    ULONGLONG FileSize;
+    ULONG BlockSize;
+    ULONG BlockCount;
+    PDB_STREAM Directory;
+    ULONG StreamCount;
+    PULONG StreamSizes;
+    PULONG* StreamBlocks;
+    PDB_STREAM Symbols;
+    PDB_STREAM Publics;
+    PDB_STREAM SectionHeaders;
+    PPDB_GSI_HASH_RECORD HashRecords;
+    ULONG HashRecordCount;
+    ULONG BucketStart[PDB_GSI_HASH_BUCKETS + 1];
+    ULONG BucketEnd[PDB_GSI_HASH_BUCKETS + 1];
+    BOOL TypesProbed;
+    PDB_STREAM Types;
+    PULONG TypeOffsets;
+    ULONG TypeCount;
+} PDB_FILE, *PPDB_FILE;
+
+//
+// A type record, past its length and leaf kind
+//
+typedef struct _PDB_TYPE
+{
+    USHORT Kind;
+    PUCHAR Data;
+    ULONG Length;
+} PDB_TYPE, *PPDB_TYPE;
+
+//
+// The parts of a class, structure or union record that we care about
+//
+typedef struct _PDB_AGGREGATE
+{
+    USHORT Property;
+    ULONG FieldList;
+    ULONGLONG Size;
+    PCHAR Name;
+} PDB_AGGREGATE, *PPDB_AGGREGATE;
+
+ULONG
+PdbpHashName (
+    _In_ PCCH Name
+    )
+{
+    ULONG hash;
+    SIZE_T length;
+    PUCHAR data;
+
+    //
+    // This is the "V1" hash used by the public and global symbol tables: XOR
+    // the name a dword at a time, then fold in the remaining word and byte
+    //
+    hash = 0;
+    data = (PUCHAR)Name;
+    length = strlen(Name);
+    while (length >= sizeof(ULONG))
+    {
+        hash ^= *(ULONG UNALIGNED*)data;
+        data += sizeof(ULONG);
+        length -= sizeof(ULONG);
+    }
+    if (length >= sizeof(USHORT))
+    {
+        hash ^= *(USHORT UNALIGNED*)data;
+        data += sizeof(USHORT);
+        length -= sizeof(USHORT);
+    }
+    if (length == 1)
+    {
+        hash ^= *data;
+    }
+
+    //
+    // Names are hashed case-insensitively
+    //
+    hash |= 0x20202020;
+    hash ^= (hash >> 11);
+    return hash ^ (hash >> 16);
+}
+
+_Success_(return != 0)
+BOOL
+PdbpMapBlocks (
+    _In_ PPDB_FILE Pdb,
+    _In_reads_(BlockCount) PULONG Blocks,
+    _In_ ULONG BlockCount,
+    _In_ ULONG Size,
+    _Out_ PPDB_STREAM Stream
+    )
+{
+    ULONG i, copySize;
+    BOOLEAN contiguous;
+
+    //
+    // Validate that all the blocks are inside the file, and see if they happen
+    // to be laid out back-to-back, which is typical for freshly linked PDBs
+    //
+    contiguous = TRUE;
+    for (i = 0; i < BlockCount; i++)
+    {
+        if ((Blocks[i] >= Pdb->BlockCount) ||
+            (((ULONGLONG)Blocks[i] + 1) * Pdb->BlockSize > Pdb->FileSize))
+        {
+            printf("[-] PDB stream block %lx is out of bounds\n", Blocks[i]);
+            return FALSE;
+        }
+        if ((i != 0) && (Blocks[i] != (Blocks[i - 1] + 1)))
+        {
+            contiguous = FALSE;
+        }
+    }
+
+    //
+    // Contiguous streams can be used in place, with no copy
+    //
+    Stream->Size = Size;
+    if (contiguous != FALSE)
+    {
+        Stream->Data = (BlockCount != 0) ?
+                       Pdb->Base + ((ULONG_PTR)Blocks[0] * Pdb->BlockSize) :
+                       NULL;
+        Stream->Allocated = FALSE;
+        return TRUE;
+    }
+
+    //
+    // Otherwise, gather the blocks into a single buffer
+    //
+    Stream->Data = HeapAlloc(GetProcessHeap(), 0, Size);
+    if (Stream->Data == NULL)
+    {
+        printf("[-] Out of memory reading PDB stream\n");
+        return FALSE;
+    }
+    for (i = 0; i < BlockCount; i++)
+    {
+        copySize = min(Pdb->BlockSize, Size - (i * Pdb->BlockSize));
+        RtlCopyMemory(Stream->Data + ((ULONG_PTR)i * Pdb->BlockSize),
+                      Pdb->Base + ((ULONG_PTR)Blocks[i] * Pdb->BlockSize),
+                      copySize);
+    }
+    Stream->Allocated = TRUE;
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpMapStream (
+    _In_ PPDB_FILE Pdb,
+    _In_ ULONG StreamIndex,
+    _Out_ PPDB_STREAM Stream
+    )
+{
+    ULONG size;
+
+    //
+    // Make sure the stream exists
+    //
+    if ((StreamIndex >= Pdb->StreamCount) ||
+        (Pdb->StreamSizes[StreamIndex] == PDB_NIL_STREAM))
+    {
+        printf("[-] PDB stream %lx does not exist\n", StreamIndex);
+        return FALSE;
+    }
+
+    //
+    // Map all of its blocks
+    //
+    size = Pdb->StreamSizes[StreamIndex];
+    return PdbpMapBlocks(Pdb,
+                         Pdb->StreamBlocks[StreamIndex],
+                         (size + Pdb->BlockSize - 1) / Pdb->BlockSize,
+                         size,
+                         Stream);
+}
+
+VOID
+PdbpUnmapStream (
+    _In_ PPDB_STREAM Stream
+    )
+{
+    //
+    // Only gathered streams have anything to free
+    //
+    if (Stream->Allocated != FALSE)
+    {
+        HeapFree(GetProcessHeap(), 0, Stream->Data);
+    }
+    RtlZeroMemory(Stream, sizeof(*Stream));
+}
+
+_Success_(return != 0)
+BOOL
+PdbpReadDirectory (
+    _In_ PPDB_FILE Pdb
+    )
+{
+    PMSF_SUPER_BLOCK superBlock;
+    PULONG directoryBlocks;
+    PULONG blockList;
+    ULONG blockCount;
+    ULONG i, blocks, remaining;
+
+    //
+    // Validate the super block
+    //
+    superBlock = (PMSF_SUPER_BLOCK)Pdb->Base;
+    if ((Pdb->FileSize < sizeof(*superBlock)) ||
+        (memcmp(superBlock->Magic,
+                PDB_MSF_MAGIC,
+                sizeof(superBlock->Magic)) != 0))
+    {
+        printf("[-] Not an MSF 7.00 PDB file\n");
+        return FALSE;
+    }
+    if ((superBlock->BlockSize == 0) ||
+        ((superBlock->BlockSize & (superBlock->BlockSize - 1)) != 0) ||
+        (superBlock->BlockMapAddr >= superBlock->NumBlocks) ||
+        ((((ULONGLONG)superBlock->BlockMapAddr + 1) *
+          superBlock->BlockSize) > Pdb->FileSize))
+    {
+        printf("[-] Corrupt MSF super block\n");
+        return FALSE;
+    }
+    Pdb->BlockSize = superBlock->BlockSize;
+    Pdb->BlockCount = superBlock->NumBlocks;
+
+    //
+    // The block map lists the blocks holding the stream directory
+    //
+    blockCount = (superBlock->NumDirectoryBytes + Pdb->BlockSize - 1) /
+                 Pdb->BlockSize;
+    if (blockCount > (Pdb->BlockSize / sizeof(ULONG)))
+    {
+        printf("[-] MSF stream directory is too large\n");
+        return FALSE;
+    }
+    directoryBlocks = (PULONG)(Pdb->Base +
+                               ((ULONG_PTR)superBlock->BlockMapAddr *
+                                Pdb->BlockSize));
+    if (PdbpMapBlocks(Pdb,
+                      directoryBlocks,
+                      blockCount,
+                      superBlock->NumDirectoryBytes,
+                      &Pdb->Directory) == FALSE)
+    {
+        return FALSE;
+    }
+
+    //
+    // The directory starts with the stream count and the stream sizes
+    //
+    remaining = Pdb->Directory.Size / sizeof(ULONG);
+    if (remaining == 0)
+    {
+        printf("[-] Empty MSF stream directory\n");
+        return FALSE;
+    }
+    Pdb->StreamCount = *(PULONG)Pdb->Directory.Data;
+    Pdb->StreamSizes = (PULONG)Pdb->Directory.Data + 1;
+    remaining--;
+    if (Pdb->StreamCount > remaining)
+    {
+        printf("[-] Corrupt MSF stream directory\n");
+        return FALSE;
+    }
+    remaining -= Pdb->StreamCount;
+
+    //
+    // Followed by the block list of each stream, back to back
+    //
+    Pdb->StreamBlocks = HeapAlloc(GetProcessHeap(),
+                                  HEAP_ZERO_MEMORY,
+                                  Pdb->StreamCount * sizeof(PULONG));
+    if (Pdb->StreamBlocks == NULL)
+    {
+        printf("[-] Out of memory reading MSF stream directory\n");
+        return FALSE;
+    }
+    blockList = Pdb->StreamSizes + Pdb->StreamCount;
+    for (i = 0; i < Pdb->StreamCount; i++)
+    {
+        blocks = 0;
+        if (Pdb->StreamSizes[i] != PDB_NIL_STREAM)
+        {
+            blocks = (Pdb->StreamSizes[i] + Pdb->BlockSize - 1) /
+                     Pdb->BlockSize;
+        }
+        if (blocks > remaining)
+        {
+            printf("[-] Corrupt MSF stream directory\n");
+            return FALSE;
+        }
+        Pdb->StreamBlocks[i] = blockList;
+        blockList += blocks;
+        remaining -= blocks;
+    }
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpReadDbi (
+    _In_ PPDB_FILE Pdb,
+    _Out_ PULONG Age,
+    _Out_ PUSHORT PublicStreamIndex,
+    _Out_ PUSHORT SymRecordStreamIndex
+    )
+{
+    PDB_STREAM dbiStream;
+    PPDB_DBI_HEADER dbiHeader;
+    PUSHORT dbgStreams;
+    ULONGLONG offset;
+    BOOL b;
+
+    //
+    // Map the DBI stream and validate its header
+    //
+    b = PdbpMapStream(Pdb, PDB_STREAM_DBI, &dbiStream);
+    if (b == FALSE)
+    {
+        return b;
+    }
+    dbiHeader = (PPDB_DBI_HEADER)dbiStream.Data;
+    if ((dbiStream.Size < sizeof(*dbiHeader)) ||
+        (dbiHeader->VersionSignature != -1))
+    {
+        printf("[-] Unsupported PDB DBI stream\n");
+        PdbpUnmapStream(&dbiStream);
+        return FALSE;
+    }
+    *Age = dbiHeader->Age;
+    *PublicStreamIndex = dbiHeader->PublicStreamIndex;
+    *SymRecordStreamIndex = dbiHeader->SymRecordStream;
+
+    //
+    // The optional debug header comes after all the other substreams, and
+    // tells us where the image's section headers were saved
+    //
+    offset = sizeof(*dbiHeader) +
+             (ULONGLONG)(ULONG)dbiHeader->ModInfoSize +
+             (ULONG)dbiHeader->SectionContributionSize +
+             (ULONG)dbiHeader->SectionMapSize +
+             (ULONG)dbiHeader->SourceInfoSize +
+             (ULONG)dbiHeader->TypeServerMapSize +
+             (ULONG)dbiHeader->EcSubstreamSize;
+    if ((dbiHeader->OptionalDbgHeaderSize < 0) ||
+        ((ULONG)dbiHeader->OptionalDbgHeaderSize <
+         ((PDB_DBI_SECTION_HEADERS + 1) * sizeof(USHORT))) ||
+        ((offset + (ULONG)dbiHeader->OptionalDbgHeaderSize) > dbiStream.Size))
+    {
+        printf("[-] PDB has no section headers\n");
+        PdbpUnmapStream(&dbiStream);
+        return FALSE;
+    }
+    dbgStreams = (PUSHORT)(dbiStream.Data + offset);
+
+    //
+    // Map the section headers, which are needed to compute RVAs
+    //
+    b = FALSE;
+    if (dbgStreams[PDB_DBI_SECTION_HEADERS] != PDB_NIL_STREAM_INDEX)
+    {
+        b = PdbpMapStream(Pdb,
+                          dbgStreams[PDB_DBI_SECTION_HEADERS],
+                          &Pdb->SectionHeaders);
+    }
+    PdbpUnmapStream(&dbiStream);
+    return b;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpReadPublics (
+    _In_ PPDB_FILE Pdb
+    )
+{
+    PPDB_PUBLICS_HEADER publicsHeader;
+    PPDB_GSI_HASH_HEADER hashHeader;
+    PULONG bitmap, buckets;
+    ULONG bitmapSize, bucketCount;
+    ULONG i, j;
+
+    //
+    // The public symbol stream starts with its own header, followed by the
+    // generic symbol hash table
+    //
+    publicsHeader = (PPDB_PUBLICS_HEADER)Pdb->Publics.Data;
+    hashHeader = (PPDB_GSI_HASH_HEADER)(publicsHeader + 1);
+    if ((Pdb->Publics.Size < (sizeof(*publicsHeader) + sizeof(*hashHeader))) ||
+        (publicsHeader->SymHash >
+         (Pdb->Publics.Size - sizeof(*publicsHeader))) ||
+        (hashHeader->VerSignature != PDB_GSI_HASH_SIGNATURE) ||
+        (hashHeader->VerHeader != PDB_GSI_HASH_VERSION) ||
+        ((sizeof(*hashHeader) +
+          (ULONGLONG)hashHeader->HashRecordSize +
+          hashHeader->BucketsSize) > publicsHeader->SymHash))
+    {
+        printf("[-] Unsupported PDB public symbol hash\n");
+        return FALSE;
+    }
+
+    //
+    // Hash records point into the symbol record stream
+    //
+    Pdb->HashRecords = (PPDB_GSI_HASH_RECORD)(hashHeader + 1);
+    Pdb->HashRecordCount = hashHeader->HashRecordSize /
+                           sizeof(PDB_GSI_HASH_RECORD);
+
+    //
+    // Then comes a bitmap of the non-empty buckets, and the starting offset
+    // of each non-empty bucket in the hash records
+    //
+    bitmapSize = ((PDB_GSI_HASH_BUCKETS + 1 + 31) / 32) * sizeof(ULONG);
+    if (hashHeader->BucketsSize < bitmapSize)
+    {
+        printf("[-] Corrupt PDB public symbol hash\n");
+        return FALSE;
+    }
+    bitmap = (PULONG)((PUCHAR)Pdb->HashRecords + hashHeader->HashRecordSize);
+    buckets = (PULONG)((PUCHAR)bitmap + bitmapSize);
+    bucketCount = (hashHeader->BucketsSize - bitmapSize) / sizeof(ULONG);
+
+    //
+    // Expand this into a start/end record index for each bucket, so lookups
+    // are a straight index
+    //
+    for (i = 0, j = 0; i <= PDB_GSI_HASH_BUCKETS; i++)
+    {
+        if ((bitmap[i / 32] & (1UL << (i % 32))) == 0)
+        {
+            continue;
+        }
+        if (j >= bucketCount)
+        {
+            printf("[-] Corrupt PDB public symbol hash\n");
+            return FALSE;
+        }
+
+        Pdb->BucketStart[i] = buckets[j] / PDB_GSI_HASH_RECORD_SIZE;
+        Pdb->BucketEnd[i] = ((j + 1) < bucketCount) ?
+                            (buckets[j + 1] / PDB_GSI_HASH_RECORD_SIZE) :
+                            Pdb->HashRecordCount;
+        if ((Pdb->BucketEnd[i] > Pdb->HashRecordCount) ||
+            (Pdb->BucketStart[i] > Pdb->BucketEnd[i]))
+        {
+            printf("[-] Corrupt PDB public symbol hash\n");
+            return FALSE;
+        }
+        j++;
+    }
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpSegmentToRva (
+    _In_ PPDB_FILE Pdb,
+    _In_ USHORT Segment,
+    _In_ ULONG Offset,
+    _Out_ PULONG Rva
+    )
+{
+    PIMAGE_SECTION_HEADER sections;
+    ULONG count;
+
+    //
+    // Segments are 1-based indices into the image's section headers
+    //
+    sections = (PIMAGE_SECTION_HEADER)Pdb->SectionHeaders.Data;
+    count = Pdb->SectionHeaders.Size / sizeof(*sections);
+    if ((Segment == 0) || (Segment > count))
+    {
+        return FALSE;
+    }
+    *Rva = sections[Segment - 1].VirtualAddress + Offset;
+    return TRUE;
+}
+
+_Success_(return != NULL)
+PPDB_PUBLIC_SYMBOL
+PdbpGetPublic (
+    _In_ PPDB_FILE Pdb,
+    _In_ ULONG RecordIndex
+    )
+{
+    PPDB_PUBLIC_SYMBOL symbol;
+    ULONG offset, maxLength;
+
+    //
+    // Offsets are biased by one, so that zero can mean "no record"
+    //
+    offset = Pdb->HashRecords[RecordIndex].Offset - 1;
+    if ((offset >= Pdb->Symbols.Size) ||
+        ((Pdb->Symbols.Size - offset) <= sizeof(*symbol)))
+    {
+        return NULL;
+    }
+
+    //
+    // Only public symbols are of interest, and their name must be bounded
+    // by the record
+    //
+    symbol = (PPDB_PUBLIC_SYMBOL)(Pdb->Symbols.Data + offset);
+    maxLength = min(symbol->Length + sizeof(symbol->Length),
+                    Pdb->Symbols.Size - offset);
+    if ((symbol->Kind != S_PUB32) ||
+        (maxLength <= FIELD_OFFSET(PDB_PUBLIC_SYMBOL, Name)))
+    {
+        return NULL;
+    }
+    maxLength -= FIELD_OFFSET(PDB_PUBLIC_SYMBOL, Name);
+    if (strnlen(symbol->Name, maxLength) == maxLength)
+    {
+        return NULL;
+    }
+    return symbol;
+}
+
+_Success_(return != 0)
+BOOL
+PdbLookupPublic (
+    _In_ PPDB_FILE Pdb,
+    _In_ PCCH SymbolName,
+    _Out_ PULONG Rva
+    )
+{
+    PPDB_PUBLIC_SYMBOL symbol;
+    ULONG bucket;
+    ULONG i;
+
+    //
+    // Go straight to the bucket, and compare each symbol in its chain
+    //
+    bucket = PdbpHashName(SymbolName) % PDB_GSI_HASH_BUCKETS;
+    for (i = Pdb->BucketStart[bucket]; i < Pdb->BucketEnd[bucket]; i++)
+    {
+        symbol = PdbpGetPublic(Pdb, i);
+        if ((symbol != NULL) && (strcmp(symbol->Name, SymbolName) == 0))
+        {
+            return PdbpSegmentToRva(Pdb, symbol->Segment, symbol->Offset, Rva);
+        }
+    }
+    return FALSE;
+}
+
+VOID
+PdbEnumPublics (
+    _In_ PPDB_FILE Pdb,
+    _In_ PSYM_ENUM_ROUTINE EnumRoutine,
+    _In_ PVOID Context
+    )
+{
+    PPDB_PUBLIC_SYMBOL symbol;
+    ULONG i, rva;
+
+    //
+    // Every public symbol has exactly one hash record, so walk them in order
+    //
+    for (i = 0; i < Pdb->HashRecordCount; i++)
+    {
+        symbol = PdbpGetPublic(Pdb, i);
+        if ((symbol != NULL) &&
+            (PdbpSegmentToRva(Pdb,
+                              symbol->Segment,
+                              symbol->Offset,
+                              &rva) != FALSE))
+        {
+            EnumRoutine(Context, symbol->Name, rva);
+        }
+    }
+}
+
+_Success_(return != 0)
+BOOL
+PdbpReadTypes (
+    _In_ PPDB_FILE Pdb
+    )
+{
+    PPDB_TPI_HEADER tpiHeader;
+    ULONG offset, end, i;
+    USHORT length;
+
+    //
+    // Map the type stream and validate its header
+    //
+    if (PdbpMapStream(Pdb, PDB_STREAM_TPI, &Pdb->Types) == FALSE)
+    {
+        return FALSE;
+    }
+    tpiHeader = (PPDB_TPI_HEADER)Pdb->Types.Data;
+    if ((Pdb->Types.Size < sizeof(*tpiHeader)) ||
+        (tpiHeader->HeaderSize < sizeof(*tpiHeader)) ||
+        (tpiHeader->TypeIndexBegin != PDB_TYPE_INDEX_BEGIN) ||
+        (tpiHeader->TypeIndexEnd < tpiHeader->TypeIndexBegin) ||
+        (((ULONGLONG)tpiHeader->HeaderSize + tpiHeader->TypeRecordBytes) >
+         Pdb->Types.Size))
+    {
+        printf("[-] Unsupported PDB type stream\n");
+        return FALSE;
+    }
+
+    //
+    // Records are variable length, so index where each of them starts
+    //
+    Pdb->TypeCount = tpiHeader->TypeIndexEnd - tpiHeader->TypeIndexBegin;
+    Pdb->TypeOffsets = HeapAlloc(GetProcessHeap(),
+                                 0,
+                                 ((SIZE_T)Pdb->TypeCount + 1) * sizeof(ULONG));
+    if (Pdb->TypeOffsets == NULL)
+    {
+        printf("[-] Out of memory indexing PDB types\n");
+        return FALSE;
+    }
+    offset = tpiHeader->HeaderSize;
+    end = tpiHeader->HeaderSize + tpiHeader->TypeRecordBytes;
+    for (i = 0; i < Pdb->TypeCount; i++)
+    {
+        if ((end - offset) < (sizeof(USHORT) * 2))
+        {
+            break;
+        }
+        length = *(USHORT UNALIGNED*)(Pdb->Types.Data + offset);
+        if ((length < sizeof(USHORT)) ||
+            (length > (end - offset - sizeof(USHORT))))
+        {
+            break;
+        }
+        Pdb->TypeOffsets[i] = offset;
+        offset += sizeof(USHORT) + length;
+    }
+
+    //
+    // Only keep what we could index
+    //
+    Pdb->TypeCount = i;
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpGetType (
+    _In_ PPDB_FILE Pdb,
+    _In_ ULONG TypeIndex,
+    _Out_ PPDB_TYPE Type
+    )
+{
+    PUCHAR record;
+
+    //
+    // Simple types have no record
+    //
+    if ((TypeIndex < PDB_TYPE_INDEX_BEGIN) ||
+        ((TypeIndex - PDB_TYPE_INDEX_BEGIN) >= Pdb->TypeCount))
+    {
+        return FALSE;
+    }
+
+    //
+    // The length covers the leaf kind and the data after it
+    //
+    record = Pdb->Types.Data + Pdb->TypeOffsets[TypeIndex - PDB_TYPE_INDEX_BEGIN];
+    Type->Length = *(USHORT UNALIGNED*)record - sizeof(USHORT);
+    Type->Kind = *(USHORT UNALIGNED*)(record + sizeof(USHORT));
+    Type->Data = record + (sizeof(USHORT) * 2);
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpReadNumeric (
+    _In_reads_bytes_(Length) PUCHAR Data,
+    _In_ ULONG Length,
+    _Out_ PULONGLONG Value,
+    _Out_ PULONG Consumed
+    )
+{
+    USHORT leaf;
+    ULONG size;
+
+    //
+    // Small values are stored directly in the leaf
+    //
+    if (Length < sizeof(USHORT))
+    {
+        return FALSE;
+    }
+    leaf = *(USHORT UNALIGNED*)Data;
+    if (leaf < LF_NUMERIC)
+    {
+        *Value = leaf;
+        *Consumed = sizeof(USHORT);
+        return TRUE;
+    }
+
+    //
+    // Otherwise, the leaf tells us how large the value that follows is
+    //
+    switch (leaf)
+    {
+        case LF_CHAR:
+            size = sizeof(CHAR);
+            break;
+        case LF_SHORT:
+        case LF_USHORT:
+            size = sizeof(USHORT);
+            break;
+        case LF_LONG:
+        case LF_ULONG:
+            size = sizeof(ULONG);
+            break;
+        case LF_QUADWORD:
+        case LF_UQUADWORD:
+            size = sizeof(ULONGLONG);
+            break;
+        default:
+            return FALSE;
+    }
+    if ((Length - sizeof(USHORT)) < size)
+    {
+        return FALSE;
+    }
+    *Value = 0;
+    RtlCopyMemory(Value, Data + sizeof(USHORT), size);
+    *Consumed = sizeof(USHORT) + size;
+    return TRUE;
+}
+
+_Success_(return != NULL)
+PCHAR
+PdbpReadName (
+    _In_reads_bytes_(Length) PUCHAR Data,
+    _In_ ULONG Length,
+    _Out_opt_ PULONG Consumed
+    )
+{
+    SIZE_T nameLength;
+
+    //
+    // Names must be terminated within the record
+    //
+    nameLength = strnlen((PCHAR)Data, Length);
+    if (nameLength == Length)
+    {
+        return NULL;
+    }
+    if (Consumed != NULL)
+    {
+        *Consumed = (ULONG)nameLength + 1;
+    }
+    return (PCHAR)Data;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpParseAggregate (
+    _In_ PPDB_TYPE Type,
+    _Out_ PPDB_AGGREGATE Aggregate
+    )
+{
+    ULONG offset, consumed;
+
+    //
+    // Classes and structures have derivation and vtable shape indices, which
+    // unions don't
+    //
+    if ((Type->Kind == LF_CLASS) || (Type->Kind == LF_STRUCTURE))
+    {
+        offset = (sizeof(USHORT) * 2) + (sizeof(ULONG) * 3);
+    }
+    else if (Type->Kind == LF_UNION)
+    {
+        offset = (sizeof(USHORT) * 2) + sizeof(ULONG);
+    }
+    else
+    {
+        return FALSE;
+    }
+    if (Type->Length < offset)
+    {
+        return FALSE;
+    }
+
+    //
+    // Then comes the size and the name
+    //
+    Aggregate->Property = *(USHORT UNALIGNED*)(Type->Data + sizeof(USHORT));
+    Aggregate->FieldList = *(ULONG UNALIGNED*)(Type->Data + (sizeof(USHORT) * 2));
+    if (PdbpReadNumeric(Type->Data + offset,
+                        Type->Length - offset,
+                        &Aggregate->Size,
+                        &consumed) == FALSE)
+    {
+        return FALSE;
+    }
+    offset += consumed;
+    Aggregate->Name = PdbpReadName(Type->Data + offset,
+                                   Type->Length - offset,
+                                   NULL);
+    return Aggregate->Name != NULL;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpFindAggregate (
+    _In_ PPDB_FILE Pdb,
+    _In_ PCCH TypeName,
+    _Out_ PULONG TypeIndex,
+    _Out_ PPDB_AGGREGATE Aggregate
+    )
+{
+    PDB_TYPE type;
+    ULONG i;
+
+    //
+    // Look for the full definition of the type, skipping forward references
+    //
+    for (i = 0; i < Pdb->TypeCount; i++)
+    {
+        if ((PdbpGetType(Pdb, PDB_TYPE_INDEX_BEGIN + i, &type) != FALSE) &&
+            (PdbpParseAggregate(&type, Aggregate) != FALSE) &&
+            ((Aggregate->Property & CV_PROP_FWDREF) == 0) &&
+            (strcmp(Aggregate->Name, TypeName) == 0))
+        {
+            *TypeIndex = PDB_TYPE_INDEX_BEGIN + i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpGetAggregate (
+    _In_ PPDB_FILE Pdb,
+    _In_ ULONG TypeIndex,
+    _Out_ PPDB_AGGREGATE Aggregate
+    )
+{
+    PDB_TYPE type;
+    ULONG depth;
+
+    //
+    // Look through any const/volatile modifiers
+    //
+    for (depth = 0; depth < PDB_TYPE_MAX_DEPTH; depth++)
+    {
+        if (PdbpGetType(Pdb, TypeIndex, &type) == FALSE)
+        {
+            return FALSE;
+        }
+        if ((type.Kind != LF_MODIFIER) || (type.Length < sizeof(ULONG)))
+        {
+            break;
+        }
+        TypeIndex = *(ULONG UNALIGNED*)type.Data;
+    }
+    if (PdbpParseAggregate(&type, Aggregate) == FALSE)
+    {
+        return FALSE;
+    }
+
+    //
+    // Members usually refer to forward references, so find the definition
+    //
+    if ((Aggregate->Property & CV_PROP_FWDREF) != 0)
+    {
+        return PdbpFindAggregate(Pdb, Aggregate->Name, &TypeIndex, Aggregate);
+    }
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpGetTypeSize (
+    _In_ PPDB_FILE Pdb,
+    _In_ ULONG TypeIndex,
+    _In_ ULONG Depth,
+    _Out_ PULONG Size
+    )
+{
+    PDB_AGGREGATE aggregate;
+    PDB_TYPE type;
+    ULONGLONG value;
+    ULONG consumed;
+
+    //
+    // Don't let corrupt, circular type chains run away
+    //
+    if (Depth == PDB_TYPE_MAX_DEPTH)
+    {
+        return FALSE;
+    }
+
+    //
+    // Simple types encode a pointer mode and a base type in their index
+    //
+    if (TypeIndex < PDB_TYPE_INDEX_BEGIN)
+    {
+        switch ((TypeIndex >> 8) & 0xF)
+        {
+            case 0:
+                break;
+            case 4:
+                *Size = sizeof(ULONG);
+                return TRUE;
+            case 6:
+                *Size = sizeof(ULONGLONG);
+                return TRUE;
+            default:
+                return FALSE;
+        }
+
+        switch (TypeIndex & 0xFF)
+        {
+            case 0x10: case 0x20: case 0x30: case 0x68: case 0x69: case 0x70:
+                *Size = sizeof(UCHAR);
+                return TRUE;
+            case 0x11: case 0x21: case 0x31: case 0x71: case 0x72: case 0x73:
+            case 0x7A:
+                *Size = sizeof(USHORT);
+                return TRUE;
+            case 0x08: case 0x12: case 0x22: case 0x32: case 0x40: case 0x74:
+            case 0x75: case 0x7B:
+                *Size = sizeof(ULONG);
+                return TRUE;
+            case 0x13: case 0x23: case 0x33: case 0x41: case 0x76: case 0x77:
+                *Size = sizeof(ULONGLONG);
+                return TRUE;
+            default:
+                return FALSE;
+        }
+    }
+
+    //
+    // Otherwise, it depends on the kind of record
+    //
+    if (PdbpGetType(Pdb, TypeIndex, &type) == FALSE)
+    {
+        return FALSE;
+    }
+    switch (type.Kind)
+    {
+        case LF_POINTER:
+            if (type.Length < (sizeof(ULONG) * 2))
+            {
+                return FALSE;
+            }
+            *Size = (*(ULONG UNALIGNED*)(type.Data + sizeof(ULONG)) >> 13) & 0x3F;
+            return TRUE;
+
+        case LF_MODIFIER:
+        case LF_BITFIELD:
+            if (type.Length < sizeof(ULONG))
+            {
+                return FALSE;
+            }
+            return PdbpGetTypeSize(Pdb,
+                                   *(ULONG UNALIGNED*)type.Data,
+                                   Depth + 1,
+                                   Size);
+
+        case LF_ENUM:
+            if (type.Length < ((sizeof(USHORT) * 2) + sizeof(ULONG)))
+            {
+                return FALSE;
+            }
+            return PdbpGetTypeSize(Pdb,
+                                   *(ULONG UNALIGNED*)(type.Data +
+                                                       (sizeof(USHORT) * 2)),
+                                   Depth + 1,
+                                   Size);
+
+        case LF_ARRAY:
+            if ((type.Length < (sizeof(ULONG) * 2)) ||
+                (PdbpReadNumeric(type.Data + (sizeof(ULONG) * 2),
+                                 type.Length - (sizeof(ULONG) * 2),
+                                 &value,
+                                 &consumed) == FALSE) ||
+                (value > MAXULONG))
+            {
+                return FALSE;
+            }
+            *Size = (ULONG)value;
+            return TRUE;
+
+        case LF_CLASS:
+        case LF_STRUCTURE:
+        case LF_UNION:
+            if ((PdbpGetAggregate(Pdb, TypeIndex, &aggregate) == FALSE) ||
+                (aggregate.Size > MAXULONG))
+            {
+                return FALSE;
+            }
+            *Size = (ULONG)aggregate.Size;
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+_Success_(return != 0)
+BOOL
+PdbpFindMember (
+    _In_ PPDB_FILE Pdb,
+    _In_ ULONG FieldList,
+    _In_ PCCH MemberName,
+    _Out_ PULONG MemberType,
+    _Out_ PULONG MemberOffset
+    )
+{
+    PDB_TYPE type;
+    USHORT kind, attributes;
+    ULONG offset, consumed, typeIndex, depth;
+    ULONGLONG value;
+    PCHAR name;
+
+    //
+    // Long field lists are split across several records, chained by LF_INDEX
+    //
+    for (depth = 0; depth < PDB_TYPE_MAX_DEPTH; depth++)
+    {
+        if ((PdbpGetType(Pdb, FieldList, &type) == FALSE) ||
+            (type.Kind != LF_FIELDLIST))
+        {
+            return FALSE;
+        }
+
+        //
+        // Walk each sub-record. They're not length-prefixed, so each kind we
+        // might encounter needs to be parsed in order to skip over it.
+        //
+        FieldList = 0;
+        offset = 0;
+        while ((offset + (sizeof(USHORT) * 2)) <= type.Length)
+        {
+            kind = *(USHORT UNALIGNED*)(type.Data + offset);
+            attributes = *(USHORT UNALIGNED*)(type.Data + offset + sizeof(USHORT));
+            offset += sizeof(USHORT) * 2;
+            name = NULL;
+            typeIndex = 0;
+            value = 0;
+
+            switch (kind)
+            {
+                case LF_MEMBER:
+                case LF_STMEMBER:
+                case LF_NESTTYPE:
+                case LF_BCLASS:
+                case LF_VFUNCTAB:
+                case LF_INDEX:
+                case LF_VBCLASS:
+                case LF_IVBCLASS:
+                case LF_ONEMETHOD:
+                case LF_METHOD:
+                    if ((type.Length - offset) < sizeof(ULONG))
+                    {
+                        return FALSE;
+                    }
+                    typeIndex = *(ULONG UNALIGNED*)(type.Data + offset);
+                    offset += sizeof(ULONG);
+                    break;
+                case LF_ENUMERATE:
+                    break;
+                default:
+                    return FALSE;
+            }
+
+            //
+            // Virtual bases have a second index and two offsets, introducing
+            // virtual methods have a vtable offset, and members, base classes
+            // and enumerators have a value
+            //
+            if ((kind == LF_VBCLASS) || (kind == LF_IVBCLASS))
+            {
+                if (((type.Length - offset) < sizeof(ULONG)) ||
+                    (PdbpReadNumeric(type.Data + offset + sizeof(ULONG),
+                                     type.Length - offset - sizeof(ULONG),
+                                     &value,
+                                     &consumed) == FALSE))
+                {
+                    return FALSE;
+                }
+                offset += sizeof(ULONG) + consumed;
+            }
+            else if ((kind == LF_ONEMETHOD) &&
+                     ((((attributes >> 2) & 7) == CV_MTINTRO) ||
+                      (((attributes >> 2) & 7) == CV_MTPUREINTRO)))
+            {
+                if ((type.Length - offset) < sizeof(ULONG))
+                {
+                    return FALSE;
+                }
+                offset += sizeof(ULONG);
+            }
+            if ((kind == LF_MEMBER) ||
+                (kind == LF_BCLASS) ||
+                (kind == LF_VBCLASS) ||
+                (kind == LF_IVBCLASS) ||
+                (kind == LF_ENUMERATE))
+            {
+                if (PdbpReadNumeric(type.Data + offset,
+                                    type.Length - offset,
+                                    &value,
+                                    &consumed) == FALSE)
+                {
+                    return FALSE;
+                }
+                offset += consumed;
+            }
+
+            //
+            // Most of them then have a name
+            //
+            if ((kind != LF_BCLASS) &&
+                (kind != LF_VBCLASS) &&
+                (kind != LF_IVBCLASS) &&
+                (kind != LF_VFUNCTAB) &&
+                (kind != LF_INDEX))
+            {
+                name = PdbpReadName(type.Data + offset,
+                                    type.Length - offset,
+                                    &consumed);
+                if (name == NULL)
+                {
+                    return FALSE;
+                }
+                offset += consumed;
+            }
+
+            //
+            // Is this the data member we're looking for?
+            //
+            if ((kind == LF_MEMBER) &&
+                (strcmp(name, MemberName) == 0) &&
+                (value <= MAXULONG))
+            {
+                *MemberType = typeIndex;
+                *MemberOffset = (ULONG)value;
+                return TRUE;
+            }
+            if (kind == LF_INDEX)
+            {
+                FieldList = typeIndex;
+            }
+
+            //
+            // Skip the padding that aligns the next sub-record
+            //
+            while ((offset < type.Length) && (type.Data[offset] > LF_PAD0))
+            {
+                offset += type.Data[offset] & 0xF;
+            }
+        }
+
+        //
+        // Move on to the continuation, if there's one
+        //
+        if (FieldList == 0)
+        {
+            break;
+        }
+    }
+    return FALSE;
+}
+
+_Success_(return != 0)
+BOOL
+PdbLookupField (
+    _In_ PPDB_FILE Pdb,
+    _In_ PCCH TypeName,
+    _In_ PCCH FieldPath,
+    _Out_ PULONG Offset,
+    _Out_ PULONG Size
+    )
+{
+    PDB_AGGREGATE aggregate;
+    CHAR fieldPath[PDB_FIELD_PATH_LENGTH];
+    PCHAR field, nextField;
+    ULONG typeIndex, memberOffset;
+    BOOL b;
+
+    //
+    // Index the type records the first time around
+    //
+    if (Pdb->TypesProbed == FALSE)
+    {
+        Pdb->TypesProbed = TRUE;
+        PdbpReadTypes(Pdb);
+    }
+    if (Pdb->TypeOffsets == NULL)
+    {
+        return FALSE;
+    }
+
+    //
+    // Find the outermost type
+    //
+    b = PdbpFindAggregate(Pdb, TypeName, &typeIndex, &aggregate);
+    if (b == FALSE)
+    {
+        printf("[-] Type %s not found\n", TypeName);
+        return FALSE;
+    }
+
+    //
+    // Then walk each member of the dotted path, which must all be embedded
+    // structures except for the last one
+    //
+    if (strlen(FieldPath) >= sizeof(fieldPath))
+    {
+        printf("[-] Field path %s is too long\n", FieldPath);
+        return FALSE;
+    }
+    strcpy_s(fieldPath, sizeof(fieldPath), FieldPath);
+    *Offset = 0;
+    for (field = fieldPath; field != NULL; field = nextField)
+    {
+        nextField = strchr(field, '.');
+        if (nextField != NULL)
+        {
+            *nextField++ = ANSI_NULL;
+        }
+
+        b = PdbpFindMember(Pdb,
+                           aggregate.FieldList,
+                           field,
+                           &typeIndex,
+                           &memberOffset);
+        if (b == FALSE)
+        {
+            printf("[-] Field %s not found in %s\n", field, aggregate.Name);
+            return FALSE;
+        }
+        *Offset += memberOffset;
+
+        if ((nextField != NULL) &&
+            (PdbpGetAggregate(Pdb, typeIndex, &aggregate) == FALSE))
+        {
+            printf("[-] Field %s is not a structure\n", field);
+            return FALSE;
+        }
+    }
+
+    //
+    // Finally, get the size of the last field
+    //
+    b = PdbpGetTypeSize(Pdb, typeIndex, 0, Size);
+    if (b == FALSE)
+    {
+        *Size = 0;
+    }
+    return TRUE;
+}
+
+VOID
+PdbClose (
+    _In_ PPDB_FILE Pdb
+    )
+{
+    //
+    // Free any gathered streams
+    //
+    PdbpUnmapStream(&Pdb->Types);
+    PdbpUnmapStream(&Pdb->SectionHeaders);
+    PdbpUnmapStream(&Pdb->Publics);
+    PdbpUnmapStream(&Pdb->Symbols);
+    PdbpUnmapStream(&Pdb->Directory);
+    if (Pdb->TypeOffsets != NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, Pdb->TypeOffsets);
+    }
+    if (Pdb->StreamBlocks != NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, Pdb->StreamBlocks);
+    }
+
+    //
+    // Unmap the file and free the tracker
+    //
+    if (Pdb->Base != NULL)
+    {
+        UnmapViewOfFile(Pdb->Base);
+    }
+    HeapFree(GetProcessHeap(), 0, Pdb);
+}
+
+_Success_(return != 0)
+BOOL
+PdbOpen (
+    _Outptr_ PPDB_FILE* Pdb,
+    _In_ PCCH PdbPath,
+    _In_ PSYM_DEBUG_ID DebugId
+    )
+{
+    HANDLE hFile, hSection;
+    LARGE_INTEGER fileSize;
+    PDB_STREAM infoStream;
+    PPDB_INFO_HEADER infoHeader;
+    USHORT publicStream, symbolStream;
+    ULONG age;
+    BOOL b;
+
+    //
+    // Allocate the tracker
+    //
+    *Pdb = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(**Pdb));
+    if (*Pdb == NULL)
+    {
+        printf("[-] Out of memory allocating PDB tracker\n");
+        return FALSE;
+    }
+
+    //
+    // Map the whole file read-only -- only the pages we touch will be read
+    //
+    hFile = CreateFileA(PdbPath,
+                        GENERIC_READ,
+                        FILE_SHARE_READ,
+                        NULL,
+                        OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        HeapFree(GetProcessHeap(), 0, *Pdb);
+        return FALSE;
+    }
+    b = GetFileSizeEx(hFile, &fileSize);
+    if ((b == FALSE) || (fileSize.QuadPart == 0))
+    {
+        CloseHandle(hFile);
+        HeapFree(GetProcessHeap(), 0, *Pdb);
+        return FALSE;
+    }
+    hSection = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (hSection == NULL)
+    {
+        printf("[-] Failed to create section for %s: %lx\n",
+               PdbPath,
+               GetLastError());
+        HeapFree(GetProcessHeap(), 0, *Pdb);
+        return FALSE;
+    }
+    (*Pdb)->Base = MapViewOfFile(hSection, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hSection);
+    if ((*Pdb)->Base == NULL)
+    {
+        printf("[-] Failed to map %s: %lx\n", PdbPath, GetLastError());
+        HeapFree(GetProcessHeap(), 0, *Pdb);
+        return FALSE;
+    }
+    (*Pdb)->FileSize = fileSize.QuadPart;
+
+    //
+    // Parse the MSF container
+    //
+    b = PdbpReadDirectory(*Pdb);
+    if (b == FALSE)
+    {
+        goto Failure;
+    }
+
+    //
+    // Make sure this PDB actually matches the image
+    //
+    b = PdbpMapStream(*Pdb, PDB_STREAM_INFO, &infoStream);
+    if (b == FALSE)
+    {
+        goto Failure;
+    }
+    infoHeader = (PPDB_INFO_HEADER)infoStream.Data;
+    b = (infoStream.Size >= sizeof(*infoHeader)) &&
+        (IsEqualGUID(&infoHeader->Guid, &DebugId->Guid));
+    PdbpUnmapStream(&infoStream);
+    if (b == FALSE)
+    {
+        printf("[-] %s does not match the image\n", PdbPath);
+        goto Failure;
+    }
+
+    //
+    // Find the public symbol and symbol record streams, as well as the
+    // section headers
+    //
+    b = PdbpReadDbi(*Pdb, &age, &publicStream, &symbolStream);
+    if (b == FALSE)
+    {
+        goto Failure;
+    }
+
+    //
+    // An incremental link keeps the GUID but bumps the age, and the DBI age
+    // is the one that the linker writes into the image, so check it as well
+    //
+    if (age != DebugId->Age)
+    {
+        printf("[-] %s is age %lu, but the image needs age %lu\n",
+               PdbPath,
+               age,
+               DebugId->Age);
+        b = FALSE;
+        goto Failure;
+    }
+
+    //
+    // Map them and build the public symbol hash
+    //
+    b = PdbpMapStream(*Pdb, symbolStream, &(*Pdb)->Symbols);
+    if (b == FALSE)
+    {
+        goto Failure;
+    }
+    b = PdbpMapStream(*Pdb, publicStream, &(*Pdb)->Publics);
+    if (b == FALSE)
+    {
+        goto Failure;
+    }
+    b = PdbpReadPublics(*Pdb);
+    if (b == FALSE)
+    {
+        goto Failure;
+    }
+    return TRUE;
+
+Failure:
+    PdbClose(*Pdb);
+    *Pdb = NULL;
+    return FALSE;
+}
+
+_Success_(return != 0)
+BOOL
+PdbpProbeStore (
+    _In_ PCCH StorePath,
+    _In_ PCCH PdbName,
+    _In_ PSYM_DEBUG_ID DebugId,
+    _Out_writes_(PathSize) PCHAR PdbPath,
+    _In_ ULONG PathSize
+    )
+{
+    ULONG attributes;
+
+    //
+    // Try the symbol server layout first -- pdbname\GUIDAGE\pdbname
+    //
+    sprintf_s(PdbPath,
+              PathSize,
+              "%s\\%s\\%08lX%04hX%04hX%02X%02X%02X%02X%02X%02X%02X%02X%lX\\%s",
+              StorePath,
+              PdbName,
+              DebugId->Guid.Data1,
+              DebugId->Guid.Data2,
+              DebugId->Guid.Data3,
+              DebugId->Guid.Data4[0],
+              DebugId->Guid.Data4[1],
+              DebugId->Guid.Data4[2],
+              DebugId->Guid.Data4[3],
+              DebugId->Guid.Data4[4],
+              DebugId->Guid.Data4[5],
+              DebugId->Guid.Data4[6],
+              DebugId->Guid.Data4[7],
+              DebugId->Age,
+              PdbName);
+    attributes = GetFileAttributesA(PdbPath);
+    if ((attributes != INVALID_FILE_ATTRIBUTES) &&
+        ((attributes & FILE_ATTRIBUTE_DIRECTORY) == 0))
+    {
+        return TRUE;
+    }
+
+    //
+    // Then a flat directory -- the GUID and age will be checked when it's
+    // opened. In a symbol server store this name is the directory holding
+    // each copy, which is not a match.
+    //
+    sprintf_s(PdbPath, PathSize, "%s\\%s", StorePath, PdbName);
+    attributes = GetFileAttributesA(PdbPath);
+    return (attributes != INVALID_FILE_ATTRIBUTES) &&
+           ((attributes & FILE_ATTRIBUTE_DIRECTORY) == 0);
+}
+
+_Success_(return != 0)
+BOOL
+PdbLocate (
+    _In_ PCCH PdbName,
+    _In_ PSYM_DEBUG_ID DebugId,
+    _Out_writes_(PathSize) PCHAR PdbPath,
+    _In_ ULONG PathSize
+    )
+{
+    static PCCH variables[] = { "_NT_SYMBOL_PATH", "_NT_ALT_SYMBOL_PATH" };
+    CHAR symbolPath[2048];
+    PCHAR element, nextElement, component, nextComponent;
+    ULONG i, length;
+    BOOL isServer;
+
+    //
+    // Walk each element of the symbol path variables
+    //
+    for (i = 0; i < _ARRAYSIZE(variables); i++)
+    {
+        length = GetEnvironmentVariableA(variables[i],
+                                         symbolPath,
+                                         sizeof(symbolPath));
+        if ((length == 0) || (length >= sizeof(symbolPath)))
+        {
+            continue;
+        }
+
+        for (element = symbolPath; element != NULL; element = nextElement)
+        {
+            nextElement = strchr(element, ';');
+            if (nextElement != NULL)
+            {
+                *nextElement++ = ANSI_NULL;
+            }
+
+            //
+            // Elements are either plain directories, or srv*/symsrv*/cache*
+            // chains, in which any local directory is a downstream store. We
+            // never reach out to the network ourselves.
+            //
+            isServer = FALSE;
+            for (component = element; component != NULL; component = nextComponent)
+            {
+                nextComponent = strchr(component, '*');
+                if (nextComponent != NULL)
+                {
+                    *nextComponent++ = ANSI_NULL;
+                }
+
+                if ((_stricmp(component, "srv") == 0) ||
+                    (_stricmp(component, "symsrv") == 0) ||
+                    (_stricmp(component, "cache") == 0))
+                {
+                    isServer = TRUE;
+                    continue;
+                }
+                if ((*component == ANSI_NULL) ||
+                    (_strnicmp(component, "http://", 7) == 0) ||
+                    (_strnicmp(component, "https://", 8) == 0) ||
+                    ((isServer != FALSE) &&
+                     (strstr(component, ".dll") != NULL)))
+                {
+                    continue;
+                }
+
+                if (PdbpProbeStore(component,
+                                   PdbName,
+                                   DebugId,
+                                   PdbPath,
+                                   PathSize) != FALSE)
+                {
+                    return TRUE;
+                }
+            }
+        }
+    }
+    return FALSE;
+}
@@ -0,0 +1,813 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    r0akpe.c
+
+Abstract:
+
+    This module implements a header-only PE image reader for r0ak
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0ak.h"
+
+//
+// Internal definitions
+//
+#define PE_HEADER_VIEW_SIZE         4096
+#define PE_MAX_VIEWS                8
+#define PE_EXPORT_HASH_EMPTY        0
+#define CV_SIGNATURE_RSDS           'SDSR'
+
+//
+// CodeView debug information record pointed to by the debug directory
+//
+typedef struct _CV_INFO_PDB70
+{
+    ULONG CvSignature;
+    GUID Signature;
+    ULONG Age;
+    CHAR PdbFileName[ANYSIZE_ARRAY];
+} CV_INFO_PDB70, *PCV_INFO_PDB70;
+
+//
+// Tracks an opened image between calls. Only the headers are mapped up front,
+// with other parts of the file mapped on demand as separate small views.
+//
+typedef struct _PE_IMAGE
+{
+    HANDLE Section;
+    ULONGLONG FileSize;
+    ULONG Granularity;
+    PUCHAR Headers;
+    PIMAGE_NT_HEADERS NtHeaders;
+    PIMAGE_SECTION_HEADER Sections;
+    ULONG SectionCount;
+    ULONG ViewCount;
+    PVOID Views[PE_MAX_VIEWS];
+    BOOL ExportsProbed;
+    PUCHAR ExportBase;
+    ULONG ExportRva;
+    ULONG ExportSize;
+    PIMAGE_EXPORT_DIRECTORY ExportDirectory;
+    PULONG ExportFunctions;
+    PULONG ExportNames;
+    PUSHORT ExportOrdinals;
+    PULONG ExportHash;
+    ULONG ExportHashMask;
+} PE_IMAGE, *PPE_IMAGE;
+
+_Success_(return != NULL)
+PVOID
+PepMapFileRange (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONGLONG FileOffset,
+    _In_ ULONG Size
+    )
+{
+    ULONGLONG viewOffset;
+    PUCHAR view;
+
+    //
+    // Make sure the range is inside the file, and that we have room to track
+    // another view
+    //
+    if ((Size == 0) ||
+        (FileOffset >= Image->FileSize) ||
+        (Size > (Image->FileSize - FileOffset)) ||
+        (Image->ViewCount == PE_MAX_VIEWS))
+    {
+        return NULL;
+    }
+
+    //
+    // Views must start on an allocation granularity boundary
+    //
+    viewOffset = FileOffset & ~((ULONGLONG)Image->Granularity - 1);
+    view = MapViewOfFile(Image->Section,
+                         FILE_MAP_READ,
+                         (ULONG)(viewOffset >> 32),
+                         (ULONG)viewOffset,
+                         (SIZE_T)(FileOffset - viewOffset) + Size);
+    if (view == NULL)
+    {
+        printf("[-] Failed to map image range: %lx\n", GetLastError());
+        return NULL;
+    }
+
+    //
+    // Remember it so that it can be unmapped when the image is closed
+    //
+    Image->Views[Image->ViewCount++] = view;
+    return view + (FileOffset - viewOffset);
+}
+
+_Success_(return != 0)
+BOOL
+PeRvaToFileOffset (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG Rva,
+    _Out_ PULONG FileOffset
+    )
+{
+    PIMAGE_SECTION_HEADER section;
+    ULONG i, size;
+
+    //
+    // The headers are mapped 1:1
+    //
+    if (Rva < Image->NtHeaders->OptionalHeader.SizeOfHeaders)
+    {
+        *FileOffset = Rva;
+        return TRUE;
+    }
+
+    //
+    // Otherwise, find the section containing this RVA
+    //
+    for (i = 0; i < Image->SectionCount; i++)
+    {
+        section = &Image->Sections[i];
+        size = max(section->Misc.VirtualSize, section->SizeOfRawData);
+        if ((Rva >= section->VirtualAddress) &&
+            (Rva < (section->VirtualAddress + size)))
+        {
+            if ((Rva - section->VirtualAddress) >= section->SizeOfRawData)
+            {
+                //
+                // Uninitialized data has no backing in the file
+                //
+                return FALSE;
+            }
+
+            *FileOffset = section->PointerToRawData +
+                          (Rva - section->VirtualAddress);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+_Success_(return != NULL)
+PVOID
+PeMapRva (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG Rva,
+    _In_ ULONG Size
+    )
+{
+    ULONG fileOffset;
+
+    //
+    // Translate the RVA to its location in the file, and map just that range
+    //
+    if (PeRvaToFileOffset(Image, Rva, &fileOffset) == FALSE)
+    {
+        return NULL;
+    }
+    return PepMapFileRange(Image, fileOffset, Size);
+}
+
+_Success_(return != NULL)
+PIMAGE_DATA_DIRECTORY
+PeGetDirectory (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG Index
+    )
+{
+    PIMAGE_OPTIONAL_HEADER64 optionalHeader;
+
+    //
+    // Check that the directory exists in this image
+    //
+    optionalHeader = &Image->NtHeaders->OptionalHeader;
+    if ((Index >= optionalHeader->NumberOfRvaAndSizes) ||
+        (optionalHeader->DataDirectory[Index].VirtualAddress == 0) ||
+        (optionalHeader->DataDirectory[Index].Size == 0))
+    {
+        return NULL;
+    }
+    return &optionalHeader->DataDirectory[Index];
+}
+
+ULONG
+PeGetImageSize (
+    _In_ PPE_IMAGE Image
+    )
+{
+    return Image->NtHeaders->OptionalHeader.SizeOfImage;
+}
+
+_Success_(return != 0)
+BOOL
+PeGetDebugId (
+    _In_ PPE_IMAGE Image,
+    _Out_ PSYM_DEBUG_ID DebugId,
+    _Out_writes_(PdbNameSize) PCHAR PdbName,
+    _In_ ULONG PdbNameSize
+    )
+{
+    PIMAGE_DATA_DIRECTORY dataDirectory;
+    PIMAGE_DEBUG_DIRECTORY debugDirectory;
+    PCV_INFO_PDB70 cvInfo;
+    PCHAR fileName;
+    ULONG i, count, nameLength;
+
+    //
+    // Map only the debug directory
+    //
+    dataDirectory = PeGetDirectory(Image, IMAGE_DIRECTORY_ENTRY_DEBUG);
+    if (dataDirectory == NULL)
+    {
+        return FALSE;
+    }
+    debugDirectory = PeMapRva(Image,
+                              dataDirectory->VirtualAddress,
+                              dataDirectory->Size);
+    if (debugDirectory == NULL)
+    {
+        return FALSE;
+    }
+
+    //
+    // Walk it looking for the CodeView record
+    //
+    count = dataDirectory->Size / sizeof(*debugDirectory);
+    for (i = 0; i < count; i++)
+    {
+        if ((debugDirectory[i].Type != IMAGE_DEBUG_TYPE_CODEVIEW) ||
+            (debugDirectory[i].SizeOfData <= sizeof(*cvInfo)))
+        {
+            continue;
+        }
+
+        //
+        // Debug data has its raw file offset, so map it directly. Only PDB
+        // 7.0 records are supported.
+        //
+        cvInfo = PepMapFileRange(Image,
+                                 debugDirectory[i].PointerToRawData,
+                                 debugDirectory[i].SizeOfData);
+        if ((cvInfo == NULL) || (cvInfo->CvSignature != CV_SIGNATURE_RSDS))
+        {
+            continue;
+        }
+
+        //
+        // Make sure the file name is terminated within the record
+        //
+        nameLength = debugDirectory[i].SizeOfData -
+                     FIELD_OFFSET(CV_INFO_PDB70, PdbFileName);
+        if (strnlen(cvInfo->PdbFileName, nameLength) == nameLength)
+        {
+            continue;
+        }
+
+        //
+        // Symbol stores are indexed by the file name alone
+        //
+        fileName = strrchr(cvInfo->PdbFileName, '\\');
+        fileName = (fileName != NULL) ? fileName + 1 : cvInfo->PdbFileName;
+        if (strlen(fileName) >= PdbNameSize)
+        {
+            return FALSE;
+        }
+        strcpy_s(PdbName, PdbNameSize, fileName);
+        DebugId->Guid = cvInfo->Signature;
+        DebugId->Age = cvInfo->Age;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+ULONG
+PepHashExportName (
+    _In_ PCCH Name
+    )
+{
+    ULONG hash;
+
+    //
+    // FNV-1a of the export name
+    //
+    for (hash = 2166136261; *Name != ANSI_NULL; Name++)
+    {
+        hash = (hash ^ (UCHAR)*Name) * 16777619;
+    }
+    return hash;
+}
+
+_Success_(return != NULL)
+PVOID
+PepMapExportRange (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG Rva,
+    _In_ ULONG Size
+    )
+{
+    //
+    // The tables are normally inside the export directory itself, which we
+    // already mapped -- otherwise map them on their own
+    //
+    if ((Rva >= Image->ExportRva) &&
+        (Size <= Image->ExportSize) &&
+        ((Rva - Image->ExportRva) <= (Image->ExportSize - Size)))
+    {
+        return Image->ExportBase + (Rva - Image->ExportRva);
+    }
+    return PeMapRva(Image, Rva, Size);
+}
+
+_Success_(return != NULL)
+PCHAR
+PepGetExportName (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG NameIndex
+    )
+{
+    PCHAR name;
+    ULONG rva, maxLength;
+
+    //
+    // Names are only looked at when they're inside the export directory, and
+    // properly terminated within it
+    //
+    rva = Image->ExportNames[NameIndex];
+    if ((rva < Image->ExportRva) ||
+        (rva >= (Image->ExportRva + Image->ExportSize)))
+    {
+        return NULL;
+    }
+    name = (PCHAR)Image->ExportBase + (rva - Image->ExportRva);
+    maxLength = Image->ExportSize - (rva - Image->ExportRva);
+    if (strnlen(name, maxLength) == maxLength)
+    {
+        return NULL;
+    }
+    return name;
+}
+
+_Success_(return != 0)
+BOOL
+PepBuildExportIndex (
+    _In_ PPE_IMAGE Image
+    )
+{
+    PIMAGE_DATA_DIRECTORY dataDirectory;
+    PIMAGE_EXPORT_DIRECTORY exportDirectory;
+    PCHAR name;
+    ULONG i, slot, hashSize;
+
+    //
+    // Map the export directory, which also contains the name strings
+    //
+    dataDirectory = PeGetDirectory(Image, IMAGE_DIRECTORY_ENTRY_EXPORT);
+    if ((dataDirectory == NULL) ||
+        (dataDirectory->Size < sizeof(*exportDirectory)))
+    {
+        return FALSE;
+    }
+    Image->ExportBase = PeMapRva(Image,
+                                 dataDirectory->VirtualAddress,
+                                 dataDirectory->Size);
+    if (Image->ExportBase == NULL)
+    {
+        return FALSE;
+    }
+    Image->ExportRva = dataDirectory->VirtualAddress;
+    Image->ExportSize = dataDirectory->Size;
+    exportDirectory = (PIMAGE_EXPORT_DIRECTORY)Image->ExportBase;
+
+    //
+    // Get the function, name and name ordinal tables
+    //
+    if ((exportDirectory->NumberOfFunctions > (MAXULONG / sizeof(ULONG))) ||
+        (exportDirectory->NumberOfNames > (MAXULONG / sizeof(ULONG))))
+    {
+        return FALSE;
+    }
+    Image->ExportFunctions = PepMapExportRange(Image,
+                                               exportDirectory->AddressOfFunctions,
+                                               exportDirectory->NumberOfFunctions *
+                                               sizeof(ULONG));
+    Image->ExportNames = PepMapExportRange(Image,
+                                           exportDirectory->AddressOfNames,
+                                           exportDirectory->NumberOfNames *
+                                           sizeof(ULONG));
+    Image->ExportOrdinals = PepMapExportRange(Image,
+                                              exportDirectory->AddressOfNameOrdinals,
+                                              exportDirectory->NumberOfNames *
+                                              sizeof(USHORT));
+    if ((Image->ExportFunctions == NULL) ||
+        ((exportDirectory->NumberOfNames != 0) &&
+         ((Image->ExportNames == NULL) || (Image->ExportOrdinals == NULL))))
+    {
+        return FALSE;
+    }
+    Image->ExportDirectory = exportDirectory;
+
+    //
+    // Build an open-addressed hash of the names, keeping it at most half full.
+    // Each slot holds a name index plus one, so that zero means empty.
+    //
+    for (hashSize = 16; hashSize < (exportDirectory->NumberOfNames * 2); hashSize <<= 1);
+    Image->ExportHash = HeapAlloc(GetProcessHeap(),
+                                  HEAP_ZERO_MEMORY,
+                                  hashSize * sizeof(ULONG));
+    if (Image->ExportHash == NULL)
+    {
+        printf("[-] Out of memory building export index\n");
+        return FALSE;
+    }
+    Image->ExportHashMask = hashSize - 1;
+    for (i = 0; i < exportDirectory->NumberOfNames; i++)
+    {
+        name = PepGetExportName(Image, i);
+        if (name == NULL)
+        {
+            continue;
+        }
+
+        slot = PepHashExportName(name) & Image->ExportHashMask;
+        while (Image->ExportHash[slot] != PE_EXPORT_HASH_EMPTY)
+        {
+            slot = (slot + 1) & Image->ExportHashMask;
+        }
+        Image->ExportHash[slot] = i + 1;
+    }
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PepGetExportRva (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG FunctionIndex,
+    _Out_ PULONG Rva
+    )
+{
+    ULONG rva;
+
+    //
+    // Skip unused slots, and forwarders, whose RVA points to a string inside
+    // the export directory instead of to code or data
+    //
+    if (FunctionIndex >= Image->ExportDirectory->NumberOfFunctions)
+    {
+        return FALSE;
+    }
+    rva = Image->ExportFunctions[FunctionIndex];
+    if ((rva == 0) ||
+        ((rva >= Image->ExportRva) &&
+         (rva < (Image->ExportRva + Image->ExportSize))))
+    {
+        return FALSE;
+    }
+    *Rva = rva;
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PepReferenceExports (
+    _In_ PPE_IMAGE Image
+    )
+{
+    //
+    // The index is only built once per image
+    //
+    if (Image->ExportsProbed == FALSE)
+    {
+        Image->ExportsProbed = TRUE;
+        PepBuildExportIndex(Image);
+    }
+    return Image->ExportHash != NULL;
+}
+
+_Success_(return != 0)
+BOOL
+PeLookupExport (
+    _In_ PPE_IMAGE Image,
+    _In_ PCCH Name,
+    _Out_ PULONG Rva
+    )
+{
+    PCHAR exportName;
+    ULONG slot, nameIndex;
+
+    //
+    // Make sure we have an index
+    //
+    if (PepReferenceExports(Image) == FALSE)
+    {
+        return FALSE;
+    }
+
+    //
+    // Probe from the home slot until we hit an empty one
+    //
+    slot = PepHashExportName(Name) & Image->ExportHashMask;
+    while (Image->ExportHash[slot] != PE_EXPORT_HASH_EMPTY)
+    {
+        nameIndex = Image->ExportHash[slot] - 1;
+        exportName = PepGetExportName(Image, nameIndex);
+        if (strcmp(exportName, Name) == 0)
+        {
+            return PepGetExportRva(Image,
+                                   Image->ExportOrdinals[nameIndex],
+                                   Rva);
+        }
+        slot = (slot + 1) & Image->ExportHashMask;
+    }
+    return FALSE;
+}
+
+_Success_(return != 0)
+BOOL
+PeLookupExportOrdinal (
+    _In_ PPE_IMAGE Image,
+    _In_ ULONG Ordinal,
+    _Out_ PULONG Rva
+    )
+{
+    //
+    // Make sure we have an index
+    //
+    if (PepReferenceExports(Image) == FALSE)
+    {
+        return FALSE;
+    }
+
+    //
+    // Ordinals are biased by the export base
+    //
+    if (Ordinal < Image->ExportDirectory->Base)
+    {
+        return FALSE;
+    }
+    return PepGetExportRva(Image, Ordinal - Image->ExportDirectory->Base, Rva);
+}
+
+VOID
+PeEnumExports (
+    _In_ PPE_IMAGE Image,
+    _In_ PSYM_ENUM_ROUTINE EnumRoutine,
+    _In_ PVOID Context
+    )
+{
+    PCHAR name;
+    ULONG i, rva;
+
+    //
+    // Make sure we have an index
+    //
+    if (PepReferenceExports(Image) == FALSE)
+    {
+        return;
+    }
+
+    //
+    // Report each named export that points to code or data in the image
+    //
+    for (i = 0; i < Image->ExportDirectory->NumberOfNames; i++)
+    {
+        name = PepGetExportName(Image, i);
+        if ((name != NULL) &&
+            (PepGetExportRva(Image, Image->ExportOrdinals[i], &rva) != FALSE))
+        {
+            EnumRoutine(Context, name, rva);
+        }
+    }
+}
+
+VOID
+PeClose (
+    _In_ PPE_IMAGE Image
+    )
+{
+    ULONG i;
+
+    //
+    // Free the export index, if one was built
+    //
+    if (Image->ExportHash != NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, Image->ExportHash);
+    }
+
+    //
+    // Unmap every view, including the headers
+    //
+    for (i = 0; i < Image->ViewCount; i++)
+    {
+        UnmapViewOfFile(Image->Views[i]);
+    }
+    if (Image->Headers != NULL)
+    {
+        UnmapViewOfFile(Image->Headers);
+    }
+
+    //
+    // Close the section and free the tracker
+    //
+    CloseHandle(Image->Section);
+    HeapFree(GetProcessHeap(), 0, Image);
+}
+
+_Success_(return != 0)
+BOOL
+PepMapHeaders (
+    _In_ PPE_IMAGE Image
+    )
+{
+    PIMAGE_DOS_HEADER dosHeader;
+    PIMAGE_NT_HEADERS ntHeaders;
+    ULONG viewSize, headerSize;
+
+    //
+    // Map the first page, which normally contains all the headers
+    //
+    viewSize = (ULONG)min(Image->FileSize, PE_HEADER_VIEW_SIZE);
+    Image->Headers = MapViewOfFile(Image->Section, FILE_MAP_READ, 0, 0, viewSize);
+    if (Image->Headers == NULL)
+    {
+        printf("[-] Failed to map image headers: %lx\n", GetLastError());
+        return FALSE;
+    }
+
+    //
+    // Validate the DOS and NT headers
+    //
+    dosHeader = (PIMAGE_DOS_HEADER)Image->Headers;
+    if ((viewSize < sizeof(*dosHeader)) ||
+        (dosHeader->e_magic != IMAGE_DOS_SIGNATURE) ||
+        (dosHeader->e_lfanew < 0) ||
+        (((ULONG)dosHeader->e_lfanew + sizeof(*ntHeaders)) > viewSize))
+    {
+        printf("[-] Invalid DOS header\n");
+        return FALSE;
+    }
+    ntHeaders = (PIMAGE_NT_HEADERS)(Image->Headers + dosHeader->e_lfanew);
+    if ((ntHeaders->Signature != IMAGE_NT_SIGNATURE) ||
+        (ntHeaders->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR64_MAGIC))
+    {
+        printf("[-] Not a 64-bit PE image\n");
+        return FALSE;
+    }
+
+    //
+    // Remap if the section table doesn't fit in the first page
+    //
+    headerSize = dosHeader->e_lfanew +
+                 FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader) +
+                 ntHeaders->FileHeader.SizeOfOptionalHeader +
+                 (ntHeaders->FileHeader.NumberOfSections *
+                  sizeof(IMAGE_SECTION_HEADER));
+    if (headerSize > viewSize)
+    {
+        if (headerSize > Image->FileSize)
+        {
+            printf("[-] Truncated PE headers\n");
+            return FALSE;
+        }
+
+        UnmapViewOfFile(Image->Headers);
+        Image->Headers = MapViewOfFile(Image->Section,
+                                       FILE_MAP_READ,
+                                       0,
+                                       0,
+                                       headerSize);
+        if (Image->Headers == NULL)
+        {
+            printf("[-] Failed to map image headers: %lx\n", GetLastError());
+            return FALSE;
+        }
+        dosHeader = (PIMAGE_DOS_HEADER)Image->Headers;
+        ntHeaders = (PIMAGE_NT_HEADERS)(Image->Headers + dosHeader->e_lfanew);
+    }
+
+    //
+    // Save the pieces we'll need later
+    //
+    Image->NtHeaders = ntHeaders;
+    Image->Sections = IMAGE_FIRST_SECTION(ntHeaders);
+    Image->SectionCount = ntHeaders->FileHeader.NumberOfSections;
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PeOpen (
+    _Outptr_ PPE_IMAGE* Image,
+    _In_ PCCH ImagePath
+    )
+{
+    HANDLE hFile;
+    LARGE_INTEGER fileSize;
+    SYSTEM_INFO systemInfo;
+    BOOL b;
+
+    //
+    // Allocate the tracker
+    //
+    *Image = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(**Image));
+    if (*Image == NULL)
+    {
+        printf("[-] Out of memory allocating image tracker\n");
+        return FALSE;
+    }
+    GetSystemInfo(&systemInfo);
+    (*Image)->Granularity = systemInfo.dwAllocationGranularity;
+
+    //
+    // Open the file and create a read-only, data (not image) section for it,
+    // so that nothing is relocated or committed
+    //
+    hFile = CreateFileA(ImagePath,
+                        GENERIC_READ,
+                        FILE_SHARE_READ | FILE_SHARE_DELETE,
+                        NULL,
+                        OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        printf("[-] Couldn't open %s: %lx\n", ImagePath, GetLastError());
+        HeapFree(GetProcessHeap(), 0, *Image);
+        return FALSE;
+    }
+    b = GetFileSizeEx(hFile, &fileSize);
+    if ((b == FALSE) || (fileSize.QuadPart == 0))
+    {
+        printf("[-] Couldn't get size of %s\n", ImagePath);
+        CloseHandle(hFile);
+        HeapFree(GetProcessHeap(), 0, *Image);
+        return FALSE;
+    }
+    (*Image)->FileSize = fileSize.QuadPart;
+    (*Image)->Section = CreateFileMappingA(hFile,
+                                           NULL,
+                                           PAGE_READONLY,
+                                           0,
+                                           0,
+                                           NULL);
+    CloseHandle(hFile);
+    if ((*Image)->Section == NULL)
+    {
+        printf("[-] Failed to create section for %s: %lx\n",
+               ImagePath,
+               GetLastError());
+        HeapFree(GetProcessHeap(), 0, *Image);
+        return FALSE;
+    }
+
+    //
+    // Map and validate the headers
+    //
+    b = PepMapHeaders(*Image);
+    if (b == FALSE)
+    {
+        PeClose(*Image);
+        *Image = NULL;
+    }
+    return b;
+}
+
+_Success_(return != 0)
+BOOL
+PeLocateImage (
+    _In_ PCCH ModuleName,
+    _Out_writes_(PathSize) PCHAR ImagePath,
+    _In_ ULONG PathSize
+    )
+{
+    CHAR systemPath[MAX_PATH];
+    ULONG length;
+
+    //
+    // Kernel images live either in System32, or in System32\Drivers
+    //
+    length = GetSystemDirectoryA(systemPath, sizeof(systemPath));
+    if ((length == 0) || (length >= sizeof(systemPath)))
+    {
+        return FALSE;
+    }
+    sprintf_s(ImagePath, PathSize, "%s\\%s", systemPath, ModuleName);
+    if (GetFileAttributesA(ImagePath) != INVALID_FILE_ATTRIBUTES)
+    {
+        return TRUE;
+    }
+    sprintf_s(ImagePath, PathSize, "%s\\drivers\\%s", systemPath, ModuleName);
+    return GetFileAttributesA(ImagePath) != INVALID_FILE_ATTRIBUTES;
+}
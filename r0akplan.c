@@ -0,0 +1,120 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    r0akplan.c
+
+Abstract:
+
+    This module plans how a set of kernel ranges is covered by HSTI reads.
+    It has no dependencies on the kernel, so it is also built into the
+    portable tests.
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0ak.h"
+
+//
+// Internal definitions
+//
+#define PAGE_SIZE                   4096
+
+//
+// Ranges being sorted by CmdPlanReads
+//
+PCMD_READ_RANGE g_PlanRanges;
+
+INT
+__cdecl
+CmdpComparePlanRange (
+    _In_ const VOID* First,
+    _In_ const VOID* Second
+    )
+{
+    ULONG_PTR firstAddress, secondAddress;
+    ULONG firstIndex, secondIndex;
+
+    //
+    // Order range indices by address, keeping the original order for ranges
+    // that start at the same address
+    //
+    firstIndex = *(const ULONG*)First;
+    secondIndex = *(const ULONG*)Second;
+    firstAddress = (ULONG_PTR)g_PlanRanges[firstIndex].KernelAddress;
+    secondAddress = (ULONG_PTR)g_PlanRanges[secondIndex].KernelAddress;
+    if (firstAddress != secondAddress)
+    {
+        return (firstAddress > secondAddress) ? 1 : -1;
+    }
+    return (firstIndex > secondIndex) - (firstIndex < secondIndex);
+}
+
+ULONG
+CmdPlanReads (
+    _In_reads_(Count) PCMD_READ_RANGE Ranges,
+    _In_ ULONG Count,
+    _In_ ULONG GapThreshold,
+    _Out_writes_(Count) PULONG Order,
+    _Out_writes_(Count) PCMD_READ_PLAN Plans
+    )
+{
+    ULONG_PTR start, end, planEnd;
+    ULONG i, planCount;
+
+    //
+    // Sort the ranges by address
+    //
+    for (i = 0; i < Count; i++)
+    {
+        Order[i] = i;
+    }
+    g_PlanRanges = Ranges;
+    qsort(Order, Count, sizeof(ULONG), CmdpComparePlanRange);
+    g_PlanRanges = NULL;
+
+    //
+    // Merge each range into the current read if it's close enough. Besides
+    // the gap threshold, the gap may never cover a whole page that none of
+    // the ranges touch, since it might not be mapped.
+    //
+    planCount = 0;
+    planEnd = 0;
+    for (i = 0; i < Count; i++)
+    {
+        start = (ULONG_PTR)Ranges[Order[i]].KernelAddress;
+        end = start + Ranges[Order[i]].Size;
+        if ((planCount != 0) &&
+            (start <= (planEnd + GapThreshold)) &&
+            ((start / PAGE_SIZE) <= (((planEnd - 1) / PAGE_SIZE) + 1)) &&
+            ((max(end, planEnd) - Plans[planCount - 1].Start) <=
+             CMD_READ_CHUNK_SIZE))
+        {
+            planEnd = max(end, planEnd);
+            Plans[planCount - 1].Size =
+                (ULONG)(planEnd - Plans[planCount - 1].Start);
+            Plans[planCount - 1].RangeCount++;
+            continue;
+        }
+
+        //
+        // Otherwise this range starts a new read
+        //
+        Plans[planCount].Start = start;
+        Plans[planCount].Size = Ranges[Order[i]].Size;
+        Plans[planCount].FirstRange = i;
+        Plans[planCount].RangeCount = 1;
+        planEnd = end;
+        planCount++;
+    }
+    return planCount;
+}
@@ -0,0 +1,600 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    r0akpool.c
+
+Abstract:
+
+    This module implements vectorized big pool table scanning, and tracking
+    of known allocations across snapshots, for r0ak
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0ak.h"
+
+//
+// Internal definitions
+//
+#define POOL_ENTRY_ULONGS           (sizeof(SYSTEM_BIGPOOL_ENTRY) / sizeof(ULONG))
+#define POOL_SSE2_ENTRIES           4
+#define POOL_AVX2_ENTRIES           8
+#define POOL_SET_EMPTY              0
+#define POOL_SET_DELETED            1
+#define POOL_SET_MIN_SLOTS          256
+
+//
+// Open-addressed hash set of pool addresses. Addresses are always at least
+// 16-byte aligned, so the two lowest values can mark empty and deleted slots.
+//
+typedef struct _POOL_ADDRESS_SET
+{
+    PULONG_PTR Slots;
+    ULONG Mask;
+    ULONG Used;
+    ULONG Count;
+} POOL_ADDRESS_SET, *PPOOL_ADDRESS_SET;
+
+//
+// State of a scan for a set of allocation sizes under a given tag
+//
+typedef struct _POOL_SCAN
+{
+    ULONG Tag;
+    PULONGLONG Sizes;
+    ULONG SizeCount;
+    PVOID* Addresses;
+    ULONG Remaining;
+    PPOOL_ADDRESS_SET Known;
+    BOOL Baseline;
+    BOOL TrackingFailed;
+} POOL_SCAN, *PPOOL_SCAN;
+
+typedef VOID
+(*PPOOL_SCAN_ROUTINE)(
+    _In_reads_(Count) PSYSTEM_BIGPOOL_ENTRY Entries,
+    _In_ ULONG Count,
+    _Inout_ PPOOL_SCAN Scan
+    );
+
+PPOOL_SCAN_ROUTINE g_PoolScanRoutine;
+POOL_ADDRESS_SET g_PoolKnown;
+BOOL g_PoolTracking;
+
+ULONG
+PoolpHashAddress (
+    _In_ ULONG_PTR Address
+    )
+{
+    //
+    // Fibonacci hashing, which spreads out the aligned, clustered addresses
+    //
+    return (ULONG)(((ULONGLONG)Address * 0x9E3779B97F4A7C15) >> 32);
+}
+
+_Success_(return != 0)
+BOOL
+PoolpSetContains (
+    _In_ PPOOL_ADDRESS_SET Set,
+    _In_ ULONG_PTR Address
+    )
+{
+    ULONG slot;
+
+    //
+    // Probe from the home slot until we find the address or an empty slot,
+    // stepping over deleted ones
+    //
+    slot = PoolpHashAddress(Address) & Set->Mask;
+    while (Set->Slots[slot] != POOL_SET_EMPTY)
+    {
+        if (Set->Slots[slot] == Address)
+        {
+            return TRUE;
+        }
+        slot = (slot + 1) & Set->Mask;
+    }
+    return FALSE;
+}
+
+_Success_(return != 0)
+BOOL
+PoolpSetResize (
+    _In_ PPOOL_ADDRESS_SET Set,
+    _In_ ULONG SlotCount
+    )
+{
+    PULONG_PTR oldSlots;
+    ULONG oldSlotCount, i, slot;
+
+    //
+    // Allocate the new slots
+    //
+    oldSlots = Set->Slots;
+    oldSlotCount = (oldSlots != NULL) ? (Set->Mask + 1) : 0;
+    Set->Slots = HeapAlloc(GetProcessHeap(),
+                           HEAP_ZERO_MEMORY,
+                           SlotCount * sizeof(ULONG_PTR));
+    if (Set->Slots == NULL)
+    {
+        Set->Slots = oldSlots;
+        return FALSE;
+    }
+    Set->Mask = SlotCount - 1;
+    Set->Used = Set->Count;
+
+    //
+    // Rehash the live addresses, which also drops the deleted slots
+    //
+    for (i = 0; i < oldSlotCount; i++)
+    {
+        if (oldSlots[i] > POOL_SET_DELETED)
+        {
+            slot = PoolpHashAddress(oldSlots[i]) & Set->Mask;
+            while (Set->Slots[slot] != POOL_SET_EMPTY)
+            {
+                slot = (slot + 1) & Set->Mask;
+            }
+            Set->Slots[slot] = oldSlots[i];
+        }
+    }
+    if (oldSlots != NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, oldSlots);
+    }
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PoolpSetInsert (
+    _In_ PPOOL_ADDRESS_SET Set,
+    _In_ ULONG_PTR Address
+    )
+{
+    ULONG slot, slotCount;
+
+    //
+    // Keep at most half of the slots in use, counting deleted ones. If it's
+    // mostly deleted slots, rehashing at the same size is enough.
+    //
+    if (Set->Slots == NULL)
+    {
+        if (PoolpSetResize(Set, POOL_SET_MIN_SLOTS) == FALSE)
+        {
+            return FALSE;
+        }
+    }
+    else if (((Set->Used + 1) * 2) > (Set->Mask + 1))
+    {
+        slotCount = Set->Mask + 1;
+        if (((Set->Count + 1) * 4) > slotCount)
+        {
+            slotCount *= 2;
+        }
+        if (PoolpSetResize(Set, slotCount) == FALSE)
+        {
+            return FALSE;
+        }
+    }
+
+    //
+    // Find the address, or the first empty slot for it
+    //
+    slot = PoolpHashAddress(Address) & Set->Mask;
+    while (Set->Slots[slot] != POOL_SET_EMPTY)
+    {
+        if (Set->Slots[slot] == Address)
+        {
+            return TRUE;
+        }
+        slot = (slot + 1) & Set->Mask;
+    }
+    Set->Slots[slot] = Address;
+    Set->Used++;
+    Set->Count++;
+    return TRUE;
+}
+
+VOID
+PoolpSetRemove (
+    _In_ PPOOL_ADDRESS_SET Set,
+    _In_ ULONG_PTR Address
+    )
+{
+    ULONG slot;
+
+    //
+    // Mark the slot as deleted, so that probe chains through it still work
+    //
+    if (Set->Slots == NULL)
+    {
+        return;
+    }
+    slot = PoolpHashAddress(Address) & Set->Mask;
+    while (Set->Slots[slot] != POOL_SET_EMPTY)
+    {
+        if (Set->Slots[slot] == Address)
+        {
+            Set->Slots[slot] = POOL_SET_DELETED;
+            Set->Count--;
+            return;
+        }
+        slot = (slot + 1) & Set->Mask;
+    }
+}
+
+VOID
+PoolpSetReset (
+    _In_ PPOOL_ADDRESS_SET Set
+    )
+{
+    //
+    // Empty the set but keep its slots around for the next snapshot
+    //
+    if (Set->Slots != NULL)
+    {
+        RtlZeroMemory(Set->Slots, (Set->Mask + 1) * sizeof(ULONG_PTR));
+    }
+    Set->Used = 0;
+    Set->Count = 0;
+}
+
+BOOL
+PoolpScanDone (
+    _In_ PPOOL_SCAN Scan
+    )
+{
+    //
+    // Baseline scans need to see every entry, others can stop once all the
+    // sizes were found
+    //
+    return (Scan->Remaining == 0) && (Scan->Baseline == FALSE);
+}
+
+VOID
+PoolpMatchEntry (
+    _In_ PSYSTEM_BIGPOOL_ENTRY Entry,
+    _Inout_ PPOOL_SCAN Scan
+    )
+{
+    ULONG_PTR address;
+    ULONG i;
+
+    //
+    // Mask out the nonpaged pool bit
+    //
+    address = (ULONG_PTR)Entry->VirtualAddress & ~1;
+
+    //
+    // When tracking, skip allocations that are already known, and remember
+    // this one so that it isn't considered new by the next scan
+    //
+    if (Scan->Known != NULL)
+    {
+        if ((Scan->Baseline == FALSE) &&
+            (PoolpSetContains(Scan->Known, address) != FALSE))
+        {
+            return;
+        }
+        if (PoolpSetInsert(Scan->Known, address) == FALSE)
+        {
+            Scan->TrackingFailed = TRUE;
+        }
+    }
+
+    //
+    // The tag already matched, so check the size against each size that is
+    // still pending. An entry can only satisfy one of them.
+    //
+    for (i = 0; i < Scan->SizeCount; i++)
+    {
+        if ((Scan->Addresses[i] == NULL) &&
+            (Entry->SizeInBytes == Scan->Sizes[i]))
+        {
+            Scan->Addresses[i] = (PVOID)address;
+            Scan->Remaining--;
+            break;
+        }
+    }
+}
+
+VOID
+PoolpScanScalar (
+    _In_reads_(Count) PSYSTEM_BIGPOOL_ENTRY Entries,
+    _In_ ULONG Count,
+    _Inout_ PPOOL_SCAN Scan
+    )
+{
+    ULONG i;
+
+    //
+    // Check one entry at a time -- used for whatever doesn't fill a vector
+    //
+    for (i = 0; (i < Count) && (PoolpScanDone(Scan) == FALSE); i++)
+    {
+        if (Entries[i].TagUlong == Scan->Tag)
+        {
+            PoolpMatchEntry(&Entries[i], Scan);
+        }
+    }
+}
+
+VOID
+PoolpScanSse2 (
+    _In_reads_(Count) PSYSTEM_BIGPOOL_ENTRY Entries,
+    _In_ ULONG Count,
+    _Inout_ PPOOL_SCAN Scan
+    )
+{
+    __m128i tagVector, tags, tags01, tags23;
+    ULONG i, mask, index;
+
+    //
+    // Entries are 24 bytes, so no two tags share a 16-byte load. Load each tag
+    // along with the padding after it, which never crosses the entry, then
+    // pack four of them together so they can be compared at once.
+    //
+    tagVector = _mm_set1_epi32((INT)Scan->Tag);
+    for (i = 0; (i + POOL_SSE2_ENTRIES) <= Count; i += POOL_SSE2_ENTRIES)
+    {
+        tags01 = _mm_unpacklo_epi32(_mm_loadl_epi64((__m128i*)&Entries[i].TagUlong),
+                                    _mm_loadl_epi64((__m128i*)&Entries[i + 1].TagUlong));
+        tags23 = _mm_unpacklo_epi32(_mm_loadl_epi64((__m128i*)&Entries[i + 2].TagUlong),
+                                    _mm_loadl_epi64((__m128i*)&Entries[i + 3].TagUlong));
+        tags = _mm_unpacklo_epi64(tags01, tags23);
+        mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(tags, tagVector)));
+
+        //
+        // Tag hits are rare, so only those have their size checked
+        //
+        while (mask != 0)
+        {
+            _BitScanForward(&index, mask);
+            PoolpMatchEntry(&Entries[i + index], Scan);
+            mask &= mask - 1;
+        }
+        if (PoolpScanDone(Scan) != FALSE)
+        {
+            return;
+        }
+    }
+
+    //
+    // Handle the remaining entries
+    //
+    PoolpScanScalar(&Entries[i], Count - i, Scan);
+}
+
+DECLSPEC_AVX2
+VOID
+PoolpScanAvx2 (
+    _In_reads_(Count) PSYSTEM_BIGPOOL_ENTRY Entries,
+    _In_ ULONG Count,
+    _Inout_ PPOOL_SCAN Scan
+    )
+{
+    __m256i tagVector, tagIndices, tags;
+    ULONG i, mask, index;
+
+    //
+    // Gather the tags of eight entries at a time, which only touches the tag
+    // itself and never reads past the last entry
+    //
+    tagVector = _mm256_set1_epi32((INT)Scan->Tag);
+    tagIndices = _mm256_setr_epi32(0 * POOL_ENTRY_ULONGS,
+                                   1 * POOL_ENTRY_ULONGS,
+                                   2 * POOL_ENTRY_ULONGS,
+                                   3 * POOL_ENTRY_ULONGS,
+                                   4 * POOL_ENTRY_ULONGS,
+                                   5 * POOL_ENTRY_ULONGS,
+                                   6 * POOL_ENTRY_ULONGS,
+                                   7 * POOL_ENTRY_ULONGS);
+    for (i = 0; (i + POOL_AVX2_ENTRIES) <= Count; i += POOL_AVX2_ENTRIES)
+    {
+        tags = _mm256_i32gather_epi32((const INT*)&Entries[i].TagUlong,
+                                      tagIndices,
+                                      sizeof(ULONG));
+        mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(tags,
+                                                                         tagVector)));
+
+        //
+        // Tag hits are rare, so only those have their size checked
+        //
+        while (mask != 0)
+        {
+            _BitScanForward(&index, mask);
+            PoolpMatchEntry(&Entries[i + index], Scan);
+            mask &= mask - 1;
+        }
+        if (PoolpScanDone(Scan) != FALSE)
+        {
+            return;
+        }
+    }
+
+    //
+    // Handle the remaining entries
+    //
+    PoolpScanScalar(&Entries[i], Count - i, Scan);
+}
+
+PPOOL_SCAN_ROUTINE
+PoolpSelectScanRoutine (
+    VOID
+    )
+{
+    INT cpuInfo[4];
+    INT maxLeaf;
+
+    //
+    // AVX2 needs the CPU to support it, and the OS to save the YMM state
+    //
+    __cpuid(cpuInfo, 0);
+    maxLeaf = cpuInfo[0];
+    __cpuid(cpuInfo, 1);
+    if ((maxLeaf >= 7) &&
+        ((cpuInfo[2] & (1 << 27)) != 0) &&
+        ((cpuInfo[2] & (1 << 28)) != 0) &&
+        ((_xgetbv(0) & 6) == 6))
+    {
+        __cpuidex(cpuInfo, 7, 0);
+        if ((cpuInfo[1] & (1 << 5)) != 0)
+        {
+            return PoolpScanAvx2;
+        }
+    }
+
+    //
+    // SSE2 is always available on x64
+    //
+    return PoolpScanSse2;
+}
+
+ULONG
+PoolFindAllocations (
+    _In_ PSYSTEM_BIGPOOL_INFORMATION BigPoolInfo,
+    _In_ ULONG Tag,
+    _In_reads_(SizeCount) PULONGLONG Sizes,
+    _In_ ULONG SizeCount,
+    _Out_writes_(SizeCount) PVOID* Addresses
+    )
+{
+    POOL_SCAN scan;
+    ULONG i;
+
+    //
+    // Pick the best scan routine for this CPU the first time around
+    //
+    if (g_PoolScanRoutine == NULL)
+    {
+        g_PoolScanRoutine = PoolpSelectScanRoutine();
+    }
+
+    //
+    // Scan the whole table once for all of the sizes, stopping as soon as
+    // each of them has been found
+    //
+    for (i = 0; i < SizeCount; i++)
+    {
+        Addresses[i] = NULL;
+    }
+    scan.Tag = Tag;
+    scan.Sizes = Sizes;
+    scan.SizeCount = SizeCount;
+    scan.Addresses = Addresses;
+    scan.Remaining = SizeCount;
+    scan.Known = NULL;
+    scan.Baseline = FALSE;
+    scan.TrackingFailed = FALSE;
+    if (SizeCount != 0)
+    {
+        g_PoolScanRoutine(BigPoolInfo->AllocatedInfo, BigPoolInfo->Count, &scan);
+    }
+    return SizeCount - scan.Remaining;
+}
+
+ULONG
+PoolFindNewAllocations (
+    _In_ PSYSTEM_BIGPOOL_INFORMATION BigPoolInfo,
+    _In_ ULONG Tag,
+    _In_reads_opt_(SizeCount) PULONGLONG Sizes,
+    _In_ ULONG SizeCount,
+    _Out_writes_opt_(SizeCount) PVOID* Addresses
+    )
+{
+    POOL_SCAN scan;
+    ULONG i;
+
+    //
+    // Pick the best scan routine for this CPU the first time around
+    //
+    if (g_PoolScanRoutine == NULL)
+    {
+        g_PoolScanRoutine = PoolpSelectScanRoutine();
+    }
+
+    //
+    // Without any sizes, or anything to compare against, this snapshot
+    // becomes the new baseline -- which means seeing every entry, and also
+    // drops addresses that were freed by someone else since the last one.
+    // Otherwise, only match allocations that are not already known, adding
+    // each new one to the known set, and stop as soon as all sizes are found.
+    //
+    for (i = 0; i < SizeCount; i++)
+    {
+        Addresses[i] = NULL;
+    }
+    scan.Tag = Tag;
+    scan.Sizes = Sizes;
+    scan.SizeCount = SizeCount;
+    scan.Addresses = Addresses;
+    scan.Remaining = SizeCount;
+    scan.Known = &g_PoolKnown;
+    scan.Baseline = (SizeCount == 0) || (g_PoolTracking == FALSE);
+    scan.TrackingFailed = FALSE;
+    if (scan.Baseline != FALSE)
+    {
+        PoolpSetReset(&g_PoolKnown);
+    }
+    g_PoolScanRoutine(BigPoolInfo->AllocatedInfo, BigPoolInfo->Count, &scan);
+
+    //
+    // If an allocation couldn't be recorded, it would look new next time, so
+    // start from scratch with the next call instead
+    //
+    g_PoolTracking = (scan.TrackingFailed == FALSE);
+    return SizeCount - scan.Remaining;
+}
+
+BOOL
+PoolIsTracking (
+    VOID
+    )
+{
+    //
+    // Check if there's a previous snapshot to compare against
+    //
+    return g_PoolTracking;
+}
+
+VOID
+PoolForgetAllocation (
+    _In_ PVOID Address
+    )
+{
+    //
+    // Once freed, the address may be handed out again for a new allocation,
+    // which must not be mistaken for an old one
+    //
+    if (g_PoolTracking != FALSE)
+    {
+        PoolpSetRemove(&g_PoolKnown, (ULONG_PTR)Address);
+    }
+}
+
+VOID
+PoolTeardown (
+    VOID
+    )
+{
+    //
+    // Free the known set
+    //
+    if (g_PoolKnown.Slots != NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, g_PoolKnown.Slots);
+    }
+    RtlZeroMemory(&g_PoolKnown, sizeof(g_PoolKnown));
+    g_PoolTracking = FALSE;
+}
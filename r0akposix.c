@@ -0,0 +1,879 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    r0akposix.c
+
+Abstract:
+
+    This module implements the subset of the Win32 API used by the offline
+    parts of r0ak on top of POSIX, for the portable build
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0ak.h"
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// Internal definitions
+//
+#define POSIX_ALLOCATION_GRANULARITY    (64 * 1024)
+#define POSIX_MAX_WORKERS               16
+
+//
+// Views are unmapped by address alone, so remember the size of each one
+//
+typedef struct _POSIX_VIEW
+{
+    struct _POSIX_VIEW* Next;
+    PVOID Base;
+    SIZE_T Size;
+} POSIX_VIEW, *PPOSIX_VIEW;
+
+//
+// Directory enumeration state behind a find handle
+//
+typedef struct _POSIX_FIND
+{
+    DIR* Directory;
+    CHAR Path[MAX_PATH];
+} POSIX_FIND, *PPOSIX_FIND;
+
+//
+// A queued thread pool callback
+//
+typedef struct _POSIX_WORK_ITEM
+{
+    struct _POSIX_WORK_ITEM* Next;
+    PTP_SIMPLE_CALLBACK Callback;
+    PVOID Context;
+} POSIX_WORK_ITEM, *PPOSIX_WORK_ITEM;
+
+//
+// A cleanup group owns its queue and the worker threads draining it
+//
+typedef struct _TP_CLEANUP_GROUP
+{
+    pthread_mutex_t Lock;
+    pthread_cond_t Wake;
+    PPOSIX_WORK_ITEM Head;
+    PPOSIX_WORK_ITEM Tail;
+    BOOL Closing;
+    ULONG WorkerCount;
+    pthread_t Workers[POSIX_MAX_WORKERS];
+} TP_CLEANUP_GROUP;
+
+pthread_mutex_t g_PosixViewLock = PTHREAD_MUTEX_INITIALIZER;
+PPOSIX_VIEW g_PosixViews;
+
+PVOID
+HeapAlloc (
+    _In_ HANDLE Heap,
+    _In_ ULONG Flags,
+    _In_ SIZE_T Size
+    )
+{
+    UNREFERENCED_PARAMETER(Heap);
+    return (Flags & HEAP_ZERO_MEMORY) ? calloc(1, Size) : malloc(Size);
+}
+
+PVOID
+HeapReAlloc (
+    _In_ HANDLE Heap,
+    _In_ ULONG Flags,
+    _In_ PVOID Memory,
+    _In_ SIZE_T Size
+    )
+{
+    UNREFERENCED_PARAMETER(Heap);
+    UNREFERENCED_PARAMETER(Flags);
+    return realloc(Memory, Size);
+}
+
+BOOL
+HeapFree (
+    _In_ HANDLE Heap,
+    _In_ ULONG Flags,
+    _In_ PVOID Memory
+    )
+{
+    UNREFERENCED_PARAMETER(Heap);
+    UNREFERENCED_PARAMETER(Flags);
+    free(Memory);
+    return TRUE;
+}
+
+INT
+strcpy_s (
+    _Out_writes_(Size) PCHAR Destination,
+    _In_ SIZE_T Size,
+    _In_ PCCH Source
+    )
+{
+    SIZE_T length;
+
+    //
+    // Like the CRT, fail with an empty string if it doesn't fit
+    //
+    length = strlen(Source);
+    if (length >= Size)
+    {
+        if (Size != 0)
+        {
+            *Destination = ANSI_NULL;
+        }
+        return ERANGE;
+    }
+    RtlCopyMemory(Destination, Source, length + 1);
+    return 0;
+}
+
+INT
+strcat_s (
+    _Inout_updates_(Size) PCHAR Destination,
+    _In_ SIZE_T Size,
+    _In_ PCCH Source
+    )
+{
+    SIZE_T length;
+
+    length = strnlen(Destination, Size);
+    if (length == Size)
+    {
+        return EINVAL;
+    }
+    return strcpy_s(Destination + length, Size - length, Source);
+}
+
+INT
+_snprintf_s (
+    _Out_writes_(Size) PCHAR Buffer,
+    _In_ SIZE_T Size,
+    _In_ SIZE_T Count,
+    _In_ PCCH Format,
+    ...
+    )
+{
+    va_list arguments;
+    SIZE_T limit;
+    INT length;
+
+    //
+    // Truncated output is reported as -1, like the CRT does
+    //
+    limit = (Count == _TRUNCATE) ? Size : min(Size, Count + 1);
+    va_start(arguments, Format);
+    length = vsnprintf(Buffer, limit, Format, arguments);
+    va_end(arguments);
+    if ((length < 0) || ((SIZE_T)length >= limit))
+    {
+        return -1;
+    }
+    return length;
+}
+
+ULONG
+GetEnvironmentVariableA (
+    _In_ PCCH Name,
+    _Out_writes_(Size) PCHAR Buffer,
+    _In_ ULONG Size
+    )
+{
+    PCCH value;
+    SIZE_T length;
+
+    //
+    // Return the size needed, including the terminator, if it doesn't fit
+    //
+    value = getenv(Name);
+    if (value == NULL)
+    {
+        return 0;
+    }
+    length = strlen(value);
+    if (length >= Size)
+    {
+        return (ULONG)length + 1;
+    }
+    RtlCopyMemory(Buffer, value, length + 1);
+    return (ULONG)length;
+}
+
+_Success_(return != 0)
+BOOL
+PosixpTranslatePath (
+    _In_ PCCH Path,
+    _Out_writes_(Size) PCHAR PosixPath,
+    _In_ ULONG Size
+    )
+{
+    ULONG i;
+
+    //
+    // The rest of r0ak builds paths with backslashes
+    //
+    for (i = 0; Path[i] != ANSI_NULL; i++)
+    {
+        if ((i + 1) == Size)
+        {
+            errno = ENAMETOOLONG;
+            return FALSE;
+        }
+        PosixPath[i] = (Path[i] == '\\') ? '/' : Path[i];
+    }
+    PosixPath[i] = ANSI_NULL;
+    return TRUE;
+}
+
+HANDLE
+PosixpFileToHandle (
+    _In_ INT Descriptor
+    )
+{
+    //
+    // Bias descriptors by one, so that neither NULL nor INVALID_HANDLE_VALUE
+    // is ever a valid handle
+    //
+    return (HANDLE)(ULONG_PTR)(Descriptor + 1);
+}
+
+INT
+PosixpHandleToFile (
+    _In_ HANDLE Handle
+    )
+{
+    return (INT)((ULONG_PTR)Handle - 1);
+}
+
+HANDLE
+CreateFileA (
+    _In_ PCCH FileName,
+    _In_ ULONG DesiredAccess,
+    _In_ ULONG ShareMode,
+    _In_opt_ PVOID SecurityAttributes,
+    _In_ ULONG CreationDisposition,
+    _In_ ULONG FlagsAndAttributes,
+    _In_opt_ HANDLE TemplateFile
+    )
+{
+    CHAR path[MAX_PATH];
+    INT flags, descriptor;
+
+    UNREFERENCED_PARAMETER(ShareMode);
+    UNREFERENCED_PARAMETER(SecurityAttributes);
+    UNREFERENCED_PARAMETER(FlagsAndAttributes);
+    UNREFERENCED_PARAMETER(TemplateFile);
+
+    if (PosixpTranslatePath(FileName, path, sizeof(path)) == FALSE)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    //
+    // Map the access and disposition onto open flags
+    //
+    if ((DesiredAccess & (GENERIC_READ | GENERIC_WRITE)) ==
+        (GENERIC_READ | GENERIC_WRITE))
+    {
+        flags = O_RDWR;
+    }
+    else
+    {
+        flags = (DesiredAccess & GENERIC_WRITE) ? O_WRONLY : O_RDONLY;
+    }
+    switch (CreationDisposition)
+    {
+        case CREATE_ALWAYS:
+            flags |= O_CREAT | O_TRUNC;
+            break;
+        case OPEN_ALWAYS:
+            flags |= O_CREAT;
+            break;
+        case OPEN_EXISTING:
+            break;
+        default:
+            errno = EINVAL;
+            return INVALID_HANDLE_VALUE;
+    }
+    descriptor = open(path, flags | O_CLOEXEC, 0644);
+    if (descriptor < 0)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+    return PosixpFileToHandle(descriptor);
+}
+
+BOOL
+GetFileSizeEx (
+    _In_ HANDLE File,
+    _Out_ PLARGE_INTEGER FileSize
+    )
+{
+    struct stat fileStat;
+
+    if (fstat(PosixpHandleToFile(File), &fileStat) != 0)
+    {
+        return FALSE;
+    }
+    FileSize->QuadPart = fileStat.st_size;
+    return TRUE;
+}
+
+BOOL
+WriteFile (
+    _In_ HANDLE File,
+    _In_reads_bytes_(Size) LPCVOID Buffer,
+    _In_ ULONG Size,
+    _Out_ PULONG Written,
+    _In_opt_ PVOID Overlapped
+    )
+{
+    ssize_t result;
+
+    UNREFERENCED_PARAMETER(Overlapped);
+
+    //
+    // Keep going through short writes
+    //
+    *Written = 0;
+    while (*Written < Size)
+    {
+        result = write(PosixpHandleToFile(File),
+                       (const UCHAR*)Buffer + *Written,
+                       Size - *Written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return FALSE;
+        }
+        *Written += (ULONG)result;
+    }
+    return TRUE;
+}
+
+BOOL
+CloseHandle (
+    _In_ HANDLE Handle
+    )
+{
+    return close(PosixpHandleToFile(Handle)) == 0;
+}
+
+DWORD
+GetFileAttributesA (
+    _In_ PCCH FileName
+    )
+{
+    CHAR path[MAX_PATH];
+    struct stat fileStat;
+
+    if ((PosixpTranslatePath(FileName, path, sizeof(path)) == FALSE) ||
+        (stat(path, &fileStat) != 0))
+    {
+        return INVALID_FILE_ATTRIBUTES;
+    }
+    return S_ISDIR(fileStat.st_mode) ? FILE_ATTRIBUTE_DIRECTORY :
+                                       FILE_ATTRIBUTE_NORMAL;
+}
+
+HANDLE
+CreateFileMappingA (
+    _In_ HANDLE File,
+    _In_opt_ PVOID SecurityAttributes,
+    _In_ ULONG Protect,
+    _In_ ULONG MaximumSizeHigh,
+    _In_ ULONG MaximumSizeLow,
+    _In_opt_ PCCH Name
+    )
+{
+    INT descriptor;
+
+    UNREFERENCED_PARAMETER(SecurityAttributes);
+    UNREFERENCED_PARAMETER(Protect);
+    UNREFERENCED_PARAMETER(Name);
+
+    //
+    // Sections always cover the file as it is, and outlive the file handle
+    //
+    if ((MaximumSizeHigh != 0) || (MaximumSizeLow != 0))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    descriptor = fcntl(PosixpHandleToFile(File), F_DUPFD_CLOEXEC, 0);
+    if (descriptor < 0)
+    {
+        return NULL;
+    }
+    return PosixpFileToHandle(descriptor);
+}
+
+PVOID
+MapViewOfFile (
+    _In_ HANDLE Section,
+    _In_ ULONG DesiredAccess,
+    _In_ ULONG FileOffsetHigh,
+    _In_ ULONG FileOffsetLow,
+    _In_ SIZE_T Size
+    )
+{
+    struct stat fileStat;
+    PPOSIX_VIEW view;
+    off_t offset;
+    INT protection;
+
+    //
+    // A size of zero maps everything up to the end of the file
+    //
+    offset = ((off_t)FileOffsetHigh << 32) | FileOffsetLow;
+    if (Size == 0)
+    {
+        if ((fstat(PosixpHandleToFile(Section), &fileStat) != 0) ||
+            (fileStat.st_size <= offset))
+        {
+            errno = (errno != 0) ? errno : EINVAL;
+            return NULL;
+        }
+        Size = (SIZE_T)(fileStat.st_size - offset);
+    }
+
+    view = malloc(sizeof(*view));
+    if (view == NULL)
+    {
+        return NULL;
+    }
+    protection = PROT_READ | ((DesiredAccess & FILE_MAP_WRITE) ? PROT_WRITE : 0);
+    view->Base = mmap(NULL,
+                      Size,
+                      protection,
+                      MAP_SHARED,
+                      PosixpHandleToFile(Section),
+                      offset);
+    if (view->Base == MAP_FAILED)
+    {
+        free(view);
+        return NULL;
+    }
+    view->Size = Size;
+
+    pthread_mutex_lock(&g_PosixViewLock);
+    view->Next = g_PosixViews;
+    g_PosixViews = view;
+    pthread_mutex_unlock(&g_PosixViewLock);
+    return view->Base;
+}
+
+BOOL
+UnmapViewOfFile (
+    _In_ LPCVOID BaseAddress
+    )
+{
+    PPOSIX_VIEW* link;
+    PPOSIX_VIEW view;
+
+    //
+    // Find the view to get its size back
+    //
+    pthread_mutex_lock(&g_PosixViewLock);
+    for (link = &g_PosixViews; *link != NULL; link = &(*link)->Next)
+    {
+        if ((*link)->Base == BaseAddress)
+        {
+            break;
+        }
+    }
+    view = *link;
+    if (view != NULL)
+    {
+        *link = view->Next;
+    }
+    pthread_mutex_unlock(&g_PosixViewLock);
+    if (view == NULL)
+    {
+        errno = EINVAL;
+        return FALSE;
+    }
+
+    munmap(view->Base, view->Size);
+    free(view);
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+PosixpReadDirectory (
+    _In_ PPOSIX_FIND Find,
+    _Out_ PWIN32_FIND_DATAA FindData
+    )
+{
+    CHAR path[MAX_PATH];
+    struct dirent* entry;
+    struct stat fileStat;
+
+    //
+    // Skip names that wouldn't fit, and fill in the directory attribute
+    //
+    while ((entry = readdir(Find->Directory)) != NULL)
+    {
+        if (strcpy_s(FindData->cFileName,
+                     sizeof(FindData->cFileName),
+                     entry->d_name) != 0)
+        {
+            continue;
+        }
+        FindData->dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
+        if ((snprintf(path, sizeof(path), "%s/%s", Find->Path, entry->d_name) <
+             (INT)sizeof(path)) &&
+            (stat(path, &fileStat) == 0) &&
+            (S_ISDIR(fileStat.st_mode)))
+        {
+            FindData->dwFileAttributes = FILE_ATTRIBUTE_DIRECTORY;
+        }
+        return TRUE;
+    }
+    errno = ENOENT;
+    return FALSE;
+}
+
+HANDLE
+FindFirstFileA (
+    _In_ PCCH FileName,
+    _Out_ PWIN32_FIND_DATAA FindData
+    )
+{
+    PPOSIX_FIND find;
+    SIZE_T length;
+
+    //
+    // Only "everything in a directory" searches are supported
+    //
+    find = malloc(sizeof(*find));
+    if (find == NULL)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+    if (PosixpTranslatePath(FileName, find->Path, sizeof(find->Path)) == FALSE)
+    {
+        free(find);
+        return INVALID_HANDLE_VALUE;
+    }
+    length = strlen(find->Path);
+    if ((length < 2) || (strcmp(find->Path + length - 2, "/*") != 0))
+    {
+        free(find);
+        errno = EINVAL;
+        return INVALID_HANDLE_VALUE;
+    }
+    find->Path[length - 2] = ANSI_NULL;
+
+    find->Directory = opendir(find->Path);
+    if (find->Directory == NULL)
+    {
+        free(find);
+        return INVALID_HANDLE_VALUE;
+    }
+    if (PosixpReadDirectory(find, FindData) == FALSE)
+    {
+        closedir(find->Directory);
+        free(find);
+        return INVALID_HANDLE_VALUE;
+    }
+    return find;
+}
+
+BOOL
+FindNextFileA (
+    _In_ HANDLE FindFile,
+    _Out_ PWIN32_FIND_DATAA FindData
+    )
+{
+    return PosixpReadDirectory((PPOSIX_FIND)FindFile, FindData);
+}
+
+BOOL
+FindClose (
+    _In_ HANDLE FindFile
+    )
+{
+    closedir(((PPOSIX_FIND)FindFile)->Directory);
+    free(FindFile);
+    return TRUE;
+}
+
+VOID
+GetSystemInfo (
+    _Out_ PSYSTEM_INFO SystemInfo
+    )
+{
+    LONG value;
+
+    value = (LONG)sysconf(_SC_PAGESIZE);
+    SystemInfo->dwPageSize = (value > 0) ? (ULONG)value : 4096;
+    SystemInfo->dwAllocationGranularity = max(SystemInfo->dwPageSize,
+                                              POSIX_ALLOCATION_GRANULARITY);
+    value = (LONG)sysconf(_SC_NPROCESSORS_ONLN);
+    SystemInfo->dwNumberOfProcessors = (value > 0) ? (ULONG)value : 1;
+}
+
+ULONG
+GetSystemDirectoryA (
+    _Out_writes_(Size) PCHAR Buffer,
+    _In_ ULONG Size
+    )
+{
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Size);
+
+    //
+    // There are no kernel images to find here
+    //
+    errno = ENOENT;
+    return 0;
+}
+
+ULONG
+GetModuleFileNameA (
+    _In_opt_ HANDLE Module,
+    _Out_writes_(Size) PCHAR FileName,
+    _In_ ULONG Size
+    )
+{
+    ssize_t length;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(Module);
+
+    //
+    // Like Windows, a path that doesn't fit is truncated and returns Size.
+    // Separators are handed back as backslashes, which callers split on.
+    //
+    if (Size == 0)
+    {
+        return 0;
+    }
+    length = readlink("/proc/self/exe", FileName, Size - 1);
+    if (length < 0)
+    {
+        return 0;
+    }
+    FileName[length] = ANSI_NULL;
+    for (i = 0; i < (ULONG)length; i++)
+    {
+        if (FileName[i] == '/')
+        {
+            FileName[i] = '\\';
+        }
+    }
+    return ((ULONG)length == (Size - 1)) ? Size : (ULONG)length;
+}
+
+PVOID
+PosixpWorker (
+    _In_ PVOID Context
+    )
+{
+    PTP_CLEANUP_GROUP group;
+    PPOSIX_WORK_ITEM workItem;
+
+    //
+    // Run queued callbacks until the group is closed and the queue is empty
+    //
+    group = Context;
+    for (;;)
+    {
+        pthread_mutex_lock(&group->Lock);
+        while ((group->Head == NULL) && (group->Closing == FALSE))
+        {
+            pthread_cond_wait(&group->Wake, &group->Lock);
+        }
+        workItem = group->Head;
+        if (workItem != NULL)
+        {
+            group->Head = workItem->Next;
+            if (group->Head == NULL)
+            {
+                group->Tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&group->Lock);
+        if (workItem == NULL)
+        {
+            return NULL;
+        }
+
+        workItem->Callback(NULL, workItem->Context);
+        free(workItem);
+    }
+}
+
+PTP_CLEANUP_GROUP
+CreateThreadpoolCleanupGroup (
+    VOID
+    )
+{
+    PTP_CLEANUP_GROUP group;
+
+    group = calloc(1, sizeof(*group));
+    if (group == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&group->Lock, NULL);
+    pthread_cond_init(&group->Wake, NULL);
+    return group;
+}
+
+VOID
+InitializeThreadpoolEnvironment (
+    _Out_ PTP_CALLBACK_ENVIRON CallbackEnviron
+    )
+{
+    CallbackEnviron->CleanupGroup = NULL;
+}
+
+VOID
+SetThreadpoolCallbackCleanupGroup (
+    _Inout_ PTP_CALLBACK_ENVIRON CallbackEnviron,
+    _In_ PTP_CLEANUP_GROUP CleanupGroup,
+    _In_opt_ PVOID CancelCallback
+    )
+{
+    UNREFERENCED_PARAMETER(CancelCallback);
+    CallbackEnviron->CleanupGroup = CleanupGroup;
+}
+
+BOOL
+TrySubmitThreadpoolCallback (
+    _In_ PTP_SIMPLE_CALLBACK Callback,
+    _In_opt_ PVOID Context,
+    _In_ PTP_CALLBACK_ENVIRON CallbackEnviron
+    )
+{
+    PTP_CLEANUP_GROUP group;
+    PPOSIX_WORK_ITEM workItem;
+    SYSTEM_INFO systemInfo;
+    ULONG workerCount;
+
+    //
+    // Without a cleanup group nobody could wait for the callback
+    //
+    group = CallbackEnviron->CleanupGroup;
+    if (group == NULL)
+    {
+        errno = EINVAL;
+        return FALSE;
+    }
+    workItem = malloc(sizeof(*workItem));
+    if (workItem == NULL)
+    {
+        return FALSE;
+    }
+    workItem->Next = NULL;
+    workItem->Callback = Callback;
+    workItem->Context = Context;
+
+    //
+    // Start one worker per processor the first time around
+    //
+    pthread_mutex_lock(&group->Lock);
+    if (group->WorkerCount == 0)
+    {
+        GetSystemInfo(&systemInfo);
+        workerCount = min(systemInfo.dwNumberOfProcessors, POSIX_MAX_WORKERS);
+        while ((group->WorkerCount < workerCount) &&
+               (pthread_create(&group->Workers[group->WorkerCount],
+                               NULL,
+                               PosixpWorker,
+                               group) == 0))
+        {
+            group->WorkerCount++;
+        }
+    }
+
+    //
+    // If no thread could be started, just run it here
+    //
+    if (group->WorkerCount == 0)
+    {
+        pthread_mutex_unlock(&group->Lock);
+        Callback(NULL, Context);
+        free(workItem);
+        return TRUE;
+    }
+
+    if (group->Tail != NULL)
+    {
+        group->Tail->Next = workItem;
+    }
+    else
+    {
+        group->Head = workItem;
+    }
+    group->Tail = workItem;
+    pthread_cond_signal(&group->Wake);
+    pthread_mutex_unlock(&group->Lock);
+    return TRUE;
+}
+
+VOID
+CloseThreadpoolCleanupGroupMembers (
+    _In_ PTP_CLEANUP_GROUP CleanupGroup,
+    _In_ BOOL CancelPendingCallbacks,
+    _In_opt_ PVOID CleanupContext
+    )
+{
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(CleanupContext);
+
+    //
+    // Let the workers drain the queue, unless pending callbacks are to be
+    // cancelled, and wait for all of them to exit
+    //
+    pthread_mutex_lock(&CleanupGroup->Lock);
+    CleanupGroup->Closing = TRUE;
+    if (CancelPendingCallbacks != FALSE)
+    {
+        while (CleanupGroup->Head != NULL)
+        {
+            CleanupGroup->Tail = CleanupGroup->Head->Next;
+            free(CleanupGroup->Head);
+            CleanupGroup->Head = CleanupGroup->Tail;
+        }
+    }
+    pthread_cond_broadcast(&CleanupGroup->Wake);
+    pthread_mutex_unlock(&CleanupGroup->Lock);
+    for (i = 0; i < CleanupGroup->WorkerCount; i++)
+    {
+        pthread_join(CleanupGroup->Workers[i], NULL);
+    }
+    CleanupGroup->WorkerCount = 0;
+}
+
+VOID
+CloseThreadpoolCleanupGroup (
+    _In_ PTP_CLEANUP_GROUP CleanupGroup
+    )
+{
+    pthread_cond_destroy(&CleanupGroup->Wake);
+    pthread_mutex_destroy(&CleanupGroup->Lock);
+    free(CleanupGroup);
+}
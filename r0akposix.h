@@ -0,0 +1,580 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    r0akposix.h
+
+Abstract:
+
+    This header maps the subset of the Win32 API used by the offline parts of
+    r0ak -- the PDB and PE readers, the big pool scanner, the read planner and
+    r0akdb -- onto POSIX, so that they can be built and tested on Linux
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include <cpuid.h>
+
+//
+// Basic types, sized as on 64-bit Windows
+//
+#define VOID                        void
+typedef char CHAR, *PCHAR;
+typedef const char* PCCH;
+typedef unsigned char UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN;
+typedef short SHORT;
+typedef unsigned short USHORT, *PUSHORT, WCHAR;
+typedef int INT, BOOL;
+typedef unsigned int UINT;
+typedef int32_t LONG;
+typedef uint32_t ULONG, *PULONG, DWORD;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG, *PULONGLONG;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+typedef size_t SIZE_T;
+typedef void *PVOID, *HANDLE, **PHANDLE;
+typedef const void* LPCVOID;
+typedef LONG NTSTATUS;
+typedef ULONG ACCESS_MASK;
+typedef INT SYSTEM_INFORMATION_CLASS;
+typedef struct _OBJECT_ATTRIBUTES *POBJECT_ATTRIBUTES;
+
+typedef struct _GUID
+{
+    ULONG Data1;
+    USHORT Data2;
+    USHORT Data3;
+    UCHAR Data4[8];
+} GUID;
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+//
+// Annotations and calling conventions have no meaning here
+//
+#define _In_
+#define _In_opt_
+#define _Inout_
+#define _Out_
+#define _Out_opt_
+#define _Outptr_
+#define _In_reads_(x)
+#define _In_reads_opt_(x)
+#define _In_reads_bytes_(x)
+#define _Inout_updates_(x)
+#define _Out_writes_(x)
+#define _Out_writes_opt_(x)
+#define _Out_writes_bytes_(x)
+#define _Success_(x)
+#define NTSYSAPI
+#define NTAPI
+#define CALLBACK
+#define __cdecl
+#define UNALIGNED
+
+//
+// AVX2 routines are compiled for AVX2 on their own, and only called once the
+// CPU has been checked for it
+//
+#define DECLSPEC_AVX2               __attribute__((target("avx2")))
+
+//
+// Constants and helper macros
+//
+#define TRUE                        1
+#define FALSE                       0
+#define ANSI_NULL                   ((CHAR)0)
+#define ANYSIZE_ARRAY               1
+#define MAX_PATH                    260
+#define MAXULONG                    0xFFFFFFFF
+#define INFINITE                    0xFFFFFFFF
+#define FIELD_OFFSET(t, f)          ((LONG)offsetof(t, f))
+#define _ARRAYSIZE(a)               (sizeof(a) / sizeof((a)[0]))
+#define UNREFERENCED_PARAMETER(p)   ((VOID)(p))
+#define RtlCopyMemory(d, s, l)      memcpy((d), (s), (l))
+#define RtlZeroMemory(d, l)         memset((d), 0, (l))
+#ifndef min
+#define min(a, b)                   (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b)                   (((a) > (b)) ? (a) : (b))
+#endif
+
+#define INVALID_HANDLE_VALUE        ((HANDLE)(LONG_PTR)-1)
+#define INVALID_FILE_ATTRIBUTES     ((DWORD)-1)
+#define FILE_ATTRIBUTE_DIRECTORY    0x10
+#define FILE_ATTRIBUTE_NORMAL       0x80
+#define GENERIC_READ                0x80000000
+#define GENERIC_WRITE               0x40000000
+#define FILE_SHARE_READ             0x1
+#define FILE_SHARE_WRITE            0x2
+#define FILE_SHARE_DELETE           0x4
+#define CREATE_ALWAYS               2
+#define OPEN_EXISTING               3
+#define OPEN_ALWAYS                 4
+#define PAGE_READONLY               0x2
+#define PAGE_READWRITE              0x4
+#define FILE_MAP_WRITE              0x2
+#define FILE_MAP_READ               0x4
+#define HEAP_ZERO_MEMORY            0x8
+#define _TRUNCATE                   ((SIZE_T)-1)
+
+//
+// PE image structures
+//
+#define IMAGE_DOS_SIGNATURE                 0x5A4D
+#define IMAGE_NT_SIGNATURE                  0x00004550
+#define IMAGE_NT_OPTIONAL_HDR64_MAGIC       0x20B
+#define IMAGE_NUMBEROF_DIRECTORY_ENTRIES    16
+#define IMAGE_SIZEOF_SHORT_NAME             8
+#define IMAGE_DIRECTORY_ENTRY_EXPORT        0
+#define IMAGE_DIRECTORY_ENTRY_DEBUG         6
+#define IMAGE_DEBUG_TYPE_CODEVIEW           2
+
+typedef struct _IMAGE_DOS_HEADER
+{
+    USHORT e_magic;
+    USHORT e_cblp;
+    USHORT e_cp;
+    USHORT e_crlc;
+    USHORT e_cparhdr;
+    USHORT e_minalloc;
+    USHORT e_maxalloc;
+    USHORT e_ss;
+    USHORT e_sp;
+    USHORT e_csum;
+    USHORT e_ip;
+    USHORT e_cs;
+    USHORT e_lfarlc;
+    USHORT e_ovno;
+    USHORT e_res[4];
+    USHORT e_oemid;
+    USHORT e_oeminfo;
+    USHORT e_res2[10];
+    LONG e_lfanew;
+} IMAGE_DOS_HEADER, *PIMAGE_DOS_HEADER;
+
+typedef struct _IMAGE_FILE_HEADER
+{
+    USHORT Machine;
+    USHORT NumberOfSections;
+    ULONG TimeDateStamp;
+    ULONG PointerToSymbolTable;
+    ULONG NumberOfSymbols;
+    USHORT SizeOfOptionalHeader;
+    USHORT Characteristics;
+} IMAGE_FILE_HEADER, *PIMAGE_FILE_HEADER;
+
+typedef struct _IMAGE_DATA_DIRECTORY
+{
+    ULONG VirtualAddress;
+    ULONG Size;
+} IMAGE_DATA_DIRECTORY, *PIMAGE_DATA_DIRECTORY;
+
+typedef struct _IMAGE_OPTIONAL_HEADER64
+{
+    USHORT Magic;
+    UCHAR MajorLinkerVersion;
+    UCHAR MinorLinkerVersion;
+    ULONG SizeOfCode;
+    ULONG SizeOfInitializedData;
+    ULONG SizeOfUninitializedData;
+    ULONG AddressOfEntryPoint;
+    ULONG BaseOfCode;
+    ULONGLONG ImageBase;
+    ULONG SectionAlignment;
+    ULONG FileAlignment;
+    USHORT MajorOperatingSystemVersion;
+    USHORT MinorOperatingSystemVersion;
+    USHORT MajorImageVersion;
+    USHORT MinorImageVersion;
+    USHORT MajorSubsystemVersion;
+    USHORT MinorSubsystemVersion;
+    ULONG Win32VersionValue;
+    ULONG SizeOfImage;
+    ULONG SizeOfHeaders;
+    ULONG CheckSum;
+    USHORT Subsystem;
+    USHORT DllCharacteristics;
+    ULONGLONG SizeOfStackReserve;
+    ULONGLONG SizeOfStackCommit;
+    ULONGLONG SizeOfHeapReserve;
+    ULONGLONG SizeOfHeapCommit;
+    ULONG LoaderFlags;
+    ULONG NumberOfRvaAndSizes;
+    IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} IMAGE_OPTIONAL_HEADER64, *PIMAGE_OPTIONAL_HEADER64;
+
+typedef struct _IMAGE_NT_HEADERS64
+{
+    ULONG Signature;
+    IMAGE_FILE_HEADER FileHeader;
+    IMAGE_OPTIONAL_HEADER64 OptionalHeader;
+} IMAGE_NT_HEADERS64, *PIMAGE_NT_HEADERS64, IMAGE_NT_HEADERS, *PIMAGE_NT_HEADERS;
+
+typedef struct _IMAGE_SECTION_HEADER
+{
+    UCHAR Name[IMAGE_SIZEOF_SHORT_NAME];
+    union
+    {
+        ULONG PhysicalAddress;
+        ULONG VirtualSize;
+    } Misc;
+    ULONG VirtualAddress;
+    ULONG SizeOfRawData;
+    ULONG PointerToRawData;
+    ULONG PointerToRelocations;
+    ULONG PointerToLinenumbers;
+    USHORT NumberOfRelocations;
+    USHORT NumberOfLinenumbers;
+    ULONG Characteristics;
+} IMAGE_SECTION_HEADER, *PIMAGE_SECTION_HEADER;
+
+#define IMAGE_FIRST_SECTION(h)                                              \
+    ((PIMAGE_SECTION_HEADER)((ULONG_PTR)(h) +                               \
+                             FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader) + \
+                             (h)->FileHeader.SizeOfOptionalHeader))
+
+typedef struct _IMAGE_EXPORT_DIRECTORY
+{
+    ULONG Characteristics;
+    ULONG TimeDateStamp;
+    USHORT MajorVersion;
+    USHORT MinorVersion;
+    ULONG Name;
+    ULONG Base;
+    ULONG NumberOfFunctions;
+    ULONG NumberOfNames;
+    ULONG AddressOfFunctions;
+    ULONG AddressOfNames;
+    ULONG AddressOfNameOrdinals;
+} IMAGE_EXPORT_DIRECTORY, *PIMAGE_EXPORT_DIRECTORY;
+
+typedef struct _IMAGE_DEBUG_DIRECTORY
+{
+    ULONG Characteristics;
+    ULONG TimeDateStamp;
+    USHORT MajorVersion;
+    USHORT MinorVersion;
+    ULONG Type;
+    ULONG SizeOfData;
+    ULONG AddressOfRawData;
+    ULONG PointerToRawData;
+} IMAGE_DEBUG_DIRECTORY, *PIMAGE_DEBUG_DIRECTORY;
+
+//
+// System information
+//
+typedef struct _SYSTEM_INFO
+{
+    ULONG dwPageSize;
+    ULONG dwAllocationGranularity;
+    ULONG dwNumberOfProcessors;
+} SYSTEM_INFO, *PSYSTEM_INFO;
+
+//
+// Directory enumeration
+//
+typedef struct _WIN32_FIND_DATAA
+{
+    DWORD dwFileAttributes;
+    CHAR cFileName[MAX_PATH];
+} WIN32_FIND_DATAA, *PWIN32_FIND_DATAA;
+
+//
+// Locks and the thread pool. Only a cleanup group's worth of the thread pool
+// is supported -- callbacks run on worker threads owned by the group.
+//
+typedef pthread_mutex_t SRWLOCK, *PSRWLOCK;
+typedef struct _TP_CALLBACK_INSTANCE *PTP_CALLBACK_INSTANCE;
+typedef struct _TP_CLEANUP_GROUP *PTP_CLEANUP_GROUP;
+
+typedef VOID
+(*PTP_SIMPLE_CALLBACK)(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _In_ PVOID Context
+    );
+
+typedef struct _TP_CALLBACK_ENVIRON
+{
+    PTP_CLEANUP_GROUP CleanupGroup;
+} TP_CALLBACK_ENVIRON, *PTP_CALLBACK_ENVIRON;
+
+#define InitializeSRWLock(l)        pthread_mutex_init((l), NULL)
+#define AcquireSRWLockExclusive(l)  pthread_mutex_lock(l)
+#define ReleaseSRWLockExclusive(l)  pthread_mutex_unlock(l)
+#define InterlockedIncrement(p)     __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+
+//
+// Heap, string and GUID routines
+//
+#define GetProcessHeap()            NULL
+#define GetLastError()              ((DWORD)errno)
+#define _stricmp                    strcasecmp
+#define _strnicmp                   strncasecmp
+#define sprintf_s                   snprintf
+#define IsEqualGUID(a, b)           (memcmp((a), (b), sizeof(GUID)) == 0)
+
+PVOID
+HeapAlloc (
+    _In_ HANDLE Heap,
+    _In_ ULONG Flags,
+    _In_ SIZE_T Size
+    );
+
+PVOID
+HeapReAlloc (
+    _In_ HANDLE Heap,
+    _In_ ULONG Flags,
+    _In_ PVOID Memory,
+    _In_ SIZE_T Size
+    );
+
+BOOL
+HeapFree (
+    _In_ HANDLE Heap,
+    _In_ ULONG Flags,
+    _In_ PVOID Memory
+    );
+
+INT
+strcpy_s (
+    _Out_writes_(Size) PCHAR Destination,
+    _In_ SIZE_T Size,
+    _In_ PCCH Source
+    );
+
+INT
+strcat_s (
+    _Inout_updates_(Size) PCHAR Destination,
+    _In_ SIZE_T Size,
+    _In_ PCCH Source
+    );
+
+INT
+_snprintf_s (
+    _Out_writes_(Size) PCHAR Buffer,
+    _In_ SIZE_T Size,
+    _In_ SIZE_T Count,
+    _In_ PCCH Format,
+    ...
+    );
+
+ULONG
+GetEnvironmentVariableA (
+    _In_ PCCH Name,
+    _Out_writes_(Size) PCHAR Buffer,
+    _In_ ULONG Size
+    );
+
+//
+// Files and sections. Paths may use either kind of separator.
+//
+HANDLE
+CreateFileA (
+    _In_ PCCH FileName,
+    _In_ ULONG DesiredAccess,
+    _In_ ULONG ShareMode,
+    _In_opt_ PVOID SecurityAttributes,
+    _In_ ULONG CreationDisposition,
+    _In_ ULONG FlagsAndAttributes,
+    _In_opt_ HANDLE TemplateFile
+    );
+
+BOOL
+GetFileSizeEx (
+    _In_ HANDLE File,
+    _Out_ PLARGE_INTEGER FileSize
+    );
+
+BOOL
+WriteFile (
+    _In_ HANDLE File,
+    _In_reads_bytes_(Size) LPCVOID Buffer,
+    _In_ ULONG Size,
+    _Out_ PULONG Written,
+    _In_opt_ PVOID Overlapped
+    );
+
+BOOL
+CloseHandle (
+    _In_ HANDLE Handle
+    );
+
+DWORD
+GetFileAttributesA (
+    _In_ PCCH FileName
+    );
+
+HANDLE
+CreateFileMappingA (
+    _In_ HANDLE File,
+    _In_opt_ PVOID SecurityAttributes,
+    _In_ ULONG Protect,
+    _In_ ULONG MaximumSizeHigh,
+    _In_ ULONG MaximumSizeLow,
+    _In_opt_ PCCH Name
+    );
+
+PVOID
+MapViewOfFile (
+    _In_ HANDLE Section,
+    _In_ ULONG DesiredAccess,
+    _In_ ULONG FileOffsetHigh,
+    _In_ ULONG FileOffsetLow,
+    _In_ SIZE_T Size
+    );
+
+BOOL
+UnmapViewOfFile (
+    _In_ LPCVOID BaseAddress
+    );
+
+HANDLE
+FindFirstFileA (
+    _In_ PCCH FileName,
+    _Out_ PWIN32_FIND_DATAA FindData
+    );
+
+BOOL
+FindNextFileA (
+    _In_ HANDLE FindFile,
+    _Out_ PWIN32_FIND_DATAA FindData
+    );
+
+BOOL
+FindClose (
+    _In_ HANDLE FindFile
+    );
+
+//
+// System information
+//
+VOID
+GetSystemInfo (
+    _Out_ PSYSTEM_INFO SystemInfo
+    );
+
+ULONG
+GetSystemDirectoryA (
+    _Out_writes_(Size) PCHAR Buffer,
+    _In_ ULONG Size
+    );
+
+ULONG
+GetModuleFileNameA (
+    _In_opt_ HANDLE Module,
+    _Out_writes_(Size) PCHAR FileName,
+    _In_ ULONG Size
+    );
+
+//
+// Thread pool
+//
+PTP_CLEANUP_GROUP
+CreateThreadpoolCleanupGroup (
+    VOID
+    );
+
+VOID
+InitializeThreadpoolEnvironment (
+    _Out_ PTP_CALLBACK_ENVIRON CallbackEnviron
+    );
+
+VOID
+SetThreadpoolCallbackCleanupGroup (
+    _Inout_ PTP_CALLBACK_ENVIRON CallbackEnviron,
+    _In_ PTP_CLEANUP_GROUP CleanupGroup,
+    _In_opt_ PVOID CancelCallback
+    );
+
+BOOL
+TrySubmitThreadpoolCallback (
+    _In_ PTP_SIMPLE_CALLBACK Callback,
+    _In_opt_ PVOID Context,
+    _In_ PTP_CALLBACK_ENVIRON CallbackEnviron
+    );
+
+VOID
+CloseThreadpoolCleanupGroupMembers (
+    _In_ PTP_CLEANUP_GROUP CleanupGroup,
+    _In_ BOOL CancelPendingCallbacks,
+    _In_opt_ PVOID CleanupContext
+    );
+
+VOID
+CloseThreadpoolCleanupGroup (
+    _In_ PTP_CLEANUP_GROUP CleanupGroup
+    );
+
+#define DestroyThreadpoolEnvironment(e) ((VOID)(e))
+
+//
+// Compiler intrinsics. The compiler's __cpuidex matches the MSVC one, while
+// its __cpuid doesn't.
+//
+#undef __cpuid
+#define __cpuid(i, f)               __cpuidex((i), (f), 0)
+
+static inline
+ULONGLONG
+PosixXgetbv (
+    _In_ ULONG Register
+    )
+{
+    ULONG low, high;
+
+    __asm__ __volatile__("xgetbv" : "=a"(low), "=d"(high) : "c"(Register));
+    return ((ULONGLONG)high << 32) | low;
+}
+
+#define _xgetbv                     PosixXgetbv
+
+static inline
+UCHAR
+_BitScanForward (
+    _Out_ PULONG Index,
+    _In_ ULONG Mask
+    )
+{
+    if (Mask == 0)
+    {
+        return 0;
+    }
+    *Index = (ULONG)__builtin_ctz(Mask);
+    return 1;
+}
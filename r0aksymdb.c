@@ -0,0 +1,407 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    r0aksymdb.c
+
+Abstract:
+
+    This module implements the precomputed symbol database for r0ak, which is
+    written by r0akdb
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0ak.h"
+
+//
+// Internal definitions
+//
+#define SYM_DB_SIGNATURE            'DSkr'
+#define SYM_DB_VERSION              1
+#define SYM_DB_NAME                 "r0ak.symdb"
+
+//
+// A symbol in the precomputed database, whose name is an offset into the
+// string table following the entries
+//
+typedef struct _SYM_DB_ENTRY
+{
+    GUID Guid;
+    ULONG Age;
+    ULONG NameOffset;
+    ULONG Rva;
+} SYM_DB_ENTRY, *PSYM_DB_ENTRY;
+
+//
+// Layout of the database file: entries sorted by image identity and then by
+// name, followed by the string table
+//
+typedef struct _SYM_DB_FILE
+{
+    ULONG Signature;
+    ULONG Version;
+    ULONG EntryCount;
+    ULONG NamesSize;
+    SYM_DB_ENTRY Entries[ANYSIZE_ARRAY];
+} SYM_DB_FILE, *PSYM_DB_FILE;
+
+PSYM_DB_FILE g_SymDb;
+PCHAR g_SymDbNames;
+
+INT
+SympDbCompare (
+    _In_ const GUID* Guid,
+    _In_ ULONG Age,
+    _In_ PCCH SymbolName,
+    _In_ const GUID* OtherGuid,
+    _In_ ULONG OtherAge,
+    _In_ PCCH OtherSymbolName
+    )
+{
+    INT result;
+
+    //
+    // Order by GUID, then by age, then by name
+    //
+    result = memcmp(Guid, OtherGuid, sizeof(*Guid));
+    if (result != 0)
+    {
+        return result;
+    }
+    if (Age != OtherAge)
+    {
+        return (Age > OtherAge) ? 1 : -1;
+    }
+    return strcmp(SymbolName, OtherSymbolName);
+}
+
+INT
+__cdecl
+SympDbCompareRecord (
+    _In_ const VOID* First,
+    _In_ const VOID* Second
+    )
+{
+    const SYM_DB_RECORD* first;
+    const SYM_DB_RECORD* second;
+
+    //
+    // Records are sorted the same way as the database entries
+    //
+    first = (const SYM_DB_RECORD*)First;
+    second = (const SYM_DB_RECORD*)Second;
+    return SympDbCompare(&first->DebugId.Guid,
+                         first->DebugId.Age,
+                         first->SymbolName,
+                         &second->DebugId.Guid,
+                         second->DebugId.Age,
+                         second->SymbolName);
+}
+
+_Success_(return != 0)
+BOOL
+SymDbLookup (
+    _In_ PSYM_DEBUG_ID DebugId,
+    _In_ PCCH SymbolName,
+    _Out_ PULONG Rva
+    )
+{
+    PSYM_DB_ENTRY entry;
+    ULONG low, high, middle;
+    INT result;
+
+    //
+    // Nothing to do if there's no database
+    //
+    if (g_SymDb == NULL)
+    {
+        return FALSE;
+    }
+
+    //
+    // Binary search the sorted entries
+    //
+    low = 0;
+    high = g_SymDb->EntryCount;
+    while (low < high)
+    {
+        middle = low + ((high - low) / 2);
+        entry = &g_SymDb->Entries[middle];
+        result = SympDbCompare(&DebugId->Guid,
+                               DebugId->Age,
+                               SymbolName,
+                               &entry->Guid,
+                               entry->Age,
+                               g_SymDbNames + entry->NameOffset);
+        if (result == 0)
+        {
+            *Rva = entry->Rva;
+            return TRUE;
+        }
+        if (result < 0)
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    return FALSE;
+}
+
+_Success_(return != 0)
+BOOL
+SymDbOpen (
+    VOID
+    )
+{
+    HANDLE hFile, hSection;
+    LARGE_INTEGER fileSize;
+    CHAR dbPath[MAX_PATH];
+    PCHAR fileName;
+    ULONGLONG dataSize;
+    ULONG i;
+    BOOL b;
+
+    //
+    // The database is deployed next to r0ak itself
+    //
+    i = GetModuleFileNameA(NULL, dbPath, sizeof(dbPath));
+    if ((i == 0) || (i == sizeof(dbPath)))
+    {
+        return FALSE;
+    }
+    fileName = strrchr(dbPath, '\\');
+    fileName = (fileName != NULL) ? fileName + 1 : dbPath;
+    *fileName = ANSI_NULL;
+    if (strcat_s(dbPath, sizeof(dbPath), SYM_DB_NAME) != 0)
+    {
+        return FALSE;
+    }
+
+    //
+    // It's optional, so quietly bail out if it's not there
+    //
+    hFile = CreateFileA(dbPath,
+                        GENERIC_READ,
+                        FILE_SHARE_READ,
+                        NULL,
+                        OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    b = GetFileSizeEx(hFile, &fileSize);
+    if ((b == FALSE) ||
+        (fileSize.QuadPart < (LONGLONG)FIELD_OFFSET(SYM_DB_FILE, Entries)))
+    {
+        printf("[-] Symbol database %s is corrupt\n", dbPath);
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    //
+    // Map the whole thing in with a single read-only view
+    //
+    hSection = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (hSection == NULL)
+    {
+        printf("[-] Failed to create symbol database section: %lx\n",
+               GetLastError());
+        return FALSE;
+    }
+    g_SymDb = MapViewOfFile(hSection, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hSection);
+    if (g_SymDb == NULL)
+    {
+        printf("[-] Failed to map symbol database: %lx\n", GetLastError());
+        return FALSE;
+    }
+
+    //
+    // Validate the header, and make sure that the string table fits and is
+    // terminated, so that names can be compared in place
+    //
+    dataSize = FIELD_OFFSET(SYM_DB_FILE, Entries) +
+               ((ULONGLONG)g_SymDb->EntryCount * sizeof(SYM_DB_ENTRY));
+    b = (g_SymDb->Signature == SYM_DB_SIGNATURE) &&
+        (g_SymDb->Version == SYM_DB_VERSION) &&
+        ((g_SymDb->NamesSize != 0) || (g_SymDb->EntryCount == 0)) &&
+        ((dataSize + g_SymDb->NamesSize) <= (ULONGLONG)fileSize.QuadPart);
+    if (b != FALSE)
+    {
+        g_SymDbNames = (PCHAR)g_SymDb + dataSize;
+        b = (g_SymDb->NamesSize == 0) ||
+            (g_SymDbNames[g_SymDb->NamesSize - 1] == ANSI_NULL);
+        for (i = 0; (b != FALSE) && (i < g_SymDb->EntryCount); i++)
+        {
+            b = (g_SymDb->Entries[i].NameOffset < g_SymDb->NamesSize);
+        }
+    }
+    if (b == FALSE)
+    {
+        printf("[-] Symbol database %s is corrupt or outdated\n", dbPath);
+        UnmapViewOfFile(g_SymDb);
+        g_SymDb = NULL;
+        g_SymDbNames = NULL;
+        return FALSE;
+    }
+    printf("[+] Using symbol database with %lu entries\n", g_SymDb->EntryCount);
+    return TRUE;
+}
+
+VOID
+SymDbClose (
+    VOID
+    )
+{
+    if (g_SymDb != NULL)
+    {
+        UnmapViewOfFile(g_SymDb);
+        g_SymDb = NULL;
+        g_SymDbNames = NULL;
+    }
+}
+
+_Success_(return != 0)
+BOOL
+SymDbWrite (
+    _In_ PCCH DbPath,
+    _Inout_updates_(RecordCount) PSYM_DB_RECORD Records,
+    _In_ ULONG RecordCount
+    )
+{
+    SYM_DB_FILE header;
+    PSYM_DB_ENTRY entries;
+    PCHAR names;
+    ULONG i, j, count, namesSize, namesCapacity, nameSize;
+    HANDLE hFile;
+    DWORD written;
+    BOOL b;
+
+    //
+    // Sort the records, which also brings duplicates next to each other
+    //
+    qsort(Records, RecordCount, sizeof(*Records), SympDbCompareRecord);
+
+    //
+    // Allocate the entries, and a string table large enough for every name
+    //
+    namesCapacity = 0;
+    for (i = 0; i < RecordCount; i++)
+    {
+        namesCapacity += (ULONG)strlen(Records[i].SymbolName) + 1;
+    }
+    entries = HeapAlloc(GetProcessHeap(),
+                        0,
+                        max(RecordCount, 1) * sizeof(*entries));
+    names = HeapAlloc(GetProcessHeap(), 0, max(namesCapacity, 1));
+    if ((entries == NULL) || (names == NULL))
+    {
+        printf("[-] Out of memory writing symbol database\n");
+        if (entries != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, entries);
+        }
+        if (names != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, names);
+        }
+        return FALSE;
+    }
+
+    //
+    // Build the entries, dropping duplicates. The same few symbols are found
+    // in every build, so each distinct name is only stored once.
+    //
+    count = 0;
+    namesSize = 0;
+    for (i = 0; i < RecordCount; i++)
+    {
+        if ((i != 0) &&
+            (SympDbCompareRecord(&Records[i], &Records[i - 1]) == 0))
+        {
+            continue;
+        }
+
+        for (j = 0; j < namesSize; j += (ULONG)strlen(names + j) + 1)
+        {
+            if (strcmp(names + j, Records[i].SymbolName) == 0)
+            {
+                break;
+            }
+        }
+        if (j == namesSize)
+        {
+            nameSize = (ULONG)strlen(Records[i].SymbolName) + 1;
+            RtlCopyMemory(names + namesSize, Records[i].SymbolName, nameSize);
+            namesSize += nameSize;
+        }
+
+        entries[count].Guid = Records[i].DebugId.Guid;
+        entries[count].Age = Records[i].DebugId.Age;
+        entries[count].NameOffset = j;
+        entries[count].Rva = Records[i].Rva;
+        count++;
+    }
+
+    //
+    // Write out the header, the entries and the string table
+    //
+    b = FALSE;
+    hFile = CreateFileA(DbPath,
+                        GENERIC_WRITE,
+                        0,
+                        NULL,
+                        CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        printf("[-] Failed to create %s: %lx\n", DbPath, GetLastError());
+    }
+    else
+    {
+        header.Signature = SYM_DB_SIGNATURE;
+        header.Version = SYM_DB_VERSION;
+        header.EntryCount = count;
+        header.NamesSize = namesSize;
+        b = WriteFile(hFile,
+                      &header,
+                      FIELD_OFFSET(SYM_DB_FILE, Entries),
+                      &written,
+                      NULL) &&
+            WriteFile(hFile,
+                      entries,
+                      count * sizeof(*entries),
+                      &written,
+                      NULL) &&
+            WriteFile(hFile, names, namesSize, &written, NULL);
+        if (b == FALSE)
+        {
+            printf("[-] Failed to write %s: %lx\n", DbPath, GetLastError());
+        }
+        CloseHandle(hFile);
+    }
+
+    //
+    // Free the buffers
+    //
+    HeapFree(GetProcessHeap(), 0, entries);
+    HeapFree(GetProcessHeap(), 0, names);
+    return b;
+}
@@ -22,10 +22,92 @@ Environment:
 
 #include "r0ak.h"
 
+//
+// Snapshot of the loaded module list, indexed by name and by base address
+//
+typedef struct _DRIVER_INDEX
+{
+    PRTL_PROCESS_MODULES Modules;
+    PULONG NameHash;
+    ULONG NameHashMask;
+    PULONG BaseOrder;
+} DRIVER_INDEX, *PDRIVER_INDEX;
+
+DRIVER_INDEX g_DriverIndex;
+
+ULONG
+GetDriverNameHash (
+    _In_ PCCH BaseName
+    )
+{
+    ULONG hash;
+
+    //
+    // FNV-1a of the lowercase name, since driver names are case-insensitive
+    //
+    for (hash = 2166136261; *BaseName != ANSI_NULL; BaseName++)
+    {
+        hash = (hash ^ (UCHAR)tolower((UCHAR)*BaseName)) * 16777619;
+    }
+    return hash;
+}
+
+INT
+__cdecl
+GetDriverCompareBase (
+    _In_ const VOID* First,
+    _In_ const VOID* Second
+    )
+{
+    ULONG_PTR firstBase, secondBase;
+
+    //
+    // Order module indices by the base address of the module
+    //
+    firstBase = (ULONG_PTR)g_DriverIndex.Modules->
+                Modules[*(const ULONG*)First].ImageBase;
+    secondBase = (ULONG_PTR)g_DriverIndex.Modules->
+                 Modules[*(const ULONG*)Second].ImageBase;
+    return (firstBase > secondBase) - (firstBase < secondBase);
+}
+
+VOID
+DumppSymbolizeRow (
+    _In_ LPCVOID Data,
+    _In_ SIZE_T Size,
+    _In_ ULONG_PTR BaseAddress,
+    _In_ SIZE_T RowStart
+    )
+{
+    CHAR symbolName[MAX_PATH];
+    ULONG_PTR value;
+    SIZE_T i;
+
+    //
+    // Find the first aligned pointer starting in this row
+    //
+    i = RowStart + ((0 - (BaseAddress + RowStart)) & (sizeof(ULONG_PTR) - 1));
+
+    //
+    // Like the debugger's "dps", only print the ones that symbolize, along
+    // with where in the row they start
+    //
+    for (; (i < (RowStart + 16)) && ((i + sizeof(ULONG_PTR)) <= Size);
+         i += sizeof(ULONG_PTR))
+    {
+        value = *(ULONG_PTR UNALIGNED*)((PUCHAR)Data + i);
+        if (SymLookupAddress(value, symbolName, sizeof(symbolName)) != FALSE)
+        {
+            printf("  +%X %s", (ULONG)(i - RowStart), symbolName);
+        }
+    }
+}
+
 VOID
 DumpHex (
     _In_ LPCVOID Data,
-    _In_ SIZE_T Size
+    _In_ SIZE_T Size,
+    _In_ ULONG_PTR BaseAddress
     )
 {
     CHAR ascii[17];
@@ -75,28 +157,142 @@ DumpHex (
         }
 
         //
-        // Is this end of the line? If so, print it out
+        // Is this end of the line, or of the buffer? If so, print it out
         //
-        if (((i + 1) % 16) == 0)
-        {
-            printf(" %s\n", ascii);
-        }
-
-        if ((i + 1) == Size)
+        if ((((i + 1) % 16) == 0) || ((i + 1) == Size))
         {
             //
-            // We've reached the end of the buffer, keep printing spaces
+            // If we've reached the end of the buffer, keep printing spaces
             // until we get to the end of the line
             //
-            ascii[(i + 1) % 16] = ANSI_NULL;
-            for (j = ((i + 1) % 16); j < 16; j++)
+            if (((i + 1) % 16) != 0)
             {
-                printf("   ");
+                ascii[(i + 1) % 16] = ANSI_NULL;
+                for (j = ((i + 1) % 16); j < 16; j++)
+                {
+                    printf("   ");
+                }
             }
 
-            printf(" %s\n", ascii);
+            //
+            // Then follow the characters with the pointers that symbolize
+            //
+            printf(" %s", ascii);
+            DumppSymbolizeRow(Data, Size, BaseAddress, i - (i % 16));
+            printf("\n");
+        }
+    }
+}
+
+_Success_(return != 0)
+BOOL
+GetDriverIndex (
+    VOID
+    )
+{
+    NTSTATUS status;
+    PRTL_PROCESS_MODULES modules;
+    PRTL_PROCESS_MODULE_INFORMATION module;
+    ULONG modulesSize, hashSize;
+    ULONG i, slot;
+
+    //
+    // The snapshot is only taken once per session
+    //
+    if (g_DriverIndex.Modules != NULL)
+    {
+        return TRUE;
+    }
+
+    //
+    // Query the loaded module list, growing the buffer as needed
+    //
+    modulesSize = sizeof(*modules) * 64;
+    for (;;)
+    {
+        modules = HeapAlloc(GetProcessHeap(), 0, modulesSize);
+        if (modules == NULL)
+        {
+            printf("[-] Out of memory for loaded module list\n");
+            return FALSE;
+        }
+
+        status = NtQuerySystemInformation(SystemModuleInformation,
+                                          modules,
+                                          modulesSize,
+                                          &modulesSize);
+        if (NT_SUCCESS(status))
+        {
+            break;
+        }
+
+        HeapFree(GetProcessHeap(), 0, modules);
+        if (status != STATUS_INFO_LENGTH_MISMATCH)
+        {
+            printf("[-] Failed to query loaded module list: %lx\n", status);
+            return FALSE;
+        }
+    }
+
+    //
+    // Allocate a name hash kept at most half full, and the base address order
+    //
+    for (hashSize = 16; hashSize < (modules->NumberOfModules * 2); hashSize <<= 1);
+    g_DriverIndex.NameHash = HeapAlloc(GetProcessHeap(),
+                                       HEAP_ZERO_MEMORY,
+                                       hashSize * sizeof(ULONG));
+    g_DriverIndex.BaseOrder = HeapAlloc(GetProcessHeap(),
+                                        0,
+                                        (modules->NumberOfModules + 1) *
+                                        sizeof(ULONG));
+    if ((g_DriverIndex.NameHash == NULL) || (g_DriverIndex.BaseOrder == NULL))
+    {
+        printf("[-] Out of memory for loaded module index\n");
+        if (g_DriverIndex.NameHash != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, g_DriverIndex.NameHash);
+        }
+        if (g_DriverIndex.BaseOrder != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, g_DriverIndex.BaseOrder);
+        }
+        HeapFree(GetProcessHeap(), 0, modules);
+        RtlZeroMemory(&g_DriverIndex, sizeof(g_DriverIndex));
+        return FALSE;
+    }
+    g_DriverIndex.NameHashMask = hashSize - 1;
+
+    //
+    // Index each module by its base name. Slots hold the module index plus
+    // one, so that zero means empty.
+    //
+    for (i = 0; i < modules->NumberOfModules; i++)
+    {
+        module = &modules->Modules[i];
+        if (module->OffsetToFileName >= sizeof(module->FullPathName))
+        {
+            module->OffsetToFileName = 0;
         }
+
+        slot = GetDriverNameHash((PCCH)&module->FullPathName[module->OffsetToFileName]) &
+               g_DriverIndex.NameHashMask;
+        while (g_DriverIndex.NameHash[slot] != 0)
+        {
+            slot = (slot + 1) & g_DriverIndex.NameHashMask;
+        }
+        g_DriverIndex.NameHash[slot] = i + 1;
+        g_DriverIndex.BaseOrder[i] = i;
     }
+
+    //
+    // And sort them by base address for reverse lookups
+    //
+    g_DriverIndex.Modules = modules;
+    qsort(g_DriverIndex.BaseOrder,
+          modules->NumberOfModules,
+          sizeof(ULONG),
+          GetDriverCompareBase);
+    return TRUE;
 }
 
 _Success_(return != 0)
@@ -105,46 +301,86 @@ GetDriverBaseAddr (
     _In_ PCCH BaseName
     )
 {
-    LPVOID BaseAddresses[1024];
-    DWORD cbNeeded;
-    CHAR FileName[MAX_PATH];
+    PRTL_PROCESS_MODULE_INFORMATION module;
+    ULONG slot;
 
     //
-    // Enumerate all the device drivers
+    // Make sure we have a snapshot of the loaded modules
     //
-    if (!EnumDeviceDrivers(BaseAddresses, sizeof(BaseAddresses), &cbNeeded))
+    if (GetDriverIndex() == FALSE)
     {
-        printf("[-] Failed to enumerate driver base addresses: %lx\n",
-               GetLastError());
         return 0;
     }
 
     //
-    // Go through each one
+    // Probe from the home slot until we find it or hit an empty slot
     //
-    for (int i = 0; i < (cbNeeded / sizeof(LPVOID)); i++)
+    slot = GetDriverNameHash(BaseName) & g_DriverIndex.NameHashMask;
+    while (g_DriverIndex.NameHash[slot] != 0)
     {
-        //
-        // Get its name
-        //
-        if (!GetDeviceDriverBaseNameA(BaseAddresses[i],
-                                      FileName,
-                                      sizeof(FileName)))
+        module = &g_DriverIndex.Modules->Modules[g_DriverIndex.NameHash[slot] - 1];
+        if (!_stricmp((PCCH)&module->FullPathName[module->OffsetToFileName],
+                      BaseName))
         {
-            printf("[-] Failed to get driver name: %lx\n",
-                   GetLastError());
-            return 0;
+            return (ULONG_PTR)module->ImageBase;
         }
+        slot = (slot + 1) & g_DriverIndex.NameHashMask;
+    }
+    return 0;
+}
 
-        //
-        // Compare it
-        //
-        if (!_stricmp(FileName, BaseName))
+_Success_(return != NULL)
+PCCH
+GetDriverByAddress (
+    _In_ ULONG_PTR Address,
+    _Out_ PULONG_PTR ImageBase,
+    _Out_ PULONG ImageSize
+    )
+{
+    PRTL_PROCESS_MODULE_INFORMATION module;
+    ULONG low, high, middle;
+
+    //
+    // Make sure we have a snapshot of the loaded modules
+    //
+    if (GetDriverIndex() == FALSE)
+    {
+        return NULL;
+    }
+
+    //
+    // Binary search for the last module starting at or below the address
+    //
+    module = NULL;
+    low = 0;
+    high = g_DriverIndex.Modules->NumberOfModules;
+    while (low < high)
+    {
+        middle = low + ((high - low) / 2);
+        if ((ULONG_PTR)g_DriverIndex.Modules->
+            Modules[g_DriverIndex.BaseOrder[middle]].ImageBase <= Address)
         {
-            return (ULONG_PTR)BaseAddresses[i];
+            module = &g_DriverIndex.Modules->
+                     Modules[g_DriverIndex.BaseOrder[middle]];
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
         }
     }
-    return 0;
+
+    //
+    // And check that it's actually inside of it
+    //
+    if ((module == NULL) ||
+        ((Address - (ULONG_PTR)module->ImageBase) >= module->ImageSize))
+    {
+        return NULL;
+    }
+    *ImageBase = (ULONG_PTR)module->ImageBase;
+    *ImageSize = module->ImageSize;
+    return (PCCH)&module->FullPathName[module->OffsetToFileName];
 }
 
 _Success_(return != 0)
@@ -41,107 +41,308 @@ typedef struct _XM_CONTEXT
     ULONG DataType;
 } XM_CONTEXT, *PXM_CONTEXT;
 
+//
+// Internal definitions
+//
+#define XM_CONTEXTS_PER_ALLOC       (KERNEL_MAX_ALLOC_SIZE / sizeof(XM_CONTEXT))
+
+//
+// A single move done by the emulator
+//
+typedef struct _XM_OPERATION
+{
+    PVOID KernelAddress;
+    ULONG KernelValue;
+    XM_OPERATION_DATATYPE DataType;
+    ULONG Size;
+} XM_OPERATION, *PXM_OPERATION;
+
+//
+// A kernel allocation holding the XM_CONTEXTs of several operations
+//
+typedef struct _XM_GROUP
+{
+    PKERNEL_ALLOC KernelAlloc;
+    PXM_CONTEXT XmContexts;
+} XM_GROUP, *PXM_GROUP;
+
 _Success_(return != 0)
 BOOL
-CmdWriteKernel (
-    _In_ PKERNEL_EXECUTE KernelExecute,
-    _In_ PVOID KernelAddress,
-    _In_ ULONG KernelValue
+CmdpPlaceWrites (
+    _In_reads_(Count) PXM_OPERATION Operations,
+    _In_ ULONG Count,
+    _Out_ PXM_GROUP Group
     )
 {
-    PKERNEL_ALLOC kernelAlloc;
-    PXM_CONTEXT xmContext;
-    BOOL b;
-    PETW_DATA etwData;
+    PXM_CONTEXT xmContexts;
+    ULONG i;
 
     //
-    // Trace operation
+    // Allocate the XM_CONTEXTs to drive the HAL x64 emulator, all at once
     //
-    printf("[+] Writing 0x%.8lX to                                0x%.16p\n",
-           KernelValue, KernelAddress);
-
-    //
-    // Allocate an XM_CONTEXT to drive the HAL x64 emulator
-    //
-    kernelAlloc = NULL;
-    xmContext = KernelAlloc(&kernelAlloc, sizeof(*xmContext));
-    if (xmContext == NULL)
+    Group->KernelAlloc = NULL;
+    xmContexts = KernelAlloc(&Group->KernelAlloc, Count * sizeof(*xmContexts));
+    if (xmContexts == NULL)
     {
         printf("[-] Failed to allocate memory for XM_CONTEXT\n");
         return FALSE;
     }
 
     //
-    // Fill it out
+    // Fill them out
     //
-    xmContext->SourceValue = KernelValue;
-    xmContext->DataType = LONG_DATA;
-    xmContext->DestinationPointer = KernelAddress;
+    for (i = 0; i < Count; i++)
+    {
+        printf("[+] Writing 0x%.8lX to                                0x%.16p\n",
+               Operations[i].KernelValue, Operations[i].KernelAddress);
+        xmContexts[i].SourceValue = Operations[i].KernelValue;
+        xmContexts[i].DataType = Operations[i].DataType;
+        xmContexts[i].DestinationPointer = Operations[i].KernelAddress;
+
+        //
+        // Anything cached about this memory is about to go stale
+        //
+        CmdInvalidateReadCache(Operations[i].KernelAddress, Operations[i].Size);
+    }
 
     //
-    // Make a kernel copy of it
+    // Make a kernel copy of them
     //
-    xmContext = KernelWrite(kernelAlloc);
-    if (xmContext == NULL)
+    Group->XmContexts = KernelWrite(Group->KernelAlloc);
+    if (Group->XmContexts == NULL)
     {
         printf("[-] Failed to find kernel memory for XM_CONTEXT\n");
-        KernelFree(kernelAlloc);
+        KernelFree(Group->KernelAlloc);
         return FALSE;
     }
+    return TRUE;
+}
+
+_Success_(return != 0)
+BOOL
+CmdpRunWrites (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_reads_(Count) PXM_OPERATION Operations,
+    _In_ ULONG Count
+    )
+{
+    PXM_GROUP groups;
+    PXM_CONTEXT xmContext;
+    PKERNEL_REQUEST requests;
+    ULONG i, groupCount, placed, submitted;
+    BOOL b;
 
     //
-    // Setup the work item
+    // Make sure we have the emulator's move routine
     //
-    b = KernelExecuteSetCallback(KernelExecute,
-                                 g_XmFunction,
-                                 xmContext->Reserved);
+    b = SymResolveGadgets(SYM_GADGET_XM);
     if (b == FALSE)
     {
-        printf("[-] Failed to initialize work item!\n");
-        KernelFree(kernelAlloc);
+        printf("[-] Failed to find write gadget\n");
         return b;
     }
+    if (Count == 0)
+    {
+        return TRUE;
+    }
 
     //
-    // Begin ETW tracing to look for the work item executing
+    // Place every XM_CONTEXT up front, packing as many as fit in each kernel
+    // allocation, so that only one big pool lookup is needed for each group.
+    // A full CMD_MAX_WRITE_SIZE write fits in a single group.
     //
-    etwData = NULL;
-    b = EtwStartSession(&etwData, g_XmFunction);
-    if (b == FALSE)
+    groupCount = (Count + XM_CONTEXTS_PER_ALLOC - 1) / XM_CONTEXTS_PER_ALLOC;
+    groups = HeapAlloc(GetProcessHeap(), 0, groupCount * sizeof(*groups));
+    requests = HeapAlloc(GetProcessHeap(), 0, Count * sizeof(*requests));
+    if ((groups == NULL) || (requests == NULL))
     {
-        printf("[-] Failed to start ETW trace\n");
-        KernelFree(kernelAlloc);
-        return b;
+        printf("[-] Out of memory placing writes\n");
+        if (groups != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, groups);
+        }
+        if (requests != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, requests);
+        }
+        return FALSE;
+    }
+    for (placed = 0; placed < groupCount; placed++)
+    {
+        b = CmdpPlaceWrites(&Operations[placed * XM_CONTEXTS_PER_ALLOC],
+                            (ULONG)min(Count - (placed * XM_CONTEXTS_PER_ALLOC),
+                                       XM_CONTEXTS_PER_ALLOC),
+                            &groups[placed]);
+        if (b == FALSE)
+        {
+            goto Cleanup;
+        }
     }
 
     //
-    // Run it!
+    // Submit each write as soon as the previous one was triggered -- the
+    // execution engine only waits for an earlier one when it needs its
+    // trampoline context again, so the kernel runs one write while the next
+    // is set up and triggered. Writes in a batch never overlap, so it doesn't
+    // matter in which order they finish.
     //
-    b = KernelExecuteRun(KernelExecute);
-    if (b == FALSE)
+    for (submitted = 0; submitted < Count; submitted++)
     {
-        printf("[-] Failed to execute kernel function!\n");
+        xmContext = &groups[submitted / XM_CONTEXTS_PER_ALLOC].
+                     XmContexts[submitted % XM_CONTEXTS_PER_ALLOC];
+        b = KernelExecuteSubmit(KernelExecute,
+                                &requests[submitted],
+                                g_XmFunction,
+                                xmContext->Reserved);
+        if (b == FALSE)
+        {
+            printf("[-] Failed to execute kernel function!\n");
+            break;
+        }
     }
-    else
+
+    //
+    // Wait for all of them to finish, after which their XM_CONTEXTs can be
+    // freed. Overdue ones may still be used by the kernel, so the allocation
+    // holding their XM_CONTEXT is left allocated.
+    //
+    for (i = 0; i < submitted; i++)
     {
-        //
-        // Wait for execution to finish
-        //
-        b = EtwParseSession(etwData);
-        if (b == FALSE)
+        if (KernelExecuteComplete(KernelExecute, &requests[i]) == FALSE)
         {
-            //
-            // We have no idea if execution finished -- block forever
-            //
-            printf("[-] Failed to parse ETW trace\n");
-            Sleep(INFINITE);
-            return b;
+            printf("[-] Write to 0x%.16p is overdue\n",
+                   Operations[i].KernelAddress);
+            if (groups[i / XM_CONTEXTS_PER_ALLOC].KernelAlloc != NULL)
+            {
+                KernelAbandon(groups[i / XM_CONTEXTS_PER_ALLOC].KernelAlloc);
+                groups[i / XM_CONTEXTS_PER_ALLOC].KernelAlloc = NULL;
+            }
+            b = FALSE;
         }
     }
 
+Cleanup:
     //
-    // Free the allocation since this path either failed or completed execution
+    // Free the allocations since this path either failed or completed execution
     //
-    KernelFree(kernelAlloc);
+    for (i = 0; i < placed; i++)
+    {
+        if (groups[i].KernelAlloc != NULL)
+        {
+            KernelFree(groups[i].KernelAlloc);
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, requests);
+    HeapFree(GetProcessHeap(), 0, groups);
     return b;
 }
+
+_Success_(return != 0)
+BOOL
+CmdWriteKernelBuffer (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID KernelAddress,
+    _In_reads_bytes_(Size) PVOID Buffer,
+    _In_ ULONG Size
+    )
+{
+    XM_OPERATION operations[(CMD_MAX_WRITE_SIZE + 3) / 4];
+    PUCHAR data;
+    ULONG offset, count;
+
+    //
+    // Keep patches to a sane number of operations
+    //
+    if (Size > CMD_MAX_WRITE_SIZE)
+    {
+        printf("[-] Invalid size, r0ak can only write up to %d bytes at once\n",
+               CMD_MAX_WRITE_SIZE);
+        return FALSE;
+    }
+
+    //
+    // Use 32-bit moves for as much as possible, then a 16-bit and an 8-bit
+    // move for whatever is left, which is the fewest moves the emulator can do
+    //
+    data = (PUCHAR)Buffer;
+    count = 0;
+    offset = 0;
+    while (offset < Size)
+    {
+        operations[count].KernelAddress = (PVOID)((ULONG_PTR)KernelAddress + offset);
+        if ((Size - offset) >= sizeof(ULONG))
+        {
+            operations[count].KernelValue = *(PULONG)&data[offset];
+            operations[count].DataType = LONG_DATA;
+            operations[count].Size = sizeof(ULONG);
+        }
+        else if ((Size - offset) >= sizeof(USHORT))
+        {
+            operations[count].KernelValue = *(PUSHORT)&data[offset];
+            operations[count].DataType = WORD_DATA;
+            operations[count].Size = sizeof(USHORT);
+        }
+        else
+        {
+            operations[count].KernelValue = data[offset];
+            operations[count].DataType = BYTE_DATA;
+            operations[count].Size = sizeof(UCHAR);
+        }
+        offset += operations[count].Size;
+        count++;
+    }
+
+    //
+    // And run them all as one batch
+    //
+    return CmdpRunWrites(KernelExecute, operations, count);
+}
+
+_Success_(return != 0)
+BOOL
+CmdWriteKernelBatch (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_reads_(Count) PVOID* KernelAddresses,
+    _In_reads_(Count) PULONG KernelValues,
+    _In_ ULONG Count
+    )
+{
+    PXM_OPERATION operations;
+    ULONG i;
+    BOOL b;
+
+    //
+    // Turn each value into a 32-bit move. They may complete in any order, so
+    // callers never pass overlapping addresses.
+    //
+    operations = HeapAlloc(GetProcessHeap(), 0, Count * sizeof(*operations));
+    if (operations == NULL)
+    {
+        printf("[-] Out of memory placing writes\n");
+        return FALSE;
+    }
+    for (i = 0; i < Count; i++)
+    {
+        operations[i].KernelAddress = KernelAddresses[i];
+        operations[i].KernelValue = KernelValues[i];
+        operations[i].DataType = LONG_DATA;
+        operations[i].Size = sizeof(ULONG);
+    }
+    b = CmdpRunWrites(KernelExecute, operations, Count);
+    HeapFree(GetProcessHeap(), 0, operations);
+    return b;
+}
+
+_Success_(return != 0)
+BOOL
+CmdWriteKernel (
+    _In_ PKERNEL_EXECUTE KernelExecute,
+    _In_ PVOID KernelAddress,
+    _In_ ULONG KernelValue
+    )
+{
+    //
+    // A single write is a batch of one
+    //
+    return CmdWriteKernelBatch(KernelExecute, &KernelAddress, &KernelValue, 1);
+}
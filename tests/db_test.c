@@ -0,0 +1,87 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    db_test.c
+
+Abstract:
+
+    This module tests the symbol database that r0akdb builds out of the
+    fixture symbol store, which the Makefile writes next to this test
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0aktest.h"
+
+//
+// Identity of the fixture kernel PDB, and of the stray HAL PDB whose
+// contents don't match its directory
+//
+static const SYM_DEBUG_ID g_TestDebugId =
+{
+    { 0xE004253F, 0x894F, 0xD311, { 0x9A, 0x0C, 0x03, 0x05, 0xE8, 0x2C, 0x33, 0x01 } },
+    3
+};
+
+static const SYM_DEBUG_ID g_TestHalDebugId =
+{
+    { 0x33221100, 0x5544, 0x7766, { 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF } },
+    1
+};
+
+INT
+main (
+    VOID
+    )
+{
+    SYM_DEBUG_ID debugId;
+    ULONG rva;
+
+    if (SymDbOpen() == FALSE)
+    {
+        printf("[-] Could not open the symbol database\n");
+        g_TestFailures++;
+        return TestExit("db_test");
+    }
+
+    //
+    // The default symbols were all collected
+    //
+    TEST_CHECK(SymDbLookup((PSYM_DEBUG_ID)&g_TestDebugId, "XmMovOp", &rva));
+    TEST_CHECK_EQUAL(rva, 0x1120);
+    TEST_CHECK(SymDbLookup((PSYM_DEBUG_ID)&g_TestDebugId, "SepHSTIResultsSize", &rva));
+    TEST_CHECK_EQUAL(rva, 0x2040);
+    TEST_CHECK(SymDbLookup((PSYM_DEBUG_ID)&g_TestDebugId, "SepHSTIResultsBuffer", &rva));
+    TEST_CHECK_EQUAL(rva, 0x2048);
+    TEST_CHECK(SymDbLookup((PSYM_DEBUG_ID)&g_TestDebugId, "PopFanIrpComplete", &rva));
+    TEST_CHECK_EQUAL(rva, 0x3030);
+
+    //
+    // But nothing else, and only for the exact identity
+    //
+    TEST_CHECK(SymDbLookup((PSYM_DEBUG_ID)&g_TestDebugId, "KiSystemCall64", &rva) == FALSE);
+    debugId = g_TestDebugId;
+    debugId.Age++;
+    TEST_CHECK(SymDbLookup(&debugId, "XmMovOp", &rva) == FALSE);
+    TEST_CHECK(SymDbLookup((PSYM_DEBUG_ID)&g_TestHalDebugId, "XmMovOp", &rva) == FALSE);
+
+    //
+    // Closing it drops every symbol, and it can be opened again afterwards
+    //
+    SymDbClose();
+    TEST_CHECK(SymDbLookup((PSYM_DEBUG_ID)&g_TestDebugId, "XmMovOp", &rva) == FALSE);
+    TEST_CHECK(SymDbOpen());
+    TEST_CHECK(SymDbLookup((PSYM_DEBUG_ID)&g_TestDebugId, "XmMovOp", &rva));
+    SymDbClose();
+    return TestExit("db_test");
+}
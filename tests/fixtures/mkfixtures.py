@@ -0,0 +1,411 @@
+#!/usr/bin/env python3
+#
+# Generates the fixtures used by the portable tests: a small 64-bit DLL with
+# exports and a CodeView record, its MSF 7.00 PDB with public symbols, section
+# headers and a few type records, and a symbol store laid out for r0akdb.
+#
+# The files are checked in, so this only needs to be run again when they
+# change. The values below are what the tests expect to find.
+#
+
+import os
+import struct
+import sys
+
+GUID = bytes.fromhex("3f2504e04f8911d39a0c0305e82c3301")
+AGE = 3
+OTHER_GUID = bytes.fromhex("00112233445566778899aabbccddeeff")
+PDB_PATH = b"d:\\build\\obj\\amd64\\test.pdb"
+BLOCK_SIZE = 512
+
+#
+# Name, virtual address and size of each section, shared by the image and the
+# section headers saved in the PDB
+#
+SECTIONS = [
+    (b".text", 0x1000, 0x200, 0x60000020),
+    (b".data", 0x2000, 0x200, 0xC0000040),
+    (b"PAGE", 0x3000, 0x200, 0x60000020),
+    (b".rdata", 0x4000, 0x2000, 0x40000040),
+]
+
+#
+# Public symbols as (name, segment, offset). Segments are 1-based. The first
+# ones are also exported by the image.
+#
+PUBLICS = [
+    ("XmMovOp", 1, 0x120),
+    ("SepHSTIResultsSize", 2, 0x40),
+    ("SepHSTIResultsBuffer", 2, 0x48),
+    ("PopFanIrpComplete", 3, 0x30),
+    ("KiSystemCall64", 1, 0x180),
+    ("kisystemcall64", 1, 0x184),
+    ("BadSegment", 9, 0x10),
+] + [("RtlpFiller%04d" % i, 3, 0x100 + (i * 4)) for i in range(400)]
+
+
+def align(value, alignment):
+    return (value + alignment - 1) & ~(alignment - 1)
+
+
+def pad4(data, filler=True):
+    padding = align(len(data), 4) - len(data)
+    if filler:
+        return data + bytes(0xF0 + i for i in range(padding, 0, -1))
+    return data + b"\0" * padding
+
+
+def hash_v1(name):
+    data = name.encode()
+    value = 0
+    i = 0
+    while len(data) - i >= 4:
+        value ^= struct.unpack_from("<I", data, i)[0]
+        i += 4
+    if len(data) - i >= 2:
+        value ^= struct.unpack_from("<H", data, i)[0]
+        i += 2
+    if len(data) - i == 1:
+        value ^= data[i]
+    value |= 0x20202020
+    value ^= value >> 11
+    value ^= value >> 16
+    return value & 0xFFFFFFFF
+
+
+def numeric(value):
+    if value < 0x8000:
+        return struct.pack("<H", value)
+    if value <= 0xFFFF:
+        return struct.pack("<HH", 0x8002, value)
+    return struct.pack("<HI", 0x8004, value)
+
+
+def record(kind, data, filler=True):
+    data = pad4(struct.pack("<HH", 0, kind) + data, filler)
+    return struct.pack("<H", len(data) - 2) + data[2:]
+
+
+def member(type_index, offset, name):
+    return pad4(struct.pack("<HHI", 0x150D, 3, type_index) + numeric(offset) +
+                name + b"\0")
+
+
+def structure(count, prop, field_list, size, name):
+    return record(0x1505,
+                       struct.pack("<HHIII", count, prop, field_list, 0, 0) +
+                       numeric(size) + name + b"\0")
+
+
+def build_types():
+    records = [
+        # 0x1000: field list of _INNER
+        record(0x1203,
+                    member(0x22, 0, b"Flags") +
+                    member(0x23, 8, b"Count")),
+        # 0x1001: forward reference to _INNER
+        structure(0, 0x80, 0, 0, b"_INNER"),
+        # 0x1002: _INNER
+        structure(2, 0, 0x1000, 16, b"_INNER"),
+        # 0x1003: 64-bit pointer to _INNER
+        record(0x1002, struct.pack("<II", 0x1001, (8 << 13) | 0xC)),
+        # 0x1004: ULONG[16]
+        record(0x1503, struct.pack("<II", 0x22, 0x23) + numeric(0x40) +
+                    b"\0"),
+        # 0x1005: const _INNER
+        record(0x1001, struct.pack("<IH", 0x1001, 1)),
+        # 0x1006: continuation of the field list of _OUTER
+        record(0x1203, member(0x20, 0x8000, b"Tail")),
+        # 0x1007: field list of _OUTER
+        record(0x1203,
+                    member(0x75, 0, b"Header") +
+                    member(0x1001, 8, b"Inner") +
+                    member(0x1003, 0x18, b"Link") +
+                    member(0x1004, 0x20, b"Table") +
+                    member(0x1005, 0x60, b"Const") +
+                    struct.pack("<HHI", 0x1404, 0, 0x1006)),
+        # 0x1008: _OUTER
+        structure(6, 0, 0x1007, 0x8008, b"_OUTER"),
+    ]
+    data = b"".join(records)
+    header = struct.pack("<IIIIIHHIIiIiIiI",
+                         20040203, 56, 0x1000, 0x1000 + len(records),
+                         len(data), 0xFFFF, 0xFFFF, 4, 0x3FFFF,
+                         0, 0, 0, 0, 0, 0)
+    return header + data
+
+
+def build_gsi(records):
+    buckets = {}
+    for offset, name in records:
+        buckets.setdefault(hash_v1(name) % 4096, []).append((offset, name))
+    hash_records = b""
+    bitmap = [0] * ((4096 + 1 + 31) // 32)
+    bucket_offsets = b""
+    index = 0
+    for bucket in sorted(buckets):
+        bitmap[bucket // 32] |= 1 << (bucket % 32)
+        bucket_offsets += struct.pack("<I", index * 12)
+        for offset, name in buckets[bucket]:
+            hash_records += struct.pack("<II", offset + 1, 1)
+            index += 1
+    bitmap_data = struct.pack("<%dI" % len(bitmap), *bitmap)
+    header = struct.pack("<IIII", 0xFFFFFFFF, 0xEFFE0000 + 19990810,
+                         len(hash_records),
+                         len(bitmap_data) + len(bucket_offsets))
+    return header + hash_records + bitmap_data + bucket_offsets
+
+
+def build_symbols():
+    symbols = b""
+    records = []
+    for name, segment, offset in PUBLICS:
+        records.append((len(symbols), name))
+        symbols += record(0x110E, struct.pack("<IIH", 0, offset, segment) +
+                          name.encode() + b"\0", filler=False)
+    gsi = build_gsi(records)
+    order = sorted(range(len(records)), key=lambda i: PUBLICS[i][1:])
+    address_map = b"".join(struct.pack("<I", records[i][0]) for i in order)
+    publics = struct.pack("<IIIIHHII", len(gsi), len(address_map), 0, 0, 0, 0,
+                          0, 0) + gsi + address_map
+    return symbols, publics
+
+
+def build_section_headers():
+    headers = b""
+    for name, address, size, characteristics in SECTIONS:
+        headers += struct.pack("<8sIIIIIIHHI", name, size, address, size, 0, 0,
+                               0, 0, 0, characteristics)
+    return headers
+
+
+def build_dbi(age, publics_stream, symbols_stream, globals_stream,
+              sections_stream):
+    source_info = struct.pack("<HH", 0, 0)
+    debug_streams = [0xFFFF] * 11
+    debug_streams[5] = sections_stream
+    optional = struct.pack("<11H", *debug_streams)
+    header = struct.pack("<iIIHHHHHHiiiiiIiiHHI",
+                         -1, 19990903, age, globals_stream, 0x8E1D,
+                         publics_stream, 0, symbols_stream, 0,
+                         0, 0, 0, len(source_info), 0, 0, len(optional), 0,
+                         0, 0x8664, 0)
+    return header + source_info + optional
+
+
+def build_info(guid, age):
+    named_streams = struct.pack("<IIIII", 0, 0, 1, 0, 0)
+    return struct.pack("<III", 20000404, 0x5B53B0F0, age) + guid + named_streams
+
+
+def build_msf(streams, scatter):
+    #
+    # Blocks 0 to 2 are the super block and the two free block maps, then the
+    # streams, then the directory and the block map
+    #
+    next_block = 3
+    stream_blocks = []
+    for index, data in enumerate(streams):
+        if data is None:
+            stream_blocks.append([])
+            continue
+        count = (len(data) + BLOCK_SIZE - 1) // BLOCK_SIZE
+        blocks = list(range(next_block, next_block + count))
+        if index in scatter:
+            blocks.reverse()
+        stream_blocks.append(blocks)
+        next_block += count
+    directory = struct.pack("<I", len(streams))
+    for data in streams:
+        directory += struct.pack("<I", 0xFFFFFFFF if data is None else len(data))
+    for blocks in stream_blocks:
+        directory += struct.pack("<%dI" % len(blocks), *blocks)
+    directory_count = (len(directory) + BLOCK_SIZE - 1) // BLOCK_SIZE
+    directory_blocks = list(range(next_block, next_block + directory_count))
+    next_block += directory_count
+    block_map = next_block
+    next_block += 1
+
+    image = bytearray(next_block * BLOCK_SIZE)
+    struct.pack_into("<32sIIIIII", image, 0,
+                     b"Microsoft C/C++ MSF 7.00\r\n\x1aDS\0\0\0", BLOCK_SIZE,
+                     1, next_block, len(directory), 0, block_map)
+    free_map = bytearray(b"\xff" * BLOCK_SIZE)
+    for block in range(next_block):
+        free_map[block // 8] &= ~(1 << (block % 8)) & 0xFF
+    image[BLOCK_SIZE:2 * BLOCK_SIZE] = free_map
+    image[2 * BLOCK_SIZE:3 * BLOCK_SIZE] = b"\xff" * BLOCK_SIZE
+
+    def write(blocks, data):
+        for i, block in enumerate(blocks):
+            chunk = data[i * BLOCK_SIZE:(i + 1) * BLOCK_SIZE]
+            image[block * BLOCK_SIZE:block * BLOCK_SIZE + len(chunk)] = chunk
+
+    for blocks, data in zip(stream_blocks, streams):
+        if data is not None:
+            write(blocks, data)
+    write(directory_blocks, directory)
+    struct.pack_into("<%dI" % directory_count, image, block_map * BLOCK_SIZE,
+                     *directory_blocks)
+    return bytes(image)
+
+
+def build_pdb(guid, age):
+    symbols, publics = build_symbols()
+    empty_gsi = build_gsi([])
+    streams = [
+        b"",
+        build_info(guid, age),
+        build_types(),
+        build_dbi(age, 5, 6, 8, 7),
+        None,
+        publics,
+        symbols,
+        build_section_headers(),
+        empty_gsi,
+    ]
+
+    #
+    # Scatter the symbol records, so that gathering blocks is covered too
+    #
+    return build_msf(streams, scatter={6})
+
+
+#
+# Exports as (name, RVA), with forwarders given as a string instead
+#
+EXPORTS = [
+    ("XmMovOp", 0x1120),
+    ("SepHSTIResultsSize", 0x2040),
+    ("SepHSTIResultsBuffer", 0x2048),
+    ("PopFanIrpComplete", 0x3030),
+    ("KiSystemCall64", 0x1180),
+    ("ForwardedExport", "ntoskrnl.KeBugCheck"),
+] + [("RtlpFiller%04d" % i, 0x3100 + (i * 4)) for i in range(200)]
+ORDINAL_BASE = 10
+ORDINAL_ONLY_RVA = 0x11C0
+
+
+def build_dll():
+    rdata_rva = SECTIONS[3][1]
+    names = sorted(name for name, _ in EXPORTS)
+    rvas = dict(EXPORTS)
+
+    #
+    # Function table: one slot per export, then an unused slot, then one
+    # exported by ordinal only
+    #
+    function_count = len(names) + 2
+    offset = 40
+    functions_rva = rdata_rva + offset
+    offset += function_count * 4
+    names_rva = rdata_rva + offset
+    offset += len(names) * 4
+    ordinals_rva = rdata_rva + offset
+    offset += align(len(names) * 2, 4)
+    strings = b""
+    strings_rva = rdata_rva + offset
+    dll_name_rva = strings_rva
+    strings += b"test.dll\0"
+    name_rvas = []
+    forwarder_rvas = {}
+    for name in names:
+        name_rvas.append(strings_rva + len(strings))
+        strings += name.encode() + b"\0"
+        if isinstance(rvas[name], str):
+            forwarder_rvas[name] = strings_rva + len(strings)
+            strings += rvas[name].encode() + b"\0"
+    export_size = offset + len(strings)
+    functions = []
+    for name in names:
+        functions.append(forwarder_rvas.get(name, rvas[name]))
+    functions += [0, ORDINAL_ONLY_RVA]
+    export_data = struct.pack("<IIHHIIIIIII", 0, 0x5B53B0F0, 0, 0, dll_name_rva,
+                              ORDINAL_BASE, function_count, len(names),
+                              functions_rva, names_rva, ordinals_rva)
+    export_data += struct.pack("<%dI" % function_count, *functions)
+    export_data += struct.pack("<%dI" % len(names), *name_rvas)
+    export_data += pad4(struct.pack("<%dH" % len(names), *range(len(names))),
+                        filler=False)
+    export_data += strings
+
+    #
+    # Debug directory after the exports: a POGO entry to be skipped, then the
+    # CodeView one
+    #
+    debug_offset = align(len(export_data), 16)
+    debug_rva = rdata_rva + debug_offset
+    codeview = b"RSDS" + GUID + struct.pack("<I", AGE) + PDB_PATH + b"\0"
+    codeview_offset = debug_offset + 2 * 28
+    rdata_raw = 0xA00
+    debug_data = struct.pack("<IIHHIIII", 0, 0x5B53B0F0, 0, 0, 13, 4,
+                             rdata_rva + codeview_offset,
+                             rdata_raw + codeview_offset)
+    debug_data += struct.pack("<IIHHIIII", 0, 0x5B53B0F0, 0, 0, 2,
+                              len(codeview), rdata_rva + codeview_offset + 4,
+                              rdata_raw + codeview_offset + 4)
+    rdata = bytearray(SECTIONS[3][2])
+    rdata[0:len(export_data)] = export_data
+    rdata[debug_offset:debug_offset + len(debug_data)] = debug_data
+    rdata[codeview_offset:codeview_offset + 4] = b"POGO"
+    rdata[codeview_offset + 4:codeview_offset + 4 + len(codeview)] = codeview
+    assert codeview_offset + 4 + len(codeview) <= len(rdata)
+
+    #
+    # Headers, then each section at its raw offset
+    #
+    image_size = align(rdata_rva + len(rdata), 0x1000)
+    directories = [(0, 0)] * 16
+    directories[0] = (rdata_rva, export_size)
+    directories[6] = (debug_rva, len(debug_data))
+    image = bytearray(0xA00 + len(rdata))
+    struct.pack_into("<H58xI", image, 0, 0x5A4D, 0x80)
+    struct.pack_into("<IHHIIIHH", image, 0x80, 0x4550, 0x8664, len(SECTIONS),
+                     0x5B53B0F0, 0, 0, 240, 0x2022)
+    optional = struct.pack("<HBBIIIIIQIIHHHHHHIIIIHHQQQQII", 0x20B, 14, 0,
+                           0x200, 0xA00, 0, 0, 0x1000, 0x140000000, 0x1000,
+                           0x200, 10, 0, 10, 0, 10, 0, 0, image_size, 0x400, 0, 1,
+                           0x160, 0x40000, 0x1000, 0x100000, 0x1000, 0, 16)
+    optional += b"".join(struct.pack("<II", *d) for d in directories)
+    image[0x98:0x98 + len(optional)] = optional
+    raw = 0x400
+    for i, (name, address, size, characteristics) in enumerate(SECTIONS):
+        struct.pack_into("<8sIIIIIIHHI", image, 0x188 + i * 40, name, size,
+                         address, align(size, 0x200), raw, 0, 0, 0, 0,
+                         characteristics)
+        raw += align(size, 0x200)
+    image[0xA00:0xA00 + len(rdata)] = rdata
+    return bytes(image)
+
+
+def guid_age_directory(guid, age):
+    data1, data2, data3 = struct.unpack_from("<IHH", guid)
+    return ("%08X%04X%04X" % (data1, data2, data3) +
+            guid[8:].hex().upper() + "%X" % age)
+
+
+def write(path, data):
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def main():
+    root = os.path.dirname(os.path.abspath(__file__))
+    pdb = build_pdb(GUID, AGE)
+    write(os.path.join(root, "test.pdb"), pdb)
+    write(os.path.join(root, "test.dll"), build_dll())
+
+    #
+    # A store with the PDB under a kernel name, and one filed under the wrong
+    # GUID, which r0akdb must skip
+    #
+    write(os.path.join(root, "store", "ntkrnlmp.pdb",
+                       guid_age_directory(GUID, AGE), "ntkrnlmp.pdb"), pdb)
+    write(os.path.join(root, "store", "hal.pdb",
+                       guid_age_directory(OTHER_GUID, 1), "hal.pdb"), pdb)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,255 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    pdb_test.c
+
+Abstract:
+
+    This module tests the native PDB reader -- the MSF container, the DBI and
+    GSI streams and the TPI field walk -- against the checked-in fixture PDB
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0aktest.h"
+
+//
+// Identity of tests/fixtures/test.pdb, as generated by mkfixtures.py
+//
+static const SYM_DEBUG_ID g_TestDebugId =
+{
+    { 0xE004253F, 0x894F, 0xD311, { 0x9A, 0x0C, 0x03, 0x05, 0xE8, 0x2C, 0x33, 0x01 } },
+    3
+};
+
+typedef struct _TEST_PUBLIC
+{
+    PCCH Name;
+    BOOL Found;
+    ULONG Rva;
+} TEST_PUBLIC;
+
+static const TEST_PUBLIC g_TestPublics[] =
+{
+    { "XmMovOp", TRUE, 0x1120 },
+    { "SepHSTIResultsSize", TRUE, 0x2040 },
+    { "SepHSTIResultsBuffer", TRUE, 0x2048 },
+    { "PopFanIrpComplete", TRUE, 0x3030 },
+    //
+    // Both of these hash to the same bucket, and only differ in case
+    //
+    { "KiSystemCall64", TRUE, 0x1180 },
+    { "kisystemcall64", TRUE, 0x1184 },
+    { "RtlpFiller0000", TRUE, 0x3100 },
+    { "RtlpFiller0399", TRUE, 0x3100 + (399 * 4) },
+    //
+    // Lives in a segment that the section headers don't describe
+    //
+    { "BadSegment", FALSE, 0 },
+    { "RtlpFiller0400", FALSE, 0 },
+    { "", FALSE, 0 },
+};
+
+typedef struct _TEST_FIELD
+{
+    PCCH TypeName;
+    PCCH FieldPath;
+    BOOL Found;
+    ULONG Offset;
+    ULONG Size;
+} TEST_FIELD;
+
+static const TEST_FIELD g_TestFields[] =
+{
+    { "_OUTER", "Header", TRUE, 0, 4 },
+    { "_OUTER", "Inner", TRUE, 8, 16 },
+    { "_OUTER", "Inner.Count", TRUE, 0x10, 8 },
+    { "_OUTER", "Link", TRUE, 0x18, 8 },
+    { "_OUTER", "Table", TRUE, 0x20, 0x40 },
+    //
+    // Goes through a modifier to a forward reference
+    //
+    { "_OUTER", "Const.Flags", TRUE, 0x60, 4 },
+    //
+    // Lives in the continuation of the field list
+    //
+    { "_OUTER", "Tail", TRUE, 0x8000, 1 },
+    { "_INNER", "Count", TRUE, 8, 8 },
+    { "_OUTER", "Missing", FALSE, 0, 0 },
+    { "_OUTER", "Header.Flags", FALSE, 0, 0 },
+    { "_OUTER", "Inner.Missing", FALSE, 0, 0 },
+    { "_MISSING", "Header", FALSE, 0, 0 },
+};
+
+static
+VOID
+TestCountPublic (
+    _In_ PVOID Context,
+    _In_ PCCH SymbolName,
+    _In_ ULONG Rva
+    )
+{
+    UNREFERENCED_PARAMETER(SymbolName);
+    UNREFERENCED_PARAMETER(Rva);
+    (*(PULONG)Context)++;
+}
+
+static
+BOOL
+TestCopyTruncated (
+    _In_ PCCH SourcePath,
+    _In_ PCCH TargetPath,
+    _In_ ULONG Size
+    )
+{
+    CHAR buffer[4096];
+    FILE* source;
+    FILE* target;
+    size_t count;
+    BOOL result;
+
+    source = fopen(SourcePath, "rb");
+    if (source == NULL)
+    {
+        return FALSE;
+    }
+    target = fopen(TargetPath, "wb");
+    if (target == NULL)
+    {
+        fclose(source);
+        return FALSE;
+    }
+
+    result = TRUE;
+    while (Size != 0)
+    {
+        count = fread(buffer, 1, min(Size, sizeof(buffer)), source);
+        if ((count == 0) || (fwrite(buffer, 1, count, target) != count))
+        {
+            result = FALSE;
+            break;
+        }
+        Size -= (ULONG)count;
+    }
+
+    fclose(target);
+    fclose(source);
+    return result;
+}
+
+INT
+main (
+    VOID
+    )
+{
+    PPDB_FILE pdb;
+    SYM_DEBUG_ID debugId;
+    CHAR pdbPath[MAX_PATH];
+    ULONG i, rva, offset, size, count;
+    BOOL found;
+
+    //
+    // The identity has to match exactly
+    //
+    debugId = g_TestDebugId;
+    debugId.Age++;
+    TEST_CHECK(PdbOpen(&pdb, TEST_FIXTURES "test.pdb", &debugId) == FALSE);
+    debugId = g_TestDebugId;
+    debugId.Guid.Data4[7] ^= 1;
+    TEST_CHECK(PdbOpen(&pdb, TEST_FIXTURES "test.pdb", &debugId) == FALSE);
+
+    //
+    // Truncated files must be rejected, not read past
+    //
+    for (size = 0; size < 25088; size += 512)
+    {
+        PPDB_FILE truncatedPdb;
+
+        TEST_CHECK(TestCopyTruncated(TEST_FIXTURES "test.pdb", TEST_OUTPUT "truncated.pdb", size));
+        if (PdbOpen(&truncatedPdb, TEST_OUTPUT "truncated.pdb", (PSYM_DEBUG_ID)&g_TestDebugId) != FALSE)
+        {
+            printf("[-] PDB truncated to %u bytes was accepted\n", size);
+            g_TestFailures++;
+            PdbClose(truncatedPdb);
+        }
+    }
+    remove(TEST_OUTPUT "truncated.pdb");
+
+    //
+    // The real one opens with its own identity
+    //
+    if (PdbOpen(&pdb, TEST_FIXTURES "test.pdb", (PSYM_DEBUG_ID)&g_TestDebugId) == FALSE)
+    {
+        printf("[-] Could not open the fixture PDB\n");
+        g_TestFailures++;
+        return TestExit("pdb_test");
+    }
+
+    for (i = 0; i < _ARRAYSIZE(g_TestPublics); i++)
+    {
+        rva = 0;
+        found = PdbLookupPublic(pdb, g_TestPublics[i].Name, &rva);
+        if (found != g_TestPublics[i].Found)
+        {
+            printf("[-] %s: lookup returned %d\n", g_TestPublics[i].Name, found);
+            g_TestFailures++;
+        }
+        else if (found != FALSE)
+        {
+            TEST_CHECK_EQUAL(rva, g_TestPublics[i].Rva);
+        }
+    }
+
+    //
+    // Every public but the one in the bogus segment is enumerated
+    //
+    count = 0;
+    PdbEnumPublics(pdb, TestCountPublic, &count);
+    TEST_CHECK_EQUAL(count, 406);
+
+    for (i = 0; i < _ARRAYSIZE(g_TestFields); i++)
+    {
+        offset = size = 0;
+        found = PdbLookupField(pdb,
+                               g_TestFields[i].TypeName,
+                               g_TestFields[i].FieldPath,
+                               &offset,
+                               &size);
+        if (found != g_TestFields[i].Found)
+        {
+            printf("[-] %s.%s: lookup returned %d\n",
+                   g_TestFields[i].TypeName,
+                   g_TestFields[i].FieldPath,
+                   found);
+            g_TestFailures++;
+        }
+        else if (found != FALSE)
+        {
+            TEST_CHECK_EQUAL(offset, g_TestFields[i].Offset);
+            TEST_CHECK_EQUAL(size, g_TestFields[i].Size);
+        }
+    }
+    PdbClose(pdb);
+
+    //
+    // Symbol stores are probed along the symbol path, and only the copy with
+    // the right identity is returned
+    //
+    setenv("_NT_SYMBOL_PATH", "srv*" TEST_FIXTURES "store*https://msdl.microsoft.com/download/symbols", 1);
+    TEST_CHECK(PdbLocate("ntkrnlmp.pdb", (PSYM_DEBUG_ID)&g_TestDebugId, pdbPath, sizeof(pdbPath)));
+    TEST_CHECK(strstr(pdbPath, "E004253F894FD3119A0C0305E82C33013") != NULL);
+    TEST_CHECK(PdbLocate("hal.pdb", (PSYM_DEBUG_ID)&g_TestDebugId, pdbPath, sizeof(pdbPath)) == FALSE);
+    unsetenv("_NT_SYMBOL_PATH");
+
+    return TestExit("pdb_test");
+}
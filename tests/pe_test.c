@@ -0,0 +1,214 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    pe_test.c
+
+Abstract:
+
+    This module tests the PE image reader -- section mapping, the CodeView
+    debug record and the export directory -- against the checked-in fixture
+    image, and cross-checks its exports against the fixture PDB
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0aktest.h"
+
+//
+// Identity of tests/fixtures/test.dll, as generated by mkfixtures.py
+//
+static const SYM_DEBUG_ID g_TestDebugId =
+{
+    { 0xE004253F, 0x894F, 0xD311, { 0x9A, 0x0C, 0x03, 0x05, 0xE8, 0x2C, 0x33, 0x01 } },
+    3
+};
+
+typedef struct _TEST_EXPORT
+{
+    PCCH Name;
+    BOOL Found;
+    ULONG Rva;
+} TEST_EXPORT;
+
+static const TEST_EXPORT g_TestExports[] =
+{
+    { "XmMovOp", TRUE, 0x1120 },
+    { "SepHSTIResultsSize", TRUE, 0x2040 },
+    { "SepHSTIResultsBuffer", TRUE, 0x2048 },
+    { "PopFanIrpComplete", TRUE, 0x3030 },
+    { "KiSystemCall64", TRUE, 0x1180 },
+    { "RtlpFiller0000", TRUE, 0x3100 },
+    { "RtlpFiller0199", TRUE, 0x3100 + (199 * 4) },
+    //
+    // Forwarders point at a string in the export directory, not at code
+    //
+    { "ForwardedExport", FALSE, 0 },
+    //
+    // Names are matched exactly, and binary searched
+    //
+    { "kisystemcall64", FALSE, 0 },
+    { "RtlpFiller0200", FALSE, 0 },
+    { "AAAA", FALSE, 0 },
+    { "zzzz", FALSE, 0 },
+};
+
+typedef struct _TEST_ORDINAL
+{
+    ULONG Ordinal;
+    BOOL Found;
+    ULONG Rva;
+} TEST_ORDINAL;
+
+static const TEST_ORDINAL g_TestOrdinals[] =
+{
+    //
+    // The ordinal base is 10, and ForwardedExport sorts first
+    //
+    { 9, FALSE, 0 },
+    { 10, FALSE, 0 },
+    { 11, TRUE, 0x1180 },
+    //
+    // An unused slot, followed by an export with no name
+    //
+    { 216, FALSE, 0 },
+    { 217, TRUE, 0x11C0 },
+    { 218, FALSE, 0 },
+    { MAXULONG, FALSE, 0 },
+};
+
+typedef struct _TEST_ENUM_CONTEXT
+{
+    ULONG Count;
+    PPDB_FILE Pdb;
+    ULONG Mismatches;
+} TEST_ENUM_CONTEXT, *PTEST_ENUM_CONTEXT;
+
+static
+VOID
+TestCheckExport (
+    _In_ PVOID Context,
+    _In_ PCCH SymbolName,
+    _In_ ULONG Rva
+    )
+{
+    PTEST_ENUM_CONTEXT context = Context;
+    ULONG pdbRva;
+
+    context->Count++;
+
+    //
+    // Every export the image resolves has to agree with the PDB
+    //
+    if ((context->Pdb != NULL) &&
+        ((PdbLookupPublic(context->Pdb, SymbolName, &pdbRva) == FALSE) ||
+         (pdbRva != Rva)))
+    {
+        printf("[-] %s: export 0x%x does not match the PDB\n", SymbolName, Rva);
+        context->Mismatches++;
+    }
+}
+
+INT
+main (
+    VOID
+    )
+{
+    PPE_IMAGE image;
+    PPDB_FILE pdb;
+    SYM_DEBUG_ID debugId;
+    CHAR pdbName[MAX_PATH];
+    TEST_ENUM_CONTEXT context;
+    PIMAGE_DATA_DIRECTORY directory;
+    ULONG i, rva, fileOffset;
+    BOOL found;
+
+    TEST_CHECK(PeOpen(&image, TEST_FIXTURES "missing.dll") == FALSE);
+    TEST_CHECK(PeOpen(&image, TEST_FIXTURES "test.pdb") == FALSE);
+    if (PeOpen(&image, TEST_FIXTURES "test.dll") == FALSE)
+    {
+        printf("[-] Could not open the fixture image\n");
+        g_TestFailures++;
+        return TestExit("pe_test");
+    }
+
+    TEST_CHECK_EQUAL(PeGetImageSize(image), 0x6000);
+
+    //
+    // Sections map back to their raw data, and nothing past them does
+    //
+    TEST_CHECK(PeRvaToFileOffset(image, 0x1120, &fileOffset));
+    TEST_CHECK(PeRvaToFileOffset(image, 0x7000, &fileOffset) == FALSE);
+    TEST_CHECK(PeMapRva(image, 0x4000, 0x2000) != NULL);
+    TEST_CHECK(PeMapRva(image, 0x4000, 0x2001) == NULL);
+    TEST_CHECK(PeMapRva(image, 0x5FFF, MAXULONG) == NULL);
+
+    directory = PeGetDirectory(image, IMAGE_DIRECTORY_ENTRY_EXPORT);
+    TEST_CHECK((directory != NULL) && (directory->VirtualAddress != 0));
+    TEST_CHECK(PeGetDirectory(image, IMAGE_NUMBEROF_DIRECTORY_ENTRIES) == NULL);
+
+    //
+    // The POGO entry ahead of the CodeView one is skipped
+    //
+    TEST_CHECK(PeGetDebugId(image, &debugId, pdbName, sizeof(pdbName)));
+    TEST_CHECK(memcmp(&debugId, &g_TestDebugId, sizeof(debugId)) == 0);
+    TEST_CHECK(strcmp(pdbName, "test.pdb") == 0);
+    TEST_CHECK(PeGetDebugId(image, &debugId, pdbName, 4) == FALSE);
+
+    for (i = 0; i < _ARRAYSIZE(g_TestExports); i++)
+    {
+        rva = 0;
+        found = PeLookupExport(image, g_TestExports[i].Name, &rva);
+        if (found != g_TestExports[i].Found)
+        {
+            printf("[-] %s: lookup returned %d\n", g_TestExports[i].Name, found);
+            g_TestFailures++;
+        }
+        else if (found != FALSE)
+        {
+            TEST_CHECK_EQUAL(rva, g_TestExports[i].Rva);
+        }
+    }
+
+    for (i = 0; i < _ARRAYSIZE(g_TestOrdinals); i++)
+    {
+        rva = 0;
+        found = PeLookupExportOrdinal(image, g_TestOrdinals[i].Ordinal, &rva);
+        if (found != g_TestOrdinals[i].Found)
+        {
+            printf("[-] #%u: lookup returned %d\n", g_TestOrdinals[i].Ordinal, found);
+            g_TestFailures++;
+        }
+        else if (found != FALSE)
+        {
+            TEST_CHECK_EQUAL(rva, g_TestOrdinals[i].Rva);
+        }
+    }
+
+    //
+    // Named exports, minus the forwarder, all match the PDB publics
+    //
+    pdb = NULL;
+    TEST_CHECK(PdbOpen(&pdb, TEST_FIXTURES "test.pdb", &debugId));
+    RtlZeroMemory(&context, sizeof(context));
+    context.Pdb = pdb;
+    PeEnumExports(image, TestCheckExport, &context);
+    TEST_CHECK_EQUAL(context.Count, 205);
+    TEST_CHECK_EQUAL(context.Mismatches, 0);
+    if (pdb != NULL)
+    {
+        PdbClose(pdb);
+    }
+
+    PeClose(image);
+    return TestExit("pe_test");
+}
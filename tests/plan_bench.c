@@ -0,0 +1,86 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    plan_bench.c
+
+Abstract:
+
+    This module benchmarks the planning of HSTI reads for batches of random
+    kernel ranges, and reports how many reads each batch needs
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0aktest.h"
+
+#define TEST_BASE                   0xFFFFF80000000000ULL
+#define TEST_PLANNED_RANGES         (4 * 1000 * 1000)
+
+INT
+main (
+    VOID
+    )
+{
+    static const ULONG counts[] = { 4, 16, 64, 256, 1024, 4096 };
+    static const ULONG thresholds[] = { 0, 0x1000 };
+    PCMD_READ_RANGE ranges;
+    PCMD_READ_PLAN plans;
+    PULONG order;
+    ULONGLONG start, elapsed;
+    ULONG i, j, k, iterations, planCount;
+
+    for (i = 0; i < _ARRAYSIZE(counts); i++)
+    {
+        ranges = HeapAlloc(GetProcessHeap(), 0, counts[i] * sizeof(*ranges));
+        plans = HeapAlloc(GetProcessHeap(), 0, counts[i] * sizeof(*plans));
+        order = HeapAlloc(GetProcessHeap(), 0, counts[i] * sizeof(*order));
+        if ((ranges == NULL) || (plans == NULL) || (order == NULL))
+        {
+            printf("[-] Out of memory\n");
+            return 1;
+        }
+
+        //
+        // Small ranges, such as structure fields, spread over 16MB
+        //
+        for (j = 0; j < counts[i]; j++)
+        {
+            ranges[j].KernelAddress =
+                (PVOID)(TEST_BASE + (TestRandom() % (16 * 1024 * 1024)));
+            ranges[j].Size = 8 << (TestRandom() % 4);
+            ranges[j].Buffer = NULL;
+        }
+
+        iterations = TEST_PLANNED_RANGES / counts[i];
+        for (j = 0; j < _ARRAYSIZE(thresholds); j++)
+        {
+            planCount = 0;
+            start = TestNow();
+            for (k = 0; k < iterations; k++)
+            {
+                planCount = CmdPlanReads(ranges, counts[i], thresholds[j], order, plans);
+            }
+            elapsed = TestNow() - start;
+            printf("[+] %5u ranges, gap 0x%04x: %6u reads, %10.2f us/plan\n",
+                   counts[i],
+                   thresholds[j],
+                   planCount,
+                   (double)elapsed / iterations / 1000);
+        }
+
+        HeapFree(GetProcessHeap(), 0, order);
+        HeapFree(GetProcessHeap(), 0, plans);
+        HeapFree(GetProcessHeap(), 0, ranges);
+    }
+    return 0;
+}
@@ -0,0 +1,297 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    plan_test.c
+
+Abstract:
+
+    This module tests how kernel ranges are merged into HSTI reads: the gap
+    threshold, the rule against reading whole pages that no range touches,
+    the cap on the size of a read, and overlapping or unsorted input
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0aktest.h"
+
+//
+// Ranges and reads are given as offsets from a page-aligned kernel address
+//
+#define TEST_BASE                   0xFFFFF80000000000ULL
+#define TEST_PAGE_SIZE              4096
+#define TEST_MAX_RANGES             8
+
+typedef struct _TEST_PLAN_CASE
+{
+    PCCH Name;
+    ULONG GapThreshold;
+    ULONG RangeCount;
+    struct
+    {
+        ULONG Offset;
+        ULONG Size;
+    } Ranges[TEST_MAX_RANGES];
+    ULONG Order[TEST_MAX_RANGES];
+    ULONG PlanCount;
+    struct
+    {
+        ULONG Offset;
+        ULONG Size;
+        ULONG FirstRange;
+        ULONG RangeCount;
+    } Plans[TEST_MAX_RANGES];
+} TEST_PLAN_CASE;
+
+static const TEST_PLAN_CASE g_TestCases[] =
+{
+    {
+        "empty", 0x100,
+        0, { { 0 } }, { 0 },
+        0, { { 0 } }
+    },
+    {
+        "single range", 0x100,
+        1, { { 0x10, 8 } }, { 0 },
+        1, { { 0x10, 8, 0, 1 } }
+    },
+    {
+        "adjacent ranges with no gap allowed", 0,
+        2, { { 0, 8 }, { 8, 8 } }, { 0, 1 },
+        1, { { 0, 0x10, 0, 2 } }
+    },
+    {
+        "gap one byte over no gap allowed", 0,
+        2, { { 0, 8 }, { 9, 8 } }, { 0, 1 },
+        2, { { 0, 8, 0, 1 }, { 9, 8, 1, 1 } }
+    },
+    {
+        "gap at the threshold", 0x100,
+        2, { { 0, 8 }, { 0x108, 8 } }, { 0, 1 },
+        1, { { 0, 0x110, 0, 2 } }
+    },
+    {
+        "gap one byte over the threshold", 0x100,
+        2, { { 0, 8 }, { 0x109, 8 } }, { 0, 1 },
+        2, { { 0, 8, 0, 1 }, { 0x109, 8, 1, 1 } }
+    },
+    {
+        "gap across into the next page", 0x10000,
+        2, { { 0x10, 8 }, { 0x1FF8, 8 } }, { 0, 1 },
+        1, { { 0x10, 0x1FF0, 0, 2 } }
+    },
+    {
+        "gap covering a whole untouched page", 0x10000,
+        2, { { 0xFF8, 8 }, { 0x2000, 8 } }, { 0, 1 },
+        2, { { 0xFF8, 8, 0, 1 }, { 0x2000, 8, 1, 1 } }
+    },
+    {
+        "read ending on a page boundary", 0x10000,
+        3, { { 0xF00, 0x100 }, { 0x1800, 8 }, { 0x3000, 8 } }, { 0, 1, 2 },
+        2, { { 0xF00, 0x908, 0, 2 }, { 0x3000, 8, 2, 1 } }
+    },
+    {
+        "merged read exactly at the cap", 0x100000,
+        3, { { 0, 0x80000 }, { 0x80000, 0x80000 }, { 0x100000, 8 } }, { 0, 1, 2 },
+        2, { { 0, 0x100000, 0, 2 }, { 0x100000, 8, 2, 1 } }
+    },
+    {
+        "merged read one byte over the cap", 0x100000,
+        2, { { 0, 0x80000 }, { 0x80000, 0x80001 } }, { 0, 1 },
+        2, { { 0, 0x80000, 0, 1 }, { 0x80000, 0x80001, 1, 1 } }
+    },
+    {
+        "range contained in one at the cap", 0,
+        2, { { 0, 0x100000 }, { 0x10, 8 } }, { 0, 1 },
+        1, { { 0, 0x100000, 0, 2 } }
+    },
+    {
+        "range larger than the cap", 0x100000,
+        2, { { 0, 0x200000 }, { 0x200000, 8 } }, { 0, 1 },
+        2, { { 0, 0x200000, 0, 1 }, { 0x200000, 8, 1, 1 } }
+    },
+    {
+        "overlapping ranges", 0,
+        2, { { 0, 0x100 }, { 0x80, 0x100 } }, { 0, 1 },
+        1, { { 0, 0x180, 0, 2 } }
+    },
+    {
+        "contained ranges don't shrink the read", 8,
+        4, { { 0, 0x1000 }, { 0x10, 0x10 }, { 0x800, 0x20 }, { 0x1008, 8 } }, { 0, 1, 2, 3 },
+        1, { { 0, 0x1010, 0, 4 } }
+    },
+    {
+        "unsorted ranges", 0x1000,
+        3, { { 0x3000, 8 }, { 0, 8 }, { 0x1000, 8 } }, { 1, 2, 0 },
+        2, { { 0, 0x1008, 0, 2 }, { 0x3000, 8, 2, 1 } }
+    },
+    {
+        "reverse sorted ranges", 0,
+        4, { { 0x30, 0x10 }, { 0x20, 0x10 }, { 0x10, 0x10 }, { 0, 0x10 } }, { 3, 2, 1, 0 },
+        1, { { 0, 0x40, 0, 4 } }
+    },
+    {
+        "duplicate ranges keep their order", 0,
+        3, { { 0x20, 8 }, { 0x20, 8 }, { 0, 4 } }, { 2, 0, 1 },
+        2, { { 0, 4, 0, 1 }, { 0x20, 8, 1, 2 } }
+    },
+};
+
+static
+VOID
+TestPlanCase (
+    _In_ const TEST_PLAN_CASE* Case
+    )
+{
+    CMD_READ_RANGE ranges[TEST_MAX_RANGES];
+    CMD_READ_PLAN plans[TEST_MAX_RANGES];
+    ULONG order[TEST_MAX_RANGES];
+    ULONG i, planCount;
+    BOOL match;
+
+    for (i = 0; i < Case->RangeCount; i++)
+    {
+        ranges[i].KernelAddress = (PVOID)(TEST_BASE + Case->Ranges[i].Offset);
+        ranges[i].Size = Case->Ranges[i].Size;
+        ranges[i].Buffer = NULL;
+    }
+    planCount = CmdPlanReads(ranges, Case->RangeCount, Case->GapThreshold, order, plans);
+
+    match = (planCount == Case->PlanCount);
+    for (i = 0; (match != FALSE) && (i < Case->RangeCount); i++)
+    {
+        match = (order[i] == Case->Order[i]);
+    }
+    for (i = 0; (match != FALSE) && (i < planCount); i++)
+    {
+        match = (plans[i].Start == (TEST_BASE + Case->Plans[i].Offset)) &&
+                (plans[i].Size == Case->Plans[i].Size) &&
+                (plans[i].FirstRange == Case->Plans[i].FirstRange) &&
+                (plans[i].RangeCount == Case->Plans[i].RangeCount);
+    }
+    if (match == FALSE)
+    {
+        printf("[-] %s: got %u reads\n", Case->Name, planCount);
+        for (i = 0; i < planCount; i++)
+        {
+            printf("    +0x%llx size 0x%x ranges %u-%u\n",
+                   (unsigned long long)(plans[i].Start - TEST_BASE),
+                   plans[i].Size,
+                   plans[i].FirstRange,
+                   plans[i].FirstRange + plans[i].RangeCount - 1);
+        }
+        g_TestFailures++;
+    }
+}
+
+static
+VOID
+TestPlanInvariants (
+    _In_ ULONG Count,
+    _In_ ULONG GapThreshold
+    )
+{
+    PCMD_READ_RANGE ranges;
+    PCMD_READ_PLAN plans;
+    PULONG order;
+    PUCHAR touched;
+    ULONG_PTR start, end, page;
+    ULONG i, j, planCount, covered;
+
+    ranges = HeapAlloc(GetProcessHeap(), 0, Count * sizeof(*ranges));
+    plans = HeapAlloc(GetProcessHeap(), 0, Count * sizeof(*plans));
+    order = HeapAlloc(GetProcessHeap(), 0, Count * sizeof(*order));
+    touched = HeapAlloc(GetProcessHeap(), 0, (CMD_READ_CHUNK_SIZE * 4) / TEST_PAGE_SIZE);
+
+    //
+    // Random ranges, mostly small, over a few megabytes
+    //
+    for (i = 0; i < Count; i++)
+    {
+        ranges[i].KernelAddress =
+            (PVOID)(TEST_BASE + (TestRandom() % (CMD_READ_CHUNK_SIZE * 3)));
+        ranges[i].Size = ((TestRandom() % 16) == 0) ?
+                         (TestRandom() % (CMD_READ_CHUNK_SIZE / 2)) + 1 :
+                         (TestRandom() % 0x100) + 1;
+        ranges[i].Buffer = NULL;
+    }
+    planCount = CmdPlanReads(ranges, Count, GapThreshold, order, plans);
+
+    covered = 0;
+    for (i = 0; i < planCount; i++)
+    {
+        //
+        // Reads cover their ranges in address order, and only go over the
+        // cap to fit a single range that is larger than it
+        //
+        RtlZeroMemory(touched, (CMD_READ_CHUNK_SIZE * 4) / TEST_PAGE_SIZE);
+        for (j = 0; j < plans[i].RangeCount; j++)
+        {
+            start = (ULONG_PTR)ranges[order[plans[i].FirstRange + j]].KernelAddress;
+            end = start + ranges[order[plans[i].FirstRange + j]].Size;
+            TEST_CHECK((start >= plans[i].Start) &&
+                       (end <= (plans[i].Start + plans[i].Size)));
+            if ((plans[i].FirstRange + j) != 0)
+            {
+                TEST_CHECK((ULONG_PTR)ranges[order[plans[i].FirstRange + j - 1]].KernelAddress <= start);
+            }
+            for (page = start / TEST_PAGE_SIZE; page <= ((end - 1) / TEST_PAGE_SIZE); page++)
+            {
+                touched[page - (TEST_BASE / TEST_PAGE_SIZE)] = TRUE;
+            }
+        }
+        TEST_CHECK((plans[i].Size <= CMD_READ_CHUNK_SIZE) || (plans[i].RangeCount == 1));
+        TEST_CHECK(plans[i].FirstRange == covered);
+        covered += plans[i].RangeCount;
+
+        //
+        // And never read a page that none of their ranges touch
+        //
+        for (page = plans[i].Start / TEST_PAGE_SIZE;
+             page <= ((plans[i].Start + plans[i].Size - 1) / TEST_PAGE_SIZE);
+             page++)
+        {
+            if (touched[page - (TEST_BASE / TEST_PAGE_SIZE)] == FALSE)
+            {
+                printf("[-] read %u covers an untouched page\n", i);
+                g_TestFailures++;
+                break;
+            }
+        }
+    }
+    TEST_CHECK_EQUAL(covered, Count);
+
+    HeapFree(GetProcessHeap(), 0, touched);
+    HeapFree(GetProcessHeap(), 0, order);
+    HeapFree(GetProcessHeap(), 0, plans);
+    HeapFree(GetProcessHeap(), 0, ranges);
+}
+
+INT
+main (
+    VOID
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < _ARRAYSIZE(g_TestCases); i++)
+    {
+        TestPlanCase(&g_TestCases[i]);
+    }
+
+    for (i = 0; i < 200; i++)
+    {
+        TestPlanInvariants(1 + (TestRandom() % 64), TestRandom() % 0x4000);
+    }
+    TestPlanInvariants(2000, 0x1000);
+    return TestExit("plan_test");
+}
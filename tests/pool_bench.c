@@ -0,0 +1,177 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    pool_bench.c
+
+Abstract:
+
+    This module benchmarks the big pool scan routines, and the tracking of new
+    allocations, over synthetic snapshots of 10K to 1M entries
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0aktest.h"
+
+//
+// Internal to r0akpool.c, with the scan state left opaque
+//
+typedef VOID
+(*PTEST_SCAN_ROUTINE)(
+    _In_reads_(Count) PSYSTEM_BIGPOOL_ENTRY Entries,
+    _In_ ULONG Count,
+    _Inout_ PVOID Scan
+    );
+
+extern PTEST_SCAN_ROUTINE g_PoolScanRoutine;
+VOID PoolpScanScalar(PSYSTEM_BIGPOOL_ENTRY Entries, ULONG Count, PVOID Scan);
+VOID PoolpScanSse2(PSYSTEM_BIGPOOL_ENTRY Entries, ULONG Count, PVOID Scan);
+VOID PoolpScanAvx2(PSYSTEM_BIGPOOL_ENTRY Entries, ULONG Count, PVOID Scan);
+
+#define TEST_TAG                    'TsoP'
+#define TEST_SCANNED_ENTRIES        (64 * 1000 * 1000)
+
+static
+PSYSTEM_BIGPOOL_INFORMATION
+TestAllocSnapshot (
+    _In_ ULONG Count
+    )
+{
+    PSYSTEM_BIGPOOL_INFORMATION info;
+    ULONG i;
+
+    info = HeapAlloc(GetProcessHeap(),
+                     0,
+                     FIELD_OFFSET(SYSTEM_BIGPOOL_INFORMATION, AllocatedInfo) +
+                     (Count * sizeof(SYSTEM_BIGPOOL_ENTRY)));
+    if (info == NULL)
+    {
+        printf("[-] Out of memory\n");
+        exit(1);
+    }
+
+    //
+    // About one entry in a thousand carries our tag, and the only one with
+    // the size we look for is the very last, so every scan sees the whole
+    // table
+    //
+    info->Count = Count;
+    for (i = 0; i < Count; i++)
+    {
+        info->AllocatedInfo[i].VirtualAddress =
+            (PVOID)(0xFFFF800000000000ULL + ((ULONGLONG)i << 12));
+        info->AllocatedInfo[i].SizeInBytes = 0x1000;
+        info->AllocatedInfo[i].TagUlong =
+            ((TestRandom() % 1000) == 0) ? TEST_TAG : (TEST_TAG ^ (1 + (i & 0xFF)));
+    }
+    info->AllocatedInfo[Count - 1].TagUlong = TEST_TAG;
+    info->AllocatedInfo[Count - 1].SizeInBytes = 0x2000;
+    return info;
+}
+
+INT
+main (
+    VOID
+    )
+{
+    static const ULONG counts[] = { 10000, 100000, 1000000 };
+    static const struct
+    {
+        PCCH Name;
+        PTEST_SCAN_ROUTINE Routine;
+    } routines[] =
+    {
+        { "scalar", PoolpScanScalar },
+        { "sse2", PoolpScanSse2 },
+        { "avx2", PoolpScanAvx2 },
+    };
+    PSYSTEM_BIGPOOL_INFORMATION info;
+    PSYSTEM_BIGPOOL_ENTRY entry;
+    SYSTEM_BIGPOOL_ENTRY saved;
+    ULONGLONG sizes[1];
+    PVOID addresses[1];
+    ULONGLONG start, elapsed;
+    ULONG i, j, k, iterations;
+
+    sizes[0] = 0x2000;
+    for (i = 0; i < _ARRAYSIZE(counts); i++)
+    {
+        info = TestAllocSnapshot(counts[i]);
+        iterations = TEST_SCANNED_ENTRIES / counts[i];
+
+        for (j = 0; j < _ARRAYSIZE(routines); j++)
+        {
+            if ((routines[j].Routine == PoolpScanAvx2) &&
+                (__builtin_cpu_supports("avx2") == FALSE))
+            {
+                continue;
+            }
+
+            g_PoolScanRoutine = routines[j].Routine;
+            start = TestNow();
+            for (k = 0; k < iterations; k++)
+            {
+                PoolFindAllocations(info, TEST_TAG, sizes, 1, addresses);
+            }
+            elapsed = TestNow() - start;
+            printf("[+] %7u entries, %-6s scan: %8.1f us/scan, %5.2f ns/entry\n",
+                   counts[i],
+                   routines[j].Name,
+                   (double)elapsed / iterations / 1000,
+                   (double)elapsed / iterations / counts[i]);
+        }
+
+        //
+        // A new baseline has to see, and hash, every allocation under the tag
+        //
+        g_PoolScanRoutine = NULL;
+        PoolTeardown();
+        start = TestNow();
+        for (k = 0; k < iterations; k++)
+        {
+            PoolFindNewAllocations(info, TEST_TAG, NULL, 0, NULL);
+        }
+        elapsed = TestNow() - start;
+        printf("[+] %7u entries, baseline:    %8.1f us/scan, %5.2f ns/entry\n",
+               counts[i],
+               (double)elapsed / iterations / 1000,
+               (double)elapsed / iterations / counts[i]);
+
+        //
+        // While looking up a new allocation stops as soon as it's found, like
+        // a plain scan, and only hashes the tag hits before it. Place it at a
+        // random position each time, and forget it afterwards like a drained
+        // buffer would be.
+        //
+        start = TestNow();
+        for (k = 0; k < iterations; k++)
+        {
+            entry = &info->AllocatedInfo[TestRandom() % counts[i]];
+            saved = *entry;
+            entry->VirtualAddress = (PVOID)(0xFFFF900000000000ULL + ((ULONGLONG)k << 12));
+            entry->SizeInBytes = 0x2000;
+            entry->TagUlong = TEST_TAG;
+            PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses);
+            PoolForgetAllocation(addresses[0]);
+            *entry = saved;
+        }
+        elapsed = TestNow() - start;
+        printf("[+] %7u entries, new lookup:  %8.1f us/scan, %5.2f ns/entry\n",
+               counts[i],
+               (double)elapsed / iterations / 1000,
+               (double)elapsed / iterations / counts[i]);
+        PoolTeardown();
+        HeapFree(GetProcessHeap(), 0, info);
+    }
+    return 0;
+}
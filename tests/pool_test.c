@@ -0,0 +1,327 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    pool_test.c
+
+Abstract:
+
+    This module tests the big pool scanner, checking that the scalar, SSE2 and
+    AVX2 scan routines agree with a reference scan on random snapshots, and
+    that new allocations are tracked correctly across snapshots
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "r0aktest.h"
+
+//
+// Internal to r0akpool.c, with the scan state left opaque
+//
+typedef VOID
+(*PTEST_SCAN_ROUTINE)(
+    _In_reads_(Count) PSYSTEM_BIGPOOL_ENTRY Entries,
+    _In_ ULONG Count,
+    _Inout_ PVOID Scan
+    );
+
+extern PTEST_SCAN_ROUTINE g_PoolScanRoutine;
+VOID PoolpScanScalar(PSYSTEM_BIGPOOL_ENTRY Entries, ULONG Count, PVOID Scan);
+VOID PoolpScanSse2(PSYSTEM_BIGPOOL_ENTRY Entries, ULONG Count, PVOID Scan);
+VOID PoolpScanAvx2(PSYSTEM_BIGPOOL_ENTRY Entries, ULONG Count, PVOID Scan);
+
+#define TEST_TAG                    'TsoP'
+#define TEST_SIZE_COUNT             4
+
+static const ULONGLONG g_TestSizes[TEST_SIZE_COUNT] = { 0x1000, 0x2000, 0x1000, 0x10010 };
+
+static
+PSYSTEM_BIGPOOL_INFORMATION
+TestAllocSnapshot (
+    _In_ ULONG Count
+    )
+{
+    PSYSTEM_BIGPOOL_INFORMATION info;
+    ULONG i;
+
+    info = HeapAlloc(GetProcessHeap(),
+                     HEAP_ZERO_MEMORY,
+                     FIELD_OFFSET(SYSTEM_BIGPOOL_INFORMATION, AllocatedInfo) +
+                     ((Count + 1) * sizeof(SYSTEM_BIGPOOL_ENTRY)));
+    if (info == NULL)
+    {
+        printf("[-] Out of memory\n");
+        exit(1);
+    }
+
+    //
+    // Fill with distinct, 16-byte aligned addresses under other tags, and
+    // flag some of them as nonpaged
+    //
+    info->Count = Count;
+    for (i = 0; i < Count; i++)
+    {
+        info->AllocatedInfo[i].VirtualAddress =
+            (PVOID)(0xFFFF800000000000ULL + ((ULONGLONG)i << 12) + (TestRandom() & 1));
+        info->AllocatedInfo[i].SizeInBytes = g_TestSizes[TestRandom() % TEST_SIZE_COUNT];
+        info->AllocatedInfo[i].TagUlong = TEST_TAG ^ (1 + (TestRandom() & 0xFF));
+    }
+    return info;
+}
+
+static
+VOID
+TestReferenceScan (
+    _In_ PSYSTEM_BIGPOOL_INFORMATION Info,
+    _Out_writes_(TEST_SIZE_COUNT) PVOID* Addresses
+    )
+{
+    ULONG i, j;
+
+    //
+    // The first matching entry wins each size, and fills only one of them
+    //
+    RtlZeroMemory(Addresses, TEST_SIZE_COUNT * sizeof(PVOID));
+    for (i = 0; i < Info->Count; i++)
+    {
+        if (Info->AllocatedInfo[i].TagUlong != TEST_TAG)
+        {
+            continue;
+        }
+        for (j = 0; j < TEST_SIZE_COUNT; j++)
+        {
+            if ((Addresses[j] == NULL) &&
+                (Info->AllocatedInfo[i].SizeInBytes == g_TestSizes[j]))
+            {
+                Addresses[j] =
+                    (PVOID)((ULONG_PTR)Info->AllocatedInfo[i].VirtualAddress & ~1);
+                break;
+            }
+        }
+    }
+}
+
+static
+VOID
+TestScanRoutines (
+    _In_ PSYSTEM_BIGPOOL_INFORMATION Info
+    )
+{
+    static const struct
+    {
+        PCCH Name;
+        PTEST_SCAN_ROUTINE Routine;
+    } routines[] =
+    {
+        { "scalar", PoolpScanScalar },
+        { "sse2", PoolpScanSse2 },
+        { "avx2", PoolpScanAvx2 },
+    };
+    PVOID expected[TEST_SIZE_COUNT];
+    PVOID addresses[TEST_SIZE_COUNT];
+    ULONG i, found, expectedFound;
+
+    TestReferenceScan(Info, expected);
+    for (expectedFound = i = 0; i < TEST_SIZE_COUNT; i++)
+    {
+        expectedFound += (expected[i] != NULL);
+    }
+
+    for (i = 0; i < _ARRAYSIZE(routines); i++)
+    {
+        if ((routines[i].Routine == PoolpScanAvx2) &&
+            (__builtin_cpu_supports("avx2") == FALSE))
+        {
+            continue;
+        }
+
+        g_PoolScanRoutine = routines[i].Routine;
+        found = PoolFindAllocations(Info,
+                                    TEST_TAG,
+                                    (PULONGLONG)g_TestSizes,
+                                    TEST_SIZE_COUNT,
+                                    addresses);
+        if ((found != expectedFound) ||
+            (memcmp(addresses, expected, sizeof(expected)) != 0))
+        {
+            printf("[-] %s scan of %u entries disagrees with the reference\n",
+                   routines[i].Name,
+                   Info->Count);
+            g_TestFailures++;
+        }
+    }
+}
+
+static
+VOID
+TestScans (
+    VOID
+    )
+{
+    PSYSTEM_BIGPOOL_INFORMATION info;
+    ULONG count, i, j, hits;
+
+    //
+    // Every count up to a few vectors, so that each tail length is covered,
+    // with tag hits sprinkled at random positions
+    //
+    for (count = 0; count < 50; count++)
+    {
+        for (i = 0; i < 20; i++)
+        {
+            info = TestAllocSnapshot(count);
+            hits = (count != 0) ? TestRandom() % 6 : 0;
+            for (j = 0; j < hits; j++)
+            {
+                info->AllocatedInfo[TestRandom() % count].TagUlong = TEST_TAG;
+            }
+            TestScanRoutines(info);
+            HeapFree(GetProcessHeap(), 0, info);
+        }
+    }
+
+    //
+    // A hit on only the very last entry, for every tail length
+    //
+    for (count = 1; count < 50; count++)
+    {
+        info = TestAllocSnapshot(count);
+        info->AllocatedInfo[count - 1].TagUlong = TEST_TAG;
+        TestScanRoutines(info);
+        HeapFree(GetProcessHeap(), 0, info);
+    }
+
+    //
+    // Large snapshots, including one where every entry is a hit
+    //
+    info = TestAllocSnapshot(100003);
+    for (j = 0; j < 40; j++)
+    {
+        info->AllocatedInfo[TestRandom() % info->Count].TagUlong = TEST_TAG;
+    }
+    TestScanRoutines(info);
+    for (j = 0; j < info->Count; j++)
+    {
+        info->AllocatedInfo[j].TagUlong = TEST_TAG;
+    }
+    TestScanRoutines(info);
+    HeapFree(GetProcessHeap(), 0, info);
+    g_PoolScanRoutine = NULL;
+}
+
+static
+VOID
+TestTracking (
+    VOID
+    )
+{
+    PSYSTEM_BIGPOOL_INFORMATION info;
+    ULONGLONG sizes[1];
+    PVOID addresses[1];
+    PVOID address;
+    ULONG i;
+
+    //
+    // 5000 allocations under the tag, which grows the sets a few times
+    //
+    info = TestAllocSnapshot(20000);
+    for (i = 0; i < info->Count; i += 4)
+    {
+        info->AllocatedInfo[i].TagUlong = TEST_TAG;
+        info->AllocatedInfo[i].SizeInBytes = 0x1000;
+    }
+
+    //
+    // Without a previous snapshot, anything matches
+    //
+    TEST_CHECK(PoolIsTracking() == FALSE);
+    sizes[0] = 0x1000;
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses), 1);
+    TEST_CHECK(addresses[0] == (PVOID)((ULONG_PTR)info->AllocatedInfo[0].VirtualAddress & ~1));
+    TEST_CHECK(PoolIsTracking());
+
+    //
+    // The same snapshot has nothing new in it
+    //
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses), 0);
+    TEST_CHECK(addresses[0] == NULL);
+
+    //
+    // Only the new allocation is found, even though it's last
+    //
+    info->AllocatedInfo[info->Count - 1].TagUlong = TEST_TAG;
+    info->AllocatedInfo[info->Count - 1].SizeInBytes = 0x1000;
+    address = (PVOID)((ULONG_PTR)info->AllocatedInfo[info->Count - 1].VirtualAddress & ~1);
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses), 1);
+    TEST_CHECK(addresses[0] == address);
+
+    //
+    // Scans stop at the first new match, but new allocations on either side
+    // of it are still told apart correctly by the next ones
+    //
+    info->AllocatedInfo[1].TagUlong = TEST_TAG;
+    info->AllocatedInfo[1].SizeInBytes = 0x2000;
+    info->AllocatedInfo[2].TagUlong = TEST_TAG;
+    info->AllocatedInfo[2].SizeInBytes = 0x3000;
+    info->AllocatedInfo[101].TagUlong = TEST_TAG;
+    info->AllocatedInfo[101].SizeInBytes = 0x4000;
+    sizes[0] = 0x3000;
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses), 1);
+    TEST_CHECK(addresses[0] == (PVOID)((ULONG_PTR)info->AllocatedInfo[2].VirtualAddress & ~1));
+    sizes[0] = 0x4000;
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses), 1);
+    TEST_CHECK(addresses[0] == (PVOID)((ULONG_PTR)info->AllocatedInfo[101].VirtualAddress & ~1));
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses), 0);
+    sizes[0] = 0x2000;
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses), 0);
+    sizes[0] = 0x1000;
+
+    //
+    // A freed address that is handed out again counts as new
+    //
+    address = (PVOID)((ULONG_PTR)info->AllocatedInfo[400].VirtualAddress & ~1);
+    PoolForgetAllocation(address);
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses), 1);
+    TEST_CHECK(addresses[0] == address);
+
+    //
+    // Snapshots can be taken with no sizes, and allocations that went away
+    // are not remembered
+    //
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, NULL, 0, NULL), 0);
+    info->AllocatedInfo[0].TagUlong = 0;
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, NULL, 0, NULL), 0);
+    info->AllocatedInfo[0].TagUlong = TEST_TAG;
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses), 1);
+    TEST_CHECK(addresses[0] == (PVOID)((ULONG_PTR)info->AllocatedInfo[0].VirtualAddress & ~1));
+
+    //
+    // Plain scans don't disturb the tracking
+    //
+    TEST_CHECK_EQUAL(PoolFindAllocations(info, TEST_TAG, sizes, 1, addresses), 1);
+    TEST_CHECK(PoolIsTracking());
+    TEST_CHECK_EQUAL(PoolFindNewAllocations(info, TEST_TAG, sizes, 1, addresses), 0);
+
+    PoolTeardown();
+    TEST_CHECK(PoolIsTracking() == FALSE);
+    HeapFree(GetProcessHeap(), 0, info);
+}
+
+INT
+main (
+    VOID
+    )
+{
+    TestScans();
+    TestTracking();
+    return TestExit("pool_test");
+}
@@ -0,0 +1,109 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    r0aktest.h
+
+Abstract:
+
+    This header defines the checks and timing helpers shared by the portable
+    tests and benchmarks for r0ak
+
+Author:
+
+    Alex Ionescu (@aionescu) 21-Jul-2018 - First public version
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "../r0ak.h"
+#include <time.h>
+
+//
+// Where the checked-in fixtures live, relative to the repository root
+//
+#ifndef TEST_FIXTURES
+#define TEST_FIXTURES               "tests/fixtures/"
+#endif
+
+//
+// Failed checks are counted, and each test exits with the count
+//
+static ULONG g_TestFailures;
+
+#define TEST_CHECK(Expression)                                              \
+    do                                                                      \
+    {                                                                       \
+        if (!(Expression))                                                  \
+        {                                                                   \
+            printf("[-] %s:%d: %s\n", __FILE__, __LINE__, #Expression);     \
+            g_TestFailures++;                                               \
+        }                                                                   \
+    } while (0)
+
+#define TEST_CHECK_EQUAL(Value, Expected)                                   \
+    do                                                                      \
+    {                                                                       \
+        ULONGLONG value = (ULONGLONG)(Value);                               \
+        ULONGLONG expected = (ULONGLONG)(Expected);                         \
+        if (value != expected)                                              \
+        {                                                                   \
+            printf("[-] %s:%d: %s is 0x%llx, expected 0x%llx\n",            \
+                   __FILE__, __LINE__, #Value,                              \
+                   (unsigned long long)value,                               \
+                   (unsigned long long)expected);                           \
+            g_TestFailures++;                                               \
+        }                                                                   \
+    } while (0)
+
+static inline
+INT
+TestExit (
+    _In_ PCCH TestName
+    )
+{
+    if (g_TestFailures != 0)
+    {
+        printf("[-] %s: %u checks failed\n", TestName, g_TestFailures);
+        return 1;
+    }
+    printf("[+] %s: all checks passed\n", TestName);
+    return 0;
+}
+
+//
+// Monotonic time in nanoseconds, for the benchmarks
+//
+static inline
+ULONGLONG
+TestNow (
+    VOID
+    )
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((ULONGLONG)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+//
+// Deterministic pseudo-random numbers, so that failures reproduce
+//
+static ULONGLONG g_TestSeed = 0x9E3779B97F4A7C15ULL;
+
+static inline
+ULONG
+TestRandom (
+    VOID
+    )
+{
+    g_TestSeed ^= g_TestSeed << 13;
+    g_TestSeed ^= g_TestSeed >> 7;
+    g_TestSeed ^= g_TestSeed << 17;
+    return (ULONG)(g_TestSeed >> 32);
+}